@@ -0,0 +1,169 @@
+/*
+ * Linux WiMax
+ * Benchmark: latency of wimaxll_open()
+ *
+ *
+ * Copyright (C) 2007-2009 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * Opens and closes a handle to a device many times with different
+ * wimaxll_open_flags() and prints the distribution of the time
+ * wimaxll_open_flags() takes, to show what the RFKILL probe (and
+ * setting up the receive side) cost.
+ *
+ * Usage: bench-open [-n ITERATIONS] DEVICE
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <wimaxll.h>
+
+
+struct bench_mode {
+	const char *name;
+	unsigned flags;
+};
+
+static
+const struct bench_mode bench_modes[] = {
+	{ "default", 0 },
+	{ "no-probe", WIMAXLL_OPEN_NO_PROBE },
+	{ "no-probe+lazy-rx", WIMAXLL_OPEN_NO_PROBE | WIMAXLL_OPEN_LAZY_RX },
+};
+
+
+static
+double ts_usec(const struct timespec *start, const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1e6
+		+ (end->tv_nsec - start->tv_nsec) / 1e3;
+}
+
+
+static
+int double_cmp(const void *_a, const void *_b)
+{
+	const double *a = _a, *b = _b;
+
+	return *a < *b ? -1 : *a > *b;
+}
+
+
+/*
+ * Time @iterations open/close cycles; fill @sample with the time
+ * (usecs) each open took
+ */
+static
+int bench_open(const char *dev_name, unsigned flags,
+	       double *sample, unsigned iterations)
+{
+	unsigned itr;
+	struct timespec start, end;
+	struct wimaxll_handle *wmx;
+
+	for (itr = 0; itr < iterations; itr++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		wmx = wimaxll_open_flags(dev_name, flags);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		if (wmx == NULL)
+			return -errno;
+		wimaxll_close(wmx);
+		sample[itr] = ts_usec(&start, &end);
+	}
+	return 0;
+}
+
+
+static
+void bench_print(const char *name, double *sample, unsigned iterations)
+{
+	unsigned itr;
+	double sum = 0;
+
+	qsort(sample, iterations, sizeof(sample[0]), double_cmp);
+	for (itr = 0; itr < iterations; itr++)
+		sum += sample[itr];
+	printf("%-18s %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", name,
+	       sample[0], sample[iterations / 2],
+	       sample[iterations * 90 / 100], sample[iterations * 99 / 100],
+	       sample[iterations - 1], sum / iterations);
+}
+
+
+int main(int argc, char **argv)
+{
+	int result, opt;
+	unsigned itr, iterations = 1000;
+	const char *dev_name;
+	double *sample;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			goto error_usage;
+		}
+	}
+	if (optind != argc - 1 || iterations == 0)
+		goto error_usage;
+	dev_name = argv[optind];
+
+	sample = calloc(iterations, sizeof(sample[0]));
+	if (sample == NULL) {
+		fprintf(stderr, "E: cannot allocate samples: %m\n");
+		return 1;
+	}
+	printf("# %u opens of %s; usecs\n", iterations, dev_name);
+	printf("%-18s %9s %9s %9s %9s %9s %9s\n", "# mode",
+	       "min", "p50", "p90", "p99", "max", "mean");
+	for (itr = 0; itr < sizeof(bench_modes) / sizeof(bench_modes[0]);
+	     itr++) {
+		result = bench_open(dev_name, bench_modes[itr].flags,
+				    sample, iterations);
+		if (result < 0) {
+			fprintf(stderr, "E: %s: cannot open %s: %d\n",
+				bench_modes[itr].name, dev_name, result);
+			free(sample);
+			return 1;
+		}
+		bench_print(bench_modes[itr].name, sample, iterations);
+	}
+	free(sample);
+	return 0;
+
+error_usage:
+	fprintf(stderr, "usage: %s [-n ITERATIONS] DEVICE\n", argv[0]);
+	return 1;
+}
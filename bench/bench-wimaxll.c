@@ -0,0 +1,756 @@
+/*
+ * Linux WiMax
+ * Benchmark suite for libwimaxll
+ *
+ *
+ * Copyright (C) 2007-2009 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * Drives the public API against the in-process fake kernel
+ * (lib/fake.h), so it runs on any box, and reports:
+ *
+ * - open.*: wimaxll_open_flags() latency (with and without the
+ *   RFKILL probe and the RX side)
+ *
+ * - rtt.*: wimaxll_rfkill() / wimaxll_state_get() round trip
+ *
+ * - msg_write.*: wimaxll_msg_write() (sync), wimaxll_msg_write_async()
+ *   and wimaxll_msg_writev() messages per second
+ *
+ * - msg_read.*: wimaxll_msg_read() and wimaxll_msg_read_borrow()
+ *   throughput by payload size
+ *
+ * - recv.*: wimaxll_recv() dispatch rate (state change callbacks run
+ *   per second) with 1 to 1000 handles open on the device
+ *
+ * - i2400m.*: i2400m_msg_to_dev() round trip and how long threads
+ *   wait for the i2400m's mutex while another thread's replies take
+ *   long to parse
+ *
+ * Results are written as JSON, one result object per line:
+ *
+ * {"suite": "wimaxll", "results": [
+ *   {"name": "open.default.p50", "unit": "us", "better": "lower", "value": 12.3},
+ *   ...
+ * ]}
+ *
+ * With -b, results are compared against a file previously written
+ * with -o (the comparison goes to stderr); each one that got worse
+ * by more than the threshold (-t, percent) is reported and the exit
+ * code is 1. -q divides the iteration counts by ten; -f runs only
+ * the benchmarks whose name starts with a prefix.
+ *
+ * Usage: bench-wimaxll [-q] [-f PREFIX] [-o OUTPUT] [-b BASELINE] [-t PCT]
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <wimaxll.h>
+#include <wimaxll/i2400m.h>
+#include "fake.h"
+
+
+enum {
+	BENCH_RESULTS_MAX = 128,
+	/* Each handle has two socketpairs with the fake kernel */
+	BENCH_FDS_PER_HANDLE = 4,
+	/* Time the slow i2400m.* reply callback takes to "parse" a
+	 * reply, and period of the lock wait probes */
+	BENCH_I2400M_PARSE_US = 1000,
+	BENCH_I2400M_PROBE_US = 100,
+};
+
+struct bench_result {
+	char name[64];
+	const char *unit;
+	int higher_is_better;
+	double value;
+};
+
+static struct {
+	unsigned scale;		/* divides the iteration counts */
+	const char *prefix;
+	struct bench_result result[BENCH_RESULTS_MAX];
+	unsigned results;
+} bench = {
+	.scale = 1,
+};
+
+/* Device the fake kernel serves */
+static const char bench_dev[] = "lo";
+
+
+static
+double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static
+int bench_enabled(const char *name)
+{
+	return bench.prefix == NULL
+		|| strncmp(name, bench.prefix, strlen(bench.prefix)) == 0;
+}
+
+
+static
+void bench_add(const char *name, const char *unit, int higher_is_better,
+	       double value)
+{
+	struct bench_result *result;
+
+	if (bench.results >= BENCH_RESULTS_MAX) {
+		fprintf(stderr, "E: too many results, dropping %s\n", name);
+		return;
+	}
+	result = &bench.result[bench.results++];
+	snprintf(result->name, sizeof(result->name), "%s", name);
+	result->unit = unit;
+	result->higher_is_better = higher_is_better;
+	result->value = value;
+	fprintf(stderr, "I: %-32s %14.2f %s\n", name, value, unit);
+}
+
+
+static
+int double_cmp(const void *_a, const void *_b)
+{
+	const double *a = _a, *b = _b;
+
+	return *a < *b ? -1 : *a > *b;
+}
+
+
+/* Add the percentiles of a set of latency samples (in seconds) */
+static
+void bench_add_latency(const char *name, double *sample, unsigned count)
+{
+	char buf[64];
+	unsigned itr;
+	double sum = 0;
+
+	qsort(sample, count, sizeof(sample[0]), double_cmp);
+	for (itr = 0; itr < count; itr++)
+		sum += sample[itr];
+	snprintf(buf, sizeof(buf), "%s.p50", name);
+	bench_add(buf, "us", 0, sample[count / 2] * 1e6);
+	snprintf(buf, sizeof(buf), "%s.p90", name);
+	bench_add(buf, "us", 0, sample[count * 90 / 100] * 1e6);
+	snprintf(buf, sizeof(buf), "%s.p99", name);
+	bench_add(buf, "us", 0, sample[count * 99 / 100] * 1e6);
+	snprintf(buf, sizeof(buf), "%s.mean", name);
+	bench_add(buf, "us", 0, sum / count * 1e6);
+}
+
+
+/*
+ * Abort if an operation being measured failed
+ *
+ * A failed call is usually much faster than one that works, so
+ * carrying on would report bogus figures.
+ */
+static
+void bench_check(const char *name, ssize_t result)
+{
+	if (result >= 0)
+		return;
+	fprintf(stderr, "E: %s: operation failed: %zd\n", name, result);
+	exit(1);
+}
+
+
+static
+struct wimaxll_handle *bench_open(unsigned flags)
+{
+	struct wimaxll_handle *wmx;
+
+	wmx = wimaxll_open_flags(bench_dev, flags);
+	if (wmx == NULL) {
+		fprintf(stderr, "E: cannot open %s: %m\n", bench_dev);
+		exit(1);
+	}
+	return wmx;
+}
+
+
+/*
+ * open.*
+ */
+static
+void bench_open_latency(void)
+{
+	static const struct {
+		const char *name;
+		unsigned flags;
+	} mode[] = {
+		{ "open.default", 0 },
+		{ "open.no_probe", WIMAXLL_OPEN_NO_PROBE },
+		{ "open.no_probe_lazy_rx",
+		  WIMAXLL_OPEN_NO_PROBE | WIMAXLL_OPEN_LAZY_RX },
+	};
+	unsigned itr, cnt, count = 2000 / bench.scale;
+	double *sample, start;
+	struct wimaxll_handle *wmx;
+
+	sample = calloc(count, sizeof(sample[0]));
+	for (itr = 0; itr < sizeof(mode) / sizeof(mode[0]); itr++) {
+		if (!bench_enabled(mode[itr].name))
+			continue;
+		for (cnt = 0; cnt < count; cnt++) {
+			start = bench_now();
+			wmx = bench_open(mode[itr].flags);
+			sample[cnt] = bench_now() - start;
+			wimaxll_close(wmx);
+		}
+		bench_add_latency(mode[itr].name, sample, count);
+	}
+	free(sample);
+}
+
+
+/*
+ * rtt.*
+ */
+static
+void bench_rtt(void)
+{
+	int result;
+	unsigned cnt, count = 20000 / bench.scale;
+	double *sample, start;
+	struct wimaxll_handle *wmx;
+
+	wmx = bench_open(WIMAXLL_OPEN_LAZY_RX);
+	sample = calloc(count, sizeof(sample[0]));
+	if (bench_enabled("rtt.rfkill")) {
+		for (cnt = 0; cnt < count; cnt++) {
+			start = bench_now();
+			result = wimaxll_rfkill(wmx, WIMAX_RF_QUERY);
+			sample[cnt] = bench_now() - start;
+			bench_check("rtt.rfkill", result);
+		}
+		bench_add_latency("rtt.rfkill", sample, count);
+	}
+	if (bench_enabled("rtt.state_get")) {
+		for (cnt = 0; cnt < count; cnt++) {
+			start = bench_now();
+			result = wimaxll_state_get(wmx);
+			sample[cnt] = bench_now() - start;
+			bench_check("rtt.state_get", result);
+		}
+		bench_add_latency("rtt.state_get", sample, count);
+	}
+	free(sample);
+	wimaxll_close(wmx);
+}
+
+
+/*
+ * msg_write.*
+ */
+static
+void bench_msg_write(void)
+{
+	unsigned cnt, itr, count = 50000 / bench.scale;
+	double start;
+	char data[64] = "";
+	struct wimaxll_handle *wmx;
+	struct wimaxll_msg_vec vec[32];
+	ssize_t result;
+
+	wmx = bench_open(WIMAXLL_OPEN_LAZY_RX);
+	if (bench_enabled("msg_write.sync")) {
+		start = bench_now();
+		for (cnt = 0; cnt < count; cnt++) {
+			result = wimaxll_msg_write(wmx, NULL, data,
+						   sizeof(data));
+			bench_check("msg_write.sync", result);
+		}
+		bench_add("msg_write.sync", "msg/s", 1,
+			  count / (bench_now() - start));
+	}
+	if (bench_enabled("msg_write.async")) {
+		start = bench_now();
+		for (cnt = 0; cnt < count; cnt++) {
+			result = wimaxll_msg_write_async(wmx, NULL, data,
+							 sizeof(data),
+							 NULL, NULL);
+			bench_check("msg_write.async", result);
+		}
+		result = wimaxll_tx_flush(wmx);
+		bench_check("msg_write.async", result);
+		bench_add("msg_write.async", "msg/s", 1,
+			  count / (bench_now() - start));
+	}
+	if (bench_enabled("msg_write.writev")) {
+		for (itr = 0; itr < 32; itr++) {
+			vec[itr].pipe_name = NULL;
+			vec[itr].data = data;
+			vec[itr].size = sizeof(data);
+		}
+		start = bench_now();
+		for (cnt = 0; cnt < count; cnt += 32) {
+			result = wimaxll_msg_writev(wmx, vec, 32);
+			bench_check("msg_write.writev", result);
+		}
+		bench_add("msg_write.writev", "msg/s", 1,
+			  cnt / (bench_now() - start));
+	}
+	wimaxll_close(wmx);
+}
+
+
+/*
+ * msg_read.*
+ *
+ * The fake kernel is fed from this same thread in bursts that fit in
+ * the socket buffer, then the burst is read; so the figures include
+ * building the notifications.
+ */
+static
+void bench_msg_read(void)
+{
+	static const size_t size[] = { 64, 1024, 16384 };
+	ssize_t result;
+	unsigned itr, cnt, burst, sent, count;
+	char name[64];
+	double start, elapsed;
+	void *data, *buf;
+	const void *borrowed;
+	struct wimaxll_handle *wmx;
+	int borrow;
+	const char *pipe_name[] = { "bench" };
+
+	wmx = bench_open(WIMAXLL_OPEN_NO_PROBE);
+	wimaxll_recv_filter(wmx, 0, pipe_name, 1);
+	for (borrow = 0; borrow < 2; borrow++) {
+		for (itr = 0; itr < sizeof(size) / sizeof(size[0]); itr++) {
+			snprintf(name, sizeof(name), "msg_read.%s.%zu",
+				 borrow ? "borrow" : "copy", size[itr]);
+			if (!bench_enabled(name))
+				continue;
+			data = calloc(1, size[itr]);
+			burst = 96 * 1024 / size[itr];
+			if (burst > 32)
+				burst = 32;
+			if (burst == 0)
+				burst = 1;
+			count = 100000 / bench.scale;
+			if (count * size[itr] > (256 << 20) / bench.scale)
+				count = (256 << 20) / bench.scale / size[itr];
+			start = bench_now();
+			for (sent = 0; sent < count; sent += burst) {
+				for (cnt = 0; cnt < burst; cnt++)
+					wimaxll_fake_msg_to_user(
+						"bench", data, size[itr]);
+				for (cnt = 0; cnt < burst; cnt++) {
+					if (borrow) {
+						result = wimaxll_msg_read_borrow(
+							wmx, "bench",
+							&borrowed);
+						bench_check(name, result);
+						wimaxll_msg_release(wmx,
+								    borrowed);
+					} else {
+						result = wimaxll_msg_read(
+							wmx, "bench", &buf);
+						bench_check(name, result);
+						wimaxll_msg_free(buf);
+					}
+				}
+			}
+			elapsed = bench_now() - start;
+			bench_add(name, "MB/s", 1,
+				  sent * size[itr] / elapsed / (1 << 20));
+			free(data);
+		}
+	}
+	wimaxll_close(wmx);
+}
+
+
+/*
+ * recv.*
+ */
+static
+int bench_state_change_cb(struct wimaxll_handle *wmx, void *priv,
+			  enum wimax_st old_state, enum wimax_st new_state)
+{
+	unsigned long *count = priv;
+
+	(*count)++;
+	return 0;
+}
+
+
+static
+void bench_recv_fanout(void)
+{
+	static const unsigned handles[] = { 1, 10, 100, 1000 };
+	enum { BURST = 16 };
+	unsigned itr, cnt, hnd, sent, count, max_handles;
+	ssize_t processed;
+	unsigned long dispatched = 0;
+	char name[64];
+	double start;
+	struct rlimit rlim;
+	struct wimaxll_handle **wmx;
+
+	getrlimit(RLIMIT_NOFILE, &rlim);
+	rlim.rlim_cur = rlim.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rlim);
+	getrlimit(RLIMIT_NOFILE, &rlim);
+	max_handles = (rlim.rlim_cur - 64) / BENCH_FDS_PER_HANDLE;
+	for (itr = 0; itr < sizeof(handles) / sizeof(handles[0]); itr++) {
+		snprintf(name, sizeof(name), "recv.handles_%u", handles[itr]);
+		if (!bench_enabled(name))
+			continue;
+		if (handles[itr] > max_handles) {
+			fprintf(stderr, "W: %s: skipped, not enough file "
+				"descriptors (%lu)\n", name,
+				(unsigned long) rlim.rlim_cur);
+			continue;
+		}
+		wmx = calloc(handles[itr], sizeof(wmx[0]));
+		for (hnd = 0; hnd < handles[itr]; hnd++) {
+			wmx[hnd] = bench_open(WIMAXLL_OPEN_NO_PROBE);
+			wimaxll_set_cb_state_change(wmx[hnd],
+						    bench_state_change_cb,
+						    &dispatched);
+		}
+		count = 100000 / handles[itr] / bench.scale;
+		if (count < BURST)
+			count = BURST;
+		dispatched = 0;
+		start = bench_now();
+		for (sent = 0; sent < count; sent += BURST) {
+			for (cnt = 0; cnt < BURST; cnt++)
+				wimaxll_fake_state_change(WIMAX_ST_READY,
+							  WIMAX_ST_READY);
+			for (hnd = 0; hnd < handles[itr]; hnd++)
+				for (cnt = 0; cnt < BURST; cnt += processed) {
+					processed = wimaxll_recv_budget(
+						wmx[hnd], BURST - cnt);
+					if (processed <= 0)
+						break;
+				}
+		}
+		bench_add(name, "events/s", 1,
+			  dispatched / (bench_now() - start));
+		for (hnd = 0; hnd < handles[itr]; hnd++)
+			wimaxll_close(wmx[hnd]);
+		free(wmx);
+	}
+}
+
+
+/*
+ * i2400m.*
+ *
+ * The fake kernel echoes the commands back, so they are their own
+ * replies. A thread runs commands whose reply callback takes
+ * BENCH_I2400M_PARSE_US (sleeping, so it works the same with one
+ * CPU) while:
+ *
+ * - the main thread runs commands of another type, with a callback
+ *   that does nothing: i2400m.rtt is their round trip;
+ *
+ * - a third thread calls i2400m_timeout_ms() every
+ *   BENCH_I2400M_PROBE_US; that only takes the i2400m's mutex to scan
+ *   the command table, so i2400m.lock_wait, the time each call takes,
+ *   is how long it waited for whoever held the mutex.
+ *
+ * If the slow callback runs in the receive path with the mutex held,
+ * both get as long as it.
+ */
+struct bench_i2400m {
+	struct i2400m *i2400m;
+	volatile int stop;
+	double *sample;
+	unsigned count, max;
+};
+
+
+static
+int bench_i2400m_slow_cb(struct i2400m *i2400m, void *priv,
+			 const struct i2400m_l3l4_hdr *reply,
+			 size_t reply_size)
+{
+	usleep(BENCH_I2400M_PARSE_US);
+	return 0;
+}
+
+
+static
+int bench_i2400m_fast_cb(struct i2400m *i2400m, void *priv,
+			 const struct i2400m_l3l4_hdr *reply,
+			 size_t reply_size)
+{
+	return 0;
+}
+
+
+static
+void *bench_i2400m_slow(void *_bench)
+{
+	struct bench_i2400m *bench = _bench;
+	struct i2400m_l3l4_hdr cmd;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.type = wimaxll_cpu_to_le16(I2400M_MT_GET_STATE);
+	while (!bench->stop)
+		i2400m_msg_to_dev(bench->i2400m, &cmd, sizeof(cmd),
+				  bench_i2400m_slow_cb, NULL);
+	return NULL;
+}
+
+
+static
+void *bench_i2400m_probe(void *_bench)
+{
+	struct bench_i2400m *bench = _bench;
+	double start;
+
+	while (!bench->stop && bench->count < bench->max) {
+		start = bench_now();
+		i2400m_timeout_ms(bench->i2400m);
+		bench->sample[bench->count++] = bench_now() - start;
+		usleep(BENCH_I2400M_PROBE_US);
+	}
+	return NULL;
+}
+
+
+static
+void bench_i2400m(const struct wimaxll_fake_config *config)
+{
+	int result;
+	unsigned cnt, count = 2000 / bench.scale;
+	double *sample, start;
+	struct wimaxll_fake_config echo_config = *config;
+	struct i2400m_l3l4_hdr cmd;
+	struct bench_i2400m slow, probe;
+	pthread_t slow_thread, probe_thread;
+
+	if (!bench_enabled("i2400m.rtt") && !bench_enabled("i2400m.lock_wait"))
+		return;
+	/* Restart the fake kernel so it echoes the commands */
+	wimaxll_fake_stop();
+	echo_config.echo = 1;
+	result = wimaxll_fake_start(&echo_config);
+	if (result < 0) {
+		fprintf(stderr, "E: cannot restart the fake kernel: %d\n",
+			result);
+		exit(1);
+	}
+	memset(&slow, 0, sizeof(slow));
+	result = i2400m_create_flags(&slow.i2400m, bench_dev, NULL, NULL,
+				     I2400M_RX_THREAD);
+	if (result < 0) {
+		fprintf(stderr, "E: cannot create i2400m handle: %d\n",
+			result);
+		exit(1);
+	}
+	memset(&probe, 0, sizeof(probe));
+	probe.i2400m = slow.i2400m;
+	probe.max = 16 * count;
+	probe.sample = calloc(probe.max, sizeof(probe.sample[0]));
+	sample = calloc(count, sizeof(sample[0]));
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.type = wimaxll_cpu_to_le16(I2400M_MT_GET_DEVICE_INFO);
+
+	pthread_create(&slow_thread, NULL, bench_i2400m_slow, &slow);
+	pthread_create(&probe_thread, NULL, bench_i2400m_probe, &probe);
+	for (cnt = 0; cnt < count; cnt++) {
+		start = bench_now();
+		result = i2400m_msg_to_dev(slow.i2400m, &cmd, sizeof(cmd),
+					   bench_i2400m_fast_cb, NULL);
+		sample[cnt] = bench_now() - start;
+		bench_check("i2400m.rtt", result);
+	}
+	slow.stop = probe.stop = 1;
+	pthread_join(probe_thread, NULL);
+	pthread_join(slow_thread, NULL);
+
+	if (bench_enabled("i2400m.rtt"))
+		bench_add_latency("i2400m.rtt", sample, count);
+	if (bench_enabled("i2400m.lock_wait") && probe.count > 0)
+		bench_add_latency("i2400m.lock_wait", probe.sample,
+				  probe.count);
+	free(sample);
+	free(probe.sample);
+	i2400m_destroy(slow.i2400m);
+	wimaxll_fake_stop();
+	wimaxll_fake_start(config);
+}
+
+
+static
+int bench_write(const char *file_name)
+{
+	unsigned itr;
+	FILE *f = stdout;
+
+	if (file_name != NULL) {
+		f = fopen(file_name, "w");
+		if (f == NULL) {
+			fprintf(stderr, "E: %s: cannot open: %m\n", file_name);
+			return -errno;
+		}
+	}
+	fprintf(f, "{\"suite\": \"wimaxll\", \"results\": [\n");
+	for (itr = 0; itr < bench.results; itr++)
+		fprintf(f, "  {\"name\": \"%s\", \"unit\": \"%s\", "
+			"\"better\": \"%s\", \"value\": %.3f}%s\n",
+			bench.result[itr].name, bench.result[itr].unit,
+			bench.result[itr].higher_is_better ? "higher" : "lower",
+			bench.result[itr].value,
+			itr + 1 < bench.results ? "," : "");
+	fprintf(f, "]}\n");
+	if (f != stdout)
+		fclose(f);
+	return 0;
+}
+
+
+/*
+ * Compare against a baseline written by bench_write()
+ *
+ * Returns the number of regressions (results that got worse by more
+ * than @threshold percent), < 0 errno code on error.
+ */
+static
+int bench_compare(const char *file_name, double threshold)
+{
+	int regressions = 0;
+	unsigned itr;
+	char line[256], name[64], *p;
+	double base, delta;
+	FILE *f;
+
+	f = fopen(file_name, "r");
+	if (f == NULL) {
+		fprintf(stderr, "E: %s: cannot open: %m\n", file_name);
+		return -errno;
+	}
+	fprintf(stderr, "%-32s %14s %14s %8s\n", "# name", "baseline", "now",
+		"delta");
+	while (fgets(line, sizeof(line), f) != NULL) {
+		p = strstr(line, "\"name\": \"");
+		if (p == NULL || sscanf(p, "\"name\": \"%63[^\"]\"", name) != 1)
+			continue;
+		p = strstr(line, "\"value\": ");
+		if (p == NULL || sscanf(p, "\"value\": %lf", &base) != 1)
+			continue;
+		for (itr = 0; itr < bench.results; itr++)
+			if (strcmp(bench.result[itr].name, name) == 0)
+				break;
+		if (itr >= bench.results)
+			continue;
+		delta = base == 0 ? 0
+			: (bench.result[itr].value - base) / base * 100;
+		fprintf(stderr, "%-32s %14.2f %14.2f %+7.1f%%", name, base,
+			bench.result[itr].value, delta);
+		if (bench.result[itr].higher_is_better ? delta < -threshold
+		    : delta > threshold) {
+			fprintf(stderr, " REGRESSION");
+			regressions++;
+		}
+		fprintf(stderr, "\n");
+	}
+	fclose(f);
+	return regressions;
+}
+
+
+int main(int argc, char **argv)
+{
+	int result, opt;
+	const char *output = NULL, *baseline = NULL;
+	double threshold = 10;
+	struct wimaxll_fake_config config = { .ifidx = 0 };
+
+	while ((opt = getopt(argc, argv, "qf:o:b:t:")) != -1) {
+		switch (opt) {
+		case 'q':
+			bench.scale = 10;
+			break;
+		case 'f':
+			bench.prefix = optarg;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'b':
+			baseline = optarg;
+			break;
+		case 't':
+			threshold = strtod(optarg, NULL);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-q] [-f PREFIX] "
+				"[-o OUTPUT] [-b BASELINE] [-t PCT]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+
+	result = wimaxll_fake_start(&config);
+	if (result < 0) {
+		fprintf(stderr, "E: cannot start the fake kernel: %d\n",
+			result);
+		return 1;
+	}
+	bench_open_latency();
+	bench_rtt();
+	bench_msg_write();
+	bench_msg_read();
+	bench_recv_fanout();
+	bench_i2400m(&config);
+	wimaxll_fake_stop();
+
+	if (bench_write(output) < 0)
+		return 1;
+	if (baseline != NULL) {
+		result = bench_compare(baseline, threshold);
+		if (result != 0)
+			return 1;
+	}
+	return 0;
+}
@@ -34,6 +34,7 @@
  */
 #define _GNU_SOURCE
 #include <argp.h>
+#include <limits.h>
 #include <wimaxll.h>
 #include <wimaxll/version.h>
 #include <wimaxll/cmd.h>
@@ -51,13 +52,9 @@ struct wfsc_args
 
 static
 struct argp_option wfsc_options[] = {
-#if 0
-	/* not really done ... will have to rewrite some code and just
-	 * use the callback with a select stuff */ 
 	{ "timeout",  't', "TIMEOUT",       0,
 	  "Time (in seconds) to wait for the state change; "
 	  "0 to wait for ever." },
-#endif
 	{ "help-states",  's', 0,       0,
 	  "List known WiMAX states." },
 	{ 0 }
@@ -77,6 +74,10 @@ int wfsc_parser(int key, char *arg, struct argp_state *state)
 		if (sscanf(arg, "%u", &args->timeout) != 1)
 			argp_error(state, "E: %s: cannot parse as a timeout (in seconds)\n",
 				   arg);
+		/* wimaxll_deadline_set() takes milliseconds */
+		else if (args->timeout > UINT_MAX / 1000)
+			argp_error(state, "E: %s: timeout too big (max %u "
+				   "seconds)\n", arg, UINT_MAX / 1000);
 		break;
 		
 	case 's':
@@ -110,16 +111,26 @@ int wfsc_fn(struct cmd *cmd, struct wimaxll_handle *wmx,
 	int result;
 	struct wfsc_args args;
 	enum wimax_st old_state, new_state;
+	struct timespec deadline, *deadlinep = NULL;
 	
 	args.cmd = cmd;
 	args.state = __WIMAX_ST_INVALID;	/* meaning any */
+	args.timeout = 0;
 	result = argp_parse(&cmd->argp, argc, argv,
 			    0, 0, &args);
 	if (result < 0)
 		goto error_argp_parse;
 	w_cmd_need_if(wmx);
+	/* The timeout covers the whole wait, not each state change */
+	if (args.timeout > 0)
+		deadlinep = wimaxll_deadline_set(&deadline,
+						 args.timeout * 1000);
 	while(1) {
-		result = wimaxll_wait_for_state_change(wmx, &old_state, &new_state);
+		result = wimaxll_wait_for_state_change_deadline(
+			wmx, &old_state, &new_state, deadlinep);
+		if (result == -ETIMEDOUT)
+			w_abort(2, "%s: timed out after %u seconds\n",
+				cmd->name, args.timeout);
 		if (result < 0)
 			w_abort(1, "%s: error waiting: %d (%s)\n", cmd->name,
 				result, strerror(result));
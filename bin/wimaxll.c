@@ -420,7 +420,10 @@ int main(int argc, char **argv)
 	}
 	
 	if (main_args.ifindex != 0) {
-		wmx = wimaxll_open(main_args.ifname);
+		/* Most commands only send; the ones that wait for
+		 * notifications set the RX side up when they need it */
+		wmx = wimaxll_open_flags(main_args.ifname,
+					 WIMAXLL_OPEN_LAZY_RX);
 		if (wmx == NULL) {
 			w_error("%s: cannot open: %m\n", main_args.ifname);
 			result = -errno;
@@ -98,6 +98,30 @@
  * status of both switches. WIMAX_RF_QUERY just returns the status of
  * both the \e HW and \e SW switches.
  *
+ * These calls block until the kernel acknowledges them; their
+ * *_deadline() variants (eg: wimaxll_rfkill_deadline()) give up with
+ * -%ETIMEDOUT at an absolute %CLOCK_MONOTONIC time, which
+ * wimaxll_deadline_set() computes from a timeout. So do
+ * wimaxll_recv_deadline(), wimaxll_msg_read_deadline() and
+ * wimaxll_wait_for_state_change_deadline(), so a wedged device can't
+ * stall the thread that waits on it.
+ *
+ * To drive many devices from a single thread, start them with
+ * wimaxll_reset_start(), wimaxll_rfkill_start(),
+ * wimaxll_state_get_start() or wimaxll_msg_write_start() instead;
+ * they return an operation object right away. When wimaxll_tx_fd()
+ * is ready for reading, call wimaxll_tx_recv(); completed operations
+ * run their callback and wimaxll_op_poll() reports their result:
+ *
+ * @code
+ *  struct wimaxll_op *op = wimaxll_rfkill_start(wmx, WIMAX_RF_QUERY,
+ *                                               NULL, NULL);
+ *  ...
+ *  while (wimaxll_op_poll(op, &result) == -EINPROGRESS)
+ *          wimaxll_tx_recv(wmx);   // when wimaxll_tx_fd() is ready
+ *  wimaxll_op_free(op);
+ * @endcode
+ *
  * See \ref device_management "device management" for more information.
  *
  * \section receiving Receiving notifications from the WiMAX kernel stack
@@ -132,6 +156,14 @@
  * for delivery. Calling said function will execute, for each
  * notification, the callback associated to it.
  *
+ * Instead of writing that loop, many handles can be watched from a
+ * single thread with an epoll set (wimaxll_epoll_create(),
+ * wimaxll_epoll_add() and wimaxll_epoll_dispatch()) or, from a GLib
+ * main loop, with wimaxll_glib_attach() (in \e libwimaxll-glib,
+ * declared in <wimaxll/glib.h>). Both drain the sockets without
+ * blocking, up to a budget per wakeup, and also process the ACKs of
+ * asynchronous operations.
+ *
  * To wait for a \e state \e change notification, for example:
  *
  * @code
@@ -159,7 +191,9 @@
  *
  * \e msg points to a buffer which contains the message payload as
  * sent by the driver. When done with \a msg it has to be freed with
- * wimaxll_msg_free().
+ * wimaxll_msg_free(). High rate readers can avoid the copy with
+ * wimaxll_msg_read_borrow() or the heap allocation with
+ * wimaxll_msg_pool_set().
  *
  * As with \e state \e change notifications, a callback can be set
  * that will be executed from a mainloop every time a message is
@@ -189,17 +223,28 @@
  *
  * @section multithreading Multithreading
  *
- * This library is not threaded or locked. Internally it uses two
- * different netlink handles, one for receiving and one for sending;
- * thus the maximum level of paralellism you can do with one handle
- * is:
+ * This library creates no threads. Internally it uses two different
+ * netlink handles, one for receiving and one for sending.
+ *
+ * The sending side can be used by many threads at the same time:
+ * wimaxll_msg_write(), wimaxll_msg_write_async(),
+ * wimaxll_msg_writev(), wimaxll_tx_recv(), wimaxll_tx_flush(),
+ * wimaxll_tx_drain(), wimaxll_rfkill(), wimaxll_reset() and
+ * wimaxll_state_get() can be called in parallel on the same handle;
+ * each ACK is delivered to the thread (or completion callback)
+ * waiting for it. So can the receiving side: wimaxll_recv(),
+ * wimaxll_recv_deadline(), wimaxll_recv_budget(),
+ * wimaxll_recv_drain(), wimaxll_msg_read(), wimaxll_msg_read_borrow(),
+ * wimaxll_msg_release() and wimaxll_wait_for_state_change(); only one
+ * thread reads and runs the callbacks at a time, the rest wait for it
+ * to be done (and each message goes to only one of the threads in
+ * wimaxll_msg_read()). The maximum level of paralellism you can do
+ * with one handle is:
  *
  * - Functions that can't be executed in parallel when using the same
  *   wimaxll handle (need to be serialized):
  *   <ul>
- *     <li> wimaxll_msg_write(), wimaxll_rfkill(), wimax_reset()
- *     <li> wimaxll_recv(), wimaxll_msg_read(),
- *          wimaxll_wait_for_state_change()
+ *     <li> wimaxll_msg_pool_set()
  *     <li> wimax_get_cb_*() and wimax_set_cb_*().
  *     <li> wimaxll_recv_fd(), as long as the handle is valid.
  *   </ul>
@@ -225,6 +270,7 @@
 #include <endian.h>
 #include <byteswap.h>
 #include <stdarg.h>
+#include <time.h>
 #include <linux/wimax.h>
 
 struct wimaxll_handle;
@@ -308,6 +354,62 @@ typedef int (*wimaxll_state_change_cb_f)(
 
 
 
+/**
+ * Callback for the acknowledgement of a message sent asynchronously
+ *
+ * The kernel has acknowledged the message sent with sequence number
+ * \a seq (for example, with wimaxll_msg_write_async()) and passed
+ * \a result as the result of the operation.
+ *
+ * \note See \ref callbacks callbacks for a set of warnings and
+ * guidelines for using callbacks.
+ *
+ * \param wmx WiMAX device handle
+ * \param priv Context passed by the user when sending the message.
+ * \param seq Sequence number of the message that was acknowledged.
+ * \param result Result code the kernel passed in the ACK (negative
+ *     errno code on error); -%ECANCELED if the handle was closed
+ *     before the ACK arrived.
+ * \return >= 0 if it is ok to keep processing ACKs, -EBUSY if
+ *     processing should stop and control be returned to the caller.
+ *
+ * \ingroup the_messaging_interface
+ */
+typedef int (*wimaxll_ack_cb_f)(struct wimaxll_handle *wmx, void *priv,
+				unsigned seq, ssize_t result);
+
+
+struct wimaxll_op;
+
+/**
+ * Callback for the completion of a non-blocking operation
+ *
+ * An operation started with wimaxll_rfkill_start(),
+ * wimaxll_reset_start(), wimaxll_state_get_start() or
+ * wimaxll_msg_write_start() has completed.
+ *
+ * \note See \ref callbacks callbacks for a set of warnings and
+ * guidelines for using callbacks.
+ *
+ * \param wmx WiMAX device handle
+ * \param op Operation that completed; the callback can release it
+ *     with wimaxll_op_free().
+ * \param priv Context passed by the user when starting the
+ *     operation.
+ * \param result What the blocking version of the call would have
+ *     returned; -%ECANCELED if the handle was closed before the
+ *     kernel acknowledged the operation.
+ * \return >= 0 if it is ok to keep processing ACKs, -EBUSY if
+ *     processing should stop and control be returned to the caller.
+ *
+ * \ingroup device_management
+ */
+typedef int (*wimaxll_op_cb_f)(struct wimaxll_handle *wmx,
+			       struct wimaxll_op *op, void *priv,
+			       ssize_t result);
+
+
+
 /**
  * General structure for storing callback context
  *
@@ -434,8 +536,26 @@ void wimaxll_cb_maybe_set_result(struct wimaxll_cb_ctx *ctx, int val)
 }
 
 
+/**
+ * Flags for wimaxll_open_flags()
+ *
+ * \ingroup device_management
+ */
+enum wimaxll_open_flags_e {
+	/** Use the process-wide shared receive socket */
+	WIMAXLL_OPEN_SHARED_RX = 0x1,
+	/** Set up the receive side only when needed */
+	WIMAXLL_OPEN_LAZY_RX = 0x2,
+	/** Don't check if the device is a WiMAX one when opening; the
+	 * first operation to complete does (failing with -%ENODEV if it
+	 * is not, as do all the ones after it) */
+	WIMAXLL_OPEN_NO_PROBE = 0x4,
+};
+
 /* Basic handle management */
 struct wimaxll_handle *wimaxll_open(const char *device_name);
+struct wimaxll_handle *wimaxll_open_flags(const char *device_name,
+					  unsigned flags);
 void *wimaxll_priv_get(struct wimaxll_handle *);
 void wimaxll_priv_set(struct wimaxll_handle *, void *);
 void wimaxll_close(struct wimaxll_handle *);
@@ -445,25 +565,158 @@ unsigned wimaxll_ifidx(const struct wimaxll_handle *);
 /* Wait for data from the kernel, execute callbacks */
 int wimaxll_recv_fd(struct wimaxll_handle *);
 ssize_t wimaxll_recv(struct wimaxll_handle *);
+ssize_t wimaxll_recv_deadline(struct wimaxll_handle *,
+			      const struct timespec *);
+ssize_t wimaxll_recv_budget(struct wimaxll_handle *, unsigned);
+ssize_t wimaxll_recv_drain(struct wimaxll_handle *, unsigned);
+int wimaxll_recv_backlog(struct wimaxll_handle *);
+void wimaxll_recv_buf_size_set(struct wimaxll_handle *, size_t);
+unsigned long wimaxll_recv_buf_grow_count(struct wimaxll_handle *);
+
+/**
+ * Flags for wimaxll_recv_filter()
+ *
+ * \ingroup mc_rx
+ */
+enum wimaxll_recv_filter_e {
+	/** Accept only notifications that have a callback set */
+	WIMAXLL_RECV_FILTER_CB = 0x1,
+	/** Don't filter in the kernel */
+	WIMAXLL_RECV_FILTER_NONE = 0x2,
+};
+
+int wimaxll_recv_filter(struct wimaxll_handle *, unsigned flags,
+			const char * const *pipe_names, size_t pipe_count);
 
 /* Default (bidirectional) message pipe from the kernel */
 ssize_t wimaxll_msg_write(struct wimaxll_handle *, const char *,
 			  const void *, size_t);
+ssize_t wimaxll_msg_write_deadline(struct wimaxll_handle *, const char *,
+				   const void *, size_t,
+				   const struct timespec *);
+ssize_t wimaxll_msg_write_async(struct wimaxll_handle *, const char *,
+				const void *, size_t,
+				wimaxll_ack_cb_f, void *);
+struct wimaxll_op *wimaxll_msg_write_start(struct wimaxll_handle *,
+					   const char *,
+					   const void *, size_t,
+					   wimaxll_op_cb_f, void *);
+
+/**
+ * Descriptor of a message to send with wimaxll_msg_writev()
+ *
+ * \param pipe_name Name of the pipe for which to send the message
+ *     (NULL for the default pipe).
+ * \param data Pointer to the message.
+ * \param size Size of the message.
+ * \param result [output] Result code the kernel passed in the ACK
+ *     for this message.
+ *
+ * \ingroup the_messaging_interface
+ */
+struct wimaxll_msg_vec {
+	const char *pipe_name;
+	const void *data;
+	size_t size;
+	ssize_t result;
+};
+ssize_t wimaxll_msg_writev(struct wimaxll_handle *,
+			   struct wimaxll_msg_vec *, size_t);
+
+/* Process ACKs for asynchronously sent messages */
+int wimaxll_tx_fd(struct wimaxll_handle *);
+ssize_t wimaxll_tx_recv(struct wimaxll_handle *);
+ssize_t wimaxll_tx_flush(struct wimaxll_handle *);
+ssize_t wimaxll_tx_drain(struct wimaxll_handle *, unsigned);
+unsigned wimaxll_tx_pending(struct wimaxll_handle *);
+
+/* Watch many handles with epoll; see libwimaxll-glib for GLib */
+struct wimaxll_epoll;
+struct wimaxll_epoll *wimaxll_epoll_create(unsigned);
+void wimaxll_epoll_destroy(struct wimaxll_epoll *);
+int wimaxll_epoll_fd(struct wimaxll_epoll *);
+int wimaxll_epoll_add(struct wimaxll_epoll *, struct wimaxll_handle *);
+int wimaxll_epoll_del(struct wimaxll_epoll *, struct wimaxll_handle *);
+int wimaxll_epoll_dispatch(struct wimaxll_epoll *, int);
 
 void wimaxll_get_cb_msg_to_user(struct wimaxll_handle *,
 				wimaxll_msg_to_user_cb_f *, void **);
 void wimaxll_set_cb_msg_to_user(struct wimaxll_handle *,
 				wimaxll_msg_to_user_cb_f, void *);
+int wimaxll_add_cb_msg_to_user(struct wimaxll_handle *,
+			       wimaxll_msg_to_user_cb_f, void *);
+int wimaxll_remove_cb(struct wimaxll_handle *, int);
 
 #define WIMAX_PIPE_ANY (NULL-1)
+int wimaxll_pipe_register(struct wimaxll_handle *, const char *);
+const char *wimaxll_pipe_name(struct wimaxll_handle *, int);
+int wimaxll_msg_pipe_id(struct wimaxll_handle *);
+int wimaxll_pipe_get_cb_msg_to_user(struct wimaxll_handle *, int,
+				    wimaxll_msg_to_user_cb_f *, void **);
+int wimaxll_pipe_set_cb_msg_to_user(struct wimaxll_handle *, int,
+				    wimaxll_msg_to_user_cb_f, void *);
 ssize_t wimaxll_msg_read(struct wimaxll_handle *, const char *pine_name,
 			 void **);
+ssize_t wimaxll_msg_read_deadline(struct wimaxll_handle *, const char *,
+				  void **, const struct timespec *);
 void wimaxll_msg_free(void *);
+int wimaxll_msg_pool_set(struct wimaxll_handle *, size_t, unsigned);
+ssize_t wimaxll_msg_read_borrow(struct wimaxll_handle *, const char *,
+				const void **);
+void wimaxll_msg_release(struct wimaxll_handle *, const void *);
+
+/**
+ * What to drop when a pipe's message queue is full
+ *
+ * \ingroup the_messaging_interface
+ */
+enum wimaxll_msg_queue_policy_e {
+	/** Drop the message that arrives (default) */
+	WIMAXLL_MSG_QUEUE_DROP_NEW = 0,
+	/** Drop the oldest queued message to make room */
+	WIMAXLL_MSG_QUEUE_DROP_OLD = 1,
+};
+
+/**
+ * Counters of a pipe's message queue
+ *
+ * \param len Messages currently queued.
+ * \param depth Maximum number of messages the queue holds.
+ * \param queued Messages queued so far.
+ * \param dropped Messages dropped because the queue was full.
+ *
+ * \ingroup the_messaging_interface
+ */
+struct wimaxll_msg_queue_stats {
+	unsigned len, depth;
+	unsigned long queued, dropped;
+};
+
+int wimaxll_msg_queue_set(struct wimaxll_handle *, const char *,
+			  unsigned, unsigned);
+int wimaxll_msg_queue_stats_get(struct wimaxll_handle *, const char *,
+				struct wimaxll_msg_queue_stats *);
 
 /* generic API */
 int wimaxll_rfkill(struct wimaxll_handle *, enum wimax_rf_state);
 int wimaxll_reset(struct wimaxll_handle *);
 int wimaxll_state_get(struct wimaxll_handle *);
+int wimaxll_rfkill_deadline(struct wimaxll_handle *, enum wimax_rf_state,
+			    const struct timespec *);
+int wimaxll_reset_deadline(struct wimaxll_handle *, const struct timespec *);
+int wimaxll_state_get_deadline(struct wimaxll_handle *,
+			       const struct timespec *);
+
+/* Non-blocking versions; see wimaxll_op_poll() */
+struct wimaxll_op *wimaxll_rfkill_start(struct wimaxll_handle *,
+					enum wimax_rf_state,
+					wimaxll_op_cb_f, void *);
+struct wimaxll_op *wimaxll_reset_start(struct wimaxll_handle *,
+				       wimaxll_op_cb_f, void *);
+struct wimaxll_op *wimaxll_state_get_start(struct wimaxll_handle *,
+					   wimaxll_op_cb_f, void *);
+int wimaxll_op_poll(struct wimaxll_op *, ssize_t *);
+void wimaxll_op_free(struct wimaxll_op *);
 
 void wimaxll_get_cb_state_change(
 	struct wimaxll_handle *, wimaxll_state_change_cb_f *,
@@ -471,9 +724,19 @@ void wimaxll_get_cb_state_change(
 void wimaxll_set_cb_state_change(
 	struct wimaxll_handle *, wimaxll_state_change_cb_f,
 	void *);
+int wimaxll_add_cb_state_change(struct wimaxll_handle *,
+				wimaxll_state_change_cb_f, void *);
 ssize_t wimaxll_wait_for_state_change(struct wimaxll_handle *wmx,
 				      enum wimax_st *old_state,
 				      enum wimax_st *new_state);
+ssize_t wimaxll_wait_for_state_change_deadline(struct wimaxll_handle *wmx,
+					       enum wimax_st *old_state,
+					       enum wimax_st *new_state,
+					       const struct timespec *deadline);
+int wimaxll_state_cache_enable(struct wimaxll_handle *);
+void wimaxll_state_cache_disable(struct wimaxll_handle *);
+int wimaxll_state_cache_get(struct wimaxll_handle *, unsigned long *,
+			    struct timespec *);
 
 
 /**
@@ -482,6 +745,7 @@ ssize_t wimaxll_wait_for_state_change(struct wimaxll_handle *wmx,
 enum wimax_st wimaxll_state_by_name(const char *);
 size_t wimaxll_states_snprintf(char *, size_t);
 const char * wimaxll_state_to_name(enum wimax_st);
+struct timespec *wimaxll_deadline_set(struct timespec *, unsigned);
 
 #define wimaxll_array_size(a) (sizeof(a)/sizeof(a[0]))
 
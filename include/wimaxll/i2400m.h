@@ -36,6 +36,7 @@
 #define __wimaxll__i2400m_h__
 
 #include <sys/types.h>
+#include <time.h>
 #include <linux/wimax/i2400m.h>
 
 struct i2400m;
@@ -45,19 +46,41 @@ struct wimaxll_handle;
  * Callback called by i2400m_msg_to_dev() when a reply to the executed
  * command arrives.
  *
- * In struct i2400m, the fields mt_cb_priv, mt_orig, and mt_orig_size are
- * set for reference.
+ * \e priv is the \e cb_priv given to i2400m_msg_to_dev(); other
+ * threads' commands of other types might be in flight at the same
+ * time.
  *
  * The callback is passed the reply and to only return some error
  * value that i2400m_msg_to_dev() will return to the caller.
  *
- * You CANNOT execute other commands with i2400m_msg_to_dev() inside
- * this function neither wait for reports to arrive. You'd deadlock.
+ * It is run by the thread that called i2400m_msg_to_dev(), on a copy
+ * of the reply and with no locks held, so it doesn't hold up the
+ * reception of other messages.
  */
 typedef int (*i2400m_reply_cb)(
 	struct i2400m *, void *priv,
 	const struct i2400m_l3l4_hdr *reply, size_t reply_size);
 
+/*
+ * Callback called when a command sent with i2400m_msg_to_dev_async()
+ * completes.
+ *
+ * \e priv is the \e cb_priv given to i2400m_msg_to_dev_async().
+ * \e result is 0 if the reply arrived (then \e reply points to it,
+ * valid only during the call; check its status field); otherwise
+ * \e reply is NULL and \e result is -%ETIMEDOUT if the deadline
+ * passed, -%ECANCELED if cancelled with i2400m_msg_to_dev_cancel(),
+ * -%EINTR if the handle was destroyed or the negative errno code of
+ * the failure sending the message.
+ *
+ * Unlike \e i2400m_reply_cb, it is called with no locks held, so it
+ * can send more commands with i2400m_msg_to_dev_async() (but not
+ * wait for them).
+ */
+typedef void (*i2400m_done_cb)(
+	struct i2400m *, void *priv, int result,
+	const struct i2400m_l3l4_hdr *reply, size_t reply_size);
+
 /**
  * Callback for handling i2400m reports.
  *
@@ -78,12 +101,48 @@ typedef void (*i2400m_report_cb)(
 	struct i2400m *i2400m,
 	const struct i2400m_l3l4_hdr *l3l4, size_t l3l4_size);
 
+/**
+ * Callback for handling one type of i2400m report.
+ *
+ * Set with i2400m_report_handler_set(); same as \e i2400m_report_cb,
+ * but also gets the \e priv pointer given when setting it.
+ */
+typedef void (*i2400m_report_type_cb)(
+	struct i2400m *i2400m, void *priv,
+	const struct i2400m_l3l4_hdr *l3l4, size_t l3l4_size);
+
+/**
+ * Flags for i2400m_create_flags()
+ */
+enum i2400m_create_flags_e {
+	/** Receive and process the device's messages in a thread owned
+	 * by the handle */
+	I2400M_RX_THREAD = 0x1,
+};
+
 int i2400m_create(struct i2400m **, const char *, void *, i2400m_report_cb);
+int i2400m_create_flags(struct i2400m **, const char *, void *,
+			i2400m_report_cb, unsigned);
+int i2400m_rx_thread_set_cpu(struct i2400m *, int);
+int i2400m_rx_thread_set_sched(struct i2400m *, int, int);
 int i2400m_create_from_handle(struct i2400m **, struct wimaxll_handle *,
 			      void *, i2400m_report_cb);
 void i2400m_destroy(struct i2400m *);
 int i2400m_msg_to_dev(struct i2400m *, const struct i2400m_l3l4_hdr *, size_t,
 		      i2400m_reply_cb, void *);
+int i2400m_msg_to_dev_deadline(struct i2400m *,
+			       const struct i2400m_l3l4_hdr *, size_t,
+			       i2400m_reply_cb, void *,
+			       const struct timespec *);
+int i2400m_msg_to_dev_async(struct i2400m *,
+			    const struct i2400m_l3l4_hdr *, size_t,
+			    i2400m_done_cb, void *,
+			    const struct timespec *);
+int i2400m_msg_to_dev_cancel(struct i2400m *, int);
+int i2400m_timeout_ms(struct i2400m *);
+int i2400m_timeout_run(struct i2400m *);
+int i2400m_report_handler_set(struct i2400m *, enum i2400m_mt,
+			      i2400m_report_type_cb, void *);
 void *i2400m_priv(struct i2400m *);
 struct wimaxll_handle *i2400m_wmx(struct i2400m *);
 
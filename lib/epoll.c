@@ -0,0 +1,368 @@
+/*
+ * Linux WiMAX
+ * epoll(7) integration
+ *
+ *
+ * Copyright (C) 2007-2009 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ *
+ * A set of handles watched by a single epoll file descriptor, for
+ * applications that drive many devices from one thread without a
+ * main loop library of their own (see lib/glib.c for GLib).
+ *
+ * For each handle, the receive socket (wimaxll_recv_fd()) and the
+ * socket where ACKs arrive (wimaxll_tx_fd()) are watched
+ * (level-triggered); when they are ready, they are drained without
+ * blocking, up to a budget of datagrams per socket and wakeup, which
+ * runs the notification callbacks and the completion callbacks of
+ * asynchronous operations (wimaxll_msg_write_async(),
+ * wimaxll_rfkill_start(), etc).
+ *
+ * Handles opened with %WIMAXLL_OPEN_SHARED_RX share a receive socket;
+ * it is watched once, through the first of them added to the set
+ * (draining it delivers to all of them). When that one is removed,
+ * the socket is handed over to another one sharing it.
+ */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <wimaxll.h>
+#include "internal.h"
+#define D_LOCAL 0
+#include "debug.h"
+
+
+enum {
+	/* Maximum number of events read with each epoll_wait() */
+	WIMAXLL_EPOLL_EVENTS_MAX = 64,
+	/* Tag in the event data for the TX socket of an entry */
+	WIMAXLL_EPOLL_TX = 1,
+};
+
+
+/*
+ * A handle in an epoll set
+ *
+ * @rx_fd: receive socket, -1 if it is watched through another entry
+ *     (shared receiver).
+ * @backlog: datagrams were left unprocessed in the handle (a callback
+ *     stopped processing); epoll won't signal them.
+ */
+struct wimaxll_epoll_entry {
+	struct wimaxll_epoll_entry *next;
+	struct wimaxll_handle *wmx;
+	int rx_fd;
+	unsigned backlog:1;
+};
+
+
+/*
+ * A set of handles to watch with epoll
+ *
+ * @fd: epoll file descriptor
+ * @budget: datagrams to process per socket on each wakeup
+ * @entries: list of handles in the set
+ * @backlog_count: number of entries with @backlog set
+ */
+struct wimaxll_epoll {
+	int fd;
+	unsigned budget;
+	struct wimaxll_epoll_entry *entries;
+	unsigned backlog_count;
+};
+
+
+/**
+ * Create a set of handles to watch with epoll
+ *
+ * \param budget Maximum number of datagrams to process from each
+ *     socket on each wakeup (0 for %WIMAXLL_RX_BATCH_MAX), so a busy
+ *     device doesn't starve the rest.
+ * \return pointer to the set; NULL on error, with \a errno set.
+ *
+ * Add handles with wimaxll_epoll_add() and call
+ * wimaxll_epoll_dispatch() in a loop.
+ *
+ * \ingroup mc_rx
+ */
+struct wimaxll_epoll *wimaxll_epoll_create(unsigned budget)
+{
+	struct wimaxll_epoll *ep;
+
+	ep = calloc(1, sizeof(*ep));
+	if (ep == NULL)
+		return NULL;
+	ep->fd = epoll_create1(EPOLL_CLOEXEC);
+	if (ep->fd < 0) {
+		free(ep);
+		return NULL;
+	}
+	ep->budget = budget ? budget : WIMAXLL_RX_BATCH_MAX;
+	return ep;
+}
+
+
+/**
+ * Release a set of handles created with wimaxll_epoll_create()
+ *
+ * \param ep Set of handles; the handles themselves are not closed.
+ *
+ * \ingroup mc_rx
+ */
+void wimaxll_epoll_destroy(struct wimaxll_epoll *ep)
+{
+	struct wimaxll_epoll_entry *entry;
+
+	if (ep == NULL)
+		return;
+	while (ep->entries != NULL) {
+		entry = ep->entries;
+		ep->entries = entry->next;
+		free(entry);
+	}
+	close(ep->fd);
+	free(ep);
+}
+
+
+/**
+ * Return the epoll file descriptor of a set of handles
+ *
+ * \param ep Set of handles
+ *
+ * It becomes ready for reading when any of the handles in the set
+ * has something to process, so the set can be nested in another
+ * main loop (call wimaxll_epoll_dispatch() with a 0 timeout then).
+ *
+ * \ingroup mc_rx
+ */
+int wimaxll_epoll_fd(struct wimaxll_epoll *ep)
+{
+	return ep->fd;
+}
+
+
+/**
+ * Add a handle to a set of handles watched with epoll
+ *
+ * \param ep Set of handles
+ * \param wmx WiMAX device handle
+ * \return 0 if ok, < 0 errno code on error.
+ *
+ * For handles opened with %WIMAXLL_OPEN_LAZY_RX, this sets up the
+ * receive side.
+ *
+ * \ingroup mc_rx
+ */
+int wimaxll_epoll_add(struct wimaxll_epoll *ep, struct wimaxll_handle *wmx)
+{
+	int result;
+	struct wimaxll_epoll_entry *entry;
+	struct epoll_event ev = { .events = EPOLLIN };
+
+	d_fnstart(3, wmx, "(ep %p wmx %p)\n", ep, wmx);
+	result = -ENOMEM;
+	entry = calloc(1, sizeof(*entry));
+	if (entry == NULL)
+		goto error_alloc;
+	entry->wmx = wmx;
+	result = wimaxll_recv_fd(wmx);
+	if (result < 0)
+		goto error_recv_fd;
+	entry->rx_fd = result;
+	ev.data.u64 = (uintptr_t) entry;
+	if (epoll_ctl(ep->fd, EPOLL_CTL_ADD, entry->rx_fd, &ev) < 0) {
+		result = -errno;
+		if (result != -EEXIST)
+			goto error_add_rx;
+		entry->rx_fd = -1;	/* shared receiver, already in */
+	}
+	ev.data.u64 = (uintptr_t) entry | WIMAXLL_EPOLL_TX;
+	if (epoll_ctl(ep->fd, EPOLL_CTL_ADD, wmx->tx_fd, &ev) < 0) {
+		result = -errno;
+		goto error_add_tx;
+	}
+	entry->next = ep->entries;
+	ep->entries = entry;
+	d_fnend(3, wmx, "(ep %p wmx %p) = 0\n", ep, wmx);
+	return 0;
+
+error_add_tx:
+	if (entry->rx_fd >= 0)
+		epoll_ctl(ep->fd, EPOLL_CTL_DEL, entry->rx_fd, NULL);
+error_add_rx:
+error_recv_fd:
+	free(entry);
+error_alloc:
+	wimaxll_msg(wmx, "E: cannot add handle to epoll set: %d\n", result);
+	d_fnend(3, wmx, "(ep %p wmx %p) = %d\n", ep, wmx, result);
+	return result;
+}
+
+
+/*
+ * Hand over the receive socket watched through @entry (being removed)
+ * to another entry sharing it, if any
+ *
+ * Returns !0 if it was handed over (so it has to stay in the epoll
+ * set).
+ */
+static
+int wimaxll_epoll_rx_handover(struct wimaxll_epoll *ep,
+			      struct wimaxll_epoll_entry *entry)
+{
+	struct wimaxll_epoll_entry *itr;
+	struct wimaxll_handle *rx_wmx = wimaxll_rx_wmx(entry->wmx);
+	struct epoll_event ev = { .events = EPOLLIN };
+
+	for (itr = ep->entries; itr != NULL; itr = itr->next)
+		if (itr->rx_fd < 0 && wimaxll_rx_wmx(itr->wmx) == rx_wmx)
+			break;
+	if (itr == NULL)
+		return 0;
+	ev.data.u64 = (uintptr_t) itr;
+	if (epoll_ctl(ep->fd, EPOLL_CTL_MOD, entry->rx_fd, &ev) < 0) {
+		wimaxll_msg(itr->wmx, "E: cannot hand over shared receive "
+			    "socket in epoll set: %d\n", -errno);
+		return 0;
+	}
+	itr->rx_fd = entry->rx_fd;
+	/* What was left unprocessed is now the new owner's */
+	if (entry->backlog && !itr->backlog) {
+		itr->backlog = 1;
+		ep->backlog_count++;
+	}
+	return 1;
+}
+
+
+/**
+ * Remove a handle from a set of handles watched with epoll
+ *
+ * \param ep Set of handles
+ * \param wmx WiMAX device handle
+ * \return 0 if ok, -%ENOENT if \a wmx is not in the set.
+ *
+ * Do it before closing the handle. Not to be called from callbacks
+ * run by wimaxll_epoll_dispatch().
+ *
+ * \ingroup mc_rx
+ */
+int wimaxll_epoll_del(struct wimaxll_epoll *ep, struct wimaxll_handle *wmx)
+{
+	struct wimaxll_epoll_entry **itr, *entry;
+
+	for (itr = &ep->entries; *itr != NULL; itr = &(*itr)->next)
+		if ((*itr)->wmx == wmx)
+			break;
+	entry = *itr;
+	if (entry == NULL)
+		return -ENOENT;
+	*itr = entry->next;
+	if (entry->rx_fd >= 0 && !wimaxll_epoll_rx_handover(ep, entry))
+		epoll_ctl(ep->fd, EPOLL_CTL_DEL, entry->rx_fd, NULL);
+	epoll_ctl(ep->fd, EPOLL_CTL_DEL, wmx->tx_fd, NULL);
+	if (entry->backlog)
+		ep->backlog_count--;
+	free(entry);
+	return 0;
+}
+
+
+/*
+ * Drain an entry's receive socket and note if something was left
+ */
+static
+void wimaxll_epoll_rx(struct wimaxll_epoll *ep,
+		      struct wimaxll_epoll_entry *entry)
+{
+	int backlog;
+
+	wimaxll_recv_drain(entry->wmx, ep->budget);
+	backlog = wimaxll_rx_backlog(entry->wmx);
+	if (backlog && !entry->backlog)
+		ep->backlog_count++;
+	else if (!backlog && entry->backlog)
+		ep->backlog_count--;
+	entry->backlog = backlog;
+}
+
+
+/**
+ * Wait for activity on a set of handles and process it
+ *
+ * \param ep Set of handles
+ * \param timeout Maximum time to wait, in milliseconds (-1 to wait
+ *     forever, 0 to just process what is ready).
+ * \return Number of sockets serviced (0 on timeout or if interrupted
+ *     by a signal); < 0 errno code on error.
+ *
+ * For each ready socket, up to the set's budget of datagrams are
+ * processed without blocking, running the callbacks set on the
+ * handles. Datagrams left unprocessed because a callback returned
+ * -%EBUSY are processed on the next call (which won't wait then).
+ *
+ * \ingroup mc_rx
+ */
+int wimaxll_epoll_dispatch(struct wimaxll_epoll *ep, int timeout)
+{
+	int result, itr, serviced = 0;
+	struct epoll_event events[WIMAXLL_EPOLL_EVENTS_MAX];
+	struct wimaxll_epoll_entry *entry;
+	uintptr_t data;
+
+	if (ep->backlog_count > 0) {
+		timeout = 0;
+		for (entry = ep->entries; entry != NULL; entry = entry->next)
+			if (entry->backlog) {
+				wimaxll_epoll_rx(ep, entry);
+				serviced++;
+			}
+	}
+	result = epoll_wait(ep->fd, events, WIMAXLL_EPOLL_EVENTS_MAX,
+			    timeout);
+	if (result < 0)
+		return errno == EINTR ? serviced : -errno;
+	for (itr = 0; itr < result; itr++) {
+		data = events[itr].data.u64;
+		entry = (void *) (data & ~(uintptr_t) WIMAXLL_EPOLL_TX);
+		if (data & WIMAXLL_EPOLL_TX)
+			wimaxll_tx_drain(entry->wmx, ep->budget);
+		else
+			wimaxll_epoll_rx(ep, entry);
+		serviced++;
+	}
+	return serviced;
+}
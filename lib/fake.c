@@ -0,0 +1,816 @@
+/*
+ * Linux WiMAX
+ * In-process stand-in for the kernel's WiMAX stack
+ *
+ *
+ * Copyright (C) 2007-2009 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * A transport (struct wimaxll_transport_ops) whose other end is a
+ * thread in this process that plays the kernel's part. See
+ * lib/fake.h for the interface.
+ *
+ * Each handle's TX and RX sides are one end of a datagram
+ * socketpair; the "kernel" holds the other end. Datagrams carry
+ * exactly what would travel over netlink: generic netlink requests
+ * one way, NLMSG_ERROR ACKs and notifications the other. So
+ * everything the library does on top (batched reads, truncation
+ * detection, socket filters, demultiplexing) is exercised as with
+ * the real thing.
+ *
+ * The kernel thread polls the TX sockets and answers requests;
+ * notifications (generated at the configured rates or requested
+ * with wimaxll_fake_msg_to_user() and wimaxll_fake_state_change())
+ * are copied to every RX socket, as the multicast group would.
+ *
+ * Only the kernel thread closes its ends of the sockets; when a
+ * handle closes, its entry is just marked and the thread reaps it,
+ * so the thread never polls a file descriptor number that might
+ * have been reused.
+ */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+#include <netlink/msg.h>
+#include <netlink/netlink.h>
+#include <netlink/genl/genl.h>
+#include <wimaxll.h>
+#include "internal.h"
+#include "fake.h"
+#define D_LOCAL 0
+#include "debug.h"
+
+
+enum {
+	/* What the fake kernel resolves the family and group to */
+	WIMAXLL_FAKE_FAMILY_ID = 0x7f,
+	WIMAXLL_FAKE_MCG_ID = 1,
+	/* Maximum size of a request */
+	WIMAXLL_FAKE_REQ_SIZE = 64 * 1024,
+	/* Maximum number of timed notifications sent in a row */
+	WIMAXLL_FAKE_BURST_MAX = 1024,
+};
+
+
+/*
+ * The kernel's end of a socketpair
+ *
+ * \param kfd Kernel's end
+ * \param fd Library's end (to find the entry when closing)
+ * \param rx !0 if this is a receive socket (member of the multicast
+ *     group); otherwise it is a TX socket, polled for requests.
+ * \param closed !0 if the library closed its end; the kernel thread
+ *     has to close \a kfd and free the entry.
+ */
+struct wimaxll_fake_sock {
+	struct wimaxll_fake_sock *next;
+	int kfd, fd;
+	unsigned rx:1, closed:1;
+};
+
+
+static struct {
+	pthread_mutex_t mutex;
+	unsigned running:1;
+	pthread_t thread;
+	int wake[2];
+	const struct wimaxll_transport_ops *prev_transport;
+	struct wimaxll_fake_config config;
+	char *msg_to_user_pipe;
+	void *msg_to_user_data;
+	unsigned ifidx;
+	enum wimax_st state;
+	enum wimax_rf_state rf_hw, rf_sw;
+	struct wimaxll_fake_sock *socks;
+	struct wimaxll_fake_stats stats;
+	void *req_buf;
+} wimaxll_fake = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+
+static
+void wimaxll_fake_wake(void)
+{
+	char c = 0;
+
+	if (write(wimaxll_fake.wake[1], &c, 1) < 0 && errno != EAGAIN)
+		wimaxll_msg(NULL, "E: fake: cannot wake up: %m\n");
+}
+
+
+static
+unsigned long long wimaxll_fake_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/*
+ * Copy a datagram to every receive socket (as the multicast group
+ * would)
+ *
+ * Called with the mutex held.
+ */
+static
+void wimaxll_fake_multicast(const void *buf, size_t size)
+{
+	struct wimaxll_fake_sock *sock;
+
+	for (sock = wimaxll_fake.socks; sock != NULL; sock = sock->next) {
+		if (!sock->rx || sock->closed)
+			continue;
+		if (send(sock->kfd, buf, size, MSG_DONTWAIT) < 0)
+			wimaxll_fake.stats.drops++;
+	}
+	wimaxll_fake.stats.events++;
+}
+
+
+/*
+ * Build a notification and send it to the multicast group
+ *
+ * Called with the mutex held.
+ */
+static
+int __wimaxll_fake_msg_to_user(const char *pipe_name,
+			       const void *data, size_t size)
+{
+	int result;
+	struct nl_msg *msg;
+
+	msg = nlmsg_new();
+	if (msg == NULL)
+		return -ENOMEM;
+	genlmsg_put(msg, 0, 0, WIMAXLL_FAKE_FAMILY_ID, 0, 0,
+		    WIMAX_GNL_OP_MSG_TO_USER, WIMAX_GNL_VERSION);
+	nla_put_u32(msg, WIMAX_GNL_MSG_IFIDX, wimaxll_fake.ifidx);
+	if (pipe_name != NULL)
+		nla_put_string(msg, WIMAX_GNL_MSG_PIPE_NAME, pipe_name);
+	result = nla_put(msg, WIMAX_GNL_MSG_DATA, size, data);
+	if (result >= 0)
+		wimaxll_fake_multicast(nlmsg_hdr(msg),
+				       nlmsg_hdr(msg)->nlmsg_len);
+	nlmsg_free(msg);
+	return result < 0 ? result : 0;
+}
+
+
+static
+int __wimaxll_fake_state_change(enum wimax_st old_state,
+				enum wimax_st new_state)
+{
+	struct nl_msg *msg;
+
+	msg = nlmsg_new();
+	if (msg == NULL)
+		return -ENOMEM;
+	genlmsg_put(msg, 0, 0, WIMAXLL_FAKE_FAMILY_ID, 0, 0,
+		    WIMAX_GNL_RE_STATE_CHANGE, WIMAX_GNL_VERSION);
+	nla_put_u32(msg, WIMAX_GNL_STCH_IFIDX, wimaxll_fake.ifidx);
+	nla_put_u8(msg, WIMAX_GNL_STCH_STATE_OLD, old_state);
+	nla_put_u8(msg, WIMAX_GNL_STCH_STATE_NEW, new_state);
+	wimaxll_fake_multicast(nlmsg_hdr(msg), nlmsg_hdr(msg)->nlmsg_len);
+	nlmsg_free(msg);
+	wimaxll_fake.state = new_state;
+	return 0;
+}
+
+
+static
+int wimaxll_fake_ifidx_check(struct nlattr *attr)
+{
+	if (attr == NULL)
+		return -EINVAL;
+	return nla_get_u32(attr) == wimaxll_fake.ifidx ? 0 : -ENODEV;
+}
+
+
+/*
+ * Execute a request and return the result code for its ACK
+ *
+ * Called with the mutex held.
+ */
+static
+int wimaxll_fake_exec(struct nlmsghdr *nl_hdr)
+{
+	int result;
+	struct genlmsghdr *gnl_hdr = nlmsg_data(nl_hdr);
+	struct nlattr *tb[WIMAX_GNL_ATTR_MAX + 1];
+	enum wimax_rf_state rf_state;
+	const char *pipe_name;
+
+	if (nl_hdr->nlmsg_type != WIMAXLL_FAKE_FAMILY_ID)
+		return -ENOENT;
+	result = genlmsg_parse(nl_hdr, 0, tb, WIMAX_GNL_ATTR_MAX, NULL);
+	if (result < 0)
+		return -EINVAL;
+	switch (gnl_hdr->cmd) {
+	case WIMAX_GNL_OP_MSG_FROM_USER:
+		result = wimaxll_fake_ifidx_check(tb[WIMAX_GNL_MSG_IFIDX]);
+		if (result < 0)
+			break;
+		if (tb[WIMAX_GNL_MSG_DATA] == NULL)
+			return -EINVAL;
+		if (wimaxll_fake.config.echo) {
+			pipe_name = tb[WIMAX_GNL_MSG_PIPE_NAME] ?
+				nla_get_string(tb[WIMAX_GNL_MSG_PIPE_NAME])
+				: NULL;
+			__wimaxll_fake_msg_to_user(
+				pipe_name, nla_data(tb[WIMAX_GNL_MSG_DATA]),
+				nla_len(tb[WIMAX_GNL_MSG_DATA]));
+		}
+		break;
+	case WIMAX_GNL_OP_RFKILL:
+		result = wimaxll_fake_ifidx_check(tb[WIMAX_GNL_RFKILL_IFIDX]);
+		if (result < 0)
+			break;
+		if (tb[WIMAX_GNL_RFKILL_STATE] == NULL)
+			return -EINVAL;
+		rf_state = nla_get_u32(tb[WIMAX_GNL_RFKILL_STATE]);
+		if (rf_state == WIMAX_RF_OFF || rf_state == WIMAX_RF_ON) {
+			wimaxll_fake.rf_sw = rf_state;
+			if (rf_state == WIMAX_RF_OFF
+			    && wimaxll_fake.state >= WIMAX_ST_READY)
+				__wimaxll_fake_state_change(
+					wimaxll_fake.state,
+					WIMAX_ST_RADIO_OFF);
+			else if (rf_state == WIMAX_RF_ON
+				 && wimaxll_fake.rf_hw == WIMAX_RF_ON
+				 && wimaxll_fake.state == WIMAX_ST_RADIO_OFF)
+				__wimaxll_fake_state_change(
+					wimaxll_fake.state, WIMAX_ST_READY);
+		} else if (rf_state != WIMAX_RF_QUERY)
+			return -EINVAL;
+		/* Same encoding as the kernel's wimax_rfkill() */
+		result = wimaxll_fake.rf_sw << 1 | wimaxll_fake.rf_hw;
+		break;
+	case WIMAX_GNL_OP_RESET:
+		result = wimaxll_fake_ifidx_check(tb[WIMAX_GNL_RESET_IFIDX]);
+		break;
+	case WIMAX_GNL_OP_STATE_GET:
+		result = wimaxll_fake_ifidx_check(tb[WIMAX_GNL_STGET_IFIDX]);
+		if (result == 0)
+			result = wimaxll_fake.state;
+		break;
+	default:
+		result = -EOPNOTSUPP;
+	}
+	return result;
+}
+
+
+/*
+ * Process the requests in a datagram received on a TX socket
+ *
+ * Called with the mutex held.
+ */
+static
+void wimaxll_fake_request(struct wimaxll_fake_sock *sock,
+			  void *buf, size_t size)
+{
+	int remaining = size;
+	struct nlmsghdr *nl_hdr;
+	struct {
+		struct nlmsghdr hdr;
+		struct nlmsgerr err;
+	} ack;
+
+	for (nl_hdr = buf; nlmsg_ok(nl_hdr, remaining);
+	     nl_hdr = nlmsg_next(nl_hdr, &remaining)) {
+		wimaxll_fake.stats.requests++;
+		ack.err.error = wimaxll_fake_exec(nl_hdr);
+		if (ack.err.error == 0
+		    && (nl_hdr->nlmsg_flags & NLM_F_ACK) == 0)
+			continue;
+		ack.hdr.nlmsg_len = sizeof(ack);
+		ack.hdr.nlmsg_type = NLMSG_ERROR;
+		ack.hdr.nlmsg_flags = 0;
+		ack.hdr.nlmsg_seq = nl_hdr->nlmsg_seq;
+		ack.hdr.nlmsg_pid = nl_hdr->nlmsg_pid;
+		ack.err.msg = *nl_hdr;
+		if (send(sock->kfd, &ack, sizeof(ack), MSG_DONTWAIT) < 0)
+			wimaxll_fake.stats.drops++;
+		else
+			wimaxll_fake.stats.acks++;
+	}
+}
+
+
+/*
+ * Send the notifications whose time has come
+ *
+ * Called with the mutex held; returns the time (in ns, monotonic) of
+ * the next one or 0 if there are none.
+ */
+static
+unsigned long long wimaxll_fake_timers(unsigned long long *next_msg,
+				       unsigned long long *next_stch)
+{
+	unsigned count;
+	unsigned long long now = wimaxll_fake_now(), period, next = 0;
+	struct wimaxll_fake_config *config = &wimaxll_fake.config;
+
+	if (config->msg_to_user_rate > 0) {
+		period = 1000000000ULL / config->msg_to_user_rate;
+		for (count = 0; *next_msg <= now; count++) {
+			if (count >= WIMAXLL_FAKE_BURST_MAX) {
+				*next_msg = now + period;	/* fell behind */
+				break;
+			}
+			__wimaxll_fake_msg_to_user(
+				wimaxll_fake.msg_to_user_pipe,
+				wimaxll_fake.msg_to_user_data,
+				config->msg_to_user_size);
+			*next_msg += period;
+		}
+		next = *next_msg;
+	}
+	if (config->state_change_rate > 0) {
+		period = 1000000000ULL / config->state_change_rate;
+		for (count = 0; *next_stch <= now; count++) {
+			if (count >= WIMAXLL_FAKE_BURST_MAX) {
+				*next_stch = now + period;
+				break;
+			}
+			__wimaxll_fake_state_change(
+				wimaxll_fake.state,
+				wimaxll_fake.state == WIMAX_ST_READY ?
+				WIMAX_ST_SCANNING : WIMAX_ST_READY);
+			*next_stch += period;
+		}
+		if (next == 0 || *next_stch < next)
+			next = *next_stch;
+	}
+	return next;
+}
+
+
+/*
+ * Free the entries of sockets closed by the library
+ *
+ * Called with the mutex held, only from the kernel thread.
+ */
+static
+void wimaxll_fake_reap(void)
+{
+	struct wimaxll_fake_sock **itr, *sock;
+
+	for (itr = &wimaxll_fake.socks; *itr != NULL;) {
+		sock = *itr;
+		if (sock->closed == 0) {
+			itr = &sock->next;
+			continue;
+		}
+		*itr = sock->next;
+		close(sock->kfd);
+		free(sock);
+	}
+}
+
+
+/*
+ * The kernel
+ */
+static
+void *wimaxll_fake_thread(void *arg)
+{
+	int timeout;
+	ssize_t size;
+	unsigned itr, count, pfd_size = 0;
+	unsigned long long now, next, next_msg, next_stch;
+	struct pollfd *pfd = NULL, *new_pfd;
+	struct wimaxll_fake_sock **pfd_sock = NULL, **new_pfd_sock, *sock;
+	char c;
+
+	next_msg = next_stch = wimaxll_fake_now();
+	pthread_mutex_lock(&wimaxll_fake.mutex);
+	while (wimaxll_fake.running) {
+		wimaxll_fake_reap();
+		count = 1;
+		for (sock = wimaxll_fake.socks; sock != NULL;
+		     sock = sock->next)
+			count++;
+		if (count > pfd_size) {
+			new_pfd = realloc(pfd, count * sizeof(pfd[0]));
+			if (new_pfd != NULL)
+				pfd = new_pfd;
+			new_pfd_sock = realloc(pfd_sock,
+					       count * sizeof(pfd_sock[0]));
+			if (new_pfd_sock != NULL)
+				pfd_sock = new_pfd_sock;
+			if (new_pfd == NULL || new_pfd_sock == NULL) {
+				wimaxll_msg(NULL, "E: fake: out of memory\n");
+				break;
+			}
+			pfd_size = count;
+		}
+		pfd[0].fd = wimaxll_fake.wake[0];
+		pfd[0].events = POLLIN;
+		count = 1;
+		for (sock = wimaxll_fake.socks; sock != NULL;
+		     sock = sock->next) {
+			if (sock->rx)
+				continue;
+			pfd[count].fd = sock->kfd;
+			pfd[count].events = POLLIN;
+			pfd_sock[count] = sock;
+			count++;
+		}
+		next = wimaxll_fake_timers(&next_msg, &next_stch);
+		timeout = -1;
+		if (next != 0) {
+			now = wimaxll_fake_now();
+			timeout = next > now ? (next - now + 999999) / 1000000
+				: 0;
+		}
+		pthread_mutex_unlock(&wimaxll_fake.mutex);
+
+		if (poll(pfd, count, timeout) < 0 && errno != EINTR)
+			wimaxll_msg(NULL, "E: fake: poll failed: %m\n");
+
+		pthread_mutex_lock(&wimaxll_fake.mutex);
+		if (pfd[0].revents & POLLIN)
+			while (read(wimaxll_fake.wake[0], &c, 1) > 0);
+		for (itr = 1; itr < count; itr++) {
+			if ((pfd[itr].revents & POLLIN) == 0)
+				continue;
+			while ((size = recv(pfd_sock[itr]->kfd,
+					    wimaxll_fake.req_buf,
+					    WIMAXLL_FAKE_REQ_SIZE,
+					    MSG_DONTWAIT)) > 0)
+				wimaxll_fake_request(pfd_sock[itr],
+						     wimaxll_fake.req_buf,
+						     size);
+		}
+	}
+	pthread_mutex_unlock(&wimaxll_fake.mutex);
+	free(pfd);
+	free(pfd_sock);
+	return NULL;
+}
+
+
+/*
+ * Create a socketpair and hand its kernel end to the kernel thread
+ */
+static
+int wimaxll_fake_sock_add(int *fd, int rx)
+{
+	int result, fds[2];
+	struct wimaxll_fake_sock *sock;
+
+	result = -ENOMEM;
+	sock = calloc(1, sizeof(*sock));
+	if (sock == NULL)
+		goto error_alloc;
+	if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, fds) < 0) {
+		result = -errno;
+		goto error_socketpair;
+	}
+	sock->kfd = fds[0];
+	sock->fd = fds[1];
+	sock->rx = rx;
+	pthread_mutex_lock(&wimaxll_fake.mutex);
+	sock->next = wimaxll_fake.socks;
+	wimaxll_fake.socks = sock;
+	pthread_mutex_unlock(&wimaxll_fake.mutex);
+	wimaxll_fake_wake();
+	*fd = sock->fd;
+	return 0;
+
+error_socketpair:
+	free(sock);
+error_alloc:
+	return result;
+}
+
+
+static
+void wimaxll_fake_sock_del(int fd)
+{
+	struct wimaxll_fake_sock *sock;
+
+	pthread_mutex_lock(&wimaxll_fake.mutex);
+	for (sock = wimaxll_fake.socks; sock != NULL; sock = sock->next)
+		if (sock->fd == fd && !sock->closed) {
+			sock->closed = 1;
+			break;
+		}
+	close(fd);
+	pthread_mutex_unlock(&wimaxll_fake.mutex);
+	wimaxll_fake_wake();
+}
+
+
+/*
+ * Transport
+ */
+
+static
+int wimaxll_fake_tx_open(struct wimaxll_handle *wmx)
+{
+	int result;
+
+	/* Not connected; only used to number the messages */
+	wmx->nlh_tx = nl_handle_alloc();
+	if (wmx->nlh_tx == NULL) {
+		result = nl_get_errno();
+		wimaxll_msg(wmx, "E: fake TX: cannot allocate handle: %d\n",
+			    result);
+		goto error_nl_handle_alloc;
+	}
+	result = wimaxll_fake_sock_add(&wmx->tx_fd, 0);
+	if (result < 0) {
+		wimaxll_msg(wmx, "E: fake TX: cannot create socket: %d\n",
+			    result);
+		goto error_sock_add;
+	}
+	return 0;
+
+error_sock_add:
+	nl_handle_destroy(wmx->nlh_tx);
+	wmx->nlh_tx = NULL;
+error_nl_handle_alloc:
+	return result;
+}
+
+
+static
+void wimaxll_fake_tx_close(struct wimaxll_handle *wmx)
+{
+	wimaxll_fake_sock_del(wmx->tx_fd);
+	wmx->tx_fd = -1;
+	nl_handle_destroy(wmx->nlh_tx);
+	wmx->nlh_tx = NULL;
+}
+
+
+static
+int wimaxll_fake_resolve(struct wimaxll_handle *wmx)
+{
+	wmx->gnl_family_id = WIMAXLL_FAKE_FAMILY_ID;
+	wmx->mcg_id = WIMAXLL_FAKE_MCG_ID;
+	return WIMAX_GNL_VERSION;
+}
+
+
+static
+int wimaxll_fake_rx_open(struct wimaxll_handle *wmx)
+{
+	int result;
+
+	result = wimaxll_fake_sock_add(&wmx->rx_fd, 1);
+	if (result < 0)
+		wimaxll_msg(wmx, "E: fake RX: cannot create socket: %d\n",
+			    result);
+	return result;
+}
+
+
+static
+void wimaxll_fake_rx_close(struct wimaxll_handle *wmx)
+{
+	wimaxll_fake_sock_del(wmx->rx_fd);
+	wmx->rx_fd = -1;
+}
+
+
+static
+ssize_t wimaxll_fake_send(struct wimaxll_handle *wmx,
+			  const void *buf, size_t size)
+{
+	ssize_t result;
+
+	result = send(wmx->tx_fd, buf, size, 0);
+	return result < 0 ? -errno : result;
+}
+
+
+static
+const struct wimaxll_transport_ops wimaxll_transport_fake = {
+	.name = "fake",
+	.tx_open = wimaxll_fake_tx_open,
+	.tx_close = wimaxll_fake_tx_close,
+	.resolve = wimaxll_fake_resolve,
+	.rx_open = wimaxll_fake_rx_open,
+	.rx_close = wimaxll_fake_rx_close,
+	.send = wimaxll_fake_send,
+};
+
+
+/**
+ * Start the fake kernel
+ *
+ * \param config Configuration (NULL for the defaults: loopback
+ *     device, no notifications unless requested, no echo).
+ * \return 0 if ok, < 0 errno code on error (-%EBUSY if already
+ *     started).
+ *
+ * Handles opened after this (until wimaxll_fake_stop()) talk to the
+ * fake kernel.
+ */
+int wimaxll_fake_start(const struct wimaxll_fake_config *config)
+{
+	int result;
+	struct wimaxll_fake_config defaults = { .ifidx = 0 };
+
+	if (config == NULL)
+		config = &defaults;
+	pthread_mutex_lock(&wimaxll_fake.mutex);
+	result = -EBUSY;
+	if (wimaxll_fake.running)
+		goto error_running;
+	wimaxll_fake.config = *config;
+	wimaxll_fake.ifidx = config->ifidx;
+	if (wimaxll_fake.ifidx == 0)
+		wimaxll_fake.ifidx = if_nametoindex("lo");
+	result = -ENODEV;
+	if (wimaxll_fake.ifidx == 0)
+		goto error_ifidx;
+	wimaxll_fake.state = WIMAX_ST_READY;
+	wimaxll_fake.rf_hw = WIMAX_RF_ON;
+	wimaxll_fake.rf_sw = WIMAX_RF_ON;
+	memset(&wimaxll_fake.stats, 0, sizeof(wimaxll_fake.stats));
+	result = -ENOMEM;
+	wimaxll_fake.req_buf = malloc(WIMAXLL_FAKE_REQ_SIZE);
+	if (wimaxll_fake.req_buf == NULL)
+		goto error_req_buf;
+	wimaxll_fake.msg_to_user_data =
+		calloc(1, config->msg_to_user_size + 1);
+	if (wimaxll_fake.msg_to_user_data == NULL)
+		goto error_data;
+	wimaxll_fake.msg_to_user_pipe = NULL;
+	if (config->msg_to_user_pipe != NULL) {
+		wimaxll_fake.msg_to_user_pipe =
+			strdup(config->msg_to_user_pipe);
+		if (wimaxll_fake.msg_to_user_pipe == NULL)
+			goto error_pipe_name;
+	}
+	if (pipe2(wimaxll_fake.wake, O_NONBLOCK | O_CLOEXEC) < 0) {
+		result = -errno;
+		goto error_wake;
+	}
+	wimaxll_fake.running = 1;
+	result = -pthread_create(&wimaxll_fake.thread, NULL,
+				 wimaxll_fake_thread, NULL);
+	if (result < 0)
+		goto error_thread;
+	wimaxll_fake.prev_transport =
+		wimaxll_transport_set(&wimaxll_transport_fake);
+	pthread_mutex_unlock(&wimaxll_fake.mutex);
+	return 0;
+
+error_thread:
+	wimaxll_fake.running = 0;
+	close(wimaxll_fake.wake[0]);
+	close(wimaxll_fake.wake[1]);
+error_wake:
+	free(wimaxll_fake.msg_to_user_pipe);
+error_pipe_name:
+	free(wimaxll_fake.msg_to_user_data);
+error_data:
+	free(wimaxll_fake.req_buf);
+error_req_buf:
+error_ifidx:
+error_running:
+	pthread_mutex_unlock(&wimaxll_fake.mutex);
+	return result;
+}
+
+
+/**
+ * Stop the fake kernel
+ *
+ * All the handles opened while it was running have to be closed
+ * first. Handles opened afterwards go back to the transport that was
+ * in use before wimaxll_fake_start().
+ */
+void wimaxll_fake_stop(void)
+{
+	struct wimaxll_fake_sock *sock;
+
+	pthread_mutex_lock(&wimaxll_fake.mutex);
+	if (!wimaxll_fake.running) {
+		pthread_mutex_unlock(&wimaxll_fake.mutex);
+		return;
+	}
+	wimaxll_fake.running = 0;
+	wimaxll_transport_set(wimaxll_fake.prev_transport);
+	pthread_mutex_unlock(&wimaxll_fake.mutex);
+	wimaxll_fake_wake();
+	pthread_join(wimaxll_fake.thread, NULL);
+
+	while ((sock = wimaxll_fake.socks) != NULL) {
+		wimaxll_fake.socks = sock->next;
+		if (!sock->closed)
+			wimaxll_msg(NULL, "W: fake: handle still open\n");
+		close(sock->kfd);
+		free(sock);
+	}
+	close(wimaxll_fake.wake[0]);
+	close(wimaxll_fake.wake[1]);
+	free(wimaxll_fake.msg_to_user_pipe);
+	free(wimaxll_fake.msg_to_user_data);
+	free(wimaxll_fake.req_buf);
+}
+
+
+/**
+ * Send a MSG_TO_USER notification from the fake device
+ *
+ * \param pipe_name Pipe to send it on (NULL for the default one).
+ * \param data Payload
+ * \param size Size of \a data
+ * \return 0 if ok, < 0 errno code on error.
+ *
+ * Can be called from any thread.
+ */
+int wimaxll_fake_msg_to_user(const char *pipe_name,
+			     const void *data, size_t size)
+{
+	int result;
+
+	pthread_mutex_lock(&wimaxll_fake.mutex);
+	result = -ENODEV;
+	if (wimaxll_fake.running)
+		result = __wimaxll_fake_msg_to_user(pipe_name, data, size);
+	pthread_mutex_unlock(&wimaxll_fake.mutex);
+	return result;
+}
+
+
+/**
+ * Send a RE_STATE_CHANGE notification from the fake device
+ *
+ * \param old_state State to report as the old one.
+ * \param new_state State to report as the new one; it becomes the
+ *     device's state (as reported to STATE_GET).
+ * \return 0 if ok, < 0 errno code on error.
+ *
+ * Can be called from any thread.
+ */
+int wimaxll_fake_state_change(enum wimax_st old_state,
+			      enum wimax_st new_state)
+{
+	int result;
+
+	pthread_mutex_lock(&wimaxll_fake.mutex);
+	result = -ENODEV;
+	if (wimaxll_fake.running)
+		result = __wimaxll_fake_state_change(old_state, new_state);
+	pthread_mutex_unlock(&wimaxll_fake.mutex);
+	return result;
+}
+
+
+/**
+ * Return the fake kernel's counters
+ */
+void wimaxll_fake_stats_get(struct wimaxll_fake_stats *stats)
+{
+	pthread_mutex_lock(&wimaxll_fake.mutex);
+	*stats = wimaxll_fake.stats;
+	pthread_mutex_unlock(&wimaxll_fake.mutex);
+}
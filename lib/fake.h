@@ -0,0 +1,100 @@
+/*
+ * Linux WiMax
+ * In-process stand-in for the kernel's WiMAX stack
+ *
+ *
+ * Copyright (C) 2007-2009 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * Not installed; for the test and benchmark programs, which link
+ * with libwimaxll-fake.a (and libwimaxll).
+ *
+ * wimaxll_fake_start() makes the handles opened afterwards talk to a
+ * thread in the process that behaves like the kernel's WiMAX generic
+ * netlink family for one device, instead of to the kernel. It
+ * answers RFKILL, RESET and STATE_GET, ACKs MSG_FROM_USER and sends
+ * MSG_TO_USER and RE_STATE_CHANGE notifications (on request or at
+ * a given rate). The device is a network interface that exists on
+ * any box (the loopback, unless configured otherwise), so that
+ * wimaxll_open("lo") works.
+ */
+#ifndef __lib_fake_h__
+#define __lib_fake_h__
+
+#include <sys/types.h>
+#include <linux/wimax.h>
+
+/**
+ * Configuration of the fake kernel
+ *
+ * \param ifidx Index of the interface to act as the WiMAX device; 0
+ *     for the loopback.
+ * \param msg_to_user_rate MSG_TO_USER notifications to send per
+ *     second (0 for none).
+ * \param msg_to_user_size Payload size of those notifications.
+ * \param msg_to_user_pipe Pipe to send them on (NULL for the
+ *     default one).
+ * \param state_change_rate RE_STATE_CHANGE notifications to send per
+ *     second (0 for none); the device flips between
+ *     %WIMAX_ST_READY and %WIMAX_ST_SCANNING.
+ * \param echo If !0, each MSG_FROM_USER is sent back as a
+ *     MSG_TO_USER on the same pipe.
+ */
+struct wimaxll_fake_config {
+	unsigned ifidx;
+	unsigned msg_to_user_rate;
+	size_t msg_to_user_size;
+	const char *msg_to_user_pipe;
+	unsigned state_change_rate;
+	unsigned echo:1;
+};
+
+/**
+ * Counters of the fake kernel
+ *
+ * \param requests Requests received.
+ * \param acks ACKs (and errors) sent back.
+ * \param events Notifications sent (once per notification, no
+ *     matter to how many handles).
+ * \param drops Copies of notifications or ACKs that were dropped
+ *     because the receiving socket was full.
+ */
+struct wimaxll_fake_stats {
+	unsigned long requests, acks, events, drops;
+};
+
+int wimaxll_fake_start(const struct wimaxll_fake_config *);
+void wimaxll_fake_stop(void);
+int wimaxll_fake_msg_to_user(const char *pipe_name,
+			     const void *data, size_t size);
+int wimaxll_fake_state_change(enum wimax_st old_state,
+			      enum wimax_st new_state);
+void wimaxll_fake_stats_get(struct wimaxll_fake_stats *);
+
+#endif /* #ifndef __lib_fake_h__ */
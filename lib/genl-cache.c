@@ -0,0 +1,280 @@
+/*
+ * Linux WiMAX
+ * Process-wide cache of generic netlink family information
+ *
+ *
+ * Copyright (C) 2007-2009 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * Resolving the WiMAX generic netlink family (ID, version and 'msg'
+ * multicast group ID) takes a round trip to the kernel's generic
+ * netlink controller. Applications that open handles for many
+ * interfaces would do that once per handle, so we keep the result
+ * in a process-wide cache.
+ *
+ * The cache can go stale when the WiMAX modules are reloaded (and
+ * the family gets a new ID). To catch that, we subscribe a socket to
+ * the controller's "notify" multicast group, which announces the
+ * families (and multicast groups) that are registered and
+ * unregistered. Before using the cache, the pending notifications are
+ * read (without blocking); if any refers to the WiMAX family (or if
+ * we might have missed some), the cache is invalidated and the next
+ * lookup goes to the kernel.
+ *
+ * If the notification socket can't be set up, we don't cache.
+ *
+ * Handles that are already open are not updated; as before, they
+ * have to be reopened after a module reload.
+ */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <netlink/msg.h>
+#include <netlink/netlink.h>
+#include <netlink/genl/genl.h>
+#include <netlink/genl/ctrl.h>
+#include <wimaxll.h>
+#include "internal.h"
+#define D_LOCAL 0
+#include "debug.h"
+
+
+/*
+ * Process-wide generic netlink cache
+ *
+ * \param mutex Protects the whole structure.
+ * \param valid !0 if \a family_id, \a mcg_id and \a version can be
+ *     used.
+ * \param family_id WiMAX generic netlink family ID
+ * \param mcg_id ID of the WiMAX 'msg' multicast group
+ * \param version Version of the WiMAX generic netlink interface
+ * \param nlh_notify Handle subscribed to the controller's "notify"
+ *     group (NULL if not set up yet).
+ * \param notify_id ID of the controller's "notify" group, found while
+ *     setting up \a nlh_notify.
+ */
+static struct {
+	pthread_mutex_t mutex;
+	int valid;
+	int family_id, mcg_id, version;
+	struct nl_handle *nlh_notify;
+	int notify_id;
+} wimaxll_gnl_cache = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+
+static
+void wimaxll_gnl_cache_notify_group_cb(void *priv, const char *name, int id)
+{
+	if (strcmp(name, "notify") == 0)
+		wimaxll_gnl_cache.notify_id = id;
+}
+
+
+static
+void wimaxll_gnl_cache_mc_group_cb(void *priv, const char *name, int id)
+{
+	if (strcmp(name, "msg") == 0)
+		wimaxll_gnl_cache.mcg_id = id;
+}
+
+
+/*
+ * Subscribe a handle to the generic netlink controller notifications
+ *
+ * Called with the cache mutex held.
+ */
+static
+int wimaxll_gnl_cache_notify_open(void)
+{
+	int result;
+	struct nl_handle *nlh;
+
+	result = -ENOMEM;
+	nlh = nl_handle_alloc();
+	if (nlh == NULL)
+		goto error_alloc;
+	/* Only for the controller query; notifications are read in
+	 * wimaxll_gnl_cache_notify_drain() */
+	nl_socket_enable_msg_peek(nlh);
+	result = nl_connect(nlh, NETLINK_GENERIC);
+	if (result < 0)
+		goto error_connect;
+	wimaxll_gnl_cache.notify_id = -1;
+	result = genl_ctrl_get_family(nlh, "nlctrl", NULL, NULL,
+				      wimaxll_gnl_cache_notify_group_cb, NULL);
+	if (result < 0)
+		goto error_resolve;
+	result = -ENXIO;
+	if (wimaxll_gnl_cache.notify_id == -1)
+		goto error_resolve;
+	result = nl_socket_add_membership(nlh, wimaxll_gnl_cache.notify_id);
+	if (result < 0)
+		goto error_add_membership;
+	wimaxll_gnl_cache.nlh_notify = nlh;
+	return 0;
+
+error_add_membership:
+error_resolve:
+	nl_close(nlh);
+error_connect:
+	nl_handle_destroy(nlh);
+error_alloc:
+	return result;
+}
+
+
+/*
+ * Check if a controller notification is about the WiMAX family
+ */
+static
+int wimaxll_gnl_cache_notify_is_wimax(struct nlmsghdr *nl_hdr)
+{
+	struct nlattr *tb[CTRL_ATTR_MAX + 1];
+
+	if (genlmsg_parse(nl_hdr, 0, tb, CTRL_ATTR_MAX, NULL) < 0)
+		return 1;	/* can't tell, assume it is */
+	if (tb[CTRL_ATTR_FAMILY_NAME] == NULL)
+		return 1;
+	return strcmp(nla_get_string(tb[CTRL_ATTR_FAMILY_NAME]),
+		      "WiMAX") == 0;
+}
+
+
+/*
+ * Read all the pending controller notifications
+ *
+ * Called with the cache mutex held; invalidates the cache if any of
+ * them is about the WiMAX family or if some might have been lost.
+ */
+static
+void wimaxll_gnl_cache_notify_drain(void)
+{
+	ssize_t size;
+	int remaining;
+	struct nlmsghdr *nl_hdr;
+	char buf[8192];
+
+	while (1) {
+		size = recv(nl_socket_get_fd(wimaxll_gnl_cache.nlh_notify),
+			    buf, sizeof(buf), MSG_DONTWAIT | MSG_TRUNC);
+		if (size < 0 && errno == EAGAIN)
+			break;
+		if (size < 0 && errno == EINTR)
+			continue;
+		if (size < 0 || size > sizeof(buf)) {
+			/* Overrun, truncated or broken, we might have
+			 * missed something */
+			wimaxll_gnl_cache.valid = 0;
+			if (size < 0 && errno != ENOBUFS)
+				break;
+			continue;
+		}
+		remaining = size;
+		for (nl_hdr = (void *) buf; nlmsg_ok(nl_hdr, remaining);
+		     nl_hdr = nlmsg_next(nl_hdr, &remaining))
+			if (wimaxll_gnl_cache_notify_is_wimax(nl_hdr)) {
+				d_printf(1, NULL, "D: WiMAX genl family "
+					 "changed, flushing cache\n");
+				wimaxll_gnl_cache.valid = 0;
+			}
+	}
+}
+
+
+/**
+ * Resolve the WiMAX generic netlink family for a handle
+ *
+ * \internal
+ *
+ * \param wmx WiMAX device handle
+ * \return version of the WiMAX generic netlink interface if ok (with
+ *     \a wmx->gnl_family_id and \a wmx->mcg_id set), < 0 errno code
+ *     on error.
+ *
+ * Uses the process-wide cache if it is valid; otherwise, queries the
+ * generic netlink controller using \a wmx->nlh_tx (with a single
+ * GETFAMILY request) and refreshes it.
+ */
+int wimaxll_gnl_cache_lookup(struct wimaxll_handle *wmx)
+{
+	int result;
+
+	d_fnstart(5, wmx, "(wmx %p)\n", wmx);
+	pthread_mutex_lock(&wimaxll_gnl_cache.mutex);
+	if (wimaxll_gnl_cache.nlh_notify != NULL)
+		wimaxll_gnl_cache_notify_drain();
+	if (wimaxll_gnl_cache.valid)
+		goto out_hit;
+	/* Subscribe before querying, so no change can sneak in
+	 * between */
+	if (wimaxll_gnl_cache.nlh_notify == NULL) {
+		result = wimaxll_gnl_cache_notify_open();
+		if (result < 0)
+			d_printf(1, wmx, "D: can't subscribe to genl "
+				 "controller notifications, not caching: "
+				 "%d\n", result);
+	}
+	wimaxll_gnl_cache.mcg_id = -1;
+	result = genl_ctrl_get_family(wmx->nlh_tx, "WiMAX",
+				      &wimaxll_gnl_cache.family_id,
+				      &wimaxll_gnl_cache.version,
+				      wimaxll_gnl_cache_mc_group_cb, NULL);
+	if (result < 0)
+		goto error_get_family;
+	wimaxll_gnl_cache.valid = wimaxll_gnl_cache.nlh_notify != NULL
+		&& wimaxll_gnl_cache.mcg_id != -1;
+out_hit:
+	wmx->gnl_family_id = wimaxll_gnl_cache.family_id;
+	wmx->mcg_id = wimaxll_gnl_cache.mcg_id;
+	result = wimaxll_gnl_cache.version;
+error_get_family:
+	pthread_mutex_unlock(&wimaxll_gnl_cache.mutex);
+	d_fnend(5, wmx, "(wmx %p) = %d\n", wmx, result);
+	return result;
+}
+
+
+/*
+ * Release the notification handle when the library is unloaded
+ */
+static __attribute__((destructor))
+void wimaxll_gnl_cache_exit(void)
+{
+	if (wimaxll_gnl_cache.nlh_notify == NULL)
+		return;
+	nl_close(wimaxll_gnl_cache.nlh_notify);
+	nl_handle_destroy(wimaxll_gnl_cache.nlh_notify);
+	wimaxll_gnl_cache.nlh_notify = NULL;
+}
@@ -49,6 +49,8 @@
 struct handler_arg {
 	void (*cb)(void *, const char *, int);
 	void *priv;
+	int id;
+	int version;
 };
 
 
@@ -83,7 +85,11 @@ static int family_handler(struct nl_msg *msg, void *_arg)
 	nla_parse(tb, CTRL_ATTR_MAX, genlmsg_attrdata(gnlh, 0),
 		  genlmsg_attrlen(gnlh, 0), NULL);
 
-	if (!tb[CTRL_ATTR_MCAST_GROUPS])
+	if (tb[CTRL_ATTR_FAMILY_ID])
+		arg->id = nla_get_u16(tb[CTRL_ATTR_FAMILY_ID]);
+	if (tb[CTRL_ATTR_VERSION])
+		arg->version = nla_get_u32(tb[CTRL_ATTR_VERSION]);
+	if (!tb[CTRL_ATTR_MCAST_GROUPS] || arg->cb == NULL)
 		return NL_SKIP;
 
 	nla_for_each_nested(mcgrp, tb[CTRL_ATTR_MCAST_GROUPS], rem_mcgrp) {
@@ -103,29 +109,33 @@ static int family_handler(struct nl_msg *msg, void *_arg)
 }
 
 /**
- * Enumerates the list of available multicast groups for a family
+ * Queries the controller for a family's ID, version and multicast groups
  *
- * \param handle netlink handle to use for querying the list
- * \param family name of family to query for multicast groups
- * \param cbf callback function to call with each multicast group's information.
+ * \param handle netlink handle to use for querying
+ * \param family name of family to query
+ * \param id where to store the family's ID (can be NULL)
+ * \param version where to store the family's version (can be NULL)
+ * \param cbf callback function to call with each multicast group's
+ *     information (can be NULL).
  * \param priv pointer to pass to the callback function
  *
  * Returns: 0 if ok, < 0 errno code on error.
  *
- * Enumerates the multicast groups available for a generic netlink
- * family and calls the callback with the arguments of each.
+ * All the information comes in the reply to a single GETFAMILY
+ * request, so this needs only one round trip to the kernel.
  */
-int nl_get_multicast_groups(struct nl_handle *handle,
-			    const char *family,
-			    void (*cbf)(void *, const char *, int),
-			    void *priv)
+int genl_ctrl_get_family(struct nl_handle *handle, const char *family,
+			 int *id, int *version,
+			 void (*cbf)(void *, const char *, int), void *priv)
 {
 	struct nl_msg *msg;
 	struct nl_cb *cb;
-	int ret, ctrlid;
+	int ret;
 	struct handler_arg arg = {
 		.priv = priv,
-		.cb = cbf
+		.cb = cbf,
+		.id = -1,
+		.version = -1,
 	};
 
 	msg = nlmsg_alloc();
@@ -138,9 +148,8 @@ int nl_get_multicast_groups(struct nl_handle *handle,
 		goto out_fail_cb;
 	}
 
-	ctrlid = genl_ctrl_resolve(handle, "nlctrl");
-
-	genlmsg_put(msg, 0, 0, ctrlid, 0,
+	/* nlctrl always has the same ID, no need to resolve it */
+	genlmsg_put(msg, 0, 0, GENL_ID_CTRL, 0,
 		    0, CTRL_CMD_GETFAMILY, 0);
 
 	ret = -ENOBUFS;
@@ -159,6 +168,12 @@ int nl_get_multicast_groups(struct nl_handle *handle,
 
 	while (ret > 0)
 		ret = nl_recvmsgs(handle, cb);
+	if (ret == 0 && arg.id < 0)
+		ret = -ENOENT;
+	if (id)
+		*id = arg.id;
+	if (version)
+		*version = arg.version;
  nla_put_failure:
  out:
 	nl_cb_put(cb);
@@ -168,6 +183,28 @@ int nl_get_multicast_groups(struct nl_handle *handle,
 }
 
 
+/**
+ * Enumerates the list of available multicast groups for a family
+ *
+ * \param handle netlink handle to use for querying the list
+ * \param family name of family to query for multicast groups
+ * \param cbf callback function to call with each multicast group's information.
+ * \param priv pointer to pass to the callback function
+ *
+ * Returns: 0 if ok, < 0 errno code on error.
+ *
+ * Enumerates the multicast groups available for a generic netlink
+ * family and calls the callback with the arguments of each.
+ */
+int nl_get_multicast_groups(struct nl_handle *handle,
+			    const char *family,
+			    void (*cbf)(void *, const char *, int),
+			    void *priv)
+{
+	return genl_ctrl_get_family(handle, family, NULL, NULL, cbf, priv);
+}
+
+
 int genl_ctrl_get_version(struct nl_handle *nlh, const char *name)
 {
 	int result = -ENOENT;
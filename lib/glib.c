@@ -0,0 +1,207 @@
+/*
+ * Linux WiMAX
+ * GLib main loop integration
+ *
+ *
+ * Copyright (C) 2007-2009 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ *
+ * A GSource that watches a handle's receive socket
+ * (wimaxll_recv_fd()) and, while there are asynchronous operations
+ * in flight, the socket where ACKs arrive (wimaxll_tx_fd()). When
+ * they are ready, they are drained without blocking, up to a budget
+ * of datagrams per socket and main loop iteration, which runs the
+ * callbacks set on the handle.
+ *
+ * Built as a separate library (libwimaxll-glib) so libwimaxll
+ * doesn't depend on GLib:
+ *
+ * @code
+ *  wmx = wimaxll_open("wmx0");
+ *  wimaxll_set_cb_state_change(wmx, my_state_change_cb, my_ctx);
+ *  wimaxll_glib_attach(wmx, 0, NULL);
+ *  g_main_loop_run(loop);
+ * @endcode
+ *
+ * See lib/epoll.c for applications without a main loop.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <glib.h>
+#include <wimaxll.h>
+#include <wimaxll/glib.h>
+#define W_VERBOSITY W_ERROR
+#include <wimaxll/log.h>
+
+
+/*
+ * GSource for a handle
+ *
+ * @rx_pfd: receive socket
+ * @tx_pfd: socket where ACKs arrive; only polled when there are
+ *     messages in flight.
+ * @budget: datagrams to process per socket and iteration
+ */
+struct wimaxll_gsource {
+	GSource source;
+	struct wimaxll_handle *wmx;
+	GPollFD rx_pfd, tx_pfd;
+	unsigned budget;
+};
+
+
+static
+gboolean wimaxll_gsource_prepare(GSource *source, gint *timeout)
+{
+	struct wimaxll_gsource *wsrc = (struct wimaxll_gsource *) source;
+	struct wimaxll_handle *wmx = wsrc->wmx;
+
+	*timeout = -1;
+	wsrc->tx_pfd.events = wimaxll_tx_pending(wmx) > 0 ? G_IO_IN : 0;
+	/* Datagrams left by a callback returning -EBUSY won't wake
+	 * up the poll */
+	return wimaxll_recv_backlog(wmx);
+}
+
+
+static
+gboolean wimaxll_gsource_check(GSource *source)
+{
+	struct wimaxll_gsource *wsrc = (struct wimaxll_gsource *) source;
+
+	return wsrc->rx_pfd.revents != 0 || wsrc->tx_pfd.revents != 0
+		|| wimaxll_recv_backlog(wsrc->wmx);
+}
+
+
+static
+gboolean wimaxll_gsource_dispatch(GSource *source, GSourceFunc callback,
+				  gpointer user_data)
+{
+	struct wimaxll_gsource *wsrc = (struct wimaxll_gsource *) source;
+	struct wimaxll_handle *wmx = wsrc->wmx;
+
+	if ((wsrc->rx_pfd.revents | wsrc->tx_pfd.revents)
+	    & (G_IO_ERR | G_IO_HUP | G_IO_NVAL)) {
+		wimaxll_msg(wmx, "E: GLib source: socket error, removing\n");
+		return FALSE;
+	}
+	if (wsrc->tx_pfd.revents & G_IO_IN)
+		wimaxll_tx_drain(wmx, wsrc->budget);
+	if ((wsrc->rx_pfd.revents & G_IO_IN) || wimaxll_recv_backlog(wmx))
+		wimaxll_recv_drain(wmx, wsrc->budget);
+	wsrc->rx_pfd.revents = 0;
+	wsrc->tx_pfd.revents = 0;
+	if (callback != NULL)
+		return callback(user_data);
+	return TRUE;
+}
+
+
+static
+GSourceFuncs wimaxll_gsource_funcs = {
+	.prepare = wimaxll_gsource_prepare,
+	.check = wimaxll_gsource_check,
+	.dispatch = wimaxll_gsource_dispatch,
+};
+
+
+/**
+ * Create a GLib main loop source for a handle
+ *
+ * \param wmx WiMAX device handle; it has to be kept open while the
+ *     source is attached.
+ * \param budget Maximum number of datagrams to process from each
+ *     socket on each main loop iteration (0 for
+ *     %WIMAXLL_RX_BATCH_MAX), so a busy device doesn't starve the
+ *     rest of the loop.
+ * \return new source (attach it with g_source_attach()); NULL on
+ *     error, with \a errno set.
+ *
+ * Notifications and ACKs are processed by running the callbacks set
+ * on the handle (wimaxll_set_cb_state_change(),
+ * wimaxll_add_cb_msg_to_user(), completion callbacks of
+ * wimaxll_rfkill_start(), etc). A callback set with
+ * g_source_set_callback() (a GSourceFunc) is also called after each
+ * dispatch; returning FALSE removes the source.
+ *
+ * For handles opened with %WIMAXLL_OPEN_LAZY_RX, this sets up the
+ * receive side.
+ */
+GSource *wimaxll_glib_source_new(struct wimaxll_handle *wmx, unsigned budget)
+{
+	int rx_fd;
+	GSource *source;
+	struct wimaxll_gsource *wsrc;
+
+	rx_fd = wimaxll_recv_fd(wmx);
+	if (rx_fd < 0) {
+		errno = -rx_fd;
+		return NULL;
+	}
+	source = g_source_new(&wimaxll_gsource_funcs, sizeof(*wsrc));
+	wsrc = (struct wimaxll_gsource *) source;
+	wsrc->wmx = wmx;
+	wsrc->budget = budget;	/* 0 is the drain functions' default */
+	wsrc->rx_pfd.fd = rx_fd;
+	wsrc->rx_pfd.events = G_IO_IN | G_IO_ERR | G_IO_HUP;
+	g_source_add_poll(source, &wsrc->rx_pfd);
+	wsrc->tx_pfd.fd = wimaxll_tx_fd(wmx);
+	wsrc->tx_pfd.events = 0;
+	g_source_add_poll(source, &wsrc->tx_pfd);
+	return source;
+}
+
+
+/**
+ * Watch a handle from a GLib main loop
+ *
+ * \param wmx WiMAX device handle; it has to be kept open while it is
+ *     watched.
+ * \param budget Same as for wimaxll_glib_source_new().
+ * \param context Main context to attach to (NULL for the default
+ *     one).
+ * \return ID of the source (use g_source_remove() to stop watching);
+ *     0 on error, with \a errno set.
+ */
+guint wimaxll_glib_attach(struct wimaxll_handle *wmx, unsigned budget,
+			  GMainContext *context)
+{
+	guint id;
+	GSource *source;
+
+	source = wimaxll_glib_source_new(wmx, budget);
+	if (source == NULL)
+		return 0;
+	id = g_source_attach(source, context);
+	g_source_unref(source);
+	return id;
+}
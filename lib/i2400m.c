@@ -38,19 +38,38 @@
  * This set of helpers simplify the task of sending commands / waiting
  * for the acks and receiving reports/indications from the i2400m.
  *
- * It boils down to a framework to support that only one thread can
- * send a command at the same time; this is because the commands don't
- * have a cookie to identify the issuer -- so a place is needed where
- * to store the "I am waiting for a response for command X".
+ * The commands don't have a cookie to identify the issuer, only the
+ * reply's message type matches the command's; so each thread that
+ * sends a command registers in a table of pending commands "I am
+ * waiting for a response for command X". Commands of different types
+ * can be in flight at the same time (from different threads); a
+ * thread sending a command of a type that is already pending waits
+ * for the first one to complete, as their replies couldn't be told
+ * apart.
  *
  * When the callback from libwimaxll comes back with the response, if
- * it was a reply to said message, then the waiter for that is woken
- * up (using pthread mutexes and conditional variables). See \ref
- * cancellation for more information on what happens when the thread
- * is cancelled.
- *
- * When a report is received, the report callback is called; care has
- * to be taken not to deadlock. See i2400m_report_cb().
+ * it was a reply to a pending command, then a copy is handed to the
+ * waiter for that, which is woken up (using pthread mutexes and a
+ * conditional variable for each pending command) and runs the
+ * command's callback on it. See \ref cancellation for more information on
+ * what happens when the thread is cancelled.
+ *
+ * i2400m_msg_to_dev_async() sends a command without waiting; its
+ * completion callback is called when the reply arrives, when it
+ * times out (see i2400m_timeout_run()) or when it is cancelled. So a
+ * single thread running an event loop can drive the command
+ * sequences of many devices. Asynchronous commands of the same type
+ * are queued and sent one after the other.
+ *
+ * Replies only arrive if some thread reads from the handle
+ * (wimaxll_recv() or an event loop, see wimaxll_epoll_add()); for
+ * the library to do it in a thread of its own, create the handle
+ * with i2400m_create_flags() and %I2400M_RX_THREAD.
+ *
+ * When a report is received, the handler set for its type with
+ * i2400m_report_handler_set() is called, or the report callback if
+ * there is none; care has to be taken not to deadlock. See
+ * i2400m_report_cb().
  *
  * For usage, create a handle:
  *
@@ -74,8 +93,9 @@
  * }
  * @endcode
  *
- * Remember there are limited things that can be done in the callback;
- * calling i2400m_msg_to_dev() will deadlock, as well as waiting for a
+ * message_cb runs in the thread that called i2400m_msg_to_dev(), with
+ * no locks held; the report callback is more limited: calling
+ * i2400m_msg_to_dev() from it will deadlock, as well as waiting for a
  * report.
  *
  * A report callback with some TLV processing example would be:
@@ -112,38 +132,175 @@
  * work only with deferred thread cancellation models. Check POSIX for
  * more information.
  */
+#define _GNU_SOURCE
 #include <wimaxll/i2400m.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 #include <wimaxll.h>
 #include <internal.h>
 
 
+/*
+ * Number of buckets in the pending command table (power of two)
+ */
+enum {
+	I2400M_CMD_HASH_SIZE = 16,
+};
+
+
+/*
+ * Reply buffers kept for reuse, and the minimum size to allocate
+ * (most replies are a header and a few TLVs)
+ */
+enum {
+	I2400M_REPLY_POOL_MAX = 4,
+	I2400M_REPLY_SIZE_MIN = 256,
+};
+
+
+/*
+ * Report handler table: a page for each value of bits 8-14 of the
+ * message type (bit 15 is I2400M_MT_REPORT_MASK), an entry in it for
+ * each value of bits 0-7
+ */
+enum {
+	I2400M_REPORT_PAGES = 128,
+	I2400M_REPORT_PAGE_SIZE = 256,
+};
+
+
+/**
+ * Handlers for the report types in a page of the report table
+ *
+ * @internal
+ * @ingroup i2400m_group
+ */
+struct i2400m_report_page {
+	struct {
+		i2400m_report_type_cb cb;
+		void *priv;
+	} entry[I2400M_REPORT_PAGE_SIZE];
+};
+
+
+/**
+ * Copy of a reply, handed by the receive path to the thread that
+ * sent the command, which parses it
+ *
+ * @param next Next in the pool of free buffers
+ * @param alloc Size of \e data
+ * @param size Size of the reply in \e data
+ * @param data Reply (L3L4 message)
+ *
+ * @internal
+ * @ingroup i2400m_group
+ */
+struct i2400m_reply {
+	struct i2400m_reply *next;
+	size_t alloc, size;
+	unsigned char data[0];
+};
+
+
+/**
+ * A command waiting for its reply
+ *
+ * @param next Next in the \e cmd_hash bucket
+ * @param mt Message type of the command (and of its reply)
+ * @param cb Callback to execute when the reply arrives.
+ * @param cb_priv Private data to pass to the \e cb
+ * @param result 0 if the reply arrived (in \e reply); if cancelled,
+ *     it will be -%EINTR.
+ * @param reply Copy of the reply, for the owner to run \e cb on.
+ * @param done Set when \e result is valid (and the entry is off the
+ *     table).
+ * @param cond Signalled when \e done is set.
+ *
+ * @param i2400m Handle the command was sent on
+ * @param id Identifier returned by i2400m_msg_to_dev_async(); 0 for
+ *     synchronous commands.
+ * @param refs Reference count (the table holds one until the
+ *     command is completed, the ACK callback one while the message
+ *     is in flight); changed atomically.
+ * @param sent Set when the message is handed to the kernel.
+ * @param has_deadline If \e deadline is valid.
+ * @param deadline When to complete the command with -%ETIMEDOUT.
+ * @param done_cb Completion callback
+ * @param msg_size Size of \e msg
+ * @param msg Copy of the message to send
+ *
+ * Synchronous commands live in the stack of the thread that sent
+ * them (i2400m_msg_to_dev_deadline()) and use up to \e cond;
+ * asynchronous ones (i2400m_msg_to_dev_async()) are allocated and
+ * use the rest. All fields but \e refs are protected by the
+ * i2400m's mutex.
+ *
+ * @internal
+ * @ingroup i2400m_group
+ */
+struct i2400m_cmd {
+	struct i2400m_cmd *next;
+	enum i2400m_mt mt;
+	i2400m_reply_cb cb;
+	void *cb_priv;
+	int result;
+	struct i2400m_reply *reply;
+	int done;
+	pthread_cond_t cond;
+
+	struct i2400m *i2400m;
+	int id;
+	int refs;
+	unsigned sent:1, has_deadline:1;
+	struct timespec deadline;
+	i2400m_done_cb done_cb;
+	size_t msg_size;
+	unsigned char msg[0];
+};
+
+
 /**
  * Descriptor for a Intel 2400m
  *
  * @param wmx libwimaxll handle
  * @param priv Private storage as set by the owner
  *
- * @param mutex Mutex for command execution (protects mt_*)
- * @param cond Conditional variable for command execution (protected
- *     by \e mutex). Threads wait on this conditional variable waiting
- *     for commands to finish executing (at which point the mt_cb is
- *     called back).
- *
- * @param mt_pending Message type of the reply that a thread is
- *     waiting for.
- * @param mt_cb Callback to execute when the \e mt_pending reply
- *     arrives.
- * @param mt_cb_priv Private data to pass to the \e mt_cb
- * @param mt_result Updated with the result of executing the \e mt_cb
- *     callback. If cancelled, it will be -%EINTR.
+ * @param mutex Mutex for command execution (protects \e cmd_hash
+ *     and the pending commands in it)
+ * @param cond_attr Attributes for the conditional variables of the
+ *     pending commands (they use the monotonic clock).
+ * @param cmd_free Conditional variable (protected by \e mutex)
+ *     signalled when a command completes, for threads waiting to
+ *     send one of the same type.
+ * @param cmd_hash Pending commands, hashed by message type (see
+ *     i2400m_cmd_hash()); commands of the same type are kept in
+ *     the order they were submitted.
+ * @param cmd_id Last identifier given to an asynchronous command
  *
  * @param report_cb Callback to execute when a report/indication is
  *     received.
  * @param report_cb_priv Private data passed to the report callback.
  *
+ * @param reply_mutex Protects \e reply_pool and \e reply_pool_count
+ * @param reply_pool Free reply buffers (see i2400m_reply_get())
+ * @param reply_pool_count Number of buffers in \e reply_pool
+ *
+ * @param report_mutex Protects \e report_page
+ * @param report_page Handlers set with i2400m_report_handler_set(),
+ *     indexed by message type (see i2400m_report_dispatch()); pages
+ *     are allocated when a handler is first set in them.
+ *
+ * @param rx_efd eventfd to tell \e rx_thread to exit; -1 if there is
+ *     no receive thread (see %I2400M_RX_THREAD).
+ * @param rx_thread Receive thread (see i2400m_rx_thread()).
+ *
  * @internal
  * @ingroup i2400m_group
  */
@@ -152,30 +309,367 @@ struct i2400m {
 	void *priv;
 
 	pthread_mutex_t mutex;
-	pthread_cond_t cond;
-
-	enum i2400m_mt mt_pending;
-	i2400m_reply_cb mt_cb;
-	void *mt_cb_priv;
-	int mt_result;
+	pthread_condattr_t cond_attr;
+	pthread_cond_t cmd_free;
+	struct i2400m_cmd *cmd_hash[I2400M_CMD_HASH_SIZE];
+	int cmd_id;
 
 	i2400m_report_cb report_cb;
 	void *report_cb_priv;
+
+	pthread_mutex_t reply_mutex;
+	struct i2400m_reply *reply_pool;
+	unsigned reply_pool_count;
+
+	pthread_mutex_t report_mutex;
+	struct i2400m_report_page *report_page[I2400M_REPORT_PAGES];
+
+	int rx_efd;
+	pthread_t rx_thread;
 };
 
 
+/*
+ * Copy a reply into a buffer from the pool (or a new one)
+ *
+ * Returns NULL if out of memory.
+ */
+static
+struct i2400m_reply *i2400m_reply_get(struct i2400m *i2400m,
+				      const void *data, size_t size)
+{
+	struct i2400m_reply *reply;
+	size_t alloc;
+
+	pthread_mutex_lock(&i2400m->reply_mutex);
+	reply = i2400m->reply_pool;
+	if (reply != NULL) {
+		i2400m->reply_pool = reply->next;
+		i2400m->reply_pool_count--;
+	}
+	pthread_mutex_unlock(&i2400m->reply_mutex);
+	if (reply != NULL && reply->alloc < size) {
+		free(reply);
+		reply = NULL;
+	}
+	if (reply == NULL) {
+		alloc = size > I2400M_REPLY_SIZE_MIN ?
+			size : I2400M_REPLY_SIZE_MIN;
+		reply = malloc(sizeof(*reply) + alloc);
+		if (reply == NULL)
+			return NULL;
+		reply->alloc = alloc;
+	}
+	memcpy(reply->data, data, size);
+	reply->size = size;
+	return reply;
+}
+
+
+/*
+ * Return a reply buffer to the pool (or free it if the pool is full)
+ */
+static
+void i2400m_reply_put(struct i2400m *i2400m, struct i2400m_reply *reply)
+{
+	if (reply == NULL)
+		return;
+	pthread_mutex_lock(&i2400m->reply_mutex);
+	if (i2400m->reply_pool_count < I2400M_REPLY_POOL_MAX) {
+		reply->next = i2400m->reply_pool;
+		i2400m->reply_pool = reply;
+		i2400m->reply_pool_count++;
+		reply = NULL;
+	}
+	pthread_mutex_unlock(&i2400m->reply_mutex);
+	free(reply);
+}
+
+
+static
+struct i2400m_cmd **i2400m_cmd_hash(struct i2400m *i2400m, enum i2400m_mt mt)
+{
+	return &i2400m->cmd_hash[(mt ^ (mt >> 8)) & (I2400M_CMD_HASH_SIZE - 1)];
+}
+
+
+/*
+ * Find the oldest pending command for message type @mt; call with
+ * the mutex held
+ */
+static
+struct i2400m_cmd *__i2400m_cmd_find(struct i2400m *i2400m, enum i2400m_mt mt)
+{
+	struct i2400m_cmd *cmd;
+
+	for (cmd = *i2400m_cmd_hash(i2400m, mt); cmd != NULL; cmd = cmd->next)
+		if (cmd->mt == mt)
+			return cmd;
+	return NULL;
+}
+
+
+/*
+ * Add a command at the end of its bucket; call with the mutex held
+ */
+static
+void __i2400m_cmd_add(struct i2400m *i2400m, struct i2400m_cmd *cmd)
+{
+	struct i2400m_cmd **itr;
+
+	for (itr = i2400m_cmd_hash(i2400m, cmd->mt); *itr != NULL;
+	     itr = &(*itr)->next)
+		;
+	cmd->next = NULL;
+	*itr = cmd;
+}
+
+
+/*
+ * Take a pending command off the table and wake up its owner (and
+ * whoever waits to send another of the same type); call with the
+ * mutex held
+ *
+ * Asynchronous commands are added to *@done, if given, for
+ * i2400m_cmd_done() to run their callback once the mutex is
+ * released.
+ */
+static
+void __i2400m_cmd_complete(struct i2400m *i2400m, struct i2400m_cmd *cmd,
+			   int result, struct i2400m_cmd **done)
+{
+	struct i2400m_cmd **itr;
+
+	for (itr = i2400m_cmd_hash(i2400m, cmd->mt); *itr != NULL;
+	     itr = &(*itr)->next)
+		if (*itr == cmd) {
+			*itr = cmd->next;
+			break;
+		}
+	cmd->result = result;
+	cmd->done = 1;
+	if (cmd->id == 0)
+		pthread_cond_signal(&cmd->cond);
+	else if (done != NULL) {
+		cmd->next = *done;
+		*done = cmd;
+	}
+	pthread_cond_broadcast(&i2400m->cmd_free);
+}
+
+
+static
+void i2400m_cmd_put(struct i2400m_cmd *cmd)
+{
+	if (__sync_sub_and_fetch(&cmd->refs, 1) == 0)
+		free(cmd);
+}
+
+
+/*
+ * Run the callbacks of the asynchronous commands completed by
+ * __i2400m_cmd_complete(); call without the mutex held
+ */
+static
+void i2400m_cmd_callbacks(struct i2400m *i2400m, struct i2400m_cmd *done)
+{
+	struct i2400m_cmd *cmd;
+
+	while (done != NULL) {
+		cmd = done;
+		done = cmd->next;
+		if (cmd->done_cb)
+			cmd->done_cb(i2400m, cmd->cb_priv, cmd->result,
+				     NULL, 0);
+		i2400m_cmd_put(cmd);
+	}
+}
+
+
+/*
+ * ACK callback for the messages of asynchronous commands
+ *
+ * If the kernel refused the message, no reply will come, so complete
+ * the command with the error.
+ */
+static
+int i2400m_cmd_ack_cb(struct wimaxll_handle *wmx, struct wimaxll_op *op,
+		      void *_cmd, ssize_t result);
+
+
+/*
+ * Send the next asynchronous command queued for message type @mt, if
+ * the one in front hasn't been sent yet; call without the mutex held
+ *
+ * If sending fails, the command is completed with the error and we
+ * try with the next one.
+ */
+static
+void i2400m_cmd_kick(struct i2400m *i2400m, enum i2400m_mt mt)
+{
+	int result;
+	struct i2400m_cmd *cmd, *done;
+	struct wimaxll_op *op;
+
+	while (1) {
+		pthread_mutex_lock(&i2400m->mutex);
+		cmd = __i2400m_cmd_find(i2400m, mt);
+		if (cmd == NULL || cmd->id == 0 || cmd->sent) {
+			pthread_mutex_unlock(&i2400m->mutex);
+			break;
+		}
+		/* Mark it before sending, as the reply might come
+		 * before wimaxll_msg_write_start() returns */
+		cmd->sent = 1;
+		__sync_add_and_fetch(&cmd->refs, 1);
+		pthread_mutex_unlock(&i2400m->mutex);
+
+		op = wimaxll_msg_write_start(i2400m->wmx, NULL,
+					     cmd->msg, cmd->msg_size,
+					     i2400m_cmd_ack_cb, cmd);
+		if (op != NULL)
+			break;
+		result = -errno;
+		done = NULL;
+		pthread_mutex_lock(&i2400m->mutex);
+		if (!cmd->done)
+			__i2400m_cmd_complete(i2400m, cmd, result, &done);
+		pthread_mutex_unlock(&i2400m->mutex);
+		i2400m_cmd_put(cmd);	/* no ACK callback coming */
+		i2400m_cmd_callbacks(i2400m, done);
+	}
+}
+
+
+/*
+ * Run the callbacks of the completed asynchronous commands in @done
+ * and send the commands that were queued behind them; call without
+ * the mutex held
+ */
+static
+void i2400m_cmd_done(struct i2400m *i2400m, struct i2400m_cmd *done)
+{
+	struct i2400m_cmd *cmd;
+	enum i2400m_mt mt;
+
+	while (done != NULL) {
+		cmd = done;
+		done = cmd->next;
+		cmd->next = NULL;
+		mt = cmd->mt;
+		i2400m_cmd_callbacks(i2400m, cmd);
+		i2400m_cmd_kick(i2400m, mt);
+	}
+}
+
+
+static
+int i2400m_cmd_ack_cb(struct wimaxll_handle *wmx, struct wimaxll_op *op,
+		      void *_cmd, ssize_t result)
+{
+	struct i2400m_cmd *cmd = _cmd;
+	struct i2400m *i2400m = cmd->i2400m;
+	struct i2400m_cmd *done = NULL;
+
+	wimaxll_op_free(op);
+	if (result < 0) {
+		pthread_mutex_lock(&i2400m->mutex);
+		if (!cmd->done)
+			__i2400m_cmd_complete(i2400m, cmd, result, &done);
+		pthread_mutex_unlock(&i2400m->mutex);
+	}
+	i2400m_cmd_put(cmd);
+	i2400m_cmd_done(i2400m, done);
+	return 0;
+}
+
+
+/*
+ * Cancellation cleanup for i2400m_msg_to_dev_deadline()
+ *
+ * Drop the command from the table if still there, as it lives in the
+ * stack that is going away. If cancelled while waiting, the mutex is
+ * held (pthread_cond_wait() takes it back before running the cleanup
+ * handlers); if while sending, it isn't (@locked). A reply that was
+ * handed over but not parsed is released.
+ */
+struct i2400m_cmd_cleanup {
+	struct i2400m *i2400m;
+	struct i2400m_cmd *cmd;
+	int locked;
+};
+
+static
+void i2400m_cmd_cleanup(void *_cleanup)
+{
+	struct i2400m_cmd_cleanup *cleanup = _cleanup;
+	int was_pending = 0;
+
+	if (!cleanup->locked)
+		pthread_mutex_lock(&cleanup->i2400m->mutex);
+	if (!cleanup->cmd->done) {
+		__i2400m_cmd_complete(cleanup->i2400m, cleanup->cmd, -EINTR,
+				      NULL);
+		was_pending = 1;
+	}
+	pthread_mutex_unlock(&cleanup->i2400m->mutex);
+	pthread_cond_destroy(&cleanup->cmd->cond);
+	i2400m_reply_put(cleanup->i2400m, cleanup->cmd->reply);
+	if (was_pending)
+		i2400m_cmd_kick(cleanup->i2400m, cleanup->cmd->mt);
+}
+
+
+/*
+ * Run the handler for a report
+ *
+ * A report type with no handler set goes to the report callback given
+ * at creation time; if there is none, it is dropped.
+ */
+static
+void i2400m_report_dispatch(struct i2400m *i2400m, enum i2400m_mt mt,
+			    const struct i2400m_l3l4_hdr *l3l4,
+			    size_t l3l4_size)
+{
+	struct i2400m_report_page *page;
+	i2400m_report_type_cb cb = NULL;
+	void *priv = NULL;
+
+	pthread_mutex_lock(&i2400m->report_mutex);
+	page = i2400m->report_page[(mt >> 8) & (I2400M_REPORT_PAGES - 1)];
+	if (page != NULL) {
+		cb = page->entry[mt & (I2400M_REPORT_PAGE_SIZE - 1)].cb;
+		priv = page->entry[mt & (I2400M_REPORT_PAGE_SIZE - 1)].priv;
+	}
+	pthread_mutex_unlock(&i2400m->report_mutex);
+	if (cb != NULL)
+		cb(i2400m, priv, l3l4, l3l4_size);
+	else if (i2400m->report_cb)
+		i2400m->report_cb(i2400m, l3l4, l3l4_size);
+}
+
+
 /*
  * When a message comes with an ack or report, chew it
  *
  * Only takes messages on the default pipe, as that's where the device
- * passes them. Executes the callback for a command ack if it's
- * message type is the one that was waited for, otherwise they are
- * ignored.
+ * passes them. If it's message type is the one of a pending command,
+ * a copy is handed to the thread waiting for it, which runs the
+ * command's callback (so a slow reply parser holds neither the mutex
+ * nor the receive path); otherwise they are ignored. The command is
+ * looked up first, so only replies a synchronous command is going to
+ * parse are copied; the copy is done with the mutex released, so
+ * all that is done under it is handing over the pointer.
  *
  * The driver takes care of coordinating so that only one command is
- * executed at the same time.
+ * executed by the device at the same time; many can be waiting for
+ * it.
  *
- * If it is a report, just run the callback.
+ * The callback of an asynchronous command is run once the mutex is
+ * released, and then the next command of that type is sent.
+ *
+ * If it is a report, just run its handler (it can't be the reply to
+ * a command, so the command table isn't looked at).
  */
 static
 int i2400m_msg_to_user_cb(struct wimaxll_handle *wmx, void *_i2400m,
@@ -185,29 +679,55 @@ int i2400m_msg_to_user_cb(struct wimaxll_handle *wmx, void *_i2400m,
 	struct i2400m *i2400m = _i2400m;
 	const struct i2400m_l3l4_hdr *hdr = data;
 	enum i2400m_mt mt;
+	struct i2400m_cmd *cmd, *async = NULL;
+	struct i2400m_reply *reply = NULL;
 
 	if (pipe_name != NULL)
 		goto out;
 
 	mt = wimaxll_le16_to_cpu(hdr->type);
+	if (mt & I2400M_MT_REPORT_MASK) {
+		i2400m_report_dispatch(i2400m, mt, data, size);
+		goto out;
+	}
 	pthread_cleanup_push((void (*)(void *))pthread_mutex_unlock,
 			     &i2400m->mutex);
 	pthread_mutex_lock(&i2400m->mutex);
-	if (mt == i2400m->mt_pending) {
-		i2400m->mt_pending = I2400M_MT_INVALID;
-		if (i2400m->mt_cb != NULL)
-			i2400m->mt_result = i2400m->mt_cb(
-				i2400m, i2400m->mt_cb_priv, data, size);
-		else
-			i2400m->mt_result = 0;
-		pthread_cond_signal(&i2400m->cond);
+	cmd = __i2400m_cmd_find(i2400m, mt);
+	if (cmd != NULL && cmd->id == 0 && cmd->cb != NULL) {
+		/* Only copy it if somebody is going to parse it, and
+		 * not under the mutex; the command might be gone
+		 * when we take it back, so look it up again */
+		pthread_mutex_unlock(&i2400m->mutex);
+		reply = i2400m_reply_get(i2400m, data, size);
+		pthread_mutex_lock(&i2400m->mutex);
+		cmd = __i2400m_cmd_find(i2400m, mt);
+	}
+	if (cmd == NULL)
+		;
+	else if (cmd->id == 0) {
+		if (cmd->cb != NULL) {
+			cmd->reply = reply;
+			reply = NULL;
+		}
+		__i2400m_cmd_complete(i2400m, cmd,
+				      cmd->cb != NULL && cmd->reply == NULL ?
+				      -ENOMEM : 0, NULL);
+	} else if (cmd->sent) {
+		__i2400m_cmd_complete(i2400m, cmd, 0, NULL);
+		async = cmd;
 	}
 	pthread_mutex_unlock(&i2400m->mutex);
 	pthread_cleanup_pop(0);
-	/* this is ran outside of the lock because it doesn't need
-	 * much tracking info. */
-	if (mt & I2400M_MT_REPORT_MASK && i2400m->report_cb)
-		i2400m->report_cb(i2400m, data, size);
+	/* Copied for a command that went away (or didn't need it) */
+	i2400m_reply_put(i2400m, reply);
+	if (async != NULL) {
+		if (async->done_cb)
+			async->done_cb(i2400m, async->cb_priv, 0, data, size);
+		i2400m_cmd_put(async);
+	}
+	if (cmd != NULL)
+		i2400m_cmd_kick(i2400m, mt);
 out:
 	return 0;
 }
@@ -218,10 +738,16 @@ void __i2400m_create(struct i2400m *i2400m,
 		    void *priv, i2400m_report_cb report_cb)
 {
 	pthread_mutex_init(&i2400m->mutex, NULL);
-	pthread_cond_init(&i2400m->cond, NULL);
+	pthread_mutex_init(&i2400m->reply_mutex, NULL);
+	pthread_mutex_init(&i2400m->report_mutex, NULL);
+	/* Deadlines are on the monotonic clock (see
+	 * i2400m_msg_to_dev_deadline()) */
+	pthread_condattr_init(&i2400m->cond_attr);
+	pthread_condattr_setclock(&i2400m->cond_attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&i2400m->cmd_free, &i2400m->cond_attr);
 	i2400m->priv = priv;
 	i2400m->report_cb = report_cb;
-	i2400m->mt_pending = I2400M_MT_INVALID;
+	i2400m->rx_efd = -1;
 
 	wimaxll_set_cb_msg_to_user(
 		i2400m->wmx, i2400m_msg_to_user_cb, i2400m);
@@ -248,6 +774,136 @@ void __i2400m_create(struct i2400m *i2400m,
  */
 int i2400m_create(struct i2400m **_i2400m, const char *ifname,
 		  void *priv, i2400m_report_cb report_cb)
+{
+	return i2400m_create_flags(_i2400m, ifname, priv, report_cb, 0);
+}
+
+
+/*
+ * Receive thread
+ *
+ * Processes the replies and reports (and the ACKs of the messages
+ * sent by asynchronous commands) as they come and times out
+ * asynchronous commands, until told to exit through the eventfd.
+ */
+static
+void *i2400m_rx_thread(void *_i2400m)
+{
+	int result, timeout;
+	struct i2400m *i2400m = _i2400m;
+	struct wimaxll_handle *wmx = i2400m->wmx;
+	struct pollfd pfd[3];
+
+	pfd[0].fd = i2400m->rx_efd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = wimaxll_recv_fd(wmx);
+	pfd[1].events = POLLIN;
+	pfd[2].fd = wimaxll_tx_fd(wmx);
+	pfd[2].events = POLLIN;
+	while (1) {
+		/* A callback might have stopped processing with
+		 * -EBUSY and left datagrams poll() won't tell about */
+		if (wimaxll_rx_backlog(wmx))
+			timeout = 0;
+		else
+			timeout = i2400m_timeout_ms(i2400m);
+		result = poll(pfd, 3, timeout);
+		if (result < 0) {
+			if (errno == EINTR)
+				continue;
+			wimaxll_msg(wmx, "E: i2400m: RX thread: "
+				    "poll failed: %m\n");
+			break;
+		}
+		if (pfd[0].revents)
+			break;
+		if (pfd[1].revents || wimaxll_rx_backlog(wmx))
+			wimaxll_recv_drain(wmx, WIMAXLL_RX_BATCH_MAX);
+		if (pfd[2].revents)
+			wimaxll_tx_drain(wmx, WIMAXLL_RX_BATCH_MAX);
+		i2400m_timeout_run(i2400m);
+	}
+	return NULL;
+}
+
+
+static
+int i2400m_rx_thread_start(struct i2400m *i2400m)
+{
+	int result;
+	sigset_t sigset, old_sigset;
+
+	result = wimaxll_recv_fd(i2400m->wmx);
+	if (result < 0)
+		goto error_recv_fd;
+	i2400m->rx_efd = eventfd(0, EFD_CLOEXEC);
+	if (i2400m->rx_efd < 0) {
+		result = -errno;
+		goto error_eventfd;
+	}
+	/* Signals are for the application's threads */
+	sigfillset(&sigset);
+	pthread_sigmask(SIG_SETMASK, &sigset, &old_sigset);
+	result = -pthread_create(&i2400m->rx_thread, NULL,
+				 i2400m_rx_thread, i2400m);
+	pthread_sigmask(SIG_SETMASK, &old_sigset, NULL);
+	if (result < 0)
+		goto error_pthread_create;
+	return 0;
+
+error_pthread_create:
+	close(i2400m->rx_efd);
+	i2400m->rx_efd = -1;
+error_eventfd:
+error_recv_fd:
+	wimaxll_msg(i2400m->wmx, "E: i2400m: cannot start RX thread: %d\n",
+		    result);
+	return result;
+}
+
+
+static
+void i2400m_rx_thread_stop(struct i2400m *i2400m)
+{
+	uint64_t one = 1;
+
+	if (i2400m->rx_efd < 0)
+		return;
+	while (write(i2400m->rx_efd, &one, sizeof(one)) < 0
+	       && errno == EINTR)
+		;
+	pthread_join(i2400m->rx_thread, NULL);
+	close(i2400m->rx_efd);
+	i2400m->rx_efd = -1;
+}
+
+
+/**
+ * Create a i2400m handle, with options
+ *
+ * @param _i2400m Same as for i2400m_create().
+ * @param ifname Same as for i2400m_create().
+ * @param priv Same as for i2400m_create().
+ * @param report_cb Same as for i2400m_create().
+ * @param flags Bitmap of values from \e i2400m_create_flags_e:
+ *
+ *     - %I2400M_RX_THREAD: start a thread, owned by the handle, that
+ *       waits for and processes the messages from the device (and
+ *       the kernel's ACKs to asynchronous commands) and times out
+ *       asynchronous commands (i2400m_timeout_run()). Otherwise
+ *       i2400m_msg_to_dev() only completes if some thread is calling
+ *       wimaxll_recv() on the handle. The callbacks are then run
+ *       from that thread; i2400m_destroy() can't be called from
+ *       them. See i2400m_rx_thread_set_cpu() and
+ *       i2400m_rx_thread_set_sched() to keep its latency low.
+ *
+ * @returns 0 if ok, < 0 errno code on error.
+ *
+ * @ingroup i2400m_group
+ */
+int i2400m_create_flags(struct i2400m **_i2400m, const char *ifname,
+			void *priv, i2400m_report_cb report_cb,
+			unsigned flags)
 {
 	int result;
 	struct i2400m *i2400m;
@@ -262,9 +918,17 @@ int i2400m_create(struct i2400m **_i2400m, const char *ifname,
 		goto error_open;
 	}
 	__i2400m_create(i2400m, priv, report_cb);
+	if (flags & I2400M_RX_THREAD) {
+		result = i2400m_rx_thread_start(i2400m);
+		if (result < 0)
+			goto error_rx_thread_start;
+	}
 	*_i2400m = i2400m;
 	return 0;
 
+error_rx_thread_start:
+	wimaxll_close(i2400m->wmx);
+	pthread_condattr_destroy(&i2400m->cond_attr);
 error_open:
 	free(i2400m);
 error_calloc:
@@ -309,24 +973,109 @@ error_calloc:
 }
 
 
+/**
+ * Pin the receive thread of a handle to a CPU
+ *
+ * @param i2400m i2400m handle created with %I2400M_RX_THREAD
+ * @param cpu Number of the CPU to run the thread on; -1 to let it run
+ *     on any.
+ *
+ * @returns 0 if ok, -%ESRCH if the handle has no receive thread,
+ *     other < 0 errno code on error (eg: -%EINVAL if the CPU doesn't
+ *     exist).
+ *
+ * @ingroup i2400m_group
+ */
+int i2400m_rx_thread_set_cpu(struct i2400m *i2400m, int cpu)
+{
+	int itr;
+	cpu_set_t cpu_set;
+
+	if (i2400m->rx_efd < 0)
+		return -ESRCH;
+	if (cpu >= CPU_SETSIZE)
+		return -EINVAL;
+	CPU_ZERO(&cpu_set);
+	if (cpu >= 0)
+		CPU_SET(cpu, &cpu_set);
+	else
+		for (itr = 0; itr < CPU_SETSIZE; itr++)
+			CPU_SET(itr, &cpu_set);
+	return -pthread_setaffinity_np(i2400m->rx_thread,
+				       sizeof(cpu_set), &cpu_set);
+}
+
+
+/**
+ * Set the scheduling policy and priority of the receive thread
+ *
+ * @param i2400m i2400m handle created with %I2400M_RX_THREAD
+ * @param policy Scheduling policy (%SCHED_OTHER, %SCHED_FIFO,
+ *     %SCHED_RR...; see sched_setscheduler(2)).
+ * @param priority Static priority for \e policy (0 for
+ *     %SCHED_OTHER, 1 to 99 for the real time ones).
+ *
+ * @returns 0 if ok, -%ESRCH if the handle has no receive thread,
+ *     other < 0 errno code on error (eg: -%EPERM if the process is
+ *     not allowed to use real time policies).
+ *
+ * A real time policy makes replies and reports be processed as soon
+ * as they arrive, even with the CPUs busy; keep the callbacks short
+ * then.
+ *
+ * @ingroup i2400m_group
+ */
+int i2400m_rx_thread_set_sched(struct i2400m *i2400m, int policy,
+			       int priority)
+{
+	struct sched_param param = {
+		.sched_priority = priority,
+	};
+
+	if (i2400m->rx_efd < 0)
+		return -ESRCH;
+	return -pthread_setschedparam(i2400m->rx_thread, policy, &param);
+}
+
+
 /**
  * Destroy a descriptor created with i2400m_create()
  *
  * @param i2400m Handle for an i2400m as returned by
  *     i2400m_create().
  *
+ * If the handle has a receive thread, it is stopped first; so this
+ * can't be called from the callbacks then.
+ *
  * @ingroup i2400m_group
  */
 void i2400m_destroy(struct i2400m *i2400m)
 {
+	unsigned itr;
+	struct i2400m_cmd *done = NULL;
+	struct i2400m_reply *reply;
+
+	i2400m_rx_thread_stop(i2400m);
 	pthread_cleanup_push((void (*)(void *))pthread_mutex_unlock,
 			     &i2400m->mutex);
 	pthread_mutex_lock(&i2400m->mutex);
-	i2400m->mt_result = -EINTR;
-	pthread_cond_broadcast(&i2400m->cond);
+	for (itr = 0; itr < I2400M_CMD_HASH_SIZE; itr++)
+		while (i2400m->cmd_hash[itr] != NULL)
+			__i2400m_cmd_complete(i2400m, i2400m->cmd_hash[itr],
+					      -EINTR, &done);
 	pthread_mutex_unlock(&i2400m->mutex);
 	pthread_cleanup_pop(0);
+	i2400m_cmd_callbacks(i2400m, done);
+	/* Closing runs the ACK callbacks of the messages still in
+	 * flight, which drop their references to the commands */
 	wimaxll_close(i2400m->wmx);
+	while ((reply = i2400m->reply_pool) != NULL) {
+		i2400m->reply_pool = reply->next;
+		free(reply);
+	}
+	for (itr = 0; itr < I2400M_REPORT_PAGES; itr++)
+		free(i2400m->report_page[itr]);
+	pthread_condattr_destroy(&i2400m->cond_attr);
 	free(i2400m);
 }
 
@@ -359,6 +1108,61 @@ struct wimaxll_handle * i2400m_wmx(struct i2400m *i2400m)
 }
 
 
+/**
+ * Set the handler for a report type
+ *
+ * @param i2400m i2400m handle
+ * @param mt Report type (eg: %I2400M_MT_REPORT_STATE)
+ * @param cb Callback to run when a report of type \e mt arrives;
+ *     NULL to remove the current one.
+ * @param priv Private pointer to pass to \e cb
+ *
+ * @returns 0 if ok, -%EINVAL if \e mt is not a report type, -%ENOMEM
+ *     if out of memory.
+ *
+ * Reports of a type with a handler go to it instead of to the report
+ * callback passed to i2400m_create(); the rest still go there (and
+ * are dropped if there is none). So different parts of a program can
+ * take care of different reports.
+ *
+ * Handlers are run from the same context as the report callback, with
+ * the same limitations (see \e i2400m_report_cb). They can be set
+ * and removed at any time, from any thread (including from a
+ * handler); a report being dispatched when its handler is removed
+ * might still be delivered to it.
+ *
+ * @ingroup i2400m_group
+ */
+int i2400m_report_handler_set(struct i2400m *i2400m, enum i2400m_mt mt,
+			      i2400m_report_type_cb cb, void *priv)
+{
+	int result = 0;
+	struct i2400m_report_page **page;
+
+	if (!(mt & I2400M_MT_REPORT_MASK) || mt > 0xffff)
+		return -EINVAL;
+	pthread_cleanup_push((void (*)(void *))pthread_mutex_unlock,
+			     &i2400m->report_mutex);
+	pthread_mutex_lock(&i2400m->report_mutex);
+	page = &i2400m->report_page[(mt >> 8) & (I2400M_REPORT_PAGES - 1)];
+	if (*page == NULL) {
+		if (cb == NULL)
+			goto out;	/* nothing to remove */
+		*page = calloc(1, sizeof(**page));
+		if (*page == NULL) {
+			result = -ENOMEM;
+			goto out;
+		}
+	}
+	(*page)->entry[mt & (I2400M_REPORT_PAGE_SIZE - 1)].cb = cb;
+	(*page)->entry[mt & (I2400M_REPORT_PAGE_SIZE - 1)].priv = priv;
+out:
+	pthread_mutex_unlock(&i2400m->report_mutex);
+	pthread_cleanup_pop(0);
+	return result;
+}
+
+
 /**
  * Execute an i2400m command and wait for a response
  *
@@ -379,17 +1183,18 @@ struct wimaxll_handle * i2400m_wmx(struct i2400m *i2400m)
  * detail) by setting a callback function and parsing the reply.
  *
  * This call can be executed from multiple threads on the same \e
- * i2400m handle at the same time, as it will be mutexed properly and
- * only one will execute at the same time (likewise, the driver will
- * make sure only one command from different threads is ran at the
- * same time).
+ * i2400m handle at the same time. Commands of different message
+ * types are in flight at the same time, each thread waiting for its
+ * own reply; a command of a type that is already pending waits for
+ * the first to complete (the driver will make sure the device
+ * executes only one command at a time).
  *
  * @note
  *
- * This call blocks waiting for the reply to the message; from the
- * callback context no calls to i2400m_msg_dev() or waits for reports
- * on the same handle as the callback can be done, as it would
- * deadlock.
+ * This call blocks waiting for the reply to the message. The
+ * callback is run from this same thread once the reply has been
+ * received, with no locks held, so it can take its time parsing it
+ * or even execute other commands.
  *
  * @ingroup i2400m_group
  */
@@ -397,32 +1202,309 @@ int i2400m_msg_to_dev(struct i2400m *i2400m,
 		      const struct i2400m_l3l4_hdr *l3l4, size_t l3l4_size,
 		      i2400m_reply_cb cb, void *cb_priv)
 {
-	int result;
-	enum i2400m_mt msg_type;
+	return i2400m_msg_to_dev_deadline(i2400m, l3l4, l3l4_size,
+					  cb, cb_priv, NULL);
+}
+
+
+/**
+ * Execute an i2400m command and wait for a response, up to a deadline
+ *
+ * @param i2400m i2400m handle
+ * @param l3l4 Same as for i2400m_msg_to_dev().
+ * @param l3l4_size Same as for i2400m_msg_to_dev().
+ * @param cb Same as for i2400m_msg_to_dev().
+ * @param cb_priv Same as for i2400m_msg_to_dev().
+ * @param deadline Absolute time (%CLOCK_MONOTONIC, see
+ *     wimaxll_deadline_set()) when to give up; NULL to wait for as
+ *     long as it takes.
+ *
+ * @returns Same as i2400m_msg_to_dev(); -%ETIMEDOUT if the kernel
+ *     didn't acknowledge the message or the device didn't reply
+ *     before the deadline. A reply arriving after that is ignored
+ *     (and \e cb is not called).
+ *
+ * @ingroup i2400m_group
+ */
+int i2400m_msg_to_dev_deadline(struct i2400m *i2400m,
+			       const struct i2400m_l3l4_hdr *l3l4,
+			       size_t l3l4_size,
+			       i2400m_reply_cb cb, void *cb_priv,
+			       const struct timespec *deadline)
+{
+	int result, cb_result;
+	struct i2400m_cmd cmd = {
+		.cb = cb,
+		.cb_priv = cb_priv,
+	};
+	struct i2400m_reply *reply;
+	struct i2400m_cmd_cleanup cleanup = {
+		.i2400m = i2400m,
+		.cmd = &cmd,
+		.locked = 1,
+	};
 
-	msg_type = wimaxll_le16_to_cpu(l3l4->type);
+	cmd.mt = wimaxll_le16_to_cpu(l3l4->type);
+	pthread_cond_init(&cmd.cond, &i2400m->cond_attr);
 	/* No need to check msg & payload consistency, the kernel will do for us */
-	/* Setup the completion, ack_skb ("we are waiting") and send
-	 * the message to the device */
-	pthread_cleanup_push((void (*)(void *))pthread_mutex_unlock,
-			     &i2400m->mutex);
+	/* Register as waiting for the reply and send the message to
+	 * the device; if a command of the same type is pending, we
+	 * have to wait for it first, as the replies would be
+	 * indistinguishable. */
+	pthread_cleanup_push(i2400m_cmd_cleanup, &cleanup);
+	pthread_mutex_lock(&i2400m->mutex);
+	while (__i2400m_cmd_find(i2400m, cmd.mt) != NULL) {
+		if (deadline == NULL)
+			pthread_cond_wait(&i2400m->cmd_free, &i2400m->mutex);
+		else if (pthread_cond_timedwait(&i2400m->cmd_free,
+						&i2400m->mutex,
+						deadline) == ETIMEDOUT) {
+			result = -ETIMEDOUT;
+			cmd.done = 1;	/* never was in the table */
+			goto error_busy;
+		}
+	}
+	__i2400m_cmd_add(i2400m, &cmd);
+	cleanup.locked = 0;
+	pthread_mutex_unlock(&i2400m->mutex);
+
+	result = wimaxll_msg_write_deadline(i2400m->wmx, NULL, l3l4, l3l4_size,
+					    deadline);
 	pthread_mutex_lock(&i2400m->mutex);
-	i2400m->mt_pending = msg_type;
-	i2400m->mt_cb = cb;
-	i2400m->mt_cb_priv = cb_priv;
-	result = wimaxll_msg_write(i2400m->wmx, NULL, l3l4, l3l4_size);
+	cleanup.locked = 1;
 	if (result < 0)
 		goto error_msg_write;
 	/* The driver guarantees that either we get the response to
 	 * the command or only a notification, so we just need to wait
-	 * for the reply to come */
-#warning FIXME: _timeout?
-	pthread_cond_wait(&i2400m->cond, &i2400m->mutex);
-	result = i2400m->mt_result;
+	 * for the reply to come (i2400m_msg_to_user_cb() or
+	 * i2400m_destroy() complete it). */
+	while (!cmd.done) {
+		if (deadline == NULL)
+			pthread_cond_wait(&cmd.cond, &i2400m->mutex);
+		else if (pthread_cond_timedwait(&cmd.cond, &i2400m->mutex,
+						deadline) == ETIMEDOUT
+			 && !cmd.done) {
+			result = -ETIMEDOUT;
+			goto error_timeout;
+		}
+	}
+	result = cmd.result;
+error_timeout:
 error_msg_write:
-	i2400m->mt_pending = I2400M_MT_INVALID;
+	/* A reply arriving from now on is ignored (or taken for the
+	 * next command of the same type) */
+	if (!cmd.done)
+		__i2400m_cmd_complete(i2400m, &cmd, result, NULL);
+error_busy:
+	reply = cmd.reply;
+	cmd.reply = NULL;
+	pthread_cleanup_pop(1);
+	/* Parse the reply here, with no locks held */
+	if (reply != NULL) {
+		if (cb != NULL) {
+			cb_result = cb(i2400m, cb_priv,
+				       (const void *) reply->data, reply->size);
+			if (result >= 0)
+				result = cb_result;
+		}
+		i2400m_reply_put(i2400m, reply);
+	}
+	/* Commands of this type might have been queued with
+	 * i2400m_msg_to_dev_async() behind ours */
+	i2400m_cmd_kick(i2400m, cmd.mt);
+	return result;
+}
+
+
+/**
+ * Send an i2400m command and return without waiting for the response
+ *
+ * @param i2400m i2400m handle
+ * @param l3l4 Same as for i2400m_msg_to_dev(); it is copied, so it
+ *     can be released once this returns.
+ * @param l3l4_size Same as for i2400m_msg_to_dev().
+ * @param cb Callback function to execute when the command completes
+ *     (can be NULL); see \e i2400m_done_cb.
+ * @param cb_priv Private pointer to pass to the callback function.
+ * @param deadline Absolute time (%CLOCK_MONOTONIC, see
+ *     wimaxll_deadline_set()) after which the command is given up
+ *     on; NULL for never.
+ *
+ * @returns Identifier for the command (> 0), to use with
+ *     i2400m_msg_to_dev_cancel(); < 0 errno code on error (then \e cb
+ *     is not called).
+ *
+ * If no command of the same type is pending, the message is sent
+ * right away; otherwise it is queued and sent when the ones before
+ * it complete. Either way, \e cb is called exactly once: when the
+ * reply arrives (from the context of wimaxll_recv()), when the
+ * kernel refuses the message (from the context of
+ * wimaxll_tx_recv()), when cancelled or when i2400m_timeout_run() or
+ * i2400m_destroy() are called.
+ *
+ * Deadlines are not checked by a timer; whoever runs the event loop
+ * has to call i2400m_timeout_run() when i2400m_timeout_ms() says so.
+ * With the epoll helpers, for example:
+ *
+ * @code
+ * while (1) {
+ * 	r = wimaxll_epoll_dispatch(ep, i2400m_timeout_ms(i2400m));
+ * 	if (r < 0)
+ * 		error;
+ * 	i2400m_timeout_run(i2400m);
+ * }
+ * @endcode
+ *
+ * @note As there is no way to tell replies apart other than by their
+ * type, a reply the device sends after its command timed out or was
+ * cancelled is taken as the reply to the next command of the same
+ * type, if there is one already sent.
+ *
+ * @ingroup i2400m_group
+ */
+int i2400m_msg_to_dev_async(struct i2400m *i2400m,
+			    const struct i2400m_l3l4_hdr *l3l4,
+			    size_t l3l4_size,
+			    i2400m_done_cb cb, void *cb_priv,
+			    const struct timespec *deadline)
+{
+	int result;
+	struct i2400m_cmd *cmd;
+
+	result = -ENOMEM;
+	cmd = calloc(1, sizeof(*cmd) + l3l4_size);
+	if (cmd == NULL)
+		goto error_calloc;
+	cmd->mt = wimaxll_le16_to_cpu(l3l4->type);
+	cmd->cb_priv = cb_priv;
+	cmd->i2400m = i2400m;
+	cmd->refs = 1;
+	if (deadline != NULL) {
+		cmd->has_deadline = 1;
+		cmd->deadline = *deadline;
+	}
+	cmd->done_cb = cb;
+	cmd->msg_size = l3l4_size;
+	memcpy(cmd->msg, l3l4, l3l4_size);
+
+	pthread_cleanup_push((void (*)(void *))pthread_mutex_unlock,
+			     &i2400m->mutex);
+	pthread_mutex_lock(&i2400m->mutex);
+	if (++i2400m->cmd_id <= 0)
+		i2400m->cmd_id = 1;
+	result = cmd->id = i2400m->cmd_id;
+	__i2400m_cmd_add(i2400m, cmd);
+	pthread_mutex_unlock(&i2400m->mutex);
+	pthread_cleanup_pop(0);
+	i2400m_cmd_kick(i2400m, cmd->mt);
+error_calloc:
+	return result;
+}
+
+
+/**
+ * Cancel a command sent with i2400m_msg_to_dev_async()
+ *
+ * @param i2400m i2400m handle
+ * @param id Identifier returned by i2400m_msg_to_dev_async()
+ *
+ * @returns 0 if cancelled (its callback has been called with
+ *     -%ECANCELED), -%ENOENT if it had already completed.
+ *
+ * If the message was already sent, the device will still execute it.
+ *
+ * @ingroup i2400m_group
+ */
+int i2400m_msg_to_dev_cancel(struct i2400m *i2400m, int id)
+{
+	int result = -ENOENT;
+	unsigned itr;
+	struct i2400m_cmd *cmd, *done = NULL;
+
+	pthread_cleanup_push((void (*)(void *))pthread_mutex_unlock,
+			     &i2400m->mutex);
+	pthread_mutex_lock(&i2400m->mutex);
+	for (itr = 0; itr < I2400M_CMD_HASH_SIZE && result < 0; itr++)
+		for (cmd = i2400m->cmd_hash[itr]; cmd != NULL; cmd = cmd->next)
+			if (cmd->id == id) {
+				__i2400m_cmd_complete(i2400m, cmd,
+						      -ECANCELED, &done);
+				result = 0;
+				break;
+			}
+	pthread_mutex_unlock(&i2400m->mutex);
+	pthread_cleanup_pop(0);
+	i2400m_cmd_done(i2400m, done);
+	return result;
+}
+
+
+/**
+ * Return how long until the next asynchronous command times out
+ *
+ * @param i2400m i2400m handle
+ *
+ * @returns milliseconds (rounded up) until the earliest deadline of
+ *     the pending commands sent with i2400m_msg_to_dev_async(), 0
+ *     if it already passed, -1 if none has a deadline; suitable as
+ *     timeout for poll() or wimaxll_epoll_dispatch().
+ *
+ * @ingroup i2400m_group
+ */
+int i2400m_timeout_ms(struct i2400m *i2400m)
+{
+	int result = -1, ms;
+	unsigned itr;
+	struct i2400m_cmd *cmd;
+
+	pthread_cleanup_push((void (*)(void *))pthread_mutex_unlock,
+			     &i2400m->mutex);
+	pthread_mutex_lock(&i2400m->mutex);
+	for (itr = 0; itr < I2400M_CMD_HASH_SIZE; itr++)
+		for (cmd = i2400m->cmd_hash[itr]; cmd != NULL; cmd = cmd->next) {
+			if (cmd->id == 0 || !cmd->has_deadline)
+				continue;
+			ms = wimaxll_deadline_ms(&cmd->deadline);
+			if (result < 0 || ms < result)
+				result = ms;
+		}
+	pthread_mutex_unlock(&i2400m->mutex);
+	pthread_cleanup_pop(0);
+	return result;
+}
+
+
+/**
+ * Complete the asynchronous commands whose deadline has passed
+ *
+ * @param i2400m i2400m handle
+ *
+ * @returns number of commands completed (their callbacks have been
+ *     called with -%ETIMEDOUT).
+ *
+ * @ingroup i2400m_group
+ */
+int i2400m_timeout_run(struct i2400m *i2400m)
+{
+	int result = 0;
+	unsigned itr;
+	struct i2400m_cmd *cmd, *next, *done = NULL;
+
+	pthread_cleanup_push((void (*)(void *))pthread_mutex_unlock,
+			     &i2400m->mutex);
+	pthread_mutex_lock(&i2400m->mutex);
+	for (itr = 0; itr < I2400M_CMD_HASH_SIZE; itr++)
+		for (cmd = i2400m->cmd_hash[itr]; cmd != NULL; cmd = next) {
+			next = cmd->next;
+			if (cmd->id == 0 || !cmd->has_deadline
+			    || wimaxll_deadline_ms(&cmd->deadline) > 0)
+				continue;
+			__i2400m_cmd_complete(i2400m, cmd, -ETIMEDOUT, &done);
+			result++;
+		}
 	pthread_mutex_unlock(&i2400m->mutex);
 	pthread_cleanup_pop(0);
+	i2400m_cmd_done(i2400m, done);
 	return result;
 }
 
@@ -37,9 +37,11 @@
 #ifndef __lib_internal_h__
 #define __lib_internal_h__
 
+#include <pthread.h>
 #include <wimaxll.h>
 
 struct nl_msg;
+struct nlmsghdr;
 struct nlmsgerr;
 struct sockaddr_nl;
 
@@ -50,6 +52,380 @@ enum {
 	 *     name.
 	 */
 	WIMAXLL_IFNAME_LEN = __WIMAXLL_IFNAME_LEN,
+	/**
+	 * WIMAXLL_TX_INFLIGHT_MAX - Maximum number of messages that
+	 *     can be waiting for an ACK on a handle (power of two).
+	 */
+	WIMAXLL_TX_INFLIGHT_MAX = 64,
+	/**
+	 * WIMAXLL_TX_BATCH_SIZE - Maximum size (in bytes) of a batch
+	 *     of messages sent in a single datagram by
+	 *     wimaxll_msg_writev() (unless a single message is bigger).
+	 */
+	WIMAXLL_TX_BATCH_SIZE = 32 * 1024,
+	/**
+	 * WIMAXLL_RX_BORROW_MAX - Maximum number of receive buffers
+	 *     that can be lent with wimaxll_msg_read_borrow() before
+	 *     they are returned with wimaxll_msg_release().
+	 */
+	WIMAXLL_RX_BORROW_MAX = 8,
+	/**
+	 * WIMAXLL_RX_BATCH_MAX - Maximum number of datagrams read
+	 *     from the kernel with a single system call.
+	 */
+	WIMAXLL_RX_BATCH_MAX = 16,
+	/**
+	 * WIMAXLL_RX_BUF_SIZE - Default size of each receive buffer
+	 *     (see wimaxll_recv_buf_size_set()).
+	 */
+	WIMAXLL_RX_BUF_SIZE = 16 * 1024,
+	/**
+	 * WIMAXLL_RX_SPILL_SIZE - Size of the area where the part of
+	 *     a datagram that doesn't fit in its receive buffer is read
+	 *     (one per receive buffer; see wimaxll_recv_fill()).
+	 */
+	WIMAXLL_RX_SPILL_SIZE = 64 * 1024,
+	/**
+	 * WIMAXLL_TX_BUF_SIZE - Default size of the buffer for
+	 *     receiving ACKs on the TX handle.
+	 */
+	WIMAXLL_TX_BUF_SIZE = 4 * 1024,
+	/**
+	 * WIMAXLL_RX_SHARED_HASH_SIZE - Number of buckets in the
+	 *     shared receiver's table of handles (power of two).
+	 */
+	WIMAXLL_RX_SHARED_HASH_SIZE = 64,
+	/**
+	 * WIMAXLL_RX_SHARED_FANOUT_MAX - Number of handles a
+	 *     notification can be delivered to by the shared receiver
+	 *     without allocating memory.
+	 */
+	WIMAXLL_RX_SHARED_FANOUT_MAX = 16,
+	/**
+	 * WIMAXLL_MSG_QUEUE_DEPTH - Default maximum number of
+	 *     messages queued for a pipe (see
+	 *     wimaxll_msg_queue_set()).
+	 */
+	WIMAXLL_MSG_QUEUE_DEPTH = 64,
+	/**
+	 * WIMAXLL_PIPE_MAX - Maximum number of message pipes
+	 *     registered in a handle (see wimaxll_pipe_register()).
+	 */
+	WIMAXLL_PIPE_MAX = 256,
+	/**
+	 * WIMAXLL_PIPE_HASH_SIZE - Number of buckets in a handle's
+	 *     table of pipe names (power of two).
+	 */
+	WIMAXLL_PIPE_HASH_SIZE = 64,
+};
+
+
+/**
+ * A message sent to the kernel that is waiting for its ACK
+ *
+ * \internal
+ *
+ * \param seq Netlink sequence number the message was sent with
+ * \param busy !0 if this slot of the in-flight table is in use
+ * \param cb Function to call when the ACK (or error) for \a seq
+ *     arrives; can be NULL.
+ * \param priv Private pointer to pass to \a cb.
+ *
+ * Messages are tracked in the handle's \e tx_inflight table in slot
+ * \a seq % %WIMAXLL_TX_INFLIGHT_MAX; as sequence numbers are
+ * allocated sequentially, slots are reused in order.
+ */
+struct wimaxll_tx_req {
+	unsigned seq;
+	unsigned busy:1;
+	wimaxll_ack_cb_f cb;
+	void *priv;
+};
+
+
+enum {
+	WIMAXLL_TX_WAIT_ACK,
+	WIMAXLL_TX_WAIT_SLOT,
+	WIMAXLL_TX_WAIT_FLUSH,
+};
+
+enum {
+	WIMAXLL_TX_WAITING,
+	WIMAXLL_TX_LEAD,
+	WIMAXLL_TX_DONE,
+};
+
+
+/**
+ * A thread waiting on the TX side of a handle
+ *
+ * \internal
+ *
+ * \param next Next in the handle's \e tx_waiters list.
+ * \param kind What it waits for: the ACK for \a seq
+ *     (%WIMAXLL_TX_WAIT_ACK), the in-flight slot of \a seq to be free
+ *     (%WIMAXLL_TX_WAIT_SLOT) or the in-flight table to be empty
+ *     (%WIMAXLL_TX_WAIT_FLUSH).
+ * \param seq Sequence number (for %WIMAXLL_TX_WAIT_ACK and
+ *     %WIMAXLL_TX_WAIT_SLOT).
+ * \param result Error code the ACK carried (%WIMAXLL_TX_WAIT_ACK).
+ * \param state Futex word: %WIMAXLL_TX_WAITING while sleeping,
+ *     %WIMAXLL_TX_LEAD when asked to take over reading ACKs,
+ *     %WIMAXLL_TX_DONE when the condition is met (and it has been
+ *     taken off the list).
+ *
+ * Lives on the waiting thread's stack; see wimaxll_tx_wait().
+ */
+struct wimaxll_tx_waiter {
+	struct wimaxll_tx_waiter *next;
+	unsigned kind;
+	unsigned seq;
+	int result;
+	int state;
+};
+
+
+/**
+ * A receive buffer lent to the user with wimaxll_msg_read_borrow()
+ *
+ * \internal
+ *
+ * \param buf Receive buffer (NULL if the slot is free).
+ * \param size Size of the data in \a buf
+ */
+struct wimaxll_rx_buf {
+	void *buf;
+	size_t size;
+};
+
+
+struct wimaxll_msg_pool;
+
+/**
+ * A message buffer handed out by wimaxll_msg_read()
+ *
+ * \internal
+ *
+ * \param pool Pool the buffer belongs to (NULL if it was allocated
+ *     from the heap and has to be freed).
+ * \param next Next free buffer in the pool's lists (or next message
+ *     in a pipe's queue)
+ * \param size Size of the message, while queued.
+ * \param seq Order in which the message was queued (to read the
+ *     oldest one with %WIMAX_PIPE_ANY).
+ * \param data Message payload; this is what the user gets.
+ */
+struct wimaxll_msg_buf {
+	struct wimaxll_msg_pool *pool;
+	struct wimaxll_msg_buf *next;
+	size_t size;
+	unsigned long seq;
+	char data[];
+};
+
+
+/**
+ * Queue of messages for a pipe, waiting for wimaxll_msg_read()
+ *
+ * \internal
+ *
+ * \param head Oldest message queued.
+ * \param tail Newest message queued.
+ * \param len Number of messages queued.
+ * \param depth Maximum number of messages to queue.
+ * \param policy What to drop when full (enum
+ *     wimaxll_msg_queue_policy_e).
+ * \param queued Messages queued so far.
+ * \param dropped Messages dropped because the queue was full.
+ */
+struct wimaxll_msg_queue {
+	struct wimaxll_msg_buf *head, *tail;
+	unsigned len, depth, policy;
+	unsigned long queued, dropped;
+};
+
+
+/**
+ * A thread waiting in wimaxll_msg_read() for a message
+ *
+ * \internal
+ *
+ * \param next Next reader in the handle's \a msg_readers.
+ * \param pipe Pipe being read (NULL for %WIMAX_PIPE_ANY).
+ * \param borrow !0 if reading with wimaxll_msg_read_borrow().
+ * \param result -%EINPROGRESS while waiting; when a message is
+ *     handed to the reader, its size (or a negative errno code if it
+ *     couldn't be).
+ * \param data The message (see wimaxll_msg_queue_deliver()).
+ */
+struct wimaxll_msg_reader {
+	struct wimaxll_msg_reader *next;
+	struct wimaxll_pipe *pipe;
+	unsigned borrow:1;
+	ssize_t result;
+	void *data;
+};
+
+
+/**
+ * Types of notifications subscribers can be added for
+ *
+ * \internal
+ */
+enum {
+	WIMAXLL_SUB_MSG_TO_USER,
+	WIMAXLL_SUB_STATE_CHANGE,
+	WIMAXLL_SUB_TYPES
+};
+
+
+/**
+ * A callback added with wimaxll_add_cb_msg_to_user() or
+ * wimaxll_add_cb_state_change()
+ *
+ * \internal
+ *
+ * \param next Next subscriber in the list for the notification type.
+ * \param token Identifies the subscriber for wimaxll_remove_cb().
+ * \param dead Removed while a notification was being delivered; it
+ *     is freed when the delivery is done.
+ * \param cb Callback (a \ref wimaxll_msg_to_user_cb_f or a \ref
+ *     wimaxll_state_change_cb_f, depending on the list).
+ * \param priv Private pointer to pass to \a cb.
+ */
+struct wimaxll_sub {
+	struct wimaxll_sub *next;
+	int token;
+	unsigned dead:1;
+	void (*cb)(void);
+	void *priv;
+};
+
+
+/**
+ * A message pipe registered in a handle
+ *
+ * \internal
+ *
+ * \param hash_next Next pipe in the same bucket of the handle's \a
+ *     pipe_hash.
+ * \param id ID of the pipe; index in the handle's \a pipes.
+ * \param hash Hash of \a name.
+ * \param name_len Length of \a name.
+ * \param cb Callback for the pipe's messages (NULL to use the
+ *     handle's), set with wimaxll_pipe_set_cb_msg_to_user().
+ * \param priv Private pointer for \a cb.
+ * \param queue Messages waiting for wimaxll_msg_read().
+ * \param name Name of the pipe (empty for the default pipe, ID 0).
+ */
+struct wimaxll_pipe {
+	struct wimaxll_pipe *hash_next;
+	unsigned id, hash;
+	size_t name_len;
+	wimaxll_msg_to_user_cb_f cb;
+	void *priv;
+	struct wimaxll_msg_queue queue;
+	char name[];
+};
+
+
+/**
+ * A pool of message buffers for wimaxll_msg_read()
+ *
+ * \internal
+ *
+ * \param refcount One reference for the handle plus one for each
+ *     buffer the user hasn't freed yet; the pool is released when it
+ *     drops to zero, so it can outlive the handle.
+ * \param obj_size Size of each buffer's payload; messages bigger
+ *     than this are allocated from the heap.
+ * \param objs_max Maximum number of buffers to allocate; when all
+ *     are in use, we fall back to the heap.
+ * \param objs Number of buffers allocated so far.
+ * \param free_list Buffers returned by wimaxll_msg_free(), which
+ *     might be called from any thread; they are pushed atomically.
+ * \param cache Free buffers owned by the reader; when empty, the
+ *     whole \a free_list is grabbed atomically into it (this way
+ *     nobody pops single entries concurrently, so there are no ABA
+ *     issues).
+ */
+struct wimaxll_msg_pool {
+	int refcount;
+	size_t obj_size;
+	unsigned objs_max, objs;
+	struct wimaxll_msg_buf *free_list;
+	struct wimaxll_msg_buf *cache;
+};
+
+
+/**
+ * Transport to the kernel's WiMAX generic netlink family
+ *
+ * \internal
+ *
+ * The library builds and parses generic netlink messages itself;
+ * the transport only moves them. What it provides is a pair of
+ * datagram file descriptors per handle: \a tx_fd, where requests
+ * are sent and their ACKs come back, and \a rx_fd, where the
+ * multicast notifications arrive. The default one is netlink
+ * (#wimaxll_transport_netlink); a test transport can stand in for
+ * the kernel (see lib/fake.h).
+ *
+ * \param name Name, for diagnostics.
+ * \param tx_open Set up \a wmx->tx_fd and \a wmx->nlh_tx (which
+ *     is always a libnl handle, as it is used to number the
+ *     messages).
+ * \param tx_close Undo \a tx_open.
+ * \param resolve Find the WiMAX family; fill \a wmx->gnl_family_id
+ *     and \a wmx->mcg_id and return the interface version (or < 0
+ *     errno code).
+ * \param rx_open Set up \a wmx->rx_fd and join the 'msg' multicast
+ *     group (\a wmx->mcg_id).
+ * \param rx_close Undo \a rx_open and set \a wmx->rx_fd to -1.
+ * \param send Send a complete netlink message (or a batch of them)
+ *     over \a wmx->tx_fd.
+ * \param rx_filter !0 if \a wmx->rx_fd is a netlink socket the
+ *     kernel-side RX filter can be attached to (see lib/rx-filter.c).
+ */
+struct wimaxll_transport_ops {
+	const char *name;
+	int (*tx_open)(struct wimaxll_handle *);
+	void (*tx_close)(struct wimaxll_handle *);
+	int (*resolve)(struct wimaxll_handle *);
+	int (*rx_open)(struct wimaxll_handle *);
+	void (*rx_close)(struct wimaxll_handle *);
+	ssize_t (*send)(struct wimaxll_handle *, const void *, size_t);
+	unsigned rx_filter:1;
+};
+
+extern const struct wimaxll_transport_ops wimaxll_transport_netlink;
+
+
+/**
+ * Cache of a device's state
+ *
+ * \internal
+ *
+ * See lib/state-cache.c.
+ *
+ * \param seq Sequence lock; odd while a writer updates the rest.
+ * \param enabled !0 if wimaxll_state_cache_enable() was called.
+ * \param valid !0 if \a state can be trusted (no notification is
+ *     known to have been missed).
+ * \param state Last known state of the device.
+ * \param generation Number of times \a state changed.
+ * \param changed When \a state last changed (%CLOCK_MONOTONIC).
+ * \param rx_overruns Value of the receiver's \a rx_overruns when the
+ *     cache was last seeded; if it changed, notifications were lost.
+ */
+struct wimaxll_state_cache {
+	unsigned seq;
+	int enabled;
+	int valid;
+	enum wimax_st state;
+	unsigned long generation;
+	struct timespec changed;
+	unsigned long rx_overruns;
 };
 
 
@@ -66,51 +442,424 @@ enum {
  * wimaxll_msg_write() and \c wimaxll_msg_read() at the same time in a
  * multithreaded environment, for example.
  *
+ * The TX side can be used by many threads at the same time: sequence
+ * numbers are allocated atomically and each thread registers what it
+ * waits for in \a tx_waiters before sending. Only one thread (the
+ * leader) reads the ACKs and hands each one to the thread (or
+ * in-flight entry) that owns its sequence number; the rest sleep on
+ * a futex until their ACK is delivered or they are asked to become
+ * the leader. The RX side works the same way: only one thread (\a
+ * rx_leader) reads from the receive socket and runs the callbacks at
+ * a time; the others wait on \a rx_cond until it is done (and return
+ * if it processed a notification for their handle in the meantime)
+ * or they can take over. Changing the receive buffer size
+ * (wimaxll_recv_buf_size_set()) is not safe while other threads use
+ * the handle.
+ *
  * \param ifidx Interface Index (of the network interface); if 0, the
  *     interface name will be \c "any" and this means that this handle
  *     works for \e any WiMAX interface.
+ * \param rx_ifidx For "any" handles, interface index of the
+ *     notification whose callbacks are being run by thread \a
+ *     rx_ifidx_thread (see wimaxll_ifidx()); 0 otherwise.
+ * \param rx_ifidx_thread Thread running callbacks on an "any" handle.
  * \param gnl_family_id Generic Netlink Family ID assigned to the
  *     device; we maintain it here (for each interface) because we
  *     want to discover it every time we open. This solves the case of
  *     the WiMAX modules being reloaded (and the ID changing) while
  *     this library is running; this way it takes only a new open when
- *     the new device is discovered.
+ *     the new device is discovered. The lookup is served from a
+ *     process-wide cache that is flushed when the kernel reports the
+ *     family changed (see wimaxll_gnl_cache_lookup()).
  * \param mcg_id Id of the 'msg' multicast group
  * \param name name of the wimax interface
  * \param priv Private pointer set with wimaxll_priv_set() or other
  *     accessors. Use wimaxll_priv_get() to access it.
  * \param nlh_tx handle for writing to the kernel.
- *     Internal note: You \b have \b to set the handlers for
- *     %NL_CB_VALID and nl_cb_err() callbacks, as each callsite will
- *     do it to suit their needs. See wimaxll_rfkill() for an
- *     example. Any other callback you are supposed to restore to what
- *     it was before.
- * \param nlh_rx handle for reading from the kernel.
+ *     Internal note: ACKs are read from it with
+ *     wimaxll_wait_for_ack(), not with libnl's receive functions
+ *     (only used while resolving the family in wimaxll_open()).
+ * \param nlh_rx handle for reading from the kernel (only with the
+ *     netlink transport).
+ * \param transport Transport the handle uses to talk to the kernel
+ *     (set when opening from wimaxll_transport_set()).
+ * \param tx_fd File descriptor requests are sent to and ACKs read
+ *     from (the socket of \a nlh_tx for netlink).
+ * \param rx_fd File descriptor notifications are read from (the
+ *     socket of \a nlh_rx for netlink); -1 if the receive side is
+ *     not set up.
  * \param nl_rx_cb Callbacks for the nlh_rx handle
+ * \param tx_inflight Table of messages sent with
+ *     wimaxll_msg_write_async() that are waiting for their ACK, indexed
+ *     by sequence number (see struct wimaxll_tx_req).
+ * \param tx_inflight_count Number of busy entries in \a tx_inflight.
+ * \param tx_mutex Protects \a tx_inflight, \a tx_waiters and the
+ *     leader state.
+ * \param tx_waiters Threads waiting for an ACK, an in-flight slot or
+ *     for the in-flight table to drain (struct wimaxll_tx_waiter).
+ * \param tx_seq Last sequence number allocated (wimaxll_tx_seq_next()).
+ * \param tx_reading !0 while a thread (\a tx_leader) reads ACKs.
+ * \param tx_leader Thread reading ACKs.
+ * \param rx_buf Receive buffers for the \a rx_fd (allocated
+ *     on first use).
+ * \param rx_buf_size Size of each of the \a rx_buf buffers; when
+ *     different from \a rx_buf_alloc_size, the buffers are
+ *     reallocated on the next read.
+ * \param rx_buf_alloc_size Size the \a rx_buf buffers were
+ *     allocated with.
+ * \param rx_spill Where datagrams that don't fit in their \a rx_buf
+ *     continue (%WIMAXLL_RX_SPILL_SIZE bytes for each \a rx_buf;
+ *     allocated on first use).
+ * \param rx_len Size of the datagram read into each \a rx_buf.
+ * \param rx_next Index in \a rx_buf of the next datagram to process.
+ * \param rx_off Offset in that datagram of the next message to
+ *     process (not 0 if a callback stopped processing in the middle
+ *     of it).
+ * \param rx_count Number of datagrams read and not yet processed.
+ * \param rx_mutex Protects the RX leader state (of the handle that
+ *     owns the receive socket, see wimaxll_rx_wmx()) and the
+ *     handle's \a rx_borrowed.
+ * \param rx_cond Signalled (with \a rx_mutex) when the RX leader is
+ *     done, for the threads in \a rx_waiting.
+ * \param rx_reading !0 while a thread (\a rx_leader) reads from \a
+ *     rx_fd and processes what it read.
+ * \param rx_leader Thread reading from \a rx_fd.
+ * \param rx_waiting Number of threads waiting for \a rx_leader.
+ * \param rx_processed Number of notifications for this handle
+ *     processed (only changed by the RX leader); lets a thread that
+ *     waited for the leader know if it got something.
+ * \param rx_borrowed Receive buffers lent to the user by
+ *     wimaxll_msg_read_borrow() and not yet released.
+ * \param rx_borrowed_count Number of used entries in \a rx_borrowed.
+ * \param rx_pin Set (in the handle that owns the receive buffers,
+ *     see wimaxll_rx_wmx()) by a receive callback to ask
+ *     wimaxll_recv() to keep the current receive buffer in the \a
+ *     rx_borrowed of \a rx_pin_wmx instead of reusing it.
+ * \param rx_pin_wmx Handle the pinned buffer was lent to (with the
+ *     shared receiver, any of the handles attached to it).
+ * \param tx_buf Buffer for reading ACKs from \a nlh_tx (allocated on
+ *     first use).
+ * \param tx_buf_size Size of \a tx_buf.
+ * \param recv_buf_grow_count Number of times \a rx_buf or \a tx_buf
+ *     had to be grown because a datagram didn't fit.
+ * \param rx_overruns Number of times notifications were lost because
+ *     the receive socket overran (or a datagram was too big even for
+ *     the receive buffer plus its spill area).
+ * \param flags Flags the handle was opened with (enum
+ *     wimaxll_open_flags_e).
+ * \param probe_pending Opened with %WIMAXLL_OPEN_NO_PROBE and no
+ *     operation has completed yet, so we don't know if the device is
+ *     really a WiMAX one.
+ * \param probe_result -%ENODEV if the first operation completed on
+ *     a handle opened with %WIMAXLL_OPEN_NO_PROBE said it is not a
+ *     WiMAX device (the rest fail with it without being sent); 0
+ *     otherwise.
+ * \param rx_shared Shared receiver the handle is attached to (with
+ *     %WIMAXLL_OPEN_SHARED_RX; NULL otherwise). It is a handle that
+ *     only has an \a rx_fd and the receive buffers.
+ * \param rx_shared_next Next handle in the shared receiver's hash
+ *     bucket.
+ * \param rx_shared_refs Number of threads running (or about to run)
+ *     the handle's callbacks from the shared receiver, or keeping a
+ *     receive buffer pinned for it; it is not detached until they
+ *     are done (protected by the shared receiver's mutex).
+ * \param msg_pool Pool of buffers for wimaxll_msg_read() (NULL to
+ *     allocate from the heap); see wimaxll_msg_pool_set().
+ * \param rx_filter_flags Flags set with wimaxll_recv_filter() (enum
+ *     wimaxll_recv_filter_e).
+ * \param rx_filter_pipes Names of the pipes whose messages the RX
+ *     socket filter accepts (NULL entries for the default pipe).
+ * \param rx_filter_pipe_count Number of entries in \a
+ *     rx_filter_pipes; 0 to accept all pipes.
+ * \param rx_filter_cmds Bitmap (1 << cmd) of the commands the
+ *     attached RX socket filter accepts.
+ * \param rx_filter_sub_cmds Bitmap (1 << cmd) of the commands there
+ *     have been subscribers for since wimaxll_recv_filter() was last
+ *     called; they stay accepted when the subscribers are removed.
+ * \param rx_filter_attached !0 if a filter generated with the
+ *     current settings is attached to \a rx_fd.
+ * \param rx_filter_mutex Serializes computing, attaching and
+ *     recording the RX socket filter (and changing its settings),
+ *     as callbacks and subscribers are set from any thread.
+ * \param pipes Registered pipes, indexed by ID (see lib/pipe.c); each
+ *     has the queue of messages that arrived for it while another
+ *     pipe was being read (see lib/msg-queue.c).
+ * \param pipe_count Number of registered pipes.
+ * \param pipe_mutex Serializes registering pipes and changing their
+ *     callbacks; looking them up (\a pipes, \a pipe_hash) needs no
+ *     lock, as entries are only added, and published once complete
+ *     (see lib/pipe.c).
+ * \param pipe_hash Hash table of the registered pipes by name (the
+ *     default pipe is not in it).
+ * \param pipe_cb_count Number of pipes that have a callback.
+ * \param rx_pipe_id ID of the pipe of the message being delivered (<
+ *     0 if not registered).
+ * \param msg_queue_depth Depth new queues are created with.
+ * \param msg_queue_policy Policy new queues are created with.
+ * \param msg_queue_seq Sequence number for the next queued message.
+ * \param msg_queue_enabled !0 once wimaxll_msg_read() (or
+ *     wimaxll_msg_queue_set()) has been used; from then on messages
+ *     no pipe callback takes are handed to readers or queued.
+ * \param msg_mutex Protects the queues, \a msg_readers and \a
+ *     msg_lent (see lib/msg-queue.c).
+ * \param msg_readers Threads waiting in wimaxll_msg_read().
+ * \param msg_lent Queued messages lent by wimaxll_msg_read_borrow()
+ *     and not yet released.
+ * \param sub_mutex Protects the subscriber lists (see
+ *     lib/subscribers.c).
+ * \param subs Lists of subscribers, by notification type.
+ * \param sub_count Number of live subscribers in each of \a subs.
+ * \param sub_dispatching Number of notifications being delivered to
+ *     subscribers (while !0, removed ones are only marked dead).
+ * \param sub_dead Number of subscribers marked dead.
+ * \param sub_token_last Last token given to a subscriber.
+ * \param state_cache Cache of the device's state (see
+ *     wimaxll_state_cache_enable()).
  *
  * FIXME: add doc on callbacks
  */
 struct wimaxll_handle {
 	unsigned ifidx;
+	unsigned rx_ifidx;
+	pthread_t rx_ifidx_thread;
 	int gnl_family_id, mcg_id;
 	char name[__WIMAXLL_IFNAME_LEN];
 	void *priv;
 
 	struct nl_handle *nlh_tx;
 	struct nl_handle *nlh_rx;
+	const struct wimaxll_transport_ops *transport;
+	int tx_fd, rx_fd;
 
 	wimaxll_msg_to_user_cb_f msg_to_user_cb;
 	void *msg_to_user_priv;
 
 	wimaxll_state_change_cb_f state_change_cb;
 	void *state_change_priv;
+
+	struct wimaxll_tx_req tx_inflight[WIMAXLL_TX_INFLIGHT_MAX];
+	unsigned tx_inflight_count;
+	pthread_mutex_t tx_mutex;
+	struct wimaxll_tx_waiter *tx_waiters;
+	unsigned tx_seq;
+	unsigned tx_reading;
+	pthread_t tx_leader;
+
+	void *rx_buf[WIMAXLL_RX_BATCH_MAX];
+	size_t rx_buf_size, rx_buf_alloc_size;
+	void *rx_spill;
+	size_t rx_len[WIMAXLL_RX_BATCH_MAX];
+	unsigned rx_next, rx_count;
+	size_t rx_off;
+	pthread_mutex_t rx_mutex;
+	pthread_cond_t rx_cond;
+	unsigned rx_reading, rx_waiting;
+	pthread_t rx_leader;
+	unsigned long rx_processed;
+
+	struct wimaxll_rx_buf rx_borrowed[WIMAXLL_RX_BORROW_MAX];
+	unsigned rx_borrowed_count;
+	unsigned rx_pin:1;
+	struct wimaxll_handle *rx_pin_wmx;
+
+	void *tx_buf;
+	size_t tx_buf_size;
+	unsigned long recv_buf_grow_count;
+	unsigned long rx_overruns;
+
+	unsigned flags;
+	unsigned probe_pending:1;
+	int probe_result;
+	struct wimaxll_handle *rx_shared, *rx_shared_next;
+	unsigned rx_shared_refs;
+
+	struct wimaxll_msg_pool *msg_pool;
+
+	unsigned rx_filter_flags;
+	char **rx_filter_pipes;
+	size_t rx_filter_pipe_count;
+	unsigned rx_filter_cmds, rx_filter_sub_cmds;
+	unsigned rx_filter_attached:1;
+	pthread_mutex_t rx_filter_mutex;
+
+	struct wimaxll_pipe *pipes[WIMAXLL_PIPE_MAX];
+	unsigned pipe_count;
+	pthread_mutex_t pipe_mutex;
+	struct wimaxll_pipe *pipe_hash[WIMAXLL_PIPE_HASH_SIZE];
+	unsigned pipe_cb_count;
+	int rx_pipe_id;
+	unsigned msg_queue_depth, msg_queue_policy;
+	unsigned long msg_queue_seq;
+	unsigned msg_queue_enabled;
+	pthread_mutex_t msg_mutex;
+	struct wimaxll_msg_reader *msg_readers;
+	struct wimaxll_msg_buf *msg_lent;
+
+	pthread_mutex_t sub_mutex;
+	struct wimaxll_sub *subs[WIMAXLL_SUB_TYPES];
+	unsigned sub_count[WIMAXLL_SUB_TYPES];
+	unsigned sub_dispatching, sub_dead;
+	int sub_token_last;
+
+	struct wimaxll_state_cache state_cache;
 };
 
 
+/*
+ * Return the handle that owns the receive socket and buffers for a
+ * handle (itself or the shared receiver).
+ */
+static inline
+struct wimaxll_handle *wimaxll_rx_wmx(struct wimaxll_handle *wmx)
+{
+	return wmx->rx_shared ? wmx->rx_shared : wmx;
+}
+
+
+/*
+ * Return if there is any callback for MSG_TO_USER messages (the
+ * handle's, a pipe's or a subscriber) or they are being queued for
+ * wimaxll_msg_read()
+ */
+static inline
+int wimaxll_has_cb_msg_to_user(struct wimaxll_handle *wmx)
+{
+	return wmx->msg_to_user_cb != NULL || wmx->pipe_cb_count > 0
+		|| wmx->sub_count[WIMAXLL_SUB_MSG_TO_USER] > 0
+		|| wmx->msg_queue_enabled;
+}
+
+
+/*
+ * Return the number of pipes registered in a handle
+ *
+ * Pipes might be being registered by another thread; any ID below
+ * the value returned can be used to index \a pipes (see lib/pipe.c).
+ */
+static inline
+unsigned wimaxll_pipe_count(struct wimaxll_handle *wmx)
+{
+	unsigned count = wmx->pipe_count;
+
+	__sync_synchronize();
+	return count;
+}
+
+
+/*
+ * Return if there is any callback for state changes (the handle's or
+ * a subscriber) or the state cache needs them
+ */
+static inline
+int wimaxll_has_cb_state_change(struct wimaxll_handle *wmx)
+{
+	return wmx->state_change_cb != NULL
+		|| wmx->sub_count[WIMAXLL_SUB_STATE_CHANGE] > 0
+		|| wmx->state_cache.enabled;
+}
+
+
+/*
+ * Return if there are datagrams already read from the receive socket
+ * that haven't been processed (eg: a callback stopped processing);
+ * polling the socket won't signal them.
+ */
+static inline
+int wimaxll_rx_backlog(struct wimaxll_handle *wmx)
+{
+	return wimaxll_rx_wmx(wmx)->rx_count > 0;
+}
+
+
+/*
+ * Tell wimaxll_ifidx() which interface a notification being processed
+ * on an "any" handle came from
+ *
+ * Only the calling thread sees it; the handle's \a ifidx is never
+ * changed, as other threads might be using it. Returns the previous
+ * value, to restore when done (callbacks might process notifications
+ * too).
+ */
+static inline
+unsigned wimaxll_rx_ifidx_set(struct wimaxll_handle *wmx, unsigned ifidx)
+{
+	unsigned old_ifidx = wmx->rx_ifidx;
+
+	if (wmx->ifidx != 0)
+		return 0;
+	if (ifidx != 0)
+		wmx->rx_ifidx_thread = pthread_self();
+	wmx->rx_ifidx = ifidx;
+	return old_ifidx;
+}
+
+
 /* Utilities */
-int wimaxll_wait_for_ack(struct wimaxll_handle *);
-int wimaxll_gnl_handle_msg_to_user(struct wimaxll_handle *, struct nl_msg *);
-int wimaxll_gnl_handle_state_change(struct wimaxll_handle *, struct nl_msg *);
+int wimaxll_deadline_ms(const struct timespec *);
+int wimaxll_state_query(struct wimaxll_handle *, const struct timespec *);
+void wimaxll_state_cache_update(struct wimaxll_handle *,
+				enum wimax_st, enum wimax_st);
+int wimaxll_state_cache_lookup(struct wimaxll_handle *, unsigned long *,
+			       struct timespec *, const struct timespec *);
+unsigned wimaxll_tx_seq_next(struct wimaxll_handle *);
+void wimaxll_tx_waiter_add(struct wimaxll_handle *,
+			   struct wimaxll_tx_waiter *, unsigned);
+void wimaxll_tx_waiter_del(struct wimaxll_handle *,
+			   struct wimaxll_tx_waiter *);
+int wimaxll_wait_for_ack(struct wimaxll_handle *,
+			 struct wimaxll_tx_waiter *, const struct timespec *);
+int wimaxll_tx_inflight_add(struct wimaxll_handle *, unsigned,
+			    wimaxll_ack_cb_f, void *);
+int wimaxll_tx_inflight_try_add(struct wimaxll_handle *, unsigned,
+				wimaxll_ack_cb_f, void *);
+void wimaxll_tx_inflight_del(struct wimaxll_handle *, unsigned);
+void wimaxll_tx_inflight_cancel(struct wimaxll_handle *);
+void wimaxll_msg_borrowed_release_all(struct wimaxll_handle *);
+void wimaxll_msg_pool_put(struct wimaxll_msg_pool *);
+struct wimaxll_msg_buf *wimaxll_msg_buf_alloc(struct wimaxll_handle *,
+					      size_t);
+struct wimaxll_pipe *wimaxll_pipe_find(struct wimaxll_handle *,
+				       const char *, size_t);
+struct wimaxll_pipe *wimaxll_pipe_get(struct wimaxll_handle *,
+				      const char *);
+void wimaxll_pipe_release_all(struct wimaxll_handle *);
+void wimaxll_msg_queue_enable(struct wimaxll_handle *);
+int wimaxll_msg_queue_deliver(struct wimaxll_handle *, struct wimaxll_pipe *,
+			      const char *, const void *, size_t);
+ssize_t wimaxll_msg_reader_add(struct wimaxll_handle *,
+			       struct wimaxll_msg_reader *);
+int wimaxll_msg_reader_done(struct wimaxll_handle *,
+			    struct wimaxll_msg_reader *);
+ssize_t wimaxll_msg_reader_del(struct wimaxll_handle *,
+			       struct wimaxll_msg_reader *);
+int wimaxll_msg_queue_unlend(struct wimaxll_handle *, const void *);
+void wimaxll_msg_queue_release_all(struct wimaxll_handle *);
+int wimaxll_sub_msg_to_user(struct wimaxll_handle *, int, const char *,
+			    const void *, size_t);
+int wimaxll_sub_state_change(struct wimaxll_handle *, int,
+			     enum wimax_st, enum wimax_st);
+void wimaxll_sub_release_all(struct wimaxll_handle *);
+void wimaxll_recv_buf_release_all(struct wimaxll_handle *);
+void wimaxll_rx_lock_init(struct wimaxll_handle *);
+void wimaxll_rx_lock_destroy(struct wimaxll_handle *);
+int wimaxll_gnl_cb(struct wimaxll_cb_ctx *, struct nlmsghdr *);
+int wimaxll_rx_shared_attach(struct wimaxll_handle *);
+void wimaxll_rx_shared_detach(struct wimaxll_handle *);
+void wimaxll_rx_shared_put(struct wimaxll_handle *);
+int wimaxll_rx_shared_dispatch(struct wimaxll_cb_ctx *, struct nlmsghdr *);
+int wimaxll_mc_rx_ensure(struct wimaxll_handle *);
+const struct wimaxll_transport_ops *wimaxll_transport_set(
+	const struct wimaxll_transport_ops *);
+const struct wimaxll_transport_ops *wimaxll_transport_get(void);
+ssize_t wimaxll_send(struct wimaxll_handle *, struct nl_msg *);
+struct wimaxll_op *wimaxll_op_send(struct wimaxll_handle *, struct nl_msg *,
+				   wimaxll_op_cb_f, void *, ssize_t *);
+int wimaxll_rx_filter_update(struct wimaxll_handle *);
+void wimaxll_rx_filter_release(struct wimaxll_handle *);
+int wimaxll_gnl_handle_msg_to_user(struct wimaxll_handle *,
+				   struct nlmsghdr *);
+int wimaxll_gnl_handle_state_change(struct wimaxll_handle *,
+				    struct nlmsghdr *);
 int wimaxll_gnl_error_cb(struct sockaddr_nl *, struct nlmsgerr *, void *);
 int wimaxll_gnl_ack_cb(struct nl_msg *msg, void *_mch);
 
@@ -135,5 +884,10 @@ int nl_get_multicast_groups(struct nl_handle *, const char *,
 			    void (*cb)(void *, const char *, int),
 			    void *);
 int genl_ctrl_get_version(struct nl_handle *, const char *);
+int genl_ctrl_get_family(struct nl_handle *, const char *, int *, int *,
+			 void (*cb)(void *, const char *, int), void *);
+
+/* Process-wide cache of generic netlink family information */
+int wimaxll_gnl_cache_lookup(struct wimaxll_handle *);
 
 #endif /* #ifndef __lib_internal_h__ */
@@ -44,6 +44,8 @@
 #include <stdarg.h>
 #include <errno.h>
 #include <assert.h>
+#include <time.h>
+#include <limits.h>
 #include <linux/types.h>
 #include <netlink/msg.h>
 #include <netlink/genl/genl.h>
@@ -86,3 +88,59 @@ size_t wimaxll_states_snprintf(char *str, size_t size)
 				  "%s ", wimax_st_names_vals[itr].name);
 	return bytes;
 }
+
+
+/**
+ * Set a deadline some time from now
+ *
+ * \param deadline Where to store the deadline
+ * \param timeout_ms Milliseconds from now
+ * \return \a deadline
+ *
+ * Deadlines are absolute times on %CLOCK_MONOTONIC, as taken by the
+ * *_deadline() variants of the blocking calls; so a caller that does
+ * several calls in a row can bound the whole sequence with one.
+ *
+ * \ingroup miscellaneous_group
+ */
+struct timespec *wimaxll_deadline_set(struct timespec *deadline,
+				      unsigned timeout_ms)
+{
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	deadline->tv_sec += timeout_ms / 1000;
+	deadline->tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if (deadline->tv_nsec >= 1000000000L) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000L;
+	}
+	return deadline;
+}
+
+
+/**
+ * Return the time left until a deadline, as a poll() timeout
+ *
+ * \internal
+ *
+ * \param deadline Absolute time on %CLOCK_MONOTONIC; NULL for none.
+ * \return milliseconds left (rounded up, so we don't wake up just
+ *     before it and spin); 0 if it passed; -1 if there is no
+ *     deadline.
+ */
+int wimaxll_deadline_ms(const struct timespec *deadline)
+{
+	struct timespec now;
+	long long ns, ms;
+
+	if (deadline == NULL)
+		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ns = (deadline->tv_sec - now.tv_sec) * 1000000000LL
+		+ deadline->tv_nsec - now.tv_nsec;
+	if (ns <= 0)
+		return 0;
+	ms = (ns + 999999) / 1000000;
+	if (ms > INT_MAX)
+		return INT_MAX;
+	return ms;
+}
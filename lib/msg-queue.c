@@ -0,0 +1,543 @@
+/*
+ * Linux WiMAX
+ * Per-pipe queues for messages from the kernel
+ *
+ *
+ * Copyright (C) 2007-2009 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ *
+ * wimaxll_msg_read() waits for a message on one pipe; messages for
+ * other pipes that arrive in the meantime used to be discarded, so
+ * two consumers of different pipes on one handle would lose each
+ * other's traffic. Now each of those messages is copied to a queue
+ * for its pipe, and wimaxll_msg_read() (and
+ * wimaxll_msg_read_borrow()) take from the queue of the pipe they
+ * are asked for before going to the kernel.
+ *
+ * Each message is delivered in a single place, the MSG_TO_USER
+ * handler (wimaxll_gnl_handle_msg_to_user()), by whichever thread
+ * is receiving: if no pipe callback takes it, it is handed to the
+ * first thread waiting in wimaxll_msg_read() for its pipe (or for
+ * %WIMAX_PIPE_ANY) or, if there is none, queued once for its
+ * pipe. Readers register in the handle's list of waiting readers in
+ * the same step in which they find their queue empty, so no message
+ * is left queued while somebody waits for it. The queues, the list
+ * of readers and the list of lent messages are protected by the
+ * handle's \a msg_mutex.
+ *
+ * Each pipe in the handle's registry (lib/pipe.c) has a queue; pipes
+ * are registered when read or, if nobody did, on their first queued
+ * message. Queues are bounded (%WIMAXLL_MSG_QUEUE_DEPTH messages by
+ * default); when one is full,
+ * either the new message or the oldest one is dropped, as set with
+ * wimaxll_msg_queue_set(), and the queue's overflow counter is
+ * incremented (see wimaxll_msg_queue_stats_get()).
+ *
+ * Queued messages are kept in the same buffers wimaxll_msg_read()
+ * hands out (struct wimaxll_msg_buf, from the handle's pool if there
+ * is one), so reading one from a queue doesn't copy it again.
+ *
+ * Queues are fed once wimaxll_msg_read() has been used on the
+ * handle (so messages that arrive between two reads are not lost);
+ * until then, messages only go to the callbacks. A callback set with
+ * wimaxll_set_cb_msg_to_user() still gets all the messages no pipe
+ * callback takes, as before.
+ */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <wimaxll.h>
+#include "internal.h"
+#define D_LOCAL 0
+#include "debug.h"
+
+
+/*
+ * Take the oldest message out of a queue
+ */
+static
+struct wimaxll_msg_buf *wimaxll_msg_queue_pop(struct wimaxll_msg_queue *queue)
+{
+	struct wimaxll_msg_buf *msg_buf = queue->head;
+
+	if (msg_buf == NULL)
+		return NULL;
+	queue->head = msg_buf->next;
+	if (queue->head == NULL)
+		queue->tail = NULL;
+	queue->len--;
+	msg_buf->next = NULL;
+	return msg_buf;
+}
+
+
+/*
+ * Drop the oldest messages until there are at most @len in @queue
+ */
+static
+void wimaxll_msg_queue_trim(struct wimaxll_msg_queue *queue, unsigned len)
+{
+	while (queue->len > len) {
+		wimaxll_msg_free(wimaxll_msg_queue_pop(queue)->data);
+		queue->dropped++;
+	}
+}
+
+
+/*
+ * Queue a copy of a message nobody is waiting for
+ *
+ * Called with the handle's msg_mutex held. Returns 0 if queued,
+ * -ENOBUFS if dropped because the queue is full (or its depth is 0),
+ * -ENOMEM if there is no memory for it.
+ */
+static
+int __wimaxll_msg_queue_put(struct wimaxll_handle *wmx,
+			    struct wimaxll_pipe *pipe,
+			    const void *data, size_t size)
+{
+	int result;
+	struct wimaxll_msg_queue *queue = &pipe->queue;
+	struct wimaxll_msg_buf *msg_buf;
+
+	d_fnstart(5, wmx, "(wmx %p pipe %u data %p size %zu)\n",
+		  wmx, pipe->id, data, size);
+	result = -ENOBUFS;
+	if (queue->depth == 0)
+		goto error_full;
+	if (queue->len >= queue->depth) {
+		if (queue->policy == WIMAXLL_MSG_QUEUE_DROP_NEW)
+			goto error_full;
+		wimaxll_msg_queue_trim(queue, queue->depth - 1);
+	}
+	result = -ENOMEM;
+	msg_buf = wimaxll_msg_buf_alloc(wmx, size);
+	if (msg_buf == NULL)
+		goto error_alloc;
+	memcpy(msg_buf->data, data, size);
+	msg_buf->size = size;
+	msg_buf->seq = wmx->msg_queue_seq++;
+	msg_buf->next = NULL;
+	if (queue->tail != NULL)
+		queue->tail->next = msg_buf;
+	else
+		queue->head = msg_buf;
+	queue->tail = msg_buf;
+	queue->len++;
+	queue->queued++;
+	result = 0;
+	goto out;
+
+error_alloc:
+error_full:
+	queue->dropped++;
+	d_printf(1, wmx, "D: pipe %u: queue full (%u), message dropped\n",
+		 pipe->id, queue->len);
+out:
+	d_fnend(5, wmx, "(wmx %p pipe %u data %p size %zu) = %d\n",
+		wmx, pipe->id, data, size, result);
+	return result;
+}
+
+
+/*
+ * Take the oldest queued message for a pipe
+ *
+ * Called with the handle's msg_mutex held. @pipe is NULL for the
+ * oldest message of all the queues (reading WIMAX_PIPE_ANY). Returns
+ * the message (which the caller owns) or NULL if there is none.
+ */
+static
+struct wimaxll_msg_buf *__wimaxll_msg_queue_get(struct wimaxll_handle *wmx,
+						struct wimaxll_pipe *pipe)
+{
+	unsigned itr;
+	struct wimaxll_msg_queue *queue, *oldest = NULL;
+
+	if (pipe != NULL)
+		return wimaxll_msg_queue_pop(&pipe->queue);
+	for (itr = 0; itr < wimaxll_pipe_count(wmx); itr++) {
+		queue = &wmx->pipes[itr]->queue;
+		if (queue->head != NULL
+		    && (oldest == NULL
+			|| (long) (queue->head->seq - oldest->head->seq) < 0))
+			oldest = queue;
+	}
+	return oldest ? wimaxll_msg_queue_pop(oldest) : NULL;
+}
+
+
+/*
+ * Start feeding the queues
+ *
+ * \internal
+ *
+ * Called when wimaxll_msg_read() or wimaxll_msg_queue_set() are
+ * first used in a handle. MSG_TO_USER messages have to be received
+ * from then on even if there are no callbacks, so the RX filter
+ * might have to change.
+ */
+void wimaxll_msg_queue_enable(struct wimaxll_handle *wmx)
+{
+	if (wmx->msg_queue_enabled)
+		return;
+	wmx->msg_queue_enabled = 1;
+	wimaxll_rx_filter_update(wmx);
+}
+
+
+/*
+ * Hand a message no pipe callback took to a reader or queue it
+ *
+ * \internal
+ *
+ * \param wmx WiMAX device handle
+ * \param pipe Pipe the message arrived on (NULL if not registered;
+ *     it is registered then, so the message can be queued).
+ * \param pipe_name Name of the pipe the message arrived on.
+ * \param data Message payload
+ * \param size Size of \a data
+ * \return 0 if ok, -%EBUSY if the message was lent (pointing into the
+ *     receive buffer) to a thread in wimaxll_msg_read_borrow(); the
+ *     receive buffer has to be kept and processing stopped. The pin
+ *     is set in the handle that owns the receive buffer (see
+ *     wimaxll_rx_wmx()), which might not be \a wmx.
+ *
+ * Called by the MSG_TO_USER handler, once per message. The message
+ * goes to the reader that has been waiting the longest for its pipe
+ * (or for any pipe);
+ * if there is none, a copy is queued for the pipe (or dropped if
+ * the queue is full).
+ */
+int wimaxll_msg_queue_deliver(struct wimaxll_handle *wmx,
+			      struct wimaxll_pipe *pipe,
+			      const char *pipe_name,
+			      const void *data, size_t size)
+{
+	int result = 0;
+	struct wimaxll_msg_reader *reader;
+	struct wimaxll_msg_buf *msg_buf;
+	struct wimaxll_handle *rx_wmx = wimaxll_rx_wmx(wmx);
+
+	if (pipe == NULL)
+		pipe = wimaxll_pipe_get(wmx, pipe_name);
+	pthread_mutex_lock(&wmx->msg_mutex);
+	for (reader = wmx->msg_readers; reader != NULL;
+	     reader = reader->next)
+		if (reader->result == -EINPROGRESS
+		    && (reader->pipe == NULL || reader->pipe == pipe))
+			break;
+	if (reader == NULL) {
+		if (pipe != NULL)
+			__wimaxll_msg_queue_put(wmx, pipe, data, size);
+	} else if (reader->borrow
+		   && wmx->rx_borrowed_count >= WIMAXLL_RX_BORROW_MAX)
+		reader->result = -ENOBUFS;
+	else if (reader->borrow && rx_wmx->rx_pin == 0) {
+		/* The buffer belongs to rx_wmx; wimaxll_recv() moves it
+		 * to our rx_borrowed once done with it */
+		reader->data = (void *) data;
+		reader->result = size;
+		rx_wmx->rx_pin = 1;
+		rx_wmx->rx_pin_wmx = wmx;
+		result = -EBUSY;
+	} else {
+		/* A borrowing reader gets a copy if the buffer is already
+		 * lent to another handle (for the same notification,
+		 * read by the shared receiver) */
+		msg_buf = wimaxll_msg_buf_alloc(wmx, size);
+		if (msg_buf != NULL) {
+			memcpy(msg_buf->data, data, size);
+			msg_buf->size = size;
+			if (reader->borrow) {
+				msg_buf->next = wmx->msg_lent;
+				wmx->msg_lent = msg_buf;
+			}
+			reader->data = msg_buf->data;
+			reader->result = size;
+		} else
+			reader->result = -ENOMEM;
+	}
+	pthread_mutex_unlock(&wmx->msg_mutex);
+	d_printf(3, wmx, "D: pipe %d: message %s\n", pipe ? (int) pipe->id : -1,
+		 reader ? "handed to a reader" : "queued");
+	return result;
+}
+
+
+/*
+ * Start waiting for a message in wimaxll_msg_read()
+ *
+ * \internal
+ *
+ * \param wmx WiMAX device handle
+ * \param reader Reader to add (\a pipe and \a borrow set).
+ * \return the size of the message, if there was one queued for the
+ *     reader's pipe (\a reader->data points to it); -%EINPROGRESS if
+ *     not, and the reader was added to the list of waiting readers
+ *     (remove it with wimaxll_msg_reader_del()).
+ *
+ * A queued message lent to a borrowing reader is kept in the
+ * handle's list of lent messages until wimaxll_msg_release() gives
+ * it back.
+ */
+ssize_t wimaxll_msg_reader_add(struct wimaxll_handle *wmx,
+			       struct wimaxll_msg_reader *reader)
+{
+	ssize_t result;
+	struct wimaxll_msg_buf *msg_buf;
+	struct wimaxll_msg_reader **prev;
+
+	pthread_mutex_lock(&wmx->msg_mutex);
+	msg_buf = __wimaxll_msg_queue_get(wmx, reader->pipe);
+	if (msg_buf != NULL) {
+		if (reader->borrow) {
+			msg_buf->next = wmx->msg_lent;
+			wmx->msg_lent = msg_buf;
+		}
+		reader->data = msg_buf->data;
+		result = msg_buf->size;
+	} else {
+		/* At the end, so readers of a pipe get turns in order */
+		for (prev = &wmx->msg_readers; *prev != NULL;
+		     prev = &(*prev)->next)
+			;
+		reader->result = -EINPROGRESS;
+		reader->next = NULL;
+		*prev = reader;
+		result = -EINPROGRESS;
+	}
+	pthread_mutex_unlock(&wmx->msg_mutex);
+	return result;
+}
+
+
+/*
+ * Return !0 if a message has been handed to a waiting reader
+ *
+ * \internal
+ */
+int wimaxll_msg_reader_done(struct wimaxll_handle *wmx,
+			    struct wimaxll_msg_reader *reader)
+{
+	int done;
+
+	pthread_mutex_lock(&wmx->msg_mutex);
+	done = reader->result != -EINPROGRESS;
+	pthread_mutex_unlock(&wmx->msg_mutex);
+	return done;
+}
+
+
+/*
+ * Stop waiting for a message
+ *
+ * \internal
+ *
+ * \return what was handed to the reader (see struct
+ *     wimaxll_msg_reader); -%EINPROGRESS if nothing was.
+ */
+ssize_t wimaxll_msg_reader_del(struct wimaxll_handle *wmx,
+			       struct wimaxll_msg_reader *reader)
+{
+	ssize_t result;
+	struct wimaxll_msg_reader **prev;
+
+	pthread_mutex_lock(&wmx->msg_mutex);
+	for (prev = &wmx->msg_readers; *prev != NULL; prev = &(*prev)->next)
+		if (*prev == reader) {
+			*prev = reader->next;
+			break;
+		}
+	result = reader->result;
+	pthread_mutex_unlock(&wmx->msg_mutex);
+	return result;
+}
+
+
+/*
+ * Give back a queued message lent by wimaxll_msg_read_borrow()
+ *
+ * \internal
+ *
+ * \return 0 if ok, -%ENOENT if \a buf is not a lent queued message.
+ */
+int wimaxll_msg_queue_unlend(struct wimaxll_handle *wmx, const void *buf)
+{
+	int result = -ENOENT;
+	struct wimaxll_msg_buf **prev, *msg_buf = NULL;
+
+	pthread_mutex_lock(&wmx->msg_mutex);
+	for (prev = &wmx->msg_lent; *prev != NULL; prev = &(*prev)->next) {
+		msg_buf = *prev;
+		if (msg_buf->data != buf)
+			continue;
+		*prev = msg_buf->next;
+		result = 0;
+		break;
+	}
+	pthread_mutex_unlock(&wmx->msg_mutex);
+	if (result == 0)
+		wimaxll_msg_free(msg_buf->data);
+	return result;
+}
+
+
+/*
+ * Empty all the queues and free the queued messages still lent (on
+ * close)
+ *
+ * \internal
+ */
+void wimaxll_msg_queue_release_all(struct wimaxll_handle *wmx)
+{
+	unsigned itr;
+
+	for (itr = 0; itr < wimaxll_pipe_count(wmx); itr++)
+		wimaxll_msg_queue_trim(&wmx->pipes[itr]->queue, 0);
+	while (wmx->msg_lent != NULL)
+		wimaxll_msg_queue_unlend(wmx, wmx->msg_lent->data);
+}
+
+
+/**
+ * Set the depth and overflow policy of the message queue of a pipe
+ *
+ * \param wmx WiMAX device handle
+ * \param pipe_name Pipe whose queue to configure (NULL for the
+ *     default pipe); %WIMAX_PIPE_ANY to configure all the existing
+ *     queues and the ones created from now on.
+ * \param depth Maximum number of messages to keep queued; 0 not to
+ *     queue messages for the pipe (they are discarded, as
+ *     wimaxll_msg_read() used to do).
+ * \param policy What to do when a message arrives and the queue is
+ *     full (enum wimaxll_msg_queue_policy_e).
+ * \return 0 if ok, < 0 errno code on error.
+ *
+ * When a queue is made shorter than the number of messages it
+ * holds, the oldest ones are dropped.
+ *
+ * \ingroup the_messaging_interface
+ */
+int wimaxll_msg_queue_set(struct wimaxll_handle *wmx, const char *pipe_name,
+			  unsigned depth, unsigned policy)
+{
+	int result;
+	unsigned itr, first, last;
+	struct wimaxll_pipe *pipe;
+	struct wimaxll_msg_queue *queue;
+
+	d_fnstart(3, wmx, "(wmx %p pipe_name %s depth %u policy %u)\n",
+		  wmx, pipe_name, depth, policy);
+	result = -EINVAL;
+	if (policy != WIMAXLL_MSG_QUEUE_DROP_NEW
+	    && policy != WIMAXLL_MSG_QUEUE_DROP_OLD)
+		goto error_policy;
+	if (pipe_name == WIMAX_PIPE_ANY) {
+		wmx->msg_queue_depth = depth;
+		wmx->msg_queue_policy = policy;
+		first = 0;
+		last = wimaxll_pipe_count(wmx);
+	} else {
+		result = -ENOMEM;
+		pipe = wimaxll_pipe_get(wmx, pipe_name);
+		if (pipe == NULL)
+			goto error_get;
+		first = pipe->id;
+		last = first + 1;
+	}
+	pthread_mutex_lock(&wmx->msg_mutex);
+	for (itr = first; itr < last; itr++) {
+		queue = &wmx->pipes[itr]->queue;
+		queue->depth = depth;
+		queue->policy = policy;
+		wimaxll_msg_queue_trim(queue, depth);
+	}
+	pthread_mutex_unlock(&wmx->msg_mutex);
+	wimaxll_msg_queue_enable(wmx);
+	result = 0;
+error_get:
+error_policy:
+	d_fnend(3, wmx, "(wmx %p pipe_name %s depth %u policy %u) = %d\n",
+		wmx, pipe_name, depth, policy, result);
+	return result;
+}
+
+
+/**
+ * Return the counters of the message queue of a pipe
+ *
+ * \param wmx WiMAX device handle
+ * \param pipe_name Pipe whose queue to query (NULL for the default
+ *     pipe); %WIMAX_PIPE_ANY to add up all the queues.
+ * \param stats Where to store the counters.
+ * \return 0 if ok, -%ENOENT if the pipe is not registered (it hasn't
+ *     been read and no message has been queued for it).
+ *
+ * \ingroup the_messaging_interface
+ */
+int wimaxll_msg_queue_stats_get(struct wimaxll_handle *wmx,
+				const char *pipe_name,
+				struct wimaxll_msg_queue_stats *stats)
+{
+	unsigned itr;
+	struct wimaxll_pipe *pipe;
+	struct wimaxll_msg_queue *queue;
+
+	memset(stats, 0, sizeof(*stats));
+	if (pipe_name != WIMAX_PIPE_ANY) {
+		pipe = wimaxll_pipe_find(wmx, pipe_name,
+					 pipe_name ? strlen(pipe_name) : 0);
+		if (pipe == NULL)
+			return -ENOENT;
+		queue = &pipe->queue;
+		pthread_mutex_lock(&wmx->msg_mutex);
+		stats->len = queue->len;
+		stats->depth = queue->depth;
+		stats->queued = queue->queued;
+		stats->dropped = queue->dropped;
+		pthread_mutex_unlock(&wmx->msg_mutex);
+		return 0;
+	}
+	stats->depth = wmx->msg_queue_depth;
+	pthread_mutex_lock(&wmx->msg_mutex);
+	for (itr = 0; itr < wimaxll_pipe_count(wmx); itr++) {
+		queue = &wmx->pipes[itr]->queue;
+		stats->len += queue->len;
+		stats->queued += queue->queued;
+		stats->dropped += queue->dropped;
+	}
+	pthread_mutex_unlock(&wmx->msg_mutex);
+	return 0;
+}
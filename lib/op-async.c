@@ -0,0 +1,247 @@
+/*
+ * Linux WiMAX
+ * Non-blocking operations
+ *
+ *
+ * Copyright (C) 2007-2009 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ *
+ * wimaxll_rfkill(), wimaxll_reset(), wimaxll_state_get() and
+ * wimaxll_msg_write() block until the kernel acknowledges the
+ * request. Their *_start() variants (wimaxll_rfkill_start(), etc)
+ * send the request and return an operation object (struct
+ * wimaxll_op) right away, so a single thread can have requests
+ * outstanding on many handles at the same time.
+ *
+ * The request is tracked in the handle's in-flight table, same as
+ * with wimaxll_msg_write_async(); when its ACK is processed (by
+ * wimaxll_tx_recv() when wimaxll_tx_fd() is ready for reading, or by
+ * any other thread reading ACKs on the handle), the operation is
+ * marked complete and its callback called. The caller can also check
+ * for completion with wimaxll_op_poll().
+ *
+ * The *_start() calls never block: if the request's slot in the
+ * in-flight table is still taken (there are already
+ * %WIMAXLL_TX_INFLIGHT_MAX requests waiting for their ACK on the
+ * handle), they fail with \a errno set to %EAGAIN; process some ACKs
+ * (wimaxll_tx_recv()) and try again.
+ *
+ * Operation objects are owned by the caller and have to be released
+ * with wimaxll_op_free(); if that happens before the operation
+ * completes, it is orphaned and released by the library when the ACK
+ * arrives (or the handle is closed).
+ */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <netlink/msg.h>
+#include <netlink/netlink.h>
+#include <wimaxll.h>
+#include "internal.h"
+#define D_LOCAL 0
+#include "debug.h"
+
+
+enum {
+	WIMAXLL_OP_PENDING,
+	WIMAXLL_OP_DONE,
+	WIMAXLL_OP_ORPHAN,
+};
+
+
+/**
+ * An operation started with one of the *_start() calls
+ *
+ * \internal
+ *
+ * \param wmx Handle the request was sent on.
+ * \param seq Sequence number of the request.
+ * \param state %WIMAXLL_OP_PENDING until the ACK arrives, then
+ *     %WIMAXLL_OP_DONE; %WIMAXLL_OP_ORPHAN if freed by the user while
+ *     pending. Changed atomically, as the ACK might be processed by
+ *     another thread.
+ * \param result Result code the kernel passed in the ACK (valid once
+ *     \a state is %WIMAXLL_OP_DONE).
+ * \param cb Completion callback (can be NULL).
+ * \param priv Private pointer for \a cb.
+ */
+struct wimaxll_op {
+	struct wimaxll_handle *wmx;
+	unsigned seq;
+	int state;
+	ssize_t result;
+	wimaxll_op_cb_f cb;
+	void *priv;
+};
+
+
+/*
+ * In-flight table completion callback for operations
+ */
+static
+int wimaxll_op_ack_cb(struct wimaxll_handle *wmx, void *_op,
+		      unsigned seq, ssize_t result)
+{
+	struct wimaxll_op *op = _op;
+	wimaxll_op_cb_f cb = op->cb;
+	void *priv = op->priv;
+
+	d_printf(3, wmx, "D: op %p seq 0x%x completed: %zd\n",
+		 op, seq, result);
+	op->result = result;
+	/* Once it is marked done, the owner might free @op at any
+	 * time (eg: from another thread that polled it); don't touch
+	 * it after */
+	if (!__sync_bool_compare_and_swap(&op->state, WIMAXLL_OP_PENDING,
+					  WIMAXLL_OP_DONE)) {
+		free(op);	/* orphaned */
+		return 0;
+	}
+	if (cb == NULL)
+		return 0;
+	return cb(wmx, op, priv, result);
+}
+
+
+/**
+ * Send a request and return an operation object to track it
+ *
+ * \internal
+ *
+ * \param wmx WiMAX device handle
+ * \param msg Message to send; its sequence number has to be set
+ *     (wimaxll_tx_seq_next()). The caller still owns it.
+ * \param cb Completion callback (can be NULL)
+ * \param priv Private pointer for \a cb
+ * \param _result Set to a negative errno code on error (-%EAGAIN
+ *     if the in-flight table has no room for it).
+ * \return operation object, NULL on error.
+ *
+ * Doesn't block waiting for room in the in-flight table (see
+ * wimaxll_tx_inflight_try_add()).
+ */
+struct wimaxll_op *wimaxll_op_send(struct wimaxll_handle *wmx,
+				   struct nl_msg *msg,
+				   wimaxll_op_cb_f cb, void *priv,
+				   ssize_t *_result)
+{
+	ssize_t result;
+	struct wimaxll_op *op;
+
+	result = -ENOMEM;
+	op = malloc(sizeof(*op));
+	if (op == NULL) {
+		wimaxll_msg(wmx, "E: cannot allocate operation: %m\n");
+		goto error_alloc;
+	}
+	op->wmx = wmx;
+	op->seq = nlmsg_hdr(msg)->nlmsg_seq;
+	op->state = WIMAXLL_OP_PENDING;
+	op->result = 0;
+	op->cb = cb;
+	op->priv = priv;
+	result = wimaxll_tx_inflight_try_add(wmx, op->seq,
+					     wimaxll_op_ack_cb, op);
+	if (result == -EAGAIN) {
+		d_printf(2, wmx, "D: in-flight table full, operation not "
+			 "sent\n");
+		goto error_inflight_add;
+	} else if (result < 0) {
+		wimaxll_msg(wmx, "E: cannot queue operation: %zd\n", result);
+		goto error_inflight_add;
+	}
+	result = wimaxll_send(wmx, msg);
+	if (result < 0) {
+		wimaxll_msg(wmx, "E: error sending message: %zd\n", result);
+		goto error_send;
+	}
+	return op;
+
+error_send:
+	wimaxll_tx_inflight_del(wmx, op->seq);
+error_inflight_add:
+	free(op);
+error_alloc:
+	*_result = result;
+	return NULL;
+}
+
+
+/**
+ * Check if an operation has completed
+ *
+ * \param op Operation object returned by one of the *_start() calls
+ *     (eg: wimaxll_rfkill_start()).
+ * \param result Where to store the result of the operation (the same
+ *     value the blocking version of the call would have returned);
+ *     can be NULL.
+ * \return 0 if the operation has completed, -%EINPROGRESS if it is
+ *     still waiting for the kernel to acknowledge it.
+ *
+ * This doesn't read anything from the kernel; ACKs are processed
+ * with wimaxll_tx_recv() when wimaxll_tx_fd() is ready for reading.
+ *
+ * \ingroup device_management
+ */
+int wimaxll_op_poll(struct wimaxll_op *op, ssize_t *result)
+{
+	if (__sync_fetch_and_add(&op->state, 0) == WIMAXLL_OP_PENDING)
+		return -EINPROGRESS;
+	if (result != NULL)
+		*result = op->result;
+	return 0;
+}
+
+
+/**
+ * Release an operation object
+ *
+ * \param op Operation object returned by one of the *_start() calls
+ *     (eg: wimaxll_rfkill_start()).
+ *
+ * If the operation hasn't completed yet, it is not cancelled (the
+ * request has already been sent to the kernel), but its callback
+ * won't be called and the object will be released when its ACK
+ * arrives or the handle is closed.
+ *
+ * It can be called from the operation's completion callback.
+ *
+ * \ingroup device_management
+ */
+void wimaxll_op_free(struct wimaxll_op *op)
+{
+	if (op == NULL)
+		return;
+	if (__sync_bool_compare_and_swap(&op->state, WIMAXLL_OP_PENDING,
+					 WIMAXLL_OP_ORPHAN))
+		return;
+	free(op);
+}
@@ -51,6 +51,21 @@
  * where \a buf points to where the message is stored. \e PIPE_NAME
  * can be NULL. It is passed verbatim to the receiver.
  *
+ * wimaxll_msg_write() waits for the kernel to acknowledge the message
+ * before returning. To keep many messages in flight, use
+ * wimaxll_msg_write_async() instead; it returns as soon as the
+ * message is sent and a completion callback is called when the ACK
+ * arrives:
+ *
+ * @code
+ *  wimaxll_msg_write_async(wmx, PIPE_NAME, buf, buf_size, my_ack_cb, priv);
+ *  ...
+ *  wimaxll_tx_flush(wmx);	// or wimaxll_tx_recv() when wimaxll_tx_fd() is ready
+ * @endcode
+ *
+ * To send a burst of messages, wimaxll_msg_writev() packs them in a
+ * single datagram and collects all the ACKs in one go.
+ *
  * To wait for a message from the driver:
  *
  * @code
@@ -72,6 +87,36 @@
  *  wimaxll_msg_free(msg);
  * @endcode
  *
+ * For high message rates, there are two ways to avoid the allocation
+ * and copy of each message:
+ *
+ * - wimaxll_msg_pool_set() gives the handle a pool of buffers;
+ *   wimaxll_msg_read() takes them from it and wimaxll_msg_free()
+ *   returns them.
+ *
+ * - wimaxll_msg_read_borrow() returns a pointer to the message in
+ *   the buffer it was received in, with no copy; the caller returns
+ *   it with wimaxll_msg_release(wmx, msg).
+ *
+ * Several consumers can read different pipes on one handle, from
+ * different threads: messages that arrive for a pipe nobody is
+ * reading right now are kept in a bounded queue for their pipe,
+ * which the next read of that pipe takes from.
+ * wimaxll_msg_queue_set() sets the depth and what to drop when full;
+ * wimaxll_msg_queue_stats_get() reports the overflows.
+ *
+ * wimaxll_add_cb_msg_to_user() adds more callbacks for messages,
+ * which are run after the one set with wimaxll_set_cb_msg_to_user();
+ * messages are handed to wimaxll_msg_read() after those have seen
+ * them, so a monitoring callback and a reader can share a handle.
+ *
+ * Pipe names can be registered with wimaxll_pipe_register(), which
+ * returns a small integer ID; each pipe can have its own callback
+ * (wimaxll_pipe_set_cb_msg_to_user()) and callbacks can use
+ * wimaxll_msg_pipe_id() instead of comparing names. Incoming messages
+ * are matched to their pipe with a hash lookup, so subscribing to
+ * many pipes doesn't slow down dispatching.
+ *
  * All functions return negative \a errno codes on error.
  *
  * To integrate message reception into a mainloop, \ref callbacks
@@ -99,6 +144,7 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <time.h>
 #include <assert.h>
 #include <linux/types.h>
 #include <netlink/msg.h>
@@ -141,32 +187,40 @@ struct nla_policy wimaxll_gnl_msg_from_user_policy[WIMAX_GNL_ATTR_MAX + 1] = {
  *
  * \param wmx WiMAX device handle
  * \param mch Pointer to \c struct wimaxll_mc_handle
- * \param msg Pointer to netlink message
+ * \param nl_hdr Pointer to netlink message header
  * \return 0 if ok, < 0 errno code on error
  *
- * wimaxll_recv() calls libnl's nl_recvmsgs() to receive messages;
+ * wimaxll_recv() calls recvmmsg() to receive messages;
  * when a valid message is received, wimax_gnl__cb() that selects a
  * callback to run for each type of message and it will call this
  * function to actually do it. If no message handling callback is set,
  * this is not called.
  *
- * This "netlink" callback will just de-marshall the arguments and
- * call the callback set by the user with wimaxll_set_cb_msg_to_user().
+ * This "netlink" callback will just de-marshall the arguments, look
+ * up the pipe in the handle's registry (lib/pipe.c) and call the
+ * pipe's callback (set with wimaxll_pipe_set_cb_msg_to_user()) or,
+ * if it has none, the one set by the user with
+ * wimaxll_set_cb_msg_to_user() and the subscribers. Messages no pipe
+ * callback takes are then handed to a thread waiting in
+ * wimaxll_msg_read() or queued for it (lib/msg-queue.c); this is the
+ * only place where that is done, so each message is delivered once.
  */
 int wimaxll_gnl_handle_msg_to_user(struct wimaxll_handle *wmx,
-				   struct nl_msg *msg)
+				   struct nlmsghdr *nl_hdr)
 {
 	size_t size;
 	ssize_t result;
-	struct nlmsghdr *nl_hdr;
 	struct genlmsghdr *gnl_hdr;
 	struct nlattr *tb[WIMAX_GNL_ATTR_MAX+1];
 	const char *pipe_name;
-	unsigned dest_ifidx;
+	size_t pipe_name_len;
+	struct wimaxll_pipe *pipe;
+	wimaxll_msg_to_user_cb_f cb;
+	void *priv;
+	unsigned dest_ifidx, rx_ifidx;
 	void *data;
 
-	d_fnstart(7, wmx, "(wmx %p msg %p)\n", wmx, msg);
-	nl_hdr = nlmsg_hdr(msg);
+	d_fnstart(7, wmx, "(wmx %p nl_hdr %p)\n", wmx, nl_hdr);
 	gnl_hdr = nlmsg_data(nl_hdr);
 
 	assert(gnl_hdr->cmd == WIMAX_GNL_OP_MSG_TO_USER);
@@ -202,10 +256,26 @@ int wimaxll_gnl_handle_msg_to_user(struct wimaxll_handle *wmx,
 	size = nla_len(tb[WIMAX_GNL_MSG_DATA]);
 	data = nla_data(tb[WIMAX_GNL_MSG_DATA]);
 
-	if (tb[WIMAX_GNL_MSG_PIPE_NAME])
+	if (tb[WIMAX_GNL_MSG_PIPE_NAME]) {
 		pipe_name = nla_get_string(tb[WIMAX_GNL_MSG_PIPE_NAME]);
-	else
+		pipe_name_len = strnlen(pipe_name,
+					nla_len(tb[WIMAX_GNL_MSG_PIPE_NAME]));
+	} else {
 		pipe_name = NULL;
+		pipe_name_len = 0;
+	}
+	pipe = wimaxll_pipe_find(wmx, pipe_name, pipe_name_len);
+	if (pipe != NULL && pipe->cb != NULL) {
+		cb = pipe->cb;
+		priv = pipe->priv;
+	} else {
+		cb = wmx->msg_to_user_cb;
+		priv = wmx->msg_to_user_priv;
+	}
+	result = 0;
+	if (cb == NULL && wmx->sub_count[WIMAXLL_SUB_MSG_TO_USER] == 0
+	    && !wmx->msg_queue_enabled)
+		goto error_no_cb;	/* only pipes with their own callback */
 
 	d_printf(1, wmx, "D: CRX genlmsghdr cmd %u version %u\n",
 		 gnl_hdr->cmd, gnl_hdr->version);
@@ -213,97 +283,126 @@ int wimaxll_gnl_handle_msg_to_user(struct wimaxll_handle *wmx,
 		 size, pipe_name);
 	d_dump(2, wmx, data, size);
 
-	/* If this is an "any" handle, set the wmx->ifidx to the
-	 * received one so the callback can now where did the thing
-	 * come from. Will be restored.
-	 */
-	if (wmx->ifidx == 0) {
-		wmx->ifidx = dest_ifidx;
-		dest_ifidx = 0;
+	/* If this is an "any" handle, let the callback know where
+	 * did the thing come from (see wimaxll_ifidx()) */
+	rx_ifidx = wimaxll_rx_ifidx_set(wmx, dest_ifidx);
+	/* Now execute the callback for handling msg-to-user and, if
+	 * it's not a pipe's own, the subscribers */
+	wmx->rx_pipe_id = pipe ? (int) pipe->id : -ENOENT;
+	if (cb != NULL)
+		result = cb(wmx, priv, pipe_name, data, size);
+	if (pipe == NULL || pipe->cb == NULL) {
+		result = wimaxll_sub_msg_to_user(wmx, result, pipe_name,
+						 data, size);
+		if (wmx->msg_queue_enabled
+		    && wimaxll_msg_queue_deliver(wmx, pipe, pipe_name,
+						 data, size) == -EBUSY)
+			result = -EBUSY;
 	}
-	/* Now execute the callback for handling msg-to-user */
-	result = wmx->msg_to_user_cb(wmx, wmx->msg_to_user_priv,
-				     pipe_name, data, size);
-	wmx->ifidx = dest_ifidx;
+	wimaxll_rx_ifidx_set(wmx, rx_ifidx);
+error_no_cb:
 error_no_attrs:
 error_parse:
-	d_fnend(7, wmx, "(wmx %p msg %p) = %zd\n", wmx, msg, result);
+	d_fnend(7, wmx, "(wmx %p nl_hdr %p) = %zd\n", wmx, nl_hdr, result);
 	return result;
 }
 
 
-struct wimaxll_cb_msg_to_user_context {
-	struct wimaxll_cb_ctx ctx;
-	void *data;
-};
+/*
+ * Get a buffer for a message to be returned by wimaxll_msg_read()
+ * (or queued for it)
+ *
+ * If the handle has a pool and the message fits, take a buffer from
+ * it (allocating a new one if we are still under the limit);
+ * otherwise use the heap.
+ */
+struct wimaxll_msg_buf *wimaxll_msg_buf_alloc(struct wimaxll_handle *wmx,
+					      size_t size)
+{
+	struct wimaxll_msg_pool *pool = wmx->msg_pool;
+	struct wimaxll_msg_buf *msg_buf = NULL;
+
+	if (pool == NULL || size > pool->obj_size)
+		goto heap;
+	if (pool->cache == NULL)
+		pool->cache = __sync_lock_test_and_set(&pool->free_list, NULL);
+	if (pool->cache != NULL) {
+		msg_buf = pool->cache;
+		pool->cache = msg_buf->next;
+	} else if (pool->objs < pool->objs_max) {
+		msg_buf = malloc(sizeof(*msg_buf) + pool->obj_size);
+		if (msg_buf != NULL)
+			pool->objs++;
+	}
+	if (msg_buf == NULL)
+		goto heap;
+	msg_buf->pool = pool;
+	__sync_add_and_fetch(&pool->refcount, 1);
+	return msg_buf;
+
+heap:
+	msg_buf = malloc(sizeof(*msg_buf) + size);
+	if (msg_buf != NULL)
+		msg_buf->pool = NULL;
+	return msg_buf;
+}
 
 
 /*
- * Default handling of messages
+ * Find the pipe wimaxll_msg_read() was asked to read
  *
- * When someone calls wimaxll_msg_read() those functions set this
- * default callback, which will just copy the data to a buffer and
- * pass that pointer to the caller along with the size.
+ * It is registered if it wasn't, so that the pipe of each message
+ * can be matched by ID. *@pipe is set to NULL for WIMAX_PIPE_ANY.
  */
 static
-int wimaxll_msg_read_cb(struct wimaxll_handle *wmx,
-			void *_ctx,
-			const char *pipe_name,
-			const void *data, size_t data_size)
+int wimaxll_msg_read_pipe(struct wimaxll_handle *wmx, const char *pipe_name,
+			  struct wimaxll_pipe **pipe)
 {
 	int result;
-	struct wimaxll_cb_ctx *ctx = _ctx;
-	struct wimaxll_cb_msg_to_user_context *mtu_ctx =
-		wimaxll_container_of(
-			ctx, struct wimaxll_cb_msg_to_user_context, ctx);
-	const char *dst_pipe_name = mtu_ctx->data;
-	int pipe_match;
-
-	d_fnstart(3, wmx, "(wmx %p ctx %p pipe_name %s data %p size %zd)\n",
-		  wmx, ctx, pipe_name, data, data_size);
-
-	result = -EBUSY;
-	if (mtu_ctx->ctx.result != -EINPROGRESS)
-		goto out;
-	/*
-	 * Is there a match in requested pipes? (dst_pipe_name ==
-	 * WIMAX_PIPE_ANY), * messages for any pipe work.
-	 *
-	 * This way of checking makes it kind of easier to read...if
-	 * the user requests messages from the default pipe (pipe_name
-	 * == NULL), we want only those. Sucks strcmp doesn't take
-	 * NULLs :)
-	 */
-	d_printf(3, wmx, "dst_pipe_name %s\n", dst_pipe_name);
-
-	if (dst_pipe_name == WIMAX_PIPE_ANY)
-		pipe_match = 1;
-	else if (dst_pipe_name == NULL && pipe_name == NULL)
-		pipe_match = 1;
-	else if ((dst_pipe_name == NULL && pipe_name != NULL)
-		 || (dst_pipe_name != NULL && pipe_name == NULL))
-		pipe_match = 0;
-	else if (strcmp(dst_pipe_name, pipe_name) == 0)
-		pipe_match = 1;
-	else
-		pipe_match = 0;
-
-	result = -EINPROGRESS;
-	if (pipe_match == 0)	/* Not addressed to us */
-		goto out;
 
-	mtu_ctx->data = malloc(data_size);
-	if (mtu_ctx->data) {
-		memcpy(mtu_ctx->data, data, data_size);
-		ctx->result = data_size;
-	} else
-		ctx->result = -ENOMEM;
-	/* Now tell wimaxll_recv() [the callback dispatcher] to stop
-	 * and return control to the caller */
-	result = -EBUSY;
-out:
-	d_fnend(3, wmx, "(wmx %p ctx %p pipe_name %s data %p size %zd) = %d\n",
-		wmx, ctx, pipe_name, data, data_size, result);
+	*pipe = NULL;
+	wimaxll_msg_queue_enable(wmx);
+	if (pipe_name == WIMAX_PIPE_ANY)
+		return 0;
+	result = wimaxll_pipe_register(wmx, pipe_name);
+	if (result < 0) {
+		wimaxll_msg(wmx, "E: cannot register pipe %s: %d\n",
+			    pipe_name, result);
+		return result;
+	}
+	*pipe = wmx->pipes[result];
+	return 0;
+}
+
+
+/*
+ * Get a message for @reader: take it from its pipe's queue or,
+ * if there is none, loop receiving until one is handed to it (or
+ * @deadline passes, if not NULL)
+ *
+ * Whichever thread is receiving (us or another one) hands it over in
+ * wimaxll_msg_queue_deliver().
+ */
+static
+ssize_t wimaxll_msg_read_wait(struct wimaxll_handle *wmx,
+			      struct wimaxll_msg_reader *reader,
+			      const struct timespec *deadline)
+{
+	ssize_t result, read_result;
+
+	result = wimaxll_msg_reader_add(wmx, reader);
+	if (result != -EINPROGRESS)
+		return result;
+	result = 0;
+	while (result >= 0 && !wimaxll_msg_reader_done(wmx, reader)) {
+		result = wimaxll_recv_deadline(wmx, deadline);
+		d_printf(3, wmx, "I: result %zd\n", result);
+	}
+	/* Something might have been handed to us even if receiving
+	 * failed or timed out; don't lose it */
+	read_result = wimaxll_msg_reader_del(wmx, reader);
+	if (read_result != -EINPROGRESS || result >= 0)
+		result = read_result;
 	return result;
 }
 
@@ -326,94 +425,288 @@ out:
  * library and owned by the caller. When done, it has to be freed with
  * wimaxll_msg_free() to release the space allocated to it.
  *
+ * Once this has been called on a handle, messages for pipes nobody
+ * is reading are queued for them (see wimaxll_msg_queue_set()); if
+ * there is one queued for this pipe, it is returned right away.
+ * Several threads can read at the same time; each message goes to
+ * only one of them.
+ *
  * \note This is a blocking call.
  *
  * \ingroup the_messaging_interface
- *
- * \internal
- *
- * We use the data pointer of the context structure to pass the
- * pipe_name to the callback. This is ok, as we process only one
- * message and then return.
  */
 ssize_t wimaxll_msg_read(struct wimaxll_handle *wmx,
 			 const char *pipe_name, void **buf)
+{
+	return wimaxll_msg_read_deadline(wmx, pipe_name, buf, NULL);
+}
+
+
+/**
+ * Same as wimaxll_msg_read(), but giving up at a deadline
+ *
+ * \param wmx WiMAX device handle
+ * \param pipe_name Same as for wimaxll_msg_read().
+ * \param buf Somewhere where to store the pointer to the message data.
+ * \param deadline Absolute time (%CLOCK_MONOTONIC, see
+ *     wimaxll_deadline_set()) when to give up waiting; NULL to wait
+ *     for as long as it takes.
+ * \return Same as wimaxll_msg_read(); -%ETIMEDOUT if no message
+ *     arrived for the pipe before the deadline.
+ *
+ * \ingroup the_messaging_interface
+ */
+ssize_t wimaxll_msg_read_deadline(struct wimaxll_handle *wmx,
+				  const char *pipe_name, void **buf,
+				  const struct timespec *deadline)
 {
 	ssize_t result;
-	struct wimaxll_cb_msg_to_user_context mtu_ctx = {
-		.ctx = WIMAXLL_CB_CTX_INIT(wmx),
-		.data = (void *) pipe_name,
-	};
-	wimaxll_msg_to_user_cb_f prev_cb = NULL;
-	void *prev_priv = NULL;
+	struct wimaxll_msg_reader reader = { .borrow = 0 };
 
 	d_fnstart(3, wmx, "(wmx %p pipe_name %s, buf %p)\n",
 		  wmx, pipe_name, buf);
-	wimaxll_get_cb_msg_to_user(wmx, &prev_cb, &prev_priv);
-	wimaxll_set_cb_msg_to_user(wmx, wimaxll_msg_read_cb,
-				   &mtu_ctx.ctx);
-	do {
-		/* Loop until we get a message in the desired pipe */
-		result = wimaxll_recv(wmx);
-		d_printf(3, wmx, "I: mtu_ctx.result %zd result %zd\n",
-			 mtu_ctx.ctx.result, result);
-	} while (result >= 0 && mtu_ctx.ctx.result == -EINPROGRESS);
-	if (result >= 0) {
-		*buf = mtu_ctx.data;
-		result = mtu_ctx.ctx.result;
-	}
-	wimaxll_set_cb_msg_to_user(wmx, prev_cb, prev_priv);
+	result = wimaxll_msg_read_pipe(wmx, pipe_name, &reader.pipe);
+	if (result < 0)
+		goto error_pipe;
+	result = wimaxll_msg_read_wait(wmx, &reader, deadline);
+	if (result >= 0)
+		*buf = reader.data;
+error_pipe:
+	d_fnend(3, wmx, "(wmx %p pipe_name %s buf %p) = %zd\n",
+		wmx, pipe_name, buf, result);
+	return result;
+}
+
+
+/**
+ * Read a message from any WiMAX kernel-user pipe without copying it
+ *
+ * \param wmx WiMAX device handle
+ * \param pipe_name Name of the pipe for which we want to read a
+ *     message; same as in wimaxll_msg_read().
+ * \param buf Somewhere where to store the pointer to the message data.
+ * \return If successful, a positive (and \c *buf set) or zero size of
+ *     the message; on error, a negative \a errno code (\c buf
+ *     n/a). -%ENOBUFS if there are already %WIMAXLL_RX_BORROW_MAX
+ *     messages that have not been released.
+ *
+ * Same as wimaxll_msg_read(), but \c *buf points straight into the
+ * buffer where the message was received from the kernel, so no
+ * memory is allocated or copied. The data is owned by the library
+ * and lent to the caller, who has to return it with
+ * wimaxll_msg_release() when done (and not with
+ * wimaxll_msg_free()). Borrowed messages are valid until released or
+ * until the handle is closed.
+ *
+ * \note This is a blocking call.
+ *
+ * \ingroup the_messaging_interface
+ */
+ssize_t wimaxll_msg_read_borrow(struct wimaxll_handle *wmx,
+				const char *pipe_name, const void **buf)
+{
+	ssize_t result;
+	struct wimaxll_msg_reader reader = { .borrow = 1 };
+
+	d_fnstart(3, wmx, "(wmx %p pipe_name %s, buf %p)\n",
+		  wmx, pipe_name, buf);
+	result = wimaxll_msg_read_pipe(wmx, pipe_name, &reader.pipe);
+	if (result < 0)
+		goto error_pipe;
+	result = -ENOBUFS;
+	if (wmx->rx_borrowed_count >= WIMAXLL_RX_BORROW_MAX)
+		goto error_no_slots;
+	result = wimaxll_msg_read_wait(wmx, &reader, NULL);
+	if (result >= 0)
+		*buf = reader.data;
+error_no_slots:
+error_pipe:
 	d_fnend(3, wmx, "(wmx %p pipe_name %s buf %p) = %zd\n",
 		wmx, pipe_name, buf, result);
 	return result;
 }
 
 
+/**
+ * Return a message lent by wimaxll_msg_read_borrow()
+ *
+ * \param wmx WiMAX device handle the message was read from
+ * \param buf Message pointer returned by wimaxll_msg_read_borrow().
+ *
+ * \ingroup the_messaging_interface
+ */
+void wimaxll_msg_release(struct wimaxll_handle *wmx, const void *buf)
+{
+	unsigned itr;
+	struct wimaxll_rx_buf *rx_buf;
+
+	d_fnstart(3, wmx, "(wmx %p buf %p)\n", wmx, buf);
+	pthread_mutex_lock(&wmx->rx_mutex);
+	for (itr = 0; itr < WIMAXLL_RX_BORROW_MAX; itr++) {
+		rx_buf = &wmx->rx_borrowed[itr];
+		if (rx_buf->buf == NULL
+		    || (const char *) buf < (const char *) rx_buf->buf
+		    || (const char *) buf >= (const char *) rx_buf->buf
+						+ rx_buf->size)
+			continue;
+		free(rx_buf->buf);
+		rx_buf->buf = NULL;
+		wmx->rx_borrowed_count--;
+		break;
+	}
+	pthread_mutex_unlock(&wmx->rx_mutex);
+	if (itr < WIMAXLL_RX_BORROW_MAX)
+		goto out;
+	if (wimaxll_msg_queue_unlend(wmx, buf) == 0)
+		goto out;
+	wimaxll_msg(wmx, "E: %s: %p was not lent by this handle\n",
+		    __func__, buf);
+out:
+	d_fnend(3, wmx, "(wmx %p buf %p) = void\n", wmx, buf);
+}
+
+
+/*
+ * Release all the receive buffers that are still lent (on close)
+ */
+void wimaxll_msg_borrowed_release_all(struct wimaxll_handle *wmx)
+{
+	unsigned itr;
+
+	for (itr = 0; itr < WIMAXLL_RX_BORROW_MAX; itr++) {
+		free(wmx->rx_borrowed[itr].buf);
+		wmx->rx_borrowed[itr].buf = NULL;
+	}
+	wmx->rx_borrowed_count = 0;
+}
+
+
 /**
  * Free a message received with wimaxll_msg_read()
  *
  * \param msg message pointer returned by wimaxll_msg_read().
  *
+ * If the message came from a pool (see wimaxll_msg_pool_set()), it
+ * is returned to it; this can be done from any thread, even after
+ * the handle has been closed.
+ *
  * \ingroup the_messaging_interface
  */
 void wimaxll_msg_free(void *msg)
 {
+	struct wimaxll_msg_buf *msg_buf;
+	struct wimaxll_msg_pool *pool;
+
 	d_fnstart(3, NULL, "(msg %p)\n", msg);
-	free(msg);
+	if (msg == NULL)
+		goto out;
+	msg_buf = wimaxll_container_of(msg, struct wimaxll_msg_buf, data);
+	pool = msg_buf->pool;
+	if (pool == NULL) {
+		free(msg_buf);
+		goto out;
+	}
+	do
+		msg_buf->next = pool->free_list;
+	while (!__sync_bool_compare_and_swap(&pool->free_list,
+					     msg_buf->next, msg_buf));
+	wimaxll_msg_pool_put(pool);
+out:
 	d_fnend(3, NULL, "(msg %p) = void\n", msg);
 }
 
 
+/*
+ * Drop a reference to a message pool, releasing it if it was the
+ * last one.
+ */
+void wimaxll_msg_pool_put(struct wimaxll_msg_pool *pool)
+{
+	struct wimaxll_msg_buf *msg_buf, *next;
+
+	if (pool == NULL
+	    || __sync_sub_and_fetch(&pool->refcount, 1) > 0)
+		return;
+	for (msg_buf = pool->cache; msg_buf != NULL; msg_buf = next) {
+		next = msg_buf->next;
+		free(msg_buf);
+	}
+	for (msg_buf = pool->free_list; msg_buf != NULL; msg_buf = next) {
+		next = msg_buf->next;
+		free(msg_buf);
+	}
+	free(pool);
+}
+
+
 /**
- * Send a driver-specific message to a WiMAX device
+ * Set up a pool of buffers for messages read with wimaxll_msg_read()
  *
- * \param wmx wimax device descriptor
- * \param pipe_name Name of the pipe for which to send the message;
- *     NULL means adding no destination pipe.
- * \param buf Pointer to the message.
- * \param size size of the message.
- * \return 0 if ok < 0 errno code on error. On error it is assumed
- *     the message wasn't delivered.
+ * \param wmx WiMAX device handle
+ * \param obj_size Size of each buffer in the pool; messages bigger
+ *     than this will still be allocated from the heap. 0 disables the
+ *     pool.
+ * \param objs_max Maximum number of buffers in the pool; when they
+ *     are all in use by the application, messages will be allocated
+ *     from the heap.
+ * \return 0 if ok, < 0 errno code on error.
  *
- * Sends a data buffer down to the kernel driver. The format of the
- * message is driver specific.
+ * By default, each message returned by wimaxll_msg_read() is
+ * allocated from the heap and freed by wimaxll_msg_free(). With a
+ * pool, wimaxll_msg_free() returns the buffer to the pool and the
+ * next wimaxll_msg_read() reuses it, so after warming up there is no
+ * allocator traffic.
  *
- * \note This is a blocking call
+ * Buffers are allocated on demand. Messages read before changing the
+ * pool can still be freed with wimaxll_msg_free(); the old pool is
+ * released when the last of them is.
  *
  * \ingroup the_messaging_interface
  */
-ssize_t wimaxll_msg_write(struct wimaxll_handle *wmx,
-			  const char *pipe_name,
-			  const void *buf, size_t size)
+int wimaxll_msg_pool_set(struct wimaxll_handle *wmx, size_t obj_size,
+			 unsigned objs_max)
+{
+	int result;
+	struct wimaxll_msg_pool *pool = NULL;
+
+	d_fnstart(3, wmx, "(wmx %p obj_size %zu objs_max %u)\n",
+		  wmx, obj_size, objs_max);
+	if (obj_size > 0 && objs_max > 0) {
+		result = -ENOMEM;
+		pool = calloc(1, sizeof(*pool));
+		if (pool == NULL)
+			goto error_alloc;
+		pool->refcount = 1;
+		pool->obj_size = obj_size;
+		pool->objs_max = objs_max;
+	}
+	wimaxll_msg_pool_put(wmx->msg_pool);
+	wmx->msg_pool = pool;
+	result = 0;
+error_alloc:
+	d_fnend(3, wmx, "(wmx %p obj_size %zu objs_max %u) = %d\n",
+		wmx, obj_size, objs_max, result);
+	return result;
+}
+
+
+/*
+ * Allocate and fill out a MSG_FROM_USER generic netlink message
+ *
+ * \param seq sequence number to use (or NL_AUTO_SEQ)
+ *
+ * Returns NULL on error with *_result set to a negative errno code.
+ */
+static
+struct nl_msg *wimaxll_msg_prep(struct wimaxll_handle *wmx, unsigned seq,
+				const char *pipe_name,
+				const void *buf, size_t size,
+				ssize_t *_result)
 {
 	ssize_t result;
 	struct nl_msg *nl_msg;
 	void *msg;
 
-	d_fnstart(3, wmx, "(wmx %p buf %p size %zu)\n", wmx, buf, size);
-	result = -EBADF;
-	if (wmx->ifidx == 0)
-		goto error_not_any;
 	nl_msg = nlmsg_new();
 	if (nl_msg == NULL) {
 		result = nl_get_errno();
@@ -421,7 +714,7 @@ ssize_t wimaxll_msg_write(struct wimaxll_handle *wmx,
 			  "message: %m\n");
 		goto error_msg_alloc;
 	}
-	msg = genlmsg_put(nl_msg, NL_AUTO_PID, NL_AUTO_SEQ,
+	msg = genlmsg_put(nl_msg, NL_AUTO_PID, seq,
 			  wimaxll_family_id(wmx), 0, 0,
 			  WIMAX_GNL_OP_MSG_FROM_USER, WIMAX_GNL_VERSION);
 	if (msg == NULL) {
@@ -431,7 +724,8 @@ ssize_t wimaxll_msg_write(struct wimaxll_handle *wmx,
 		goto error_msg_prep;
 	}
 
-	nla_put_u32(nl_msg, WIMAX_GNL_MSG_IFIDX, (__u32) wmx->ifidx);
+	nla_put_u32(nl_msg, WIMAX_GNL_MSG_IFIDX,
+		    (__u32) wimaxll_ifidx(wmx));
 	if (pipe_name != NULL)
 		nla_put_string(nl_msg, WIMAX_GNL_MSG_PIPE_NAME, pipe_name);
 	nla_put(nl_msg, WIMAX_GNL_MSG_DATA, size, buf);
@@ -441,21 +735,93 @@ ssize_t wimaxll_msg_write(struct wimaxll_handle *wmx,
 	       sizeof(struct nlmsghdr) + sizeof(struct genlmsghdr));
 	d_printf(5, wmx, "D: CTX wimax message:\n");
 	d_dump(5, wmx, buf, size);
+	return nl_msg;
+
+error_msg_prep:
+	nlmsg_free(nl_msg);
+error_msg_alloc:
+	*_result = result;
+	return NULL;
+}
+
 
-	result = nl_send_auto_complete(wmx->nlh_tx, nl_msg);
+/**
+ * Send a driver-specific message to a WiMAX device
+ *
+ * \param wmx wimax device descriptor
+ * \param pipe_name Name of the pipe for which to send the message;
+ *     NULL means adding no destination pipe.
+ * \param buf Pointer to the message.
+ * \param size size of the message.
+ * \return 0 if ok < 0 errno code on error. On error it is assumed
+ *     the message wasn't delivered.
+ *
+ * Sends a data buffer down to the kernel driver. The format of the
+ * message is driver specific.
+ *
+ * \note This is a blocking call
+ *
+ * \ingroup the_messaging_interface
+ */
+ssize_t wimaxll_msg_write(struct wimaxll_handle *wmx,
+			  const char *pipe_name,
+			  const void *buf, size_t size)
+{
+	return wimaxll_msg_write_deadline(wmx, pipe_name, buf, size, NULL);
+}
+
+
+/**
+ * Same as wimaxll_msg_write(), but giving up at a deadline
+ *
+ * \param wmx WiMAX device handle
+ * \param pipe_name Same as for wimaxll_msg_write().
+ * \param buf Pointer to the message.
+ * \param size size of the message.
+ * \param deadline Absolute time (%CLOCK_MONOTONIC, see
+ *     wimaxll_deadline_set()) when to give up waiting for the device;
+ *     NULL to wait for as long as it takes.
+ * \return Same as wimaxll_msg_write(); -%ETIMEDOUT if the
+ *     deadline passed before the kernel answered (the operation
+ *     might still complete later).
+ *
+ * \ingroup the_messaging_interface
+ */
+ssize_t wimaxll_msg_write_deadline(struct wimaxll_handle *wmx,
+				   const char *pipe_name,
+				   const void *buf, size_t size,
+				   const struct timespec *deadline)
+{
+	ssize_t result;
+	struct nl_msg *nl_msg;
+	struct wimaxll_tx_waiter waiter;
+	unsigned seq;
+
+	d_fnstart(3, wmx, "(wmx %p buf %p size %zu)\n", wmx, buf, size);
+	result = -EBADF;
+	if (wimaxll_ifidx(wmx) == 0)
+		goto error_not_any;
+	seq = wimaxll_tx_seq_next(wmx);
+	nl_msg = wimaxll_msg_prep(wmx, seq, pipe_name, buf, size, &result);
+	if (nl_msg == NULL)
+		goto error_msg_prep;
+
+	wimaxll_tx_waiter_add(wmx, &waiter, seq);
+	result = wimaxll_send(wmx, nl_msg);
 	if (result < 0) {
+		wimaxll_tx_waiter_del(wmx, &waiter);
 		wimaxll_msg(wmx, "E: error sending message: %zd\n", result);
 		goto error_msg_send;
 	}
 
-	result = wimaxll_wait_for_ack(wmx);	/* Get the ACK from netlink */
+	/* Get the ACK from netlink */
+	result = wimaxll_wait_for_ack(wmx, &waiter, deadline);
 	if (result < 0)
 		wimaxll_msg(wmx, "E: %s: generic netlink ack failed: %zd\n",
 			  __func__, result);
 error_msg_send:
-error_msg_prep:
 	nlmsg_free(nl_msg);
-error_msg_alloc:
+error_msg_prep:
 error_not_any:
 	d_fnend(3, wmx, "(wmx %p buf %p size %zu) = %zd\n",
 		wmx, buf, size, result);
@@ -463,6 +829,303 @@ error_not_any:
 }
 
 
+/**
+ * Send a driver-specific message to a WiMAX device without waiting
+ * for it to be acknowledged
+ *
+ * \param wmx wimax device descriptor
+ * \param pipe_name Name of the pipe for which to send the message;
+ *     NULL means adding no destination pipe.
+ * \param buf Pointer to the message.
+ * \param size size of the message.
+ * \param cb Function to call when the kernel acknowledges the
+ *     message (or reports an error); can be NULL, in which case
+ *     errors are only logged.
+ * \param priv Private pointer to pass to \a cb.
+ * \return 0 if ok < 0 errno code on error. On error it is assumed
+ *     the message wasn't delivered and \a cb won't be called.
+ *
+ * Same as wimaxll_msg_write(), but returns as soon as the message is
+ * sent, so many messages can be outstanding at the same time. Each
+ * message is tracked by its netlink sequence number; when its ACK is
+ * received by wimaxll_tx_recv() or wimaxll_tx_flush() (or while
+ * waiting for the ACK of a synchronous operation on the same handle,
+ * maybe in another thread), \a cb is called with the result the kernel passed in the ACK. When
+ * the handle is closed, callbacks for messages still in flight are
+ * called with -%ECANCELED.
+ *
+ * Up to %WIMAXLL_TX_INFLIGHT_MAX messages can be in flight; when the
+ * window is full, this call will block processing ACKs until there is
+ * space for a new one.
+ *
+ * \ingroup the_messaging_interface
+ */
+ssize_t wimaxll_msg_write_async(struct wimaxll_handle *wmx,
+				const char *pipe_name,
+				const void *buf, size_t size,
+				wimaxll_ack_cb_f cb, void *priv)
+{
+	ssize_t result;
+	struct nl_msg *nl_msg;
+	unsigned seq;
+
+	d_fnstart(3, wmx, "(wmx %p buf %p size %zu cb %p priv %p)\n",
+		  wmx, buf, size, cb, priv);
+	result = -EBADF;
+	if (wimaxll_ifidx(wmx) == 0)
+		goto error_not_any;
+	seq = wimaxll_tx_seq_next(wmx);
+	nl_msg = wimaxll_msg_prep(wmx, seq, pipe_name, buf, size, &result);
+	if (nl_msg == NULL)
+		goto error_msg_prep;
+	result = wimaxll_tx_inflight_add(wmx, seq, cb, priv);
+	if (result < 0) {
+		wimaxll_msg(wmx, "E: %s: cannot queue message: %zd\n",
+			    __func__, result);
+		goto error_inflight_add;
+	}
+	result = wimaxll_send(wmx, nl_msg);
+	if (result < 0) {
+		wimaxll_msg(wmx, "E: error sending message: %zd\n", result);
+		wimaxll_tx_inflight_del(wmx, seq);
+		goto error_msg_send;
+	}
+	result = 0;
+error_msg_send:
+error_inflight_add:
+	nlmsg_free(nl_msg);
+error_msg_prep:
+error_not_any:
+	d_fnend(3, wmx, "(wmx %p buf %p size %zu cb %p priv %p) = %zd\n",
+		wmx, buf, size, cb, priv, result);
+	return result;
+}
+
+
+/**
+ * Start sending a driver-specific message to a WiMAX device and
+ * return an operation object to track it
+ *
+ * \param wmx wimax device descriptor
+ * \param pipe_name Name of the pipe for which to send the message;
+ *     NULL means adding no destination pipe.
+ * \param buf Pointer to the message.
+ * \param size size of the message.
+ * \param cb Function to call when the operation completes (with what
+ *     wimaxll_msg_write() would have returned); can be NULL.
+ * \param priv Private pointer to pass to \a cb.
+ * \return operation object to check with wimaxll_op_poll() and
+ *     release with wimaxll_op_free(); NULL on error, with \a errno
+ *     set (%EAGAIN if too many requests are in flight, see
+ *     wimaxll_rfkill_start()).
+ *
+ * Non-blocking version of wimaxll_msg_write(); see
+ * wimaxll_rfkill_start() for the device management operations.
+ *
+ * \ingroup the_messaging_interface
+ */
+struct wimaxll_op *wimaxll_msg_write_start(struct wimaxll_handle *wmx,
+					   const char *pipe_name,
+					   const void *buf, size_t size,
+					   wimaxll_op_cb_f cb, void *priv)
+{
+	ssize_t result;
+	struct nl_msg *nl_msg;
+	struct wimaxll_op *op = NULL;
+
+	d_fnstart(3, wmx, "(wmx %p buf %p size %zu cb %p priv %p)\n",
+		  wmx, buf, size, cb, priv);
+	result = -EBADF;
+	if (wimaxll_ifidx(wmx) == 0)
+		goto error_not_any;
+	nl_msg = wimaxll_msg_prep(wmx, wimaxll_tx_seq_next(wmx), pipe_name,
+				  buf, size, &result);
+	if (nl_msg == NULL)
+		goto error_msg_prep;
+	op = wimaxll_op_send(wmx, nl_msg, cb, priv, &result);
+	nlmsg_free(nl_msg);
+error_msg_prep:
+error_not_any:
+	if (op == NULL)
+		errno = -result;
+	d_fnend(3, wmx, "(wmx %p buf %p size %zu cb %p priv %p) = %p\n",
+		wmx, buf, size, cb, priv, op);
+	return op;
+}
+
+
+/*
+ * Completion callback for the messages in a wimaxll_msg_writev()
+ * batch; just store the result in the vector entry.
+ */
+static
+int wimaxll_msg_writev_cb(struct wimaxll_handle *wmx, void *_vec,
+			  unsigned seq, ssize_t result)
+{
+	struct wimaxll_msg_vec *vec = _vec;
+
+	vec->result = result;
+	return 0;
+}
+
+
+/*
+ * Send a chunk of a wimaxll_msg_writev() batch in a single datagram
+ *
+ * The chunk is limited to sequence numbers less than
+ * WIMAXLL_TX_INFLIGHT_MAX apart (so they don't collide in the
+ * in-flight table; other threads might be allocating numbers too) and to about
+ * WIMAXLL_TX_BATCH_SIZE bytes. Each message is completed (pid, seq,
+ * flags) and appended to @buf; all but the last are added to the
+ * in-flight table, so when the ACK of the last one arrives (the
+ * kernel processes them in order), all the others have been
+ * collected too.
+ *
+ * Returns the number of messages sent or a negative errno code.
+ */
+static
+ssize_t wimaxll_msg_writev_chunk(struct wimaxll_handle *wmx,
+				 struct wimaxll_msg_vec *vec, size_t count,
+				 void **_buf, size_t *_buf_size)
+{
+	ssize_t result;
+	size_t itr, cnt, used = 0, msg_size;
+	struct nl_msg *nl_msg;
+	struct nlmsghdr *nl_hdr;
+	unsigned seq[WIMAXLL_TX_INFLIGHT_MAX];
+	struct wimaxll_tx_waiter waiter;
+	void *buf = *_buf;
+
+	for (itr = 0; itr < count && itr < WIMAXLL_TX_INFLIGHT_MAX; itr++) {
+		seq[itr] = wimaxll_tx_seq_next(wmx);
+		if (seq[itr] - seq[0] >= WIMAXLL_TX_INFLIGHT_MAX)
+			break;		/* would collide with seq[0] */
+		nl_msg = wimaxll_msg_prep(wmx, seq[itr], vec[itr].pipe_name,
+					  vec[itr].data, vec[itr].size,
+					  &result);
+		if (nl_msg == NULL)
+			goto error_msg_prep;
+		nl_auto_complete(wmx->nlh_tx, nl_msg);
+		nl_hdr = nlmsg_hdr(nl_msg);
+		msg_size = NLMSG_ALIGN(nl_hdr->nlmsg_len);
+		if (itr > 0 && used + msg_size > WIMAXLL_TX_BATCH_SIZE) {
+			nlmsg_free(nl_msg);
+			break;		/* leave it for the next chunk */
+		}
+		if (used + msg_size > *_buf_size) {
+			buf = realloc(*_buf, used + msg_size);
+			if (buf == NULL) {
+				result = -ENOMEM;
+				nlmsg_free(nl_msg);
+				goto error_realloc;
+			}
+			*_buf = buf;
+			*_buf_size = used + msg_size;
+		}
+		memset(buf + used, 0, msg_size);
+		memcpy(buf + used, nl_hdr, nl_hdr->nlmsg_len);
+		used += msg_size;
+		nlmsg_free(nl_msg);
+	}
+	/* All but the last one go to the in-flight table */
+	for (cnt = 0; cnt + 1 < itr; cnt++) {
+		result = wimaxll_tx_inflight_add(wmx, seq[cnt],
+						 wimaxll_msg_writev_cb,
+						 &vec[cnt]);
+		if (result < 0)
+			goto error_inflight_add;
+	}
+	d_printf(3, wmx, "D: CTX batch of %zu messages, %zu bytes\n",
+		 itr, used);
+	wimaxll_tx_waiter_add(wmx, &waiter, seq[itr - 1]);
+	result = wmx->transport->send(wmx, buf, used);
+	if (result < 0) {
+		wimaxll_tx_waiter_del(wmx, &waiter);
+		wimaxll_msg(wmx, "E: error sending message batch: %zd\n",
+			    result);
+		goto error_send;
+	}
+	vec[itr - 1].result = wimaxll_wait_for_ack(wmx, &waiter, NULL);
+	/* If the wait failed (vs the kernel reporting an error in the
+	 * ACK), there might be some still in flight; forget them, as
+	 * @vec won't be valid once we return. */
+	result = itr;
+error_send:
+error_inflight_add:
+	while (cnt-- > 0)
+		wimaxll_tx_inflight_del(wmx, seq[cnt]);
+error_realloc:
+error_msg_prep:
+	return result;
+}
+
+
+/**
+ * Send a batch of driver-specific messages to a WiMAX device
+ *
+ * \param wmx wimax device descriptor
+ * \param vec Array of messages to send; for each, \e pipe_name, \e
+ *     data and \e size have the same meaning as the arguments to
+ *     wimaxll_msg_write(). On return, \e result is set to the result
+ *     the kernel passed in the message's ACK (or -%EINPROGRESS if the
+ *     message couldn't be sent).
+ * \param count Number of entries in \a vec.
+ * \return 0 if all the messages were delivered ok; otherwise, the
+ *     first negative errno code found (check each entry's \e result
+ *     for details).
+ *
+ * Same as calling wimaxll_msg_write() for each message, but the
+ * messages are packed back to back in a single buffer, sent to the
+ * kernel with a single system call and all their ACKs are collected
+ * in a single pass. Big batches are split in chunks of up to
+ * %WIMAXLL_TX_INFLIGHT_MAX messages (or about %WIMAXLL_TX_BATCH_SIZE
+ * bytes).
+ *
+ * Messages are delivered in order; a failure in one message doesn't
+ * stop the kernel from processing the next ones.
+ *
+ * \note This is a blocking call
+ *
+ * \ingroup the_messaging_interface
+ */
+ssize_t wimaxll_msg_writev(struct wimaxll_handle *wmx,
+			   struct wimaxll_msg_vec *vec, size_t count)
+{
+	ssize_t result;
+	size_t itr, buf_size = 0;
+	void *buf = NULL;
+
+	d_fnstart(3, wmx, "(wmx %p vec %p count %zu)\n", wmx, vec, count);
+	for (itr = 0; itr < count; itr++)
+		vec[itr].result = -EINPROGRESS;
+	result = -EBADF;
+	if (wimaxll_ifidx(wmx) == 0)
+		goto error_not_any;
+	result = wmx->probe_result;	/* see wimaxll_send() */
+	if (result < 0)
+		goto error_probe;
+	for (itr = 0; itr < count; itr += result) {
+		result = wimaxll_msg_writev_chunk(wmx, vec + itr, count - itr,
+						  &buf, &buf_size);
+		if (result < 0)
+			goto error_chunk;
+	}
+	result = 0;
+	for (itr = 0; itr < count; itr++)
+		if (vec[itr].result < 0) {
+			result = vec[itr].result;
+			break;
+		}
+error_chunk:
+	free(buf);
+error_probe:
+error_not_any:
+	d_fnend(3, wmx, "(wmx %p vec %p count %zu) = %zd\n",
+		wmx, vec, count, result);
+	return result;
+}
+
+
 /**
  * Get the callback and priv pointer for a MSG_TO_USER message
  *
@@ -498,12 +1161,28 @@ void wimaxll_get_cb_msg_to_user(
  *     struct and pass a pointer to it; then use wimaxll_container_of()
  *     to extract it back).
  *
+ * Setting a callback sets up the receive side of handles opened
+ * with %WIMAXLL_OPEN_LAZY_RX (if that fails, the error is logged and
+ * wimaxll_recv_fd() will return it). If the handle was set up with
+ * wimaxll_recv_filter() and %WIMAXLL_RECV_FILTER_CB, this updates
+ * the kernel filter too.
+ *
  * \ingroup the_messaging_interface_group
  */
 void wimaxll_set_cb_msg_to_user(
 	struct wimaxll_handle *wmx, wimaxll_msg_to_user_cb_f cb,
 	void *priv)
 {
+	int result;
+
 	wmx->msg_to_user_cb = cb;
 	wmx->msg_to_user_priv = priv;
+	if (cb != NULL) {
+		result = wimaxll_mc_rx_ensure(wmx);
+		if (result < 0)
+			wimaxll_msg(wmx, "E: cannot set up receiving, the "
+				    "msg-to-user callback won't be called: "
+				    "%d\n", result);
+	}
+	wimaxll_rx_filter_update(wmx);
 }
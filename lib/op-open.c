@@ -61,12 +61,15 @@
  */
 #define _GNU_SOURCE
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <errno.h>
 #include <assert.h>
+#include <poll.h>
+#include <time.h>
 #include <linux/types.h>
 #include <net/if.h>
 #include <netlink/msg.h>
@@ -79,37 +82,15 @@
 #include "debug.h"
 
 
-/*
- * Netlink callback for (disabled) sequence check
- *
- * When reading from multicast groups ignore the sequence check, as
- * they are events (as indicated by the netlink documentation; see the
- * documentation on nl_disable_sequence_check(), for example here:
- * http://people.suug.ch/~tgr/libnl/doc-1.1/
- * group__socket.html#g0ff2f43147e3a4547f7109578b3ca422).
- *
- * We need to do this \e manually, as we are using a new callback set
- * group and thus the libnl defaults set by
- * nl_disable_sequence_check() don't apply.
- */
-static
-int wimaxll_seq_check_cb(struct nl_msg *msg, void *arg)
-{
-	return NL_OK;
-}
-
-
-static
 /**
- * Callback to process a (succesful) message coming from generic
- * netlink
+ * Process a (succesful) message coming from generic netlink
  *
  * \internal
  *
- * Called by nl_recvmsgs() when a valid message is received. We
- * multiplex and handle messages that are known to the library. If the
- * message is unknown, do nothing other than maybe printing an error
- * message. 
+ * Called by wimaxll_recv_dispatch() for each valid message received.
+ * We multiplex and handle messages that are known to the
+ * library. If the message is unknown, do nothing other than maybe
+ * printing an error message.
  *
  * The wimaxll_gnl_handle_*() functions need to return:
  *
@@ -120,33 +101,32 @@ static
  * - any other < 0 error code to indicate an error and that the
  *   message should be skipped.
  *
- * \fn int wimaxll_gnl_cb(struct nl_msg *msg, void *_ctx)
+ * \return \c enum nl_cb_action
+ *
+ * \fn int wimaxll_gnl_cb(struct wimaxll_cb_ctx *ctx, struct nlmsghdr *nl_hdr)
  */
-int wimaxll_gnl_cb(struct nl_msg *msg, void *_ctx)
+int wimaxll_gnl_cb(struct wimaxll_cb_ctx *ctx, struct nlmsghdr *nl_hdr)
 {
 	ssize_t result;
 	enum nl_cb_action result_nl;
-	struct wimaxll_cb_ctx *ctx = _ctx;
 	struct wimaxll_handle *wmx = ctx->wmx;
-	struct nlmsghdr *nl_hdr;
 	struct genlmsghdr *gnl_hdr;
 
-	d_fnstart(3, wmx, "(msg %p wmx %p)\n", msg, wmx);
-	nl_hdr = nlmsg_hdr(msg);
+	d_fnstart(3, wmx, "(nl_hdr %p wmx %p)\n", nl_hdr, wmx);
 	gnl_hdr = nlmsg_data(nl_hdr);
 
 	d_printf(3, wmx, "E: %s: received gnl message %d\n",
 		 __func__, gnl_hdr->cmd);
 	switch (gnl_hdr->cmd) {
 	case WIMAX_GNL_OP_MSG_TO_USER:
-		if (wmx->msg_to_user_cb)
-			result = wimaxll_gnl_handle_msg_to_user(wmx, msg);
+		if (wimaxll_has_cb_msg_to_user(wmx))
+			result = wimaxll_gnl_handle_msg_to_user(wmx, nl_hdr);
 		else
 			result = 0;
 		break;
 	case WIMAX_GNL_RE_STATE_CHANGE:
-		if (wmx->state_change_cb)
-			result = wimaxll_gnl_handle_state_change(wmx, msg);
+		if (wimaxll_has_cb_state_change(wmx))
+			result = wimaxll_gnl_handle_state_change(wmx, nl_hdr);
 		else
 			result = 0;
 		break;
@@ -155,6 +135,8 @@ int wimaxll_gnl_cb(struct nl_msg *msg, void *_ctx)
 			 __func__, gnl_hdr->cmd);
 		result = 0;
 	}
+	if (result != -ENODEV)
+		wmx->rx_processed++;
 	if (result == -EBUSY) {		/* stop signal from the user's callback */
 		result_nl = NL_STOP;
 		result = 0;
@@ -164,11 +146,549 @@ int wimaxll_gnl_cb(struct nl_msg *msg, void *_ctx)
 	else
 		result_nl = NL_OK;
 	wimaxll_cb_maybe_set_result(ctx, result);	
-	d_fnend(3, wmx, "(msg %p ctx %p) = %zd\n", msg, ctx, result);
+	d_fnend(3, wmx, "(nl_hdr %p ctx %p) = %zd\n", nl_hdr, ctx, result);
 	return result_nl;
 }
 
 
+/*
+ * Run the callbacks for each of the netlink messages in a buffer
+ *
+ * \internal
+ *
+ * \param wmx WiMAX device handle that read \a buf
+ * \param ctx Callback context
+ * \param buf Buffer with one or more netlink messages as read from
+ *     the RX handle.
+ * \param size Size of the data in \a buf
+ * \param off Offset in \a buf where to start; updated to where to
+ *     continue (\a size or more once all were processed).
+ *
+ * We do this instead of using libnl's nl_recvmsgs() because that
+ * makes a copy of each message and frees the receive buffer before
+ * returning; we want the messages to be processed in place, so the
+ * buffer can be lent to the caller (see wimaxll_msg_read_borrow()).
+ *
+ * Stops processing when a callback requests so or an ack/error is
+ * received (with \a ctx->result updated); the rest of the messages
+ * in the buffer are processed when called again with the updated \a
+ * off.
+ *
+ * \return !0 if processing was stopped, 0 otherwise.
+ */
+static
+int wimaxll_recv_dispatch(struct wimaxll_handle *wmx,
+			  struct wimaxll_cb_ctx *ctx,
+			  void *buf, size_t size, size_t *off)
+{
+	int result, remaining = size - *off;
+	struct nlmsghdr *nl_hdr;
+
+	for (nl_hdr = buf + *off; nlmsg_ok(nl_hdr, remaining);
+	     nl_hdr = nlmsg_next(nl_hdr, &remaining)) {
+		/* Where to continue if we stop with this one */
+		*off = (void *) nl_hdr - buf + NLMSG_ALIGN(nl_hdr->nlmsg_len);
+		switch (nl_hdr->nlmsg_type) {
+		case NLMSG_NOOP:
+		case NLMSG_DONE:
+		case NLMSG_OVERRUN:
+			continue;
+		case NLMSG_ERROR:
+			if (nlmsg_len(nl_hdr) < sizeof(struct nlmsgerr)) {
+				wimaxll_msg(wmx, "E: netlink ack: buffer too "
+					    "small (%d bytes)\n",
+					    nlmsg_len(nl_hdr));
+				continue;
+			}
+			wimaxll_gnl_error_cb(NULL, nlmsg_data(nl_hdr), ctx);
+			return 1;
+		default:
+			if (ctx->wmx->rx_shared != NULL)
+				result = wimaxll_rx_shared_dispatch(ctx, nl_hdr);
+			else
+				result = wimaxll_gnl_cb(ctx, nl_hdr);
+			if (result == NL_STOP)
+				return 1;
+		}
+	}
+	*off = size;
+	return 0;
+}
+
+
+/*
+ * Release a receive buffer once its messages have been processed
+ *
+ * If a callback asked to keep it (because it lent a pointer into it
+ * to the caller, see wimaxll_msg_read_borrow()), we move it to the
+ * handle's borrowed buffer table until wimaxll_msg_release() is
+ * called; wimaxll_recv_fill() will allocate a new one for the slot.
+ *
+ * If the datagram is not done (@done is 0; a callback stopped before
+ * its last message), the rest of it still has to be processed from
+ * the slot, so it gets a copy.
+ *
+ * \a rx_wmx is the handle that owns the receive buffers (the shared
+ * receiver for handles opened with %WIMAXLL_OPEN_SHARED_RX); the
+ * buffer goes to the handle it was lent to (\a rx_pin_wmx), which
+ * with the shared receiver is not always the one that is reading.
+ */
+static
+void wimaxll_recv_buf_put(struct wimaxll_handle *rx_wmx, unsigned idx,
+			  int done)
+{
+	unsigned itr;
+	void *copy = NULL;
+	struct wimaxll_handle *wmx = rx_wmx->rx_pin_wmx;
+
+	if (rx_wmx->rx_pin == 0)
+		return;
+	rx_wmx->rx_pin = 0;
+	rx_wmx->rx_pin_wmx = NULL;
+	if (!done) {
+		copy = malloc(rx_wmx->rx_buf_alloc_size > rx_wmx->rx_len[idx] ?
+			      rx_wmx->rx_buf_alloc_size : rx_wmx->rx_len[idx]);
+		if (copy == NULL) {
+			wimaxll_msg(wmx, "E: no memory to keep the rest of "
+				    "a datagram, dropping it\n");
+			rx_wmx->rx_off = rx_wmx->rx_len[idx];
+		} else
+			memcpy(copy, rx_wmx->rx_buf[idx],
+			       rx_wmx->rx_len[idx]);
+	}
+	/* wimaxll_msg_release() might be running in another thread */
+	pthread_mutex_lock(&wmx->rx_mutex);
+	for (itr = 0; itr < WIMAXLL_RX_BORROW_MAX; itr++)
+		if (wmx->rx_borrowed[itr].buf == NULL) {
+			wmx->rx_borrowed[itr].buf = rx_wmx->rx_buf[idx];
+			wmx->rx_borrowed[itr].size = rx_wmx->rx_len[idx];
+			wmx->rx_borrowed_count++;
+			rx_wmx->rx_buf[idx] = copy;
+			break;
+		}
+	pthread_mutex_unlock(&wmx->rx_mutex);
+	/* wimaxll_msg_read_borrow() checks there is space */
+	assert(itr < WIMAXLL_RX_BORROW_MAX);
+	/* wimaxll_rx_shared_dispatch() kept it referenced for us */
+	if (wmx != rx_wmx)
+		wimaxll_rx_shared_put(wmx);
+}
+
+
+/*
+ * Free the receive buffers (on close or to resize them)
+ */
+void wimaxll_recv_buf_release_all(struct wimaxll_handle *wmx)
+{
+	unsigned itr;
+
+	for (itr = 0; itr < WIMAXLL_RX_BATCH_MAX; itr++) {
+		free(wmx->rx_buf[itr]);
+		wmx->rx_buf[itr] = NULL;
+	}
+	free(wmx->rx_spill);
+	wmx->rx_spill = NULL;
+	wmx->rx_count = 0;
+	wmx->rx_off = 0;
+}
+
+
+/*
+ * Move the part of a datagram that went to the spill area to the end
+ * of its receive buffer
+ *
+ * The buffer is grown to fit it (and the next time all of them will
+ * be allocated with that size). Returns 0 if ok, -ENOMEM if the
+ * buffer couldn't be grown.
+ */
+static
+int wimaxll_recv_unspill(struct wimaxll_handle *wmx, unsigned idx,
+			 size_t size)
+{
+	void *buf;
+
+	buf = realloc(wmx->rx_buf[idx], size);
+	if (buf == NULL)
+		return -ENOMEM;
+	memcpy(buf + wmx->rx_buf_size,
+	       wmx->rx_spill + idx * WIMAXLL_RX_SPILL_SIZE,
+	       size - wmx->rx_buf_size);
+	wmx->rx_buf[idx] = buf;
+	return 0;
+}
+
+
+/*
+ * Read a batch of datagrams from the RX handle
+ *
+ * \param wmx WiMAX device handle
+ * \param max Maximum number of datagrams to read (up to
+ *     %WIMAXLL_RX_BATCH_MAX).
+ * \param flags Flags for recvmmsg()
+ * \return Number of datagrams read or negative errno code.
+ *
+ * Reads as many datagrams as are available (at least one, unless
+ * \a flags include MSG_DONTWAIT) with a single system call into the
+ * handle's receive buffers; they are queued in \a rx_len and
+ * consumed by wimaxll_recv_ctx().
+ *
+ * Datagrams are never dropped because they don't fit:
+ *
+ * - the first one is sized with MSG_PEEK | MSG_TRUNC (which also
+ *   does the waiting) and the buffers grown before reading it;
+ *
+ * - the rest can't be peeked at, so each buffer is followed (with a
+ *   second iovec) by a spill area; a datagram that goes into it is
+ *   moved to a bigger buffer and the buffers are grown so the next
+ *   ones fit.
+ *
+ * Only a datagram that doesn't fit in the buffer plus its spill area
+ * would be truncated (the WiMAX stack carries the payload in a single
+ * netlink attribute, so it can't be bigger than
+ * %WIMAXLL_RX_SPILL_SIZE); it's dropped (queued with zero length) and
+ * counted as an overrun.
+ */
+static
+ssize_t wimaxll_recv_fill(struct wimaxll_handle *wmx, unsigned max,
+			  int flags)
+{
+	ssize_t result;
+	unsigned itr;
+	size_t size;
+	struct mmsghdr msgs[WIMAXLL_RX_BATCH_MAX];
+	struct iovec iov[WIMAXLL_RX_BATCH_MAX][2];
+
+	assert(wmx->rx_count == 0);
+	assert(max > 0 && max <= WIMAXLL_RX_BATCH_MAX);
+	/* Wait for the first one and find out how big it is */
+	result = recv(wmx->rx_fd, NULL, 0, MSG_PEEK | MSG_TRUNC
+		      | (flags & MSG_DONTWAIT));
+	if (result < 0) {
+		result = -errno;
+		/* The kernel dropped notifications; the state caches
+		 * fed from this socket can't be trusted anymore */
+		if (result == -ENOBUFS)
+			__sync_add_and_fetch(&wmx->rx_overruns, 1);
+		goto error_peek;
+	}
+	if (wmx->rx_buf_size == 0)
+		wmx->rx_buf_size = WIMAXLL_RX_BUF_SIZE;
+	if ((size_t) result > wmx->rx_buf_size) {
+		wmx->rx_buf_size = result;
+		wmx->recv_buf_grow_count++;
+	}
+	if (wmx->rx_buf_size != wmx->rx_buf_alloc_size) {
+		wimaxll_recv_buf_release_all(wmx);
+		wmx->rx_buf_alloc_size = wmx->rx_buf_size;
+	}
+	if (wmx->rx_spill == NULL) {
+		/* Big, but it's only touched when used */
+		wmx->rx_spill = malloc(WIMAXLL_RX_BATCH_MAX
+				       * WIMAXLL_RX_SPILL_SIZE);
+		if (wmx->rx_spill == NULL) {
+			result = -ENOMEM;
+			goto error_alloc;
+		}
+	}
+	memset(msgs, 0, max * sizeof(msgs[0]));
+	for (itr = 0; itr < max; itr++) {
+		if (wmx->rx_buf[itr] == NULL) {
+			wmx->rx_buf[itr] = malloc(wmx->rx_buf_size);
+			if (wmx->rx_buf[itr] == NULL) {
+				result = -ENOMEM;
+				goto error_alloc;
+			}
+		}
+		iov[itr][0].iov_base = wmx->rx_buf[itr];
+		iov[itr][0].iov_len = wmx->rx_buf_size;
+		iov[itr][1].iov_base =
+			wmx->rx_spill + itr * WIMAXLL_RX_SPILL_SIZE;
+		iov[itr][1].iov_len = WIMAXLL_RX_SPILL_SIZE;
+		msgs[itr].msg_hdr.msg_iov = iov[itr];
+		msgs[itr].msg_hdr.msg_iovlen = 2;
+	}
+	/* There is at least one waiting, no need to block */
+	result = recvmmsg(wmx->rx_fd, msgs, max,
+			  MSG_DONTWAIT | MSG_TRUNC, NULL);
+	if (result < 0) {
+		result = -errno;
+		if (result == -ENOBUFS)
+			__sync_add_and_fetch(&wmx->rx_overruns, 1);
+		goto error_recv;
+	}
+	size = wmx->rx_buf_size;
+	for (itr = 0; itr < result; itr++) {
+		wmx->rx_len[itr] = msgs[itr].msg_len;
+		if (msgs[itr].msg_hdr.msg_flags & MSG_TRUNC) {
+			wimaxll_msg(wmx, "E: %s: %u byte datagram bigger than "
+				    "the receive buffer and spill area (%zu "
+				    "bytes), dropped\n", __func__,
+				    msgs[itr].msg_len,
+				    wmx->rx_buf_size + WIMAXLL_RX_SPILL_SIZE);
+			__sync_add_and_fetch(&wmx->rx_overruns, 1);
+			wmx->rx_len[itr] = 0;
+		} else if (msgs[itr].msg_len > wmx->rx_buf_size
+			   && wimaxll_recv_unspill(wmx, itr,
+						   msgs[itr].msg_len) < 0) {
+			wimaxll_msg(wmx, "E: %s: no memory for a %u byte "
+				    "datagram, dropped\n", __func__,
+				    msgs[itr].msg_len);
+			__sync_add_and_fetch(&wmx->rx_overruns, 1);
+			wmx->rx_len[itr] = 0;
+		}
+		/* Make the next ones fit without spilling */
+		if (msgs[itr].msg_len > size)
+			size = msgs[itr].msg_len;
+	}
+	if (size > wmx->rx_buf_size) {
+		wmx->rx_buf_size = size;
+		wmx->recv_buf_grow_count++;
+	}
+	d_printf(3, wmx, "D: CRX batch of %zd datagrams\n", result);
+	wmx->rx_next = 0;
+	wmx->rx_count = result;
+error_recv:
+error_alloc:
+error_peek:
+	return result;
+}
+
+
+/*
+ * Set up the RX leader state of a handle
+ *
+ * \internal
+ *
+ * Done for every handle on open (and for the shared receiver), as
+ * the handle that owns the receive socket might set it up later.
+ */
+void wimaxll_rx_lock_init(struct wimaxll_handle *wmx)
+{
+	pthread_condattr_t attr;
+
+	pthread_mutex_init(&wmx->rx_mutex, NULL);
+	pthread_condattr_init(&attr);
+	/* deadlines are CLOCK_MONOTONIC (wimaxll_deadline_set()) */
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&wmx->rx_cond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+
+/*
+ * Release what wimaxll_rx_lock_init() set up
+ *
+ * \internal
+ */
+void wimaxll_rx_lock_destroy(struct wimaxll_handle *wmx)
+{
+	pthread_cond_destroy(&wmx->rx_cond);
+	pthread_mutex_destroy(&wmx->rx_mutex);
+}
+
+
+/*
+ * Become the thread that reads from the receive socket of @rx_wmx
+ *
+ * If another thread is reading, wait until it is done; if meanwhile
+ * it processed a notification for @wmx, we return without reading,
+ * as if we had done it. With @nowait, we don't wait; with a
+ * @deadline, no longer than it.
+ *
+ * If we already were the leader (eg: a callback receives), we keep
+ * reading; *@nested is set so the inner call doesn't give up the
+ * leadership.
+ *
+ * Returns 1 if we are now the leader, 0 if a notification for @wmx
+ * was processed by the leader while we waited, -EAGAIN if another
+ * thread is reading and @nowait, -ETIMEDOUT if the deadline passed.
+ */
+static
+int wimaxll_rx_lead(struct wimaxll_handle *rx_wmx, struct wimaxll_handle *wmx,
+		    int nowait, const struct timespec *deadline, int *nested)
+{
+	int result;
+	unsigned long processed;
+
+	*nested = 0;
+	pthread_mutex_lock(&rx_wmx->rx_mutex);
+	processed = wmx->rx_processed;
+	while (rx_wmx->rx_reading) {
+		if (pthread_equal(rx_wmx->rx_leader, pthread_self())) {
+			*nested = 1;
+			break;
+		}
+		result = -EAGAIN;
+		if (nowait)
+			goto out;
+		rx_wmx->rx_waiting++;
+		if (deadline != NULL)
+			result = pthread_cond_timedwait(&rx_wmx->rx_cond,
+							&rx_wmx->rx_mutex,
+							deadline);
+		else
+			result = pthread_cond_wait(&rx_wmx->rx_cond,
+						   &rx_wmx->rx_mutex);
+		rx_wmx->rx_waiting--;
+		if (wmx->rx_processed != processed) {
+			result = 0;
+			goto out;
+		}
+		if (result == ETIMEDOUT && rx_wmx->rx_reading) {
+			result = -ETIMEDOUT;
+			goto out;
+		}
+	}
+	rx_wmx->rx_reading = 1;
+	rx_wmx->rx_leader = pthread_self();
+	result = 1;
+out:
+	pthread_mutex_unlock(&rx_wmx->rx_mutex);
+	return result;
+}
+
+
+/*
+ * Stop reading and let the threads waiting take over (or see what
+ * we processed for them)
+ */
+static
+void wimaxll_rx_unlead(struct wimaxll_handle *rx_wmx, int nested)
+{
+	if (nested)
+		return;
+	pthread_mutex_lock(&rx_wmx->rx_mutex);
+	rx_wmx->rx_reading = 0;
+	if (rx_wmx->rx_waiting > 0)
+		pthread_cond_broadcast(&rx_wmx->rx_cond);
+	pthread_mutex_unlock(&rx_wmx->rx_mutex);
+}
+
+
+/*
+ * Wait for the receive socket to be ready, up to @deadline
+ *
+ * Returns 0 when there is something to process (maybe a backlog from
+ * a previous call), -ETIMEDOUT if the deadline passed first. Only
+ * the RX leader waits here; the rest wait for it (so they see what
+ * it read for them).
+ */
+static
+int wimaxll_recv_wait(struct wimaxll_handle *wmx,
+		      const struct timespec *deadline)
+{
+	int result;
+	struct pollfd pfd = { .events = POLLIN };
+
+	result = wimaxll_mc_rx_ensure(wmx);
+	if (result < 0)
+		return result;
+	pfd.fd = wimaxll_rx_wmx(wmx)->rx_fd;
+	while (!wimaxll_rx_backlog(wmx)) {
+		result = poll(&pfd, 1, wimaxll_deadline_ms(deadline));
+		if (result > 0)
+			break;
+		if (result == 0)
+			return -ETIMEDOUT;
+		if (errno != EINTR)
+			return -errno;
+	}
+	return 0;
+}
+
+
+/*
+ * Receive and process up to @budget datagrams
+ *
+ * \return Number of datagrams processed, or negative errno code if
+ *     the socket couldn't be read (-EAGAIN if there was nothing to
+ *     read or, with MSG_DONTWAIT and no @deadline, if another thread
+ *     is reading; -ETIMEDOUT if the @deadline passed while waiting
+ *     for it).
+ *
+ * Datagrams queued from a previous call are processed first; if
+ * there are none, we read with @flags (MSG_WAITFORONE blocks until
+ * at least one is available, MSG_DONTWAIT doesn't) as many as the
+ * budget allows, without blocking again. With a @deadline, we first
+ * poll() until something is available or it passes.
+ *
+ * Only one thread reads at a time (see wimaxll_rx_lead()); if
+ * another one processed a notification for @wmx while we waited for
+ * it, we just set @ctx's result to 0 and return 0.
+ *
+ * When a callback stops processing (or an ack/error is received),
+ * we return; datagrams already read (and the rest of the messages in
+ * the current one, see \a rx_off) are kept queued for the next call,
+ * so no message is lost.
+ */
+static
+ssize_t wimaxll_recv_ctx(struct wimaxll_handle *wmx,
+			 struct wimaxll_cb_ctx *ctx, unsigned budget, int flags,
+			 const struct timespec *deadline)
+{
+	ssize_t result;
+	unsigned idx, processed = 0, max;
+	int stop = 0, done, nested;
+	struct wimaxll_handle *rx_wmx;
+
+	result = wimaxll_mc_rx_ensure(wmx);
+	if (result < 0)
+		goto error_rx_open;
+	rx_wmx = wimaxll_rx_wmx(wmx);
+	result = wimaxll_rx_lead(rx_wmx, wmx,
+				 (flags & MSG_DONTWAIT) && deadline == NULL,
+				 deadline, &nested);
+	if (result == 0)
+		wimaxll_cb_maybe_set_result(ctx, 0);
+	if (result <= 0)
+		goto error_lead;
+	if (deadline != NULL) {
+		result = wimaxll_recv_wait(wmx, deadline);
+		if (result < 0)
+			goto error_wait;
+	}
+	while (processed < budget && stop == 0) {
+		if (rx_wmx->rx_count == 0) {
+			max = budget - processed;
+			if (max > WIMAXLL_RX_BATCH_MAX)
+				max = WIMAXLL_RX_BATCH_MAX;
+			/* Don't block once we have done something (eg:
+			 * processed the backlog) */
+			if (processed > 0)
+				flags = MSG_DONTWAIT;
+			result = wimaxll_recv_fill(rx_wmx, max, flags);
+			if (result == -EAGAIN && processed > 0)
+				break;
+			if (result < 0)
+				goto error_fill;
+			flags = MSG_DONTWAIT;
+		}
+		idx = rx_wmx->rx_next;
+		stop = wimaxll_recv_dispatch(rx_wmx, ctx, rx_wmx->rx_buf[idx],
+					     rx_wmx->rx_len[idx],
+					     &rx_wmx->rx_off);
+		done = rx_wmx->rx_off >= rx_wmx->rx_len[idx];
+		wimaxll_recv_buf_put(rx_wmx, idx, done);
+		if (done || rx_wmx->rx_off >= rx_wmx->rx_len[idx]) {
+			rx_wmx->rx_next++;
+			rx_wmx->rx_count--;
+			rx_wmx->rx_off = 0;
+		}
+		processed++;
+		/* if this was a message for another device, we skip it */
+		if (ctx->result == -ENODEV)
+			ctx->result = -EINPROGRESS;
+	}
+	result = processed;
+error_fill:
+error_wait:
+	wimaxll_rx_unlead(rx_wmx, nested);
+error_lead:
+error_rx_open:
+	return result;
+}
+
+
 /**
  * Return the file descriptor associated to a WiMAX handle
  *
@@ -176,16 +696,27 @@ int wimaxll_gnl_cb(struct nl_msg *msg, void *_ctx)
  *
  * \return file descriptor associated to the handle can be fed to
  *     functions like select() to wait for notifications to be ready..
+ *     On error, a negative errno code (eg: the receive side of a
+ *     handle opened with %WIMAXLL_OPEN_LAZY_RX couldn't be set up);
+ *     check for it before using it as a file descriptor.
  *
  * This allows to select() on the file descriptor, which will block
  * until a message is available, that then can be read with
  * wimaxll_recv().
  *
+ * For handles opened with %WIMAXLL_OPEN_LAZY_RX, this sets up the
+ * receive side if it wasn't yet.
+ *
  * \ingroup the_messaging_interface
  */
 int wimaxll_recv_fd(struct wimaxll_handle *wmx)
 {
-	return nl_socket_get_fd(wmx->nlh_rx);
+	int result;
+
+	result = wimaxll_mc_rx_ensure(wmx);
+	if (result < 0)
+		return result;
+	return wimaxll_rx_wmx(wmx)->rx_fd;
 }
 
 
@@ -207,71 +738,219 @@ int wimaxll_recv_fd(struct wimaxll_handle *wmx)
  * (mch->cb_ctx). In case of any type of errors (cb_ctx.result < 0),
  * it is expected that no resources will be tied to the context.
  *
+ * Blocks until a message for this handle has been processed;
+ * messages for other devices are skipped. Datagrams that are already
+ * waiting behind it (up to %WIMAXLL_RX_BATCH_MAX) are processed in
+ * the same call; to bound the work done on each wakeup of an event
+ * loop use wimaxll_recv_budget() instead.
+ *
  * \remarks This is a blocking call.
  *
  * \ingroup mc_rx
  *
  * \internal
  *
- * This calls nl_recvmsgs() on the handle specific to a multi-cast
- * group; wimaxll_gnl_cb() will be called for succesfully received
- * generic netlink messages from the kernel and execute the callbacks
- * for each.
+ * This calls recvmmsg() on the handle specific to a multi-cast group
+ * to read a batch of datagrams, until one carries a message for this
+ * handle; wimaxll_gnl_cb() will be called for each succesfully
+ * received generic netlink messages from the kernel and execute the
+ * callbacks for each.
  */
 ssize_t wimaxll_recv(struct wimaxll_handle *wmx)
+{
+	return wimaxll_recv_deadline(wmx, NULL);
+}
+
+
+/**
+ * Same as wimaxll_recv(), but giving up at a deadline
+ *
+ * \param wmx WiMAX device handle
+ * \param deadline Absolute time (%CLOCK_MONOTONIC, see
+ *     wimaxll_deadline_set()) when to give up waiting; NULL to wait
+ *     for as long as it takes.
+ * \return Same as wimaxll_recv(); -%ETIMEDOUT if nothing arrived
+ *     before the deadline.
+ *
+ * The wait is done with poll() on wimaxll_recv_fd(), so the handle's
+ * file descriptor can stay in blocking mode. If another thread reads
+ * the datagram that woke us up first, we go back to waiting.
+ *
+ * \ingroup mc_rx
+ */
+ssize_t wimaxll_recv_deadline(struct wimaxll_handle *wmx,
+			      const struct timespec *deadline)
 {
 	ssize_t result;
+	int flags = MSG_WAITFORONE;
 	struct wimaxll_cb_ctx ctx = WIMAXLL_CB_CTX_INIT(wmx);
-	struct nl_cb *cb;
-
-	d_fnstart(3, wmx, "(wmx %p)\n", wmx);
-
-	/*
-	 * The reading and processing happens here
-	 *
-	 * libnl's nl_recvmsgs() will read and call the different
-	 * callbacks we specified wimaxll_open() time. That's where
-	 * the processing of the message content is done.
-	 */
-	cb = nl_socket_get_cb(wmx->nlh_rx);
-	nl_cb_set(cb, NL_CB_ACK, NL_CB_CUSTOM, wimaxll_gnl_ack_cb, &ctx);
-	nl_cb_set(cb, NL_CB_SEQ_CHECK, NL_CB_CUSTOM,
-		  wimaxll_seq_check_cb, NULL);
-	nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, wimaxll_gnl_cb, &ctx);
-	nl_cb_err(cb, NL_CB_CUSTOM, wimaxll_gnl_error_cb, &ctx);
-	d_printf(2, wmx, "I: Calling nl_recvmsgs()\n");
+
+	d_fnstart(3, wmx, "(wmx %p deadline %p)\n", wmx, deadline);
+	if (deadline != NULL)
+		flags = MSG_DONTWAIT;
 	do {
-		ctx.result = -EINPROGRESS;
-		result = nl_recvmsgs(wmx->nlh_rx, cb);
+		result = wimaxll_recv_ctx(wmx, &ctx, WIMAXLL_RX_BATCH_MAX,
+					  flags, deadline);
 		d_printf(3, wmx, "I: ctx.result %zd result %zd\n",
 			 ctx.result, result);
-		/* if this was a message for another device, we skip it */
-		if (ctx.result == -ENODEV)
-			ctx.result = -EINPROGRESS;
-	} while ((ctx.result == -EINPROGRESS)
-		 && result > 0);
-	if (result < 0)
-		wimaxll_msg(wmx, "E: %s: nl_recvmgsgs failed: %zd\n",
+		/* nothing to read after all; wait again */
+		if (result == -EAGAIN && deadline != NULL)
+			result = 0;
+	} while (ctx.result == -EINPROGRESS && result >= 0);
+	if (result < 0 && result != -ETIMEDOUT)
+		wimaxll_msg(wmx, "E: %s: receive failed: %zd\n",
 			    __func__, result);
-	else if (ctx.result != -EINPROGRESS)
+	else if (result >= 0)
 		result = ctx.result;
-	else
-		result = 0;
 	/* No complains on error; the kernel might just be sending an
 	 * error out; pass it through. */
-	d_fnend(3, wmx, "(wmx %p) = %zd\n", wmx, result);
+	d_fnend(3, wmx, "(wmx %p deadline %p) = %zd\n", wmx, deadline, result);
 	return result;
 }
 
 
-static
-void wimaxll_mc_group_cb(void *_wmx, const char *name, int id)
+/**
+ * Read and process a bounded number of notifications
+ *
+ * \param wmx WiMAX device handle
+ * \param budget Maximum number of datagrams to process (each
+ *     datagram can carry one or more messages).
+ * \return Number of datagrams processed, or a negative errno code
+ *     if the socket couldn't be read.
+ *
+ * This is the batch engine behind wimaxll_recv(), for event loops
+ * that want to bound the work done on each wakeup: instead of
+ * waiting for a message for this handle, it returns after processing
+ * whatever is available. Datagrams are read in batches of up to
+ * %WIMAXLL_RX_BATCH_MAX per system call. The call blocks until at
+ * least one datagram is available (unless the file descriptor is
+ * non-blocking, in which case -%EAGAIN is returned) and then
+ * processes as many as are available, up to \a budget.
+ *
+ * If a callback stops processing (by returning -%EBUSY), datagrams
+ * already read are kept in the handle and processed first on the
+ * next call. As wimaxll_recv_fd() won't signal them, call again
+ * before going back to wait on it.
+ *
+ * \ingroup mc_rx
+ */
+ssize_t wimaxll_recv_budget(struct wimaxll_handle *wmx, unsigned budget)
+{
+	ssize_t result;
+	struct wimaxll_cb_ctx ctx = WIMAXLL_CB_CTX_INIT(wmx);
+
+	d_fnstart(3, wmx, "(wmx %p budget %u)\n", wmx, budget);
+	result = wimaxll_recv_ctx(wmx, &ctx, budget, MSG_WAITFORONE, NULL);
+	if (result < 0 && result != -EAGAIN)
+		wimaxll_msg(wmx, "E: %s: receive failed: %zd\n",
+			    __func__, result);
+	d_fnend(3, wmx, "(wmx %p budget %u) = %zd\n", wmx, budget, result);
+	return result;
+}
+
+
+/**
+ * Process the notifications that are already waiting, without
+ * blocking
+ *
+ * \param wmx WiMAX device handle
+ * \param budget Maximum number of datagrams to process (0 for
+ *     %WIMAXLL_RX_BATCH_MAX).
+ * \return Number of datagrams processed (0 if none were waiting), or
+ *     a negative errno code if the socket couldn't be read.
+ *
+ * For event loop integration (lib/epoll.c, libwimaxll-glib), which
+ * call this when wimaxll_recv_fd() is ready for reading or
+ * wimaxll_recv_backlog() says there is something left.
+ *
+ * \ingroup mc_rx
+ */
+ssize_t wimaxll_recv_drain(struct wimaxll_handle *wmx, unsigned budget)
 {
-	struct wimaxll_handle *wmx = _wmx;
+	ssize_t result;
+	struct wimaxll_cb_ctx ctx = WIMAXLL_CB_CTX_INIT(wmx);
 
-	if (strcmp(name, "msg"))
-		return;
-	wmx->mcg_id = id;
+	d_fnstart(3, wmx, "(wmx %p budget %u)\n", wmx, budget);
+	if (budget == 0)
+		budget = WIMAXLL_RX_BATCH_MAX;
+	result = wimaxll_recv_ctx(wmx, &ctx, budget, MSG_DONTWAIT,
+				  NULL);
+	if (result == -EAGAIN)
+		result = 0;
+	else if (result < 0)
+		wimaxll_msg(wmx, "E: %s: receive failed: %zd\n",
+			    __func__, result);
+	d_fnend(3, wmx, "(wmx %p budget %u) = %zd\n", wmx, budget, result);
+	return result;
+}
+
+
+/**
+ * Return if there are notifications already read and not processed
+ *
+ * \param wmx WiMAX device handle
+ * \return !0 if a callback stopped processing (returning -%EBUSY)
+ *     and left datagrams in the handle; wimaxll_recv_fd() won't
+ *     signal them, so process them (wimaxll_recv_drain()) before
+ *     waiting on it.
+ *
+ * \ingroup mc_rx
+ */
+int wimaxll_recv_backlog(struct wimaxll_handle *wmx)
+{
+	return wimaxll_rx_backlog(wmx);
+}
+
+
+/**
+ * Set the size of the buffers used to receive from the kernel
+ *
+ * \param wmx WiMAX device handle
+ * \param size Size (in bytes) of each receive buffer; 0 restores the
+ *     default.
+ *
+ * Datagrams from the kernel are read in batches straight into
+ * preallocated buffers of this size. When one doesn't fit, it is
+ * moved to a bigger buffer (at the cost of a copy) and the buffers
+ * are grown to its size (see wimaxll_recv_buf_grow_count()); setting
+ * this to the biggest message the driver is expected to send avoids
+ * that. ACKs are never lost, as only their header is needed.
+ *
+ * \ingroup mc_rx
+ */
+void wimaxll_recv_buf_size_set(struct wimaxll_handle *wmx, size_t size)
+{
+	void *buf;
+
+	wimaxll_rx_wmx(wmx)->rx_buf_size = size ? size : WIMAXLL_RX_BUF_SIZE;
+	if (size == 0)
+		size = WIMAXLL_TX_BUF_SIZE;
+	buf = realloc(wmx->tx_buf, size);
+	if (buf != NULL) {
+		wmx->tx_buf = buf;
+		wmx->tx_buf_size = size;
+	}
+}
+
+
+/**
+ * Return how many times the receive buffers had to be grown
+ *
+ * \param wmx WiMAX device handle
+ *
+ * Each time a datagram from the kernel doesn't fit in the receive
+ * buffers (see wimaxll_recv_buf_size_set()) they are grown and this
+ * counter incremented.
+ *
+ * \ingroup mc_rx
+ */
+unsigned long wimaxll_recv_buf_grow_count(struct wimaxll_handle *wmx)
+{
+	unsigned long count = wmx->recv_buf_grow_count;
+
+	if (wmx->rx_shared != NULL)
+		count += wmx->rx_shared->recv_buf_grow_count;
+	return count;
 }
 
 
@@ -282,18 +961,17 @@ int wimaxll_gnl_resolve(struct wimaxll_handle *wmx)
 	unsigned major, minor;
 
 	d_fnstart(5, wmx, "(wmx %p)\n", wmx);
-	/* Lookup the generic netlink family */
-	result = genl_ctrl_resolve(wmx->nlh_tx, "WiMAX");
-	if (result < 0) {
+	/* Lookup the generic netlink family (for netlink, cached
+	 * process-wide) */
+	version = wmx->transport->resolve(wmx);
+	if (version < 0) {
+		result = version;
 		wimaxll_msg(wmx, "E: can't find kernel's WiMAX API "
 			    "over genetic netlink: %d\n", result);
 		goto error_ctrl_resolve;
 	}
-	wmx->gnl_family_id = result;
 	d_printf(1, wmx, "D: WiMAX device %s, genl family ID %d\n",
 		 wmx->name, wmx->gnl_family_id);
-	wmx->mcg_id = -1;
-	nl_get_multicast_groups(wmx->nlh_tx, "WiMAX", wimaxll_mc_group_cb, wmx);
 	if (wmx->mcg_id == -1) {
 		wimaxll_msg(wmx, "E: %s: cannot resolve multicast group ID; "
 			  "your kernel might be too old (< 2.6.23).\n",
@@ -302,7 +980,6 @@ int wimaxll_gnl_resolve(struct wimaxll_handle *wmx)
 		goto error_mcg_resolve;
 	}
 
-	version = genl_ctrl_get_version(wmx->nlh_tx, "WiMAX");
 	/* Check version compatibility -- check include/linux/wimax.h
 	 * for a complete description. The idea is to allow for good
 	 * expandability of the interface without causing breakage. */
@@ -330,10 +1007,79 @@ error_ctrl_resolve:
 static
 void wimaxll_free(struct wimaxll_handle *wmx)
 {
+	pthread_mutex_destroy(&wmx->tx_mutex);
+	pthread_mutex_destroy(&wmx->sub_mutex);
+	pthread_mutex_destroy(&wmx->pipe_mutex);
+	pthread_mutex_destroy(&wmx->msg_mutex);
+	pthread_mutex_destroy(&wmx->rx_filter_mutex);
+	wimaxll_rx_lock_destroy(wmx);
 	free(wmx);
 }
 
 
+/*
+ * Set up the RX side of a handle
+ *
+ * \internal
+ *
+ * Either a socket of its own (set up by the transport) that joins
+ * the WiMAX 'msg' multicast group or, with %WIMAXLL_OPEN_SHARED_RX, the process-wide
+ * shared receiver.
+ */
+static
+int wimaxll_mc_rx_open(struct wimaxll_handle *wmx)
+{
+	int result;
+
+	if (wmx->flags & WIMAXLL_OPEN_SHARED_RX)
+		return wimaxll_rx_shared_attach(wmx);
+	result = wmx->transport->rx_open(wmx);
+	if (result < 0)
+		return result;
+	/* Not fatal, wimaxll_recv() filters anyway */
+	wimaxll_rx_filter_update(wmx);
+	return 0;
+}
+
+
+/*
+ * Set up the receive side of a handle if it wasn't yet
+ *
+ * \internal
+ *
+ * \param wmx WiMAX device handle
+ * \return 0 if ok, < 0 errno code on error.
+ *
+ * Handles opened with %WIMAXLL_OPEN_LAZY_RX don't join the multicast
+ * group until they need to receive: when a callback is set or
+ * wimaxll_recv_fd() / wimaxll_recv() are called.
+ */
+int wimaxll_mc_rx_ensure(struct wimaxll_handle *wmx)
+{
+	if (wmx->rx_fd >= 0 || wmx->rx_shared != NULL)
+		return 0;
+	d_printf(2, wmx, "D: RX: setting up on demand\n");
+	return wimaxll_mc_rx_open(wmx);
+}
+
+
+/*
+ * Tear down what wimaxll_mc_rx_open() set up
+ *
+ * \internal
+ */
+static
+void wimaxll_mc_rx_close(struct wimaxll_handle *wmx)
+{
+	if (wmx->rx_shared != NULL)
+		wimaxll_rx_shared_detach(wmx);
+	if (wmx->rx_fd >= 0)
+		wmx->transport->rx_close(wmx);
+	wmx->rx_filter_attached = 0;
+	wimaxll_recv_buf_release_all(wmx);
+}
+
+
 /**
  * Open a handle to the WiMAX control interface in the kernel
  *
@@ -367,11 +1113,67 @@ void wimaxll_free(struct wimaxll_handle *wmx)
  * supported by an interface.
  */
 struct wimaxll_handle *wimaxll_open(const char *device)
+{
+	return wimaxll_open_flags(device, 0);
+}
+
+
+/**
+ * Open a handle to the WiMAX control interface in the kernel
+ *
+ * \param device device name of the WiMAX network interface; same as
+ *     for wimaxll_open().
+ * \param flags Bitmask of flags from enum wimaxll_open_flags_e:
+ *
+ *     - %WIMAXLL_OPEN_SHARED_RX: don't open a multicast receive
+ *       socket for this handle; use a single process-wide one that
+ *       is shared by all the handles opened with this flag. Each
+ *       notification is read and parsed once and routed to the
+ *       handle(s) for the interface it is addressed to (instead of
+ *       each handle getting a copy and discarding those for other
+ *       devices). Reading from any of the shared handles
+ *       (wimaxll_recv(), wimaxll_msg_read(), etc) runs the callbacks
+ *       of all of them (only one thread reads at a time across all
+ *       of them), so wimaxll_open_flags() and wimaxll_close() for
+ *       them have to be serialized with those calls on any of the
+ *       shared handles, and a notification for a handle that has
+ *       no callback set when it arrives is dropped instead of queued.
+ *       wimaxll_recv_fd() returns the same file descriptor for all
+ *       of them.
+ *
+ *     - %WIMAXLL_OPEN_LAZY_RX: don't set up the receive side (socket
+ *       and multicast group membership) until it is needed; that is,
+ *       when a message-to-user or state change callback is set or
+ *       when wimaxll_recv_fd() or wimaxll_recv() are called. Handles
+ *       that only send commands (reset, rfkill, state get) then use
+ *       a single socket and don't get a copy of every notification.
+ *       Notifications sent by the kernel before that are not
+ *       received; for example, to read replies to messages sent
+ *       with wimaxll_msg_write(), set a callback or call
+ *       wimaxll_recv_fd() before writing.
+ *
+ *     - %WIMAXLL_OPEN_NO_PROBE: don't query the device's RFKILL
+ *       status to check it is a WiMAX device (and that the kernel
+ *       interface is one the library knows how to talk to); this
+ *       saves a request/ACK round trip to the kernel per open. If it
+ *       is not a WiMAX device, the first operation done with the
+ *       handle will fail with -%ENODEV (and a message explaining why
+ *       will be logged). To validate explicitly at a later time,
+ *       call wimaxll_rfkill() with %WIMAX_RF_QUERY.
+ *
+ * \return WiMAX device handle on success; on error, %NULL is returned
+ *     and the \a errno variable is updated with a corresponding
+ *     negative value.
+ *
+ * \ingroup device_management
+ */
+struct wimaxll_handle *wimaxll_open_flags(const char *device,
+					  unsigned flags)
 {
 	int result;
 	struct wimaxll_handle *wmx;
 
-	d_fnstart(3, NULL, "(device %s)\n", device);
+	d_fnstart(3, NULL, "(device %s flags 0x%x)\n", device, flags);
 	result = ENOMEM;
 	wmx = malloc(sizeof(*wmx));
 	if (wmx == NULL) {
@@ -379,6 +1181,18 @@ struct wimaxll_handle *wimaxll_open(const char *device)
 		goto error_gnl_handle_alloc;
 	}
 	memset(wmx, 0, sizeof(*wmx));
+	wmx->flags = flags;
+	wmx->transport = wimaxll_transport_get();
+	wmx->tx_fd = -1;
+	wmx->rx_fd = -1;
+	wmx->msg_queue_depth = WIMAXLL_MSG_QUEUE_DEPTH;
+	wmx->tx_seq = time(NULL);
+	pthread_mutex_init(&wmx->tx_mutex, NULL);
+	pthread_mutex_init(&wmx->sub_mutex, NULL);
+	pthread_mutex_init(&wmx->pipe_mutex, NULL);
+	pthread_mutex_init(&wmx->msg_mutex, NULL);
+	pthread_mutex_init(&wmx->rx_filter_mutex, NULL);
+	wimaxll_rx_lock_init(wmx);
 	if (device != NULL && sscanf(device, "#%u", &wmx->ifidx) == 1) {
 		/* Open by interface index "#IFINDEX" */
 		if (if_indextoname(wmx->ifidx, wmx->name) == NULL) {
@@ -403,52 +1217,26 @@ struct wimaxll_handle *wimaxll_open(const char *device)
 	}
 
 	/* Setup the TX side */
-	wmx->nlh_tx = nl_handle_alloc();
-	if (wmx->nlh_tx == NULL) {
-		result = nl_get_errno();
-		wimaxll_msg(wmx, "E: TX: cannot allocate handle: %d (%s)\n",
-			    result, nl_geterror());
-		goto error_nl_handle_alloc_tx;
-	}
-	nl_socket_enable_msg_peek(wmx->nlh_tx);
-
-	result = nl_connect(wmx->nlh_tx, NETLINK_GENERIC);
-	if (result < 0) {
-		wimaxll_msg(wmx, "E: TX: cannot connect netlink: %d (%s)\n",
-			    result, nl_geterror());
-		goto error_nl_connect_tx;
-	}
-
-	/* Set up the RX side */
-	wmx->nlh_rx = nl_handle_alloc();
-	if (wmx->nlh_rx == NULL) {
-		result = nl_get_errno();
-		wimaxll_msg(wmx, "E: RX: cannot allocate handle: %d (%s)\n",
-			    result, nl_geterror());
-		goto error_nl_handle_alloc_rx;
-	}
-	result = nl_connect(wmx->nlh_rx, NETLINK_GENERIC);
-	if (result < 0) {
-		wimaxll_msg(wmx, "E: RX: cannot connect netlink: %d (%s)\n",
-			    result, nl_geterror());
-		goto error_nl_connect_rx;
-	}
-	nl_socket_enable_msg_peek(wmx->nlh_rx);
+	result = wmx->transport->tx_open(wmx);
+	if (result < 0)
+		goto error_tx_open;
 
 	result = wimaxll_gnl_resolve(wmx);	/* Get genl information */
 	if (result < 0)				/* fills wmx->mcg_id */
 		goto error_gnl_resolve;
 
-	result = nl_socket_add_membership(wmx->nlh_rx, wmx->mcg_id);
-	if (result < 0) {
-		wimaxll_msg(wmx, "E: RX: cannot join multicast group %u: %d (%s)\n",
-			    wmx->mcg_id, result, nl_geterror());
-		goto error_nl_add_membership;
+	/* Set up the RX side (unless it is to be done on demand) */
+	if ((flags & WIMAXLL_OPEN_LAZY_RX) == 0) {
+		result = wimaxll_mc_rx_open(wmx);
+		if (result < 0)
+			goto error_mc_rx_open;
 	}
 	/* Now we check if the device is a WiMAX supported device, by
 	 * just querying for the RFKILL status. If this is not a WiMAX
 	 * device, it will fail with -ENODEV. */
-	if (wmx->ifidx > 0) {		/* if this handle is for any, don't check */
+	if (wmx->ifidx > 0 && (flags & WIMAXLL_OPEN_NO_PROBE))
+		wmx->probe_pending = 1;	/* first operation will tell */
+	else if (wmx->ifidx > 0) {	/* if this handle is for any, don't check */
 		result = wimaxll_rfkill(wmx, WIMAX_RF_QUERY);
 		if (result == -ENODEV) {
 			wimaxll_msg(wmx, "E: device %s is not a WiMAX device; "
@@ -457,25 +1245,21 @@ struct wimaxll_handle *wimaxll_open(const char *device)
 			goto error_rfkill;
 		}
 	}
-	d_fnend(3, wmx, "(device %s) = %p\n", device, wmx);
+	d_fnend(3, wmx, "(device %s flags 0x%x) = %p\n", device, flags, wmx);
 	return wmx;
 
 error_rfkill:
-error_nl_add_membership:
+	free(wmx->tx_buf);
+	wimaxll_mc_rx_close(wmx);
+error_mc_rx_open:
 error_gnl_resolve:
-	nl_close(wmx->nlh_rx);
-error_nl_connect_rx:
-	nl_handle_destroy(wmx->nlh_rx);
-error_nl_handle_alloc_rx:
-	nl_close(wmx->nlh_tx);
-error_nl_connect_tx:
-	nl_handle_destroy(wmx->nlh_tx);
-error_nl_handle_alloc_tx:
+	wmx->transport->tx_close(wmx);
+error_tx_open:
 error_no_dev:
 	wimaxll_free(wmx);
 error_gnl_handle_alloc:
 	errno = -result;
-	d_fnend(3, NULL, "(device %s) = NULL\n", device);
+	d_fnend(3, NULL, "(device %s flags 0x%x) = NULL\n", device, flags);
 	return NULL;
 }
 
@@ -488,14 +1272,25 @@ error_gnl_handle_alloc:
  * \internal
  *
  * Performs the natural oposite actions done in wimaxll_open().
+ *
+ * For a handle opened with %WIMAXLL_OPEN_SHARED_RX, waits for other
+ * threads that are running its callbacks to be done; it must not be
+ * called from one of them.
  */
 void wimaxll_close(struct wimaxll_handle *wmx)
 {
 	d_fnstart(3, NULL, "(wmx %p)\n", wmx);
-	nl_close(wmx->nlh_rx);
-	nl_handle_destroy(wmx->nlh_rx);
-	nl_close(wmx->nlh_tx);
-	nl_handle_destroy(wmx->nlh_tx);
+	wimaxll_tx_inflight_cancel(wmx);
+	/* First, so no callbacks run on what we release next */
+	wimaxll_mc_rx_close(wmx);
+	wimaxll_msg_borrowed_release_all(wmx);
+	wimaxll_msg_queue_release_all(wmx);
+	wimaxll_pipe_release_all(wmx);
+	wimaxll_sub_release_all(wmx);
+	wimaxll_rx_filter_release(wmx);
+	free(wmx->tx_buf);
+	wimaxll_msg_pool_put(wmx->msg_pool);
+	wmx->transport->tx_close(wmx);
 	wimaxll_free(wmx);
 	d_fnend(3, NULL, "(wmx %p) = void\n", wmx);
 }
@@ -39,6 +39,7 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <time.h>
 #include <assert.h>
 #include <linux/types.h>
 #include <netlink/msg.h>
@@ -50,6 +51,47 @@
 #include "debug.h"
 
 
+/*
+ * Allocate and fill out an RFKILL generic netlink message
+ *
+ * Returns NULL on error with *_result set to a negative errno code.
+ */
+static
+struct nl_msg *wimaxll_rfkill_msg(struct wimaxll_handle *wmx,
+				  enum wimax_rf_state state,
+				  ssize_t *_result)
+{
+	ssize_t result;
+	struct nl_msg *msg;
+
+	msg = nlmsg_new();
+	if (msg == NULL) {
+		result = errno;
+		wimaxll_msg(wmx, "E: RFKILL: cannot allocate generic netlink "
+			  "message: %m\n");
+		goto error_msg_alloc;
+	}
+	if (genlmsg_put(msg, NL_AUTO_PID, wimaxll_tx_seq_next(wmx),
+			wimaxll_family_id(wmx), 0, 0,
+			WIMAX_GNL_OP_RFKILL, WIMAX_GNL_VERSION) == NULL) {
+		result = -ENOMEM;
+		wimaxll_msg(wmx, "E: RFKILL: error preparing message: "
+			  "%zd 0x%08x\n", result, (unsigned int) result);
+		goto error_msg_prep;
+	}
+	nla_put_u32(msg, WIMAX_GNL_RFKILL_IFIDX,
+		    (__u32) wimaxll_ifidx(wmx));
+	nla_put_u32(msg, WIMAX_GNL_RFKILL_STATE, (__u32) state);
+	return msg;
+
+error_msg_prep:
+	nlmsg_free(msg);
+error_msg_alloc:
+	*_result = result;
+	return NULL;
+}
+
+
 /**
  * Control the software RF Kill switch and obtain switch status
  *
@@ -90,46 +132,102 @@
  * wimax_rfkill() and returns it's return code.
  */
 int wimaxll_rfkill(struct wimaxll_handle *wmx, enum wimax_rf_state state)
+{
+	return wimaxll_rfkill_deadline(wmx, state, NULL);
+}
+
+
+/**
+ * Same as wimaxll_rfkill(), but giving up at a deadline
+ *
+ * \param wmx WiMAX device handle
+ * \param state Same as for wimaxll_rfkill().
+ * \param deadline Absolute time (%CLOCK_MONOTONIC, see
+ *     wimaxll_deadline_set()) when to give up waiting for the device;
+ *     NULL to wait for as long as it takes.
+ * \return Same as wimaxll_rfkill(); -%ETIMEDOUT if the
+ *     deadline passed before the kernel answered (the operation
+ *     might still complete later).
+ *
+ * \ingroup device_management
+ */
+int wimaxll_rfkill_deadline(struct wimaxll_handle *wmx,
+			    enum wimax_rf_state state,
+			    const struct timespec *deadline)
 {
 	ssize_t result;
 	struct nl_msg *msg;
+	struct wimaxll_tx_waiter waiter;
 
 	d_fnstart(3, wmx, "(wmx %p state %u)\n", wmx, state);
 	result = -EBADF;
-	if (wmx->ifidx == 0)
+	if (wimaxll_ifidx(wmx) == 0)
 		goto error_not_any;
-	msg = nlmsg_new();
-	if (msg == NULL) {
-		result = errno;
-		wimaxll_msg(wmx, "E: RFKILL: cannot allocate generic netlink "
-			  "message: %m\n");
-		goto error_msg_alloc;
-	}
-	if (genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ,
-			wimaxll_family_id(wmx), 0, 0,
-			WIMAX_GNL_OP_RFKILL, WIMAX_GNL_VERSION) == NULL) {
-		result = -ENOMEM;
-		wimaxll_msg(wmx, "E: RFKILL: error preparing message: "
-			  "%zd 0x%08x\n", result, (unsigned int) result);
+	msg = wimaxll_rfkill_msg(wmx, state, &result);
+	if (msg == NULL)
 		goto error_msg_prep;
-	}
-	nla_put_u32(msg, WIMAX_GNL_RFKILL_IFIDX, (__u32) wmx->ifidx);
-	nla_put_u32(msg, WIMAX_GNL_RFKILL_STATE, (__u32) state);
-	result = nl_send_auto_complete(wmx->nlh_tx, msg);
+	wimaxll_tx_waiter_add(wmx, &waiter, nlmsg_hdr(msg)->nlmsg_seq);
+	result = wimaxll_send(wmx, msg);
 	if (result < 0) {
+		wimaxll_tx_waiter_del(wmx, &waiter);
 		wimaxll_msg(wmx, "E: RFKILL: error sending message: %zd\n",
 			  result);
 		goto error_msg_send;
 	}
 	/* Read the message ACK from netlink */
-	result = wimaxll_wait_for_ack(wmx);
+	result = wimaxll_wait_for_ack(wmx, &waiter, deadline);
 	if (result < 0 && result != -ENODEV)
 		wimaxll_msg(wmx, "E: RFKILL: operation failed: %zd\n", result);
-error_msg_prep:
 error_msg_send:
 	nlmsg_free(msg);
-error_msg_alloc:
+error_msg_prep:
 error_not_any:
 	d_fnend(3, wmx, "(wmx %p state %u) = %zd\n", wmx, state, result);
 	return result;
 }
+
+
+/**
+ * Start controlling the software RF Kill switch without waiting for
+ * it to complete
+ *
+ * \param wmx WiMAX device handle
+ * \param state Same as for wimaxll_rfkill().
+ * \param cb Function to call when the operation completes (with what
+ *     wimaxll_rfkill() would have returned); can be NULL.
+ * \param priv Private pointer to pass to \a cb.
+ * \return operation object to check with wimaxll_op_poll() and
+ *     release with wimaxll_op_free(); NULL on error, with \a errno
+ *     set.
+ *
+ * This never blocks: if %WIMAXLL_TX_INFLIGHT_MAX requests sent on
+ * the handle are still waiting for their ACK, it fails with \a errno
+ * set to %EAGAIN; process ACKs (wimaxll_tx_recv()) and try again.
+ * The same goes for all the *_start() calls.
+ *
+ * \ingroup device_management
+ */
+struct wimaxll_op *wimaxll_rfkill_start(struct wimaxll_handle *wmx,
+					enum wimax_rf_state state,
+					wimaxll_op_cb_f cb, void *priv)
+{
+	ssize_t result;
+	struct nl_msg *msg;
+	struct wimaxll_op *op = NULL;
+
+	d_fnstart(3, wmx, "(wmx %p state %u)\n", wmx, state);
+	result = -EBADF;
+	if (wimaxll_ifidx(wmx) == 0)
+		goto error_not_any;
+	msg = wimaxll_rfkill_msg(wmx, state, &result);
+	if (msg == NULL)
+		goto error_msg_prep;
+	op = wimaxll_op_send(wmx, msg, cb, priv, &result);
+	nlmsg_free(msg);
+error_msg_prep:
+error_not_any:
+	if (op == NULL)
+		errno = -result;
+	d_fnend(3, wmx, "(wmx %p state %u) = %p\n", wmx, state, op);
+	return op;
+}
@@ -43,6 +43,7 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <time.h>
 #include <assert.h>
 #include <linux/types.h>
 #include <netlink/msg.h>
@@ -54,6 +55,45 @@
 #include "debug.h"
 
 
+/*
+ * Allocate and fill out a STATE_GET generic netlink message
+ *
+ * Returns NULL on error with *_result set to a negative errno code.
+ */
+static
+struct nl_msg *wimaxll_state_get_msg(struct wimaxll_handle *wmx,
+				     ssize_t *_result)
+{
+	ssize_t result;
+	struct nl_msg *msg;
+
+	msg = nlmsg_new();
+	if (msg == NULL) {
+		result = errno;
+		wimaxll_msg(wmx, "E: STATE_GET: cannot allocate generic"
+			"netlink message: %m\n");
+		goto error_msg_alloc;
+	}
+	if (genlmsg_put(msg, NL_AUTO_PID, wimaxll_tx_seq_next(wmx),
+			wimaxll_family_id(wmx), 0, 0,
+			WIMAX_GNL_OP_STATE_GET, WIMAX_GNL_VERSION) == NULL) {
+		result = -ENOMEM;
+		wimaxll_msg(wmx, "E: STATE_GET: error preparing message: "
+			  "%zd 0x%08x\n", result, (unsigned int) result);
+		goto error_msg_prep;
+	}
+	nla_put_u32(msg, WIMAX_GNL_STGET_IFIDX,
+		    (__u32) wimaxll_ifidx(wmx));
+	return msg;
+
+error_msg_prep:
+	nlmsg_free(msg);
+error_msg_alloc:
+	*_result = result;
+	return NULL;
+}
+
+
 /**
  * Get Wimax device status from kernel and return it to user space
  *
@@ -64,49 +104,125 @@
  *
  * Allows the caller to get the state of the Wimax device.
  *
+ * If the handle keeps a state cache (wimaxll_state_cache_enable()),
+ * the state is taken from it, without asking the kernel, as long as
+ * it is known to be in sync.
+ *
  * \ingroup device_management
  * \internal
  *
  */
 int wimaxll_state_get(struct wimaxll_handle *wmx)
+{
+	return wimaxll_state_get_deadline(wmx, NULL);
+}
+
+
+/**
+ * Ask the kernel for the state of a WiMAX device
+ *
+ * \internal
+ *
+ * \param wmx WiMAX device handle
+ * \param deadline When to give up waiting for the kernel (NULL for
+ *     never).
+ * \return Same as wimaxll_state_get_deadline().
+ *
+ * Always does the round trip, whether the state cache is enabled or
+ * not (lib/state-cache.c uses it to seed the cache).
+ */
+int wimaxll_state_query(struct wimaxll_handle *wmx,
+			const struct timespec *deadline)
 {
 	ssize_t result;
 	struct nl_msg *msg;
+	struct wimaxll_tx_waiter waiter;
 
+	d_fnstart(3, wmx, "(wmx %p)\n", wmx);
 	result = -EBADF;
-	if (wmx->ifidx == 0)
+	if (wimaxll_ifidx(wmx) == 0)
 		goto error_not_any;
-	msg = nlmsg_new();
-	if (msg == NULL) {
-		result = errno;
-		wimaxll_msg(wmx, "E: STATE_GET: cannot allocate generic"
-			"netlink message: %m\n");
-		goto error_msg_alloc;
-	}
-	if (genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ,
-			wimaxll_family_id(wmx), 0, 0,
-			WIMAX_GNL_OP_STATE_GET, WIMAX_GNL_VERSION) == NULL) {
-		result = -ENOMEM;
-		wimaxll_msg(wmx, "E: STATE_GET: error preparing message: "
-			  "%zd 0x%08x\n", result, (unsigned int) result);
+	msg = wimaxll_state_get_msg(wmx, &result);
+	if (msg == NULL)
 		goto error_msg_prep;
-	}
-	nla_put_u32(msg, WIMAX_GNL_STGET_IFIDX, (__u32) wmx->ifidx);
-	result = nl_send_auto_complete(wmx->nlh_tx, msg);
+	wimaxll_tx_waiter_add(wmx, &waiter, nlmsg_hdr(msg)->nlmsg_seq);
+	result = wimaxll_send(wmx, msg);
 	if (result < 0) {
+		wimaxll_tx_waiter_del(wmx, &waiter);
 		wimaxll_msg(wmx, "E: STATE_GET: error sending message: %zd\n",
 			  result);
 		goto error_msg_send;
 	}
 	/* Read the message ACK from netlink */
-	result = wimaxll_wait_for_ack(wmx);
+	result = wimaxll_wait_for_ack(wmx, &waiter, deadline);
 	if (result < 0 && result != -ENODEV)
 		wimaxll_msg(wmx, "E: STATE_GET: operation failed: %zd\n", result);
-error_msg_prep:
 error_msg_send:
 	nlmsg_free(msg);
-error_msg_alloc:
+error_msg_prep:
 error_not_any:
 	d_fnend(3, wmx, "(wmx %p) = %zd\n", wmx, result);
 	return result;
 }
+
+
+/**
+ * Same as wimaxll_state_get(), but giving up at a deadline
+ *
+ * \param wmx WiMAX device handle
+ * \param deadline Absolute time (%CLOCK_MONOTONIC, see
+ *     wimaxll_deadline_set()) when to give up waiting for the device;
+ *     NULL to wait for as long as it takes.
+ * \return Same as wimaxll_state_get(); -%ETIMEDOUT if the
+ *     deadline passed before the kernel answered (the operation
+ *     might still complete later).
+ *
+ * \ingroup device_management
+ */
+int wimaxll_state_get_deadline(struct wimaxll_handle *wmx,
+			       const struct timespec *deadline)
+{
+	if (wmx->state_cache.enabled)
+		return wimaxll_state_cache_lookup(wmx, NULL, NULL, deadline);
+	return wimaxll_state_query(wmx, deadline);
+}
+
+
+/**
+ * Start querying the state of a WiMAX device without waiting for
+ * it to complete
+ *
+ * \param wmx WiMAX device handle
+ * \param cb Function to call when the operation completes (with what
+ *     wimaxll_state_get() would have returned); can be NULL.
+ * \param priv Private pointer to pass to \a cb.
+ * \return operation object to check with wimaxll_op_poll() and
+ *     release with wimaxll_op_free(); NULL on error, with \a errno
+ *     set (%EAGAIN if too many requests are in flight, see
+ *     wimaxll_rfkill_start()).
+ *
+ * \ingroup device_management
+ */
+struct wimaxll_op *wimaxll_state_get_start(struct wimaxll_handle *wmx,
+					   wimaxll_op_cb_f cb, void *priv)
+{
+	ssize_t result;
+	struct nl_msg *msg;
+	struct wimaxll_op *op = NULL;
+
+	d_fnstart(3, wmx, "(wmx %p)\n", wmx);
+	result = -EBADF;
+	if (wimaxll_ifidx(wmx) == 0)
+		goto error_not_any;
+	msg = wimaxll_state_get_msg(wmx, &result);
+	if (msg == NULL)
+		goto error_msg_prep;
+	op = wimaxll_op_send(wmx, msg, cb, priv, &result);
+	nlmsg_free(msg);
+error_msg_prep:
+error_not_any:
+	if (op == NULL)
+		errno = -result;
+	d_fnend(3, wmx, "(wmx %p) = %p\n", wmx, op);
+	return op;
+}
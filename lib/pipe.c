@@ -0,0 +1,340 @@
+/*
+ * Linux WiMAX
+ * Registry of message pipe names
+ *
+ *
+ * Copyright (C) 2007-2009 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ *
+ * Messages from the kernel carry the name of the pipe they are sent
+ * on as a string. Instead of comparing it against every pipe the
+ * application is interested in, each handle keeps a registry of the
+ * pipe names it knows about: wimaxll_pipe_register() interns a name
+ * once and returns a small integer ID for it, and each incoming
+ * message's pipe name is looked up in a hash table (the default
+ * pipe, which has no name, has its own slot, ID 0) to find its ID,
+ * its callback and its queue in one go.
+ *
+ * Pipes are never unregistered while the handle is open, so IDs are
+ * stable and can be used to index the application's own tables. The
+ * number of pipes is bounded (%WIMAXLL_PIPE_MAX), as names of pipes
+ * nobody asked for are interned too when their messages are queued
+ * (see lib/msg-queue.c).
+ *
+ * Pipes can be registered from any thread while another one receives
+ * and looks them up. As entries are only ever added (and the table
+ * of IDs has room for all of them, so it never moves), registering
+ * is serialized with the handle's \a pipe_mutex and looking up needs
+ * no lock: a new pipe is completely filled out before it is made
+ * visible in the hash table and the pipe count.
+ */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <wimaxll.h>
+#include "internal.h"
+#define D_LOCAL 0
+#include "debug.h"
+
+
+/*
+ * FNV-1a hash of a pipe name
+ */
+static
+unsigned wimaxll_pipe_hash(const char *name, size_t len)
+{
+	unsigned hash = 2166136261u;
+
+	while (len-- > 0)
+		hash = (hash ^ (unsigned char) *name++) * 16777619u;
+	return hash;
+}
+
+
+/**
+ * Find a registered pipe by name
+ *
+ * \internal
+ *
+ * \param wmx WiMAX device handle
+ * \param name Pipe name (NULL for the default pipe)
+ * \param len Length of \a name (not counting the terminating zero)
+ * \return the pipe or NULL if it is not registered.
+ */
+struct wimaxll_pipe *wimaxll_pipe_find(struct wimaxll_handle *wmx,
+				       const char *name, size_t len)
+{
+	unsigned hash;
+	struct wimaxll_pipe *pipe;
+
+	if (name == NULL)
+		return wimaxll_pipe_count(wmx) > 0 ? wmx->pipes[0] : NULL;
+	hash = wimaxll_pipe_hash(name, len);
+	for (pipe = wmx->pipe_hash[hash & (WIMAXLL_PIPE_HASH_SIZE - 1)];
+	     pipe != NULL; pipe = pipe->hash_next)
+		if (pipe->hash == hash && pipe->name_len == len
+		    && memcmp(pipe->name, name, len) == 0)
+			return pipe;
+	return NULL;
+}
+
+
+/*
+ * Allocate a registry entry and give it the next ID
+ *
+ * Called with the pipe mutex held.
+ */
+static
+struct wimaxll_pipe *__wimaxll_pipe_add(struct wimaxll_handle *wmx,
+					const char *name, size_t len)
+{
+	struct wimaxll_pipe *pipe;
+	unsigned bucket;
+
+	if (wmx->pipe_count >= WIMAXLL_PIPE_MAX)
+		return NULL;
+	pipe = calloc(1, sizeof(*pipe) + len + 1);
+	if (pipe == NULL)
+		return NULL;
+	pipe->id = wmx->pipe_count;
+	pipe->queue.depth = wmx->msg_queue_depth;
+	pipe->queue.policy = wmx->msg_queue_policy;
+	wmx->pipes[pipe->id] = pipe;
+	if (name != NULL) {
+		memcpy(pipe->name, name, len);
+		pipe->name_len = len;
+		pipe->hash = wimaxll_pipe_hash(name, len);
+		bucket = pipe->hash & (WIMAXLL_PIPE_HASH_SIZE - 1);
+		pipe->hash_next = wmx->pipe_hash[bucket];
+	}
+	/* Readers don't lock; make sure they see it complete */
+	__sync_synchronize();
+	if (name != NULL)
+		wmx->pipe_hash[bucket] = pipe;
+	wmx->pipe_count++;
+	return pipe;
+}
+
+
+/**
+ * Find a registered pipe by name, registering it if needed
+ *
+ * \internal
+ *
+ * \return the pipe; NULL if there is no memory or room for it.
+ */
+struct wimaxll_pipe *wimaxll_pipe_get(struct wimaxll_handle *wmx,
+				      const char *name)
+{
+	size_t len = name ? strlen(name) : 0;
+	struct wimaxll_pipe *pipe;
+
+	pipe = wimaxll_pipe_find(wmx, name, len);
+	if (pipe != NULL)
+		return pipe;
+	pthread_mutex_lock(&wmx->pipe_mutex);
+	/* Another thread might have registered it meanwhile */
+	pipe = wimaxll_pipe_find(wmx, name, len);
+	if (pipe != NULL)
+		goto out;
+	/* The default pipe always gets ID 0 */
+	if (wmx->pipe_count == 0 && name != NULL
+	    && __wimaxll_pipe_add(wmx, NULL, 0) == NULL)
+		goto out;
+	pipe = __wimaxll_pipe_add(wmx, name, len);
+out:
+	pthread_mutex_unlock(&wmx->pipe_mutex);
+	return pipe;
+}
+
+
+/*
+ * Free the registry (on close)
+ *
+ * \internal
+ *
+ * The queues have to have been emptied already.
+ */
+void wimaxll_pipe_release_all(struct wimaxll_handle *wmx)
+{
+	unsigned itr;
+
+	for (itr = 0; itr < wmx->pipe_count; itr++) {
+		free(wmx->pipes[itr]);
+		wmx->pipes[itr] = NULL;
+	}
+	wmx->pipe_count = 0;
+	memset(wmx->pipe_hash, 0, sizeof(wmx->pipe_hash));
+}
+
+
+/**
+ * Register a message pipe name and return its ID
+ *
+ * \param wmx WiMAX device handle
+ * \param pipe_name Name of the pipe (NULL for the default pipe).
+ * \return the ID of the pipe (>= 0) if ok, < 0 errno code on
+ *     error (-%ENOSPC if there are already %WIMAXLL_PIPE_MAX pipes).
+ *
+ * Registering a name that is already registered returns the same
+ * ID. The default pipe is always ID 0. IDs are small consecutive
+ * integers, valid until the handle is closed.
+ *
+ * \ingroup the_messaging_interface
+ */
+int wimaxll_pipe_register(struct wimaxll_handle *wmx, const char *pipe_name)
+{
+	struct wimaxll_pipe *pipe;
+
+	pipe = wimaxll_pipe_get(wmx, pipe_name);
+	if (pipe == NULL)
+		return wmx->pipe_count >= WIMAXLL_PIPE_MAX ? -ENOSPC : -ENOMEM;
+	return pipe->id;
+}
+
+
+/**
+ * Return the name of a registered message pipe
+ *
+ * \param wmx WiMAX device handle
+ * \param pipe_id ID returned by wimaxll_pipe_register()
+ * \return the name of the pipe; NULL for the default pipe or if \a
+ *     pipe_id is not registered.
+ *
+ * \ingroup the_messaging_interface
+ */
+const char *wimaxll_pipe_name(struct wimaxll_handle *wmx, int pipe_id)
+{
+	struct wimaxll_pipe *pipe;
+
+	if (pipe_id <= 0 || (unsigned) pipe_id >= wimaxll_pipe_count(wmx))
+		return NULL;
+	pipe = wmx->pipes[pipe_id];
+	return pipe->name;
+}
+
+
+/**
+ * Return the ID of the pipe of the message being delivered
+ *
+ * \param wmx WiMAX device handle
+ * \return the ID (see wimaxll_pipe_register()) of the pipe of the
+ *     message passed to the \ref wimaxll_msg_to_user_cb_f callback
+ *     that is running, or -%ENOENT if that pipe is not registered.
+ *
+ * Only valid when called from such a callback; it allows switching on
+ * an integer instead of comparing the pipe name.
+ *
+ * \ingroup the_messaging_interface
+ */
+int wimaxll_msg_pipe_id(struct wimaxll_handle *wmx)
+{
+	return wmx->rx_pipe_id;
+}
+
+
+/**
+ * Get the callback for messages of a pipe
+ *
+ * \param wmx WiMAX device handle
+ * \param pipe_id ID returned by wimaxll_pipe_register()
+ * \param cb Where to store the callback function (NULL if none).
+ * \param priv Where to store the private pointer.
+ * \return 0 if ok, -%ENOENT if \a pipe_id is not registered.
+ *
+ * \ingroup the_messaging_interface
+ */
+int wimaxll_pipe_get_cb_msg_to_user(struct wimaxll_handle *wmx, int pipe_id,
+				    wimaxll_msg_to_user_cb_f *cb,
+				    void **priv)
+{
+	struct wimaxll_pipe *pipe;
+
+	if (pipe_id < 0 || (unsigned) pipe_id >= wimaxll_pipe_count(wmx))
+		return -ENOENT;
+	pipe = wmx->pipes[pipe_id];
+	*cb = pipe->cb;
+	*priv = pipe->priv;
+	return 0;
+}
+
+
+/**
+ * Set the callback for messages of a pipe
+ *
+ * \param wmx WiMAX device handle
+ * \param pipe_id ID returned by wimaxll_pipe_register()
+ * \param cb Callback function to run for each message received on
+ *     the pipe (NULL to go back to the handle's callback).
+ * \param priv Private data pointer to pass to the callback
+ * \return 0 if ok, -%ENOENT if \a pipe_id is not registered; other
+ *     negative errno code if the receive side couldn't be set up (the
+ *     callback is not changed).
+ *
+ * Messages for a pipe that has a callback are passed to it instead
+ * of to the one set with wimaxll_set_cb_msg_to_user(); they are not
+ * queued for, nor returned by, wimaxll_msg_read(). Finding the
+ * callback costs a hash lookup, no matter how many pipes have one.
+ *
+ * Like wimaxll_set_cb_msg_to_user(), this sets up the receive side
+ * of handles opened with %WIMAXLL_OPEN_LAZY_RX and updates the
+ * kernel filter set with %WIMAXLL_RECV_FILTER_CB.
+ *
+ * \ingroup the_messaging_interface
+ */
+int wimaxll_pipe_set_cb_msg_to_user(struct wimaxll_handle *wmx, int pipe_id,
+				    wimaxll_msg_to_user_cb_f cb, void *priv)
+{
+	int result;
+	struct wimaxll_pipe *pipe;
+
+	if (pipe_id < 0 || (unsigned) pipe_id >= wimaxll_pipe_count(wmx))
+		return -ENOENT;
+	pipe = wmx->pipes[pipe_id];
+	if (cb != NULL) {
+		result = wimaxll_mc_rx_ensure(wmx);
+		if (result < 0)
+			return result;
+	}
+	pthread_mutex_lock(&wmx->pipe_mutex);
+	if (pipe->cb == NULL && cb != NULL)
+		wmx->pipe_cb_count++;
+	else if (pipe->cb != NULL && cb == NULL)
+		wmx->pipe_cb_count--;
+	pipe->cb = cb;
+	pipe->priv = priv;
+	pthread_mutex_unlock(&wmx->pipe_mutex);
+	wimaxll_rx_filter_update(wmx);
+	return 0;
+}
@@ -63,6 +63,20 @@
  *
  * Applications can query the current callback set for the state
  * change notifications with wimaxll_get_cb_state_change().
+ *
+ * Applications that ask for the state often (eg: health checks) can
+ * have the handle keep it up to date from the notifications with
+ * wimaxll_state_cache_enable(); wimaxll_state_get() then answers
+ * from the cache, and wimaxll_state_cache_get() also returns a
+ * generation counter and the time of the last change:
+ *
+ * @code
+ * wimaxll_state_cache_enable(wmx);
+ * ...
+ * state = wimaxll_state_cache_get(wmx, &generation, &changed);
+ * if (generation != last_generation)
+ *         ...; // it changed since we last looked
+ * @endcode
  */
 #define _GNU_SOURCE
 #include <sys/types.h>
@@ -105,10 +119,10 @@ struct nla_policy wimaxll_gnl_re_state_change_policy[WIMAX_GNL_ATTR_MAX + 1] = {
  *
  * \param wmx WiMAX device handle
  * \param mch WiMAX multicast group handle
- * \param msg Pointer to netlink message
+ * \param nl_hdr Pointer to netlink message header
  * \return \c enum nl_cb_action
  *
- * wimaxll_mc_rx_read() calls libnl's nl_recvmsgs() to receive messages;
+ * wimaxll_recv() calls recvmmsg() to receive messages;
  * when a valid message is received, it goes into a loop that selects
  * a callback to run for each type of message and it will call this
  * function.
@@ -118,17 +132,15 @@ struct nla_policy wimaxll_gnl_re_state_change_policy[WIMAX_GNL_ATTR_MAX + 1] = {
  * the callback defined in the handle.
  */
 int wimaxll_gnl_handle_state_change(struct wimaxll_handle *wmx,
-				    struct nl_msg *msg)
+				    struct nlmsghdr *nl_hdr)
 {
 	ssize_t result;
-	struct nlmsghdr *nl_hdr;
 	struct genlmsghdr *gnl_hdr;
 	struct nlattr *tb[WIMAX_GNL_ATTR_MAX+1];
 	enum wimax_st old_state, new_state;
-	unsigned dest_ifidx;
+	unsigned dest_ifidx, rx_ifidx;
 	
-	d_fnstart(7, wmx, "(wmx %p msg %p)\n", wmx, msg);
-	nl_hdr = nlmsg_hdr(msg);
+	d_fnstart(7, wmx, "(wmx %p nl_hdr %p)\n", wmx, nl_hdr);
 	gnl_hdr = nlmsg_data(nl_hdr);
 
 	assert(gnl_hdr->cmd == WIMAX_GNL_RE_STATE_CHANGE);
@@ -171,22 +183,22 @@ int wimaxll_gnl_handle_state_change(struct wimaxll_handle *wmx,
 	d_printf(1, wmx, "D: CRX re_state_change old %u new %u\n",
 		 old_state, new_state);
 
-	/* If this is an "any" handle, set the wmx->ifidx to the
-	 * received one so the callback can now where did the thing
-	 * come from. Will be restored.
-	 */
-	if (wmx->ifidx == 0) {
-		wmx->ifidx = dest_ifidx;
-		dest_ifidx = 0;
-	}
+	/* If this is an "any" handle, let the callback know where
+	 * did the thing come from (see wimaxll_ifidx()) */
+	rx_ifidx = wimaxll_rx_ifidx_set(wmx, dest_ifidx);
+	if (wmx->state_cache.enabled)
+		wimaxll_state_cache_update(wmx, old_state, new_state);
 	/* Now execute the callback for handling re-state-change; if
 	 * it doesn't update the context's result code, we'll do. */
-	result = wmx->state_change_cb(wmx, wmx->state_change_priv,
-				      old_state, new_state);
-	wmx->ifidx = dest_ifidx;
+	result = 0;
+	if (wmx->state_change_cb)
+		result = wmx->state_change_cb(wmx, wmx->state_change_priv,
+					      old_state, new_state);
+	result = wimaxll_sub_state_change(wmx, result, old_state, new_state);
+	wimaxll_rx_ifidx_set(wmx, rx_ifidx);
 error_no_attrs:
 error_parse:
-	d_fnend(7, wmx, "(wmx %p msg %p) = %zd\n", wmx, msg, result);
+	d_fnend(7, wmx, "(wmx %p nl_hdr %p) = %zd\n", wmx, nl_hdr, result);
 	return result;
 }
 
@@ -227,13 +239,29 @@ void wimaxll_get_cb_state_change(struct wimaxll_handle *wmx,
  * \param cb Callback function to set
  * \param priv Private data pointer to pass to the callback function.
  *
+ * Setting a callback sets up the receive side of handles opened
+ * with %WIMAXLL_OPEN_LAZY_RX (if that fails, the error is logged and
+ * wimaxll_recv_fd() will return it). If the handle was set up with
+ * wimaxll_recv_filter() and %WIMAXLL_RECV_FILTER_CB, this updates
+ * the kernel filter too.
+ *
  * \ingroup state_change_group
  */
 void wimaxll_set_cb_state_change(struct wimaxll_handle *wmx,
 			       wimaxll_state_change_cb_f cb, void *priv)
 {
+	int result;
+
 	wmx->state_change_cb = cb;
 	wmx->state_change_priv = priv;
+	if (cb != NULL) {
+		result = wimaxll_mc_rx_ensure(wmx);
+		if (result < 0)
+			wimaxll_msg(wmx, "E: cannot set up receiving, the "
+				    "state change callback won't be called: "
+				    "%d\n", result);
+	}
+	wimaxll_rx_filter_update(wmx);
 }
 
 
@@ -274,22 +302,45 @@ int wimaxll_cb_state_change(struct wimaxll_handle *wmx, void *_ctx,
  *
  * Internally, this function uses wimax_recv() , which means that on
  * reception (from the kernel) of notifications other than state
- * change, any callbacks that are set for them will be executed.
+ * change, any callbacks that are set for them will be executed. The
+ * state change callbacks (see wimaxll_set_cb_state_change() and
+ * wimaxll_add_cb_state_change()) see the state change too.
  *
  * \note This is a blocking call.
  *
- * \note This function cannot be run in parallel with other code that
- *     modifies the \e state \e change callbacks for this same handle.
- *
  * \ingroup state_change_group
  */
 ssize_t wimaxll_wait_for_state_change(struct wimaxll_handle *wmx,
 				      enum wimax_st *old_state,
 				      enum wimax_st *new_state)
+{
+	return wimaxll_wait_for_state_change_deadline(wmx, old_state,
+						      new_state, NULL);
+}
+
+
+/**
+ * Same as wimaxll_wait_for_state_change(), but giving up at a
+ * deadline
+ *
+ * \param wmx WiMAX device handle
+ * \param old_state Pointer to where to store the previous state
+ * \param new_state Pointer to where to store the new state
+ * \param deadline Absolute time (%CLOCK_MONOTONIC, see
+ *     wimaxll_deadline_set()) when to give up waiting; NULL to wait
+ *     for as long as it takes.
+ * \return Same as wimaxll_wait_for_state_change(); -%ETIMEDOUT if
+ *     the device didn't change state before the deadline.
+ *
+ * \ingroup state_change_group
+ */
+ssize_t wimaxll_wait_for_state_change_deadline(struct wimaxll_handle *wmx,
+					       enum wimax_st *old_state,
+					       enum wimax_st *new_state,
+					       const struct timespec *deadline)
 {
 	ssize_t result;
-	wimaxll_state_change_cb_f prev_cb = NULL;
-	void *prev_priv = NULL;
+	int token;
 	struct wimaxll_state_change_context ctx = {
 		.ctx = WIMAXLL_CB_CTX_INIT(wmx),
 		.old_state = old_state,
@@ -299,11 +350,20 @@ ssize_t wimaxll_wait_for_state_change(struct wimaxll_handle *wmx,
 
 	d_fnstart(3, wmx, "(wmx %p old_state %p new_state %p)\n",
 		  wmx, old_state, new_state);
-	wimaxll_get_cb_state_change(wmx, &prev_cb, &prev_priv);
-	wimaxll_set_cb_state_change(wmx, wimaxll_cb_state_change, &ctx.ctx);
-	result = wimaxll_recv(wmx);
+	result = wimaxll_add_cb_state_change(wmx, wimaxll_cb_state_change,
+					     &ctx.ctx);
+	if (result < 0)
+		goto error_add_cb;
+	token = result;
+	/* Another thread receiving might have got it for us already */
+	result = 0;
+	while (result >= 0 && !ctx.set)
+		result = wimaxll_recv_deadline(wmx, deadline);
 	/* the callback filled out *old_state and *new_state if ok */
-	wimaxll_set_cb_state_change(wmx, prev_cb, prev_priv);
+	if (result >= 0)
+		result = 0;
+	wimaxll_remove_cb(wmx, token);
+error_add_cb:
 	d_fnend(3, wmx, "(wmx %p old_state %p [%u] new_state %p [%u])\n",
 		wmx, old_state, *old_state, new_state, *new_state);
 	return result;
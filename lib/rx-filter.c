@@ -0,0 +1,662 @@
+/*
+ * Linux WiMAX
+ * Kernel-side filtering of notifications
+ *
+ *
+ * Copyright (C) 2007-2009 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * All the handles subscribed to the WiMAX 'msg' multicast group get
+ * a copy of every notification, for every device. A handle bound to
+ * a single interface discards in wimaxll_recv() the ones for other
+ * interfaces (-ENODEV), but they still wake it up and cost a copy to
+ * user space.
+ *
+ * Instead, we generate a classic BPF program and attach it to the
+ * handle's RX socket (SO_ATTACH_FILTER), so the kernel drops them.
+ * The program accepts only notifications that:
+ *
+ * - are a WIMAX_GNL_OP_MSG_TO_USER or a WIMAX_GNL_RE_STATE_CHANGE
+ *   (optionally, only those for which the handle has a callback set)
+ *
+ * - carry an IFIDX attribute that matches the handle's interface
+ *
+ * - (optionally, for MSG_TO_USER) come from one of a set of pipes.
+ *
+ * Classic BPF can't loop, so the attribute walk is unrolled for the
+ * first %WIMAXLL_RX_FILTER_ATTRS attributes (the kernel puts IFIDX
+ * and PIPE_NAME first). Anything the program can't make sense of is
+ * accepted and left for wimaxll_recv() to sort out, as loads past
+ * the end of the packet would make it drop it.
+ *
+ * Netlink headers and attributes are in host byte order, while BPF
+ * loads are big endian; we generate the program at run time, so we
+ * know which byte is which.
+ *
+ * With %WIMAXLL_RECV_FILTER_CB, the commands accepted are computed
+ * from what is registered in the handle: its callbacks, the pipes'
+ * callbacks, the message queues (once wimaxll_msg_read() has been
+ * used) and the state cache. Subscribers come and go (eg:
+ * wimaxll_wait_for_state_change() adds one for as long as it waits),
+ * so a command they needed stays accepted when they are removed;
+ * otherwise each wait would reattach the filter twice and what
+ * arrived between two waits would be dropped.
+ *
+ * Callbacks and subscribers are set from any thread, so computing,
+ * attaching and recording the filter is serialized with the
+ * handle's rx_filter_mutex; otherwise a thread that computed it
+ * before another registered something could attach it last.
+ *
+ * Only netlink transports get a filter; the test transport (see
+ * lib/fake.h) is not the kernel and is left alone.
+ *
+ * \internal
+ * \section Roadmap Roadmap
+ *
+ * \code
+ * wimaxll_recv_filter()
+ *   wimaxll_rx_filter_update()
+ *
+ * wimaxll_set_cb_msg_to_user()
+ * wimaxll_set_cb_state_change()
+ *   wimaxll_rx_filter_update()
+ *     wimaxll_rx_filter_gen()
+ *       wimaxll_rx_filter_gen_cmd()
+ * \endcode
+ */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <linux/filter.h>
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+#include <netlink/netlink.h>
+#include <wimaxll.h>
+#include "internal.h"
+#define D_LOCAL 0
+#include "debug.h"
+
+
+enum {
+	/* Number of attributes the program walks */
+	WIMAXLL_RX_FILTER_ATTRS = 4,
+	WIMAXLL_BPF_INSN_MAX = 1024,
+	WIMAXLL_BPF_LABEL_MAX = 64,
+	WIMAXLL_BPF_FIXUP_MAX = 256,
+	/* Scratch memory slots */
+	M_LEN = 0,		/* packet length */
+	M_X,			/* saved X register */
+	M_TMP,
+	M_NLA_LEN,		/* length of the current attribute */
+	M_IFIDX,		/* 1 if the IFIDX attribute matched */
+	M_PIPE,			/* offset of the PIPE_NAME attribute */
+	M_PIPE_LEN,		/* length of the PIPE_NAME attribute */
+	/* Offset of the first attribute */
+	WIMAXLL_BPF_ATTR_OFFSET = NLMSG_HDRLEN + GENL_HDRLEN,
+};
+
+
+/*
+ * BPF program being generated
+ *
+ * Jumps to labels are always done with BPF_JA (32 bit offset); a
+ * conditional jump to a label is a conditional that skips over the
+ * BPF_JA. Label offsets are resolved at the end.
+ */
+struct wimaxll_bpf {
+	struct sock_filter insn[WIMAXLL_BPF_INSN_MAX];
+	unsigned cnt;
+	unsigned labels;
+	int label_pos[WIMAXLL_BPF_LABEL_MAX];
+	struct {
+		unsigned insn, label;
+	} fixup[WIMAXLL_BPF_FIXUP_MAX];
+	unsigned fixups;
+	unsigned overflow:1;
+	/* Offsets of the low and high bytes of a host u16 */
+	unsigned lo, hi;
+};
+
+
+static
+void bpf_emit(struct wimaxll_bpf *bpf, __u16 code, __u32 k, __u8 jt, __u8 jf)
+{
+	struct sock_filter *insn;
+
+	if (bpf->cnt >= WIMAXLL_BPF_INSN_MAX) {
+		bpf->overflow = 1;
+		return;
+	}
+	insn = &bpf->insn[bpf->cnt++];
+	insn->code = code;
+	insn->k = k;
+	insn->jt = jt;
+	insn->jf = jf;
+}
+
+
+static
+unsigned bpf_label_new(struct wimaxll_bpf *bpf)
+{
+	if (bpf->labels >= WIMAXLL_BPF_LABEL_MAX) {
+		bpf->overflow = 1;
+		return 0;
+	}
+	bpf->label_pos[bpf->labels] = -1;
+	return bpf->labels++;
+}
+
+
+static
+void bpf_label_here(struct wimaxll_bpf *bpf, unsigned label)
+{
+	bpf->label_pos[label] = bpf->cnt;
+}
+
+
+static
+void bpf_goto(struct wimaxll_bpf *bpf, unsigned label)
+{
+	if (bpf->fixups >= WIMAXLL_BPF_FIXUP_MAX) {
+		bpf->overflow = 1;
+		return;
+	}
+	bpf->fixup[bpf->fixups].insn = bpf->cnt;
+	bpf->fixup[bpf->fixups].label = label;
+	bpf->fixups++;
+	bpf_emit(bpf, BPF_JMP | BPF_JA, 0, 0, 0);
+}
+
+
+/* if (A <op> k) goto label */
+static
+void bpf_goto_if(struct wimaxll_bpf *bpf, __u16 op, __u32 k, unsigned label)
+{
+	bpf_emit(bpf, BPF_JMP | op | BPF_K, k, 0, 1);
+	bpf_goto(bpf, label);
+}
+
+
+/* if !(A <op> k) goto label */
+static
+void bpf_goto_ifnot(struct wimaxll_bpf *bpf, __u16 op, __u32 k,
+		    unsigned label)
+{
+	bpf_emit(bpf, BPF_JMP | op | BPF_K, k, 1, 0);
+	bpf_goto(bpf, label);
+}
+
+
+/* if (A > packet length) goto label; X is preserved */
+static
+void bpf_goto_if_past_end(struct wimaxll_bpf *bpf, unsigned label)
+{
+	bpf_emit(bpf, BPF_STX, M_X, 0, 0);
+	bpf_emit(bpf, BPF_LDX | BPF_MEM, M_LEN, 0, 0);
+	bpf_emit(bpf, BPF_JMP | BPF_JGT | BPF_X, 0, 0, 2);
+	bpf_emit(bpf, BPF_LDX | BPF_MEM, M_X, 0, 0);
+	bpf_goto(bpf, label);
+	bpf_emit(bpf, BPF_LDX | BPF_MEM, M_X, 0, 0);
+}
+
+
+/* A = host u16 at X + offset; X is preserved */
+static
+void bpf_load_u16(struct wimaxll_bpf *bpf, unsigned offset)
+{
+	bpf_emit(bpf, BPF_LD | BPF_B | BPF_IND, offset + bpf->lo, 0, 0);
+	bpf_emit(bpf, BPF_ST, M_TMP, 0, 0);
+	bpf_emit(bpf, BPF_LD | BPF_B | BPF_IND, offset + bpf->hi, 0, 0);
+	bpf_emit(bpf, BPF_ALU | BPF_LSH | BPF_K, 8, 0, 0);
+	bpf_emit(bpf, BPF_STX, M_X, 0, 0);
+	bpf_emit(bpf, BPF_LDX | BPF_MEM, M_TMP, 0, 0);
+	bpf_emit(bpf, BPF_ALU | BPF_OR | BPF_X, 0, 0, 0);
+	bpf_emit(bpf, BPF_LDX | BPF_MEM, M_X, 0, 0);
+}
+
+
+/*
+ * Value a BPF word load returns for @size bytes of @data (zero
+ * padded)
+ */
+static
+__u32 bpf_word(const void *data, size_t size)
+{
+	const unsigned char *p = data;
+	__u32 word = 0;
+	unsigned itr;
+
+	for (itr = 0; itr < 4; itr++)
+		word = (word << 8) | (itr < size ? p[itr] : 0);
+	return word;
+}
+
+
+/*
+ * Generate the checks for the attributes of a command
+ *
+ * Walks the attributes looking for the IFIDX one (rejecting if it
+ * doesn't match) and the PIPE_NAME one (if @pipe_type is not 0);
+ * then, if there is a list of pipes, checks the PIPE_NAME against it.
+ */
+static
+void wimaxll_rx_filter_gen_cmd(struct wimaxll_bpf *bpf,
+			       struct wimaxll_handle *wmx,
+			       unsigned ifidx_type, unsigned pipe_type,
+			       unsigned accept, unsigned reject)
+{
+	unsigned itr, word, words, next_attr, next_pipe, size;
+	unsigned walk_done = bpf_label_new(bpf);
+	__u32 ifidx = wmx->ifidx;
+	const char *pipe_name;
+
+	bpf_emit(bpf, BPF_LD | BPF_IMM, 0, 0, 0);
+	bpf_emit(bpf, BPF_ST, M_IFIDX, 0, 0);
+	bpf_emit(bpf, BPF_ST, M_PIPE, 0, 0);
+	/* The kernel rejects programs that might read unset slots */
+	bpf_emit(bpf, BPF_ST, M_PIPE_LEN, 0, 0);
+	bpf_emit(bpf, BPF_ST, M_NLA_LEN, 0, 0);
+	bpf_emit(bpf, BPF_LDX | BPF_IMM, WIMAXLL_BPF_ATTR_OFFSET, 0, 0);
+	for (itr = 0; itr < WIMAXLL_RX_FILTER_ATTRS; itr++) {
+		next_attr = bpf_label_new(bpf);
+		/* Header within the packet? */
+		bpf_emit(bpf, BPF_MISC | BPF_TXA, 0, 0, 0);
+		bpf_emit(bpf, BPF_ALU | BPF_ADD | BPF_K, NLA_HDRLEN, 0, 0);
+		bpf_goto_if_past_end(bpf, walk_done);
+		/* Sane length and payload within the packet? */
+		bpf_load_u16(bpf, 0);
+		bpf_emit(bpf, BPF_ST, M_NLA_LEN, 0, 0);
+		bpf_goto_ifnot(bpf, BPF_JGE, NLA_HDRLEN, walk_done);
+		bpf_emit(bpf, BPF_ALU | BPF_ADD | BPF_X, 0, 0, 0);
+		bpf_goto_if_past_end(bpf, walk_done);
+		/* Type */
+		bpf_load_u16(bpf, 2);
+		bpf_emit(bpf, BPF_ALU | BPF_AND | BPF_K, 0x3fff, 0, 0);
+		if (pipe_type != 0) {
+			bpf_emit(bpf, BPF_JMP | BPF_JEQ | BPF_K, pipe_type,
+				 0, 4);
+			bpf_emit(bpf, BPF_STX, M_PIPE, 0, 0);
+			bpf_emit(bpf, BPF_LD | BPF_MEM, M_NLA_LEN, 0, 0);
+			bpf_emit(bpf, BPF_ST, M_PIPE_LEN, 0, 0);
+			bpf_goto(bpf, next_attr);
+		}
+		bpf_goto_ifnot(bpf, BPF_JEQ, ifidx_type, next_attr);
+		bpf_emit(bpf, BPF_LD | BPF_MEM, M_NLA_LEN, 0, 0);
+		bpf_goto_ifnot(bpf, BPF_JGE, NLA_HDRLEN + sizeof(__u32),
+			       walk_done);
+		bpf_emit(bpf, BPF_LD | BPF_W | BPF_IND, NLA_HDRLEN, 0, 0);
+		bpf_goto_ifnot(bpf, BPF_JEQ, bpf_word(&ifidx, sizeof(ifidx)),
+			       reject);
+		bpf_emit(bpf, BPF_LD | BPF_IMM, 1, 0, 0);
+		bpf_emit(bpf, BPF_ST, M_IFIDX, 0, 0);
+		/* Move on to the next one */
+		bpf_label_here(bpf, next_attr);
+		bpf_emit(bpf, BPF_LD | BPF_MEM, M_NLA_LEN, 0, 0);
+		bpf_emit(bpf, BPF_ALU | BPF_ADD | BPF_K, NLA_ALIGNTO - 1, 0, 0);
+		bpf_emit(bpf, BPF_ALU | BPF_AND | BPF_K, ~(NLA_ALIGNTO - 1),
+			 0, 0);
+		bpf_emit(bpf, BPF_ALU | BPF_ADD | BPF_X, 0, 0, 0);
+		bpf_emit(bpf, BPF_MISC | BPF_TAX, 0, 0, 0);
+	}
+	bpf_label_here(bpf, walk_done);
+	if (pipe_type == 0 || wmx->rx_filter_pipe_count == 0) {
+		bpf_goto(bpf, accept);
+		return;
+	}
+	/* If we couldn't find the IFIDX, we can't trust the walk */
+	bpf_emit(bpf, BPF_LD | BPF_MEM, M_IFIDX, 0, 0);
+	bpf_goto_if(bpf, BPF_JEQ, 0, accept);
+	/* No PIPE_NAME attribute means the default pipe */
+	bpf_emit(bpf, BPF_LD | BPF_MEM, M_PIPE, 0, 0);
+	for (itr = 0; itr < wmx->rx_filter_pipe_count; itr++)
+		if (wmx->rx_filter_pipes[itr] == NULL)
+			bpf_goto_if(bpf, BPF_JEQ, 0, accept);
+	bpf_goto_if(bpf, BPF_JEQ, 0, reject);
+	for (itr = 0; itr < wmx->rx_filter_pipe_count; itr++) {
+		pipe_name = wmx->rx_filter_pipes[itr];
+		if (pipe_name == NULL)
+			continue;
+		next_pipe = bpf_label_new(bpf);
+		size = strlen(pipe_name) + 1;
+		words = (size + 3) / 4;
+		bpf_emit(bpf, BPF_LD | BPF_MEM, M_PIPE_LEN, 0, 0);
+		bpf_goto_ifnot(bpf, BPF_JEQ, NLA_HDRLEN + size, next_pipe);
+		bpf_emit(bpf, BPF_LDX | BPF_MEM, M_PIPE, 0, 0);
+		bpf_emit(bpf, BPF_MISC | BPF_TXA, 0, 0, 0);
+		bpf_emit(bpf, BPF_ALU | BPF_ADD | BPF_K,
+			 NLA_HDRLEN + 4 * words, 0, 0);
+		bpf_goto_if_past_end(bpf, next_pipe);
+		for (word = 0; word < words; word++) {
+			bpf_emit(bpf, BPF_LD | BPF_W | BPF_IND,
+				 NLA_HDRLEN + 4 * word, 0, 0);
+			bpf_goto_ifnot(bpf, BPF_JEQ,
+				       bpf_word(pipe_name + 4 * word,
+						size - 4 * word),
+				       next_pipe);
+		}
+		bpf_goto(bpf, accept);
+		bpf_label_here(bpf, next_pipe);
+	}
+	bpf_goto(bpf, reject);
+}
+
+
+/*
+ * Generate the filter program for a handle
+ *
+ * \param cmds Bitmap of the commands to accept (1 << cmd)
+ * \return 0 if ok, -E2BIG if the program is too big.
+ */
+static
+int wimaxll_rx_filter_gen(struct wimaxll_bpf *bpf,
+			  struct wimaxll_handle *wmx, unsigned cmds)
+{
+	unsigned itr, accept, reject, msg_to_user, state_change;
+	union {
+		__u16 val;
+		__u8 byte[2];
+	} probe = { .val = 1 };
+
+	memset(bpf, 0, sizeof(*bpf));
+	bpf->lo = probe.byte[0] == 1 ? 0 : 1;
+	bpf->hi = 1 - bpf->lo;
+	accept = bpf_label_new(bpf);
+	reject = bpf_label_new(bpf);
+	msg_to_user = bpf_label_new(bpf);
+	state_change = bpf_label_new(bpf);
+
+	bpf_emit(bpf, BPF_LD | BPF_W | BPF_LEN, 0, 0, 0);
+	bpf_emit(bpf, BPF_ST, M_LEN, 0, 0);
+	/* Too short to have a command? let user space deal with it */
+	bpf_goto_ifnot(bpf, BPF_JGE, WIMAXLL_BPF_ATTR_OFFSET, accept);
+	bpf_emit(bpf, BPF_LD | BPF_B | BPF_ABS,
+		 NLMSG_HDRLEN + offsetof(struct genlmsghdr, cmd), 0, 0);
+	if (cmds & (1 << WIMAX_GNL_OP_MSG_TO_USER))
+		bpf_goto_if(bpf, BPF_JEQ, WIMAX_GNL_OP_MSG_TO_USER,
+			    msg_to_user);
+	if (cmds & (1 << WIMAX_GNL_RE_STATE_CHANGE))
+		bpf_goto_if(bpf, BPF_JEQ, WIMAX_GNL_RE_STATE_CHANGE,
+			    state_change);
+	bpf_goto(bpf, reject);
+
+	bpf_label_here(bpf, msg_to_user);
+	wimaxll_rx_filter_gen_cmd(bpf, wmx, WIMAX_GNL_MSG_IFIDX,
+				  WIMAX_GNL_MSG_PIPE_NAME, accept, reject);
+	bpf_label_here(bpf, state_change);
+	wimaxll_rx_filter_gen_cmd(bpf, wmx, WIMAX_GNL_STCH_IFIDX, 0,
+				  accept, reject);
+
+	bpf_label_here(bpf, accept);
+	bpf_emit(bpf, BPF_RET | BPF_K, 0xffffffff, 0, 0);
+	bpf_label_here(bpf, reject);
+	bpf_emit(bpf, BPF_RET | BPF_K, 0, 0, 0);
+
+	if (bpf->overflow)
+		return -E2BIG;
+	for (itr = 0; itr < bpf->fixups; itr++)
+		bpf->insn[bpf->fixup[itr].insn].k =
+			bpf->label_pos[bpf->fixup[itr].label]
+			- bpf->fixup[itr].insn - 1;
+	return 0;
+}
+
+
+/*
+ * Regenerate and attach (if needed) the filter for a handle
+ *
+ * Called with the handle's rx_filter_mutex held, so two threads
+ * can't attach filters computed from different registrations in
+ * the wrong order.
+ */
+static
+int __wimaxll_rx_filter_update(struct wimaxll_handle *wmx)
+{
+	int result;
+	unsigned cmds;
+	struct wimaxll_bpf *bpf;
+	struct sock_fprog prog;
+
+	if (wmx->rx_fd < 0 || wmx->ifidx == 0 || !wmx->transport->rx_filter
+	    || (wmx->rx_filter_flags & WIMAXLL_RECV_FILTER_NONE))
+		return 0;
+	cmds = (1 << WIMAX_GNL_OP_MSG_TO_USER)
+		| (1 << WIMAX_GNL_RE_STATE_CHANGE);
+	if (wmx->rx_filter_flags & WIMAXLL_RECV_FILTER_CB) {
+		if (wmx->sub_count[WIMAXLL_SUB_MSG_TO_USER] > 0)
+			wmx->rx_filter_sub_cmds |=
+				1 << WIMAX_GNL_OP_MSG_TO_USER;
+		if (wmx->sub_count[WIMAXLL_SUB_STATE_CHANGE] > 0)
+			wmx->rx_filter_sub_cmds |=
+				1 << WIMAX_GNL_RE_STATE_CHANGE;
+		if (!wimaxll_has_cb_msg_to_user(wmx)
+		    && !(wmx->rx_filter_sub_cmds
+			 & (1 << WIMAX_GNL_OP_MSG_TO_USER)))
+			cmds &= ~(1 << WIMAX_GNL_OP_MSG_TO_USER);
+		if (!wimaxll_has_cb_state_change(wmx)
+		    && !(wmx->rx_filter_sub_cmds
+			 & (1 << WIMAX_GNL_RE_STATE_CHANGE)))
+			cmds &= ~(1 << WIMAX_GNL_RE_STATE_CHANGE);
+	}
+	if (wmx->rx_filter_attached && cmds == wmx->rx_filter_cmds)
+		return 0;
+	result = -ENOMEM;
+	bpf = malloc(sizeof(*bpf));
+	if (bpf == NULL)
+		goto error_alloc;
+	result = wimaxll_rx_filter_gen(bpf, wmx, cmds);
+	if (result < 0) {
+		wimaxll_msg(wmx, "E: RX filter: program too big\n");
+		goto error_gen;
+	}
+	prog.len = bpf->cnt;
+	prog.filter = bpf->insn;
+	result = setsockopt(wmx->rx_fd, SOL_SOCKET,
+			    SO_ATTACH_FILTER, &prog, sizeof(prog));
+	if (result < 0) {
+		result = -errno;
+		wimaxll_msg(wmx, "E: RX filter: can't attach: %d\n", result);
+		goto error_attach;
+	}
+	d_printf(2, wmx, "D: RX filter: %u instructions, cmds 0x%x\n",
+		 bpf->cnt, cmds);
+	wmx->rx_filter_cmds = cmds;
+	wmx->rx_filter_attached = 1;
+	result = 0;
+error_attach:
+error_gen:
+	free(bpf);
+error_alloc:
+	return result;
+}
+
+
+/*
+ * Regenerate and attach (if needed) the filter for a handle
+ *
+ * \internal
+ *
+ * \param wmx WiMAX device handle
+ * \return 0 if ok, < 0 errno code on error.
+ *
+ * Called when the RX socket is created, when the filter settings
+ * change and when callbacks are set or subscribers added (as with
+ * %WIMAXLL_RECV_FILTER_CB the commands accepted depend on them). If
+ * the set of commands to accept didn't change, it does nothing.
+ *
+ * Callers register what they need before calling, from any thread;
+ * the last one to get here sees all of it.
+ */
+int wimaxll_rx_filter_update(struct wimaxll_handle *wmx)
+{
+	int result;
+
+	pthread_mutex_lock(&wmx->rx_filter_mutex);
+	result = __wimaxll_rx_filter_update(wmx);
+	pthread_mutex_unlock(&wmx->rx_filter_mutex);
+	return result;
+}
+
+
+static
+void wimaxll_rx_filter_pipes_free(char **pipes, size_t pipe_count)
+{
+	size_t itr;
+
+	for (itr = 0; itr < pipe_count; itr++)
+		free(pipes[itr]);
+	free(pipes);
+}
+
+
+/*
+ * Release the filter settings (on close)
+ *
+ * \internal
+ */
+void wimaxll_rx_filter_release(struct wimaxll_handle *wmx)
+{
+	wimaxll_rx_filter_pipes_free(wmx->rx_filter_pipes,
+				     wmx->rx_filter_pipe_count);
+	wmx->rx_filter_pipes = NULL;
+	wmx->rx_filter_pipe_count = 0;
+}
+
+
+/**
+ * Control which notifications the kernel delivers to a handle
+ *
+ * \param wmx WiMAX device handle
+ * \param flags Bitmask of flags from enum wimaxll_recv_filter_e:
+ *
+ *     - %WIMAXLL_RECV_FILTER_CB: accept only the notifications for
+ *       which a callback is set when they arrive (message to user
+ *       with wimaxll_set_cb_msg_to_user() or
+ *       wimaxll_pipe_set_cb_msg_to_user(), state change with
+ *       wimaxll_set_cb_state_change()) or that are being queued for
+ *       wimaxll_msg_read(); the rest are dropped by the kernel
+ *       instead of being queued, so notifications that arrive while
+ *       no callback is set are lost. The filter is regenerated when
+ *       a callback is set or cleared. Callbacks added with
+ *       wimaxll_add_cb_msg_to_user() or
+ *       wimaxll_add_cb_state_change() (also the ones
+ *       wimaxll_wait_for_state_change() adds while it waits) keep
+ *       their notifications accepted after they are removed, until
+ *       this is called again.
+ *
+ *     - %WIMAXLL_RECV_FILTER_NONE: remove the filter; the handle
+ *       gets every notification, for all devices (as handles for
+ *       "any" device always do).
+ *
+ * \param pipe_names Array of names of pipes whose messages to accept
+ *     (NULL entries stand for the default pipe); the rest are dropped
+ *     by the kernel. Can be NULL to accept messages from all pipes.
+ * \param pipe_count Number of entries in \a pipe_names.
+ * \return 0 if ok, < 0 errno code on error (-%EOPNOTSUPP if the
+ *     handle is for "any" device or opened with
+ *     %WIMAXLL_OPEN_SHARED_RX).
+ *
+ * Handles that are bound to a single interface (and have their own
+ * receive socket) get a socket filter attached when opened, so the
+ * kernel only delivers to them the message-to-user and state change
+ * notifications addressed to their interface; this is cheaper than
+ * having them woken up and discarding them in wimaxll_recv(). This
+ * call allows to narrow that down further. Handles on a test
+ * transport (see lib/fake.h) get no filter; the settings are only
+ * recorded.
+ *
+ * \ingroup mc_rx
+ */
+int wimaxll_recv_filter(struct wimaxll_handle *wmx, unsigned flags,
+			const char * const *pipe_names, size_t pipe_count)
+{
+	int result;
+	size_t itr, old_pipe_count;
+	char **pipes = NULL, **old_pipes;
+
+	d_fnstart(3, wmx, "(wmx %p flags 0x%x pipe_names %p pipe_count "
+		  "%zu)\n", wmx, flags, pipe_names, pipe_count);
+	result = -EOPNOTSUPP;
+	if (wmx->ifidx == 0 || (wmx->flags & WIMAXLL_OPEN_SHARED_RX))
+		goto error_not_supported;
+	result = -ENOMEM;
+	if (pipe_count > 0) {
+		pipes = calloc(pipe_count, sizeof(pipes[0]));
+		if (pipes == NULL)
+			goto error_alloc;
+	}
+	for (itr = 0; itr < pipe_count; itr++) {
+		if (pipe_names[itr] == NULL)
+			continue;
+		pipes[itr] = strdup(pipe_names[itr]);
+		if (pipes[itr] == NULL)
+			goto error_dup;
+	}
+	pthread_mutex_lock(&wmx->rx_filter_mutex);
+	old_pipes = wmx->rx_filter_pipes;
+	old_pipe_count = wmx->rx_filter_pipe_count;
+	wmx->rx_filter_pipes = pipes;
+	wmx->rx_filter_pipe_count = pipe_count;
+	wmx->rx_filter_flags = flags;
+	wmx->rx_filter_sub_cmds = 0;
+	wmx->rx_filter_attached = 0;
+	if (flags & WIMAXLL_RECV_FILTER_NONE) {
+		result = 0;
+		if (wmx->rx_fd >= 0 && wmx->transport->rx_filter)
+			result = setsockopt(wmx->rx_fd,
+					    SOL_SOCKET, SO_DETACH_FILTER,
+					    NULL, 0);
+		if (result < 0 && errno != ENOENT)
+			result = -errno;
+		else
+			result = 0;
+	} else
+		result = __wimaxll_rx_filter_update(wmx);
+	pthread_mutex_unlock(&wmx->rx_filter_mutex);
+	wimaxll_rx_filter_pipes_free(old_pipes, old_pipe_count);
+	d_fnend(3, wmx, "(wmx %p flags 0x%x pipe_names %p pipe_count "
+		"%zu) = %d\n", wmx, flags, pipe_names, pipe_count, result);
+	return result;
+
+error_dup:
+	while (itr-- > 0)
+		free(pipes[itr]);
+	free(pipes);
+error_alloc:
+error_not_supported:
+	d_fnend(3, wmx, "(wmx %p flags 0x%x pipe_names %p pipe_count "
+		"%zu) = %d\n", wmx, flags, pipe_names, pipe_count, result);
+	return result;
+}
@@ -0,0 +1,380 @@
+/*
+ * Linux WiMAX
+ * Process-wide shared receiver for notifications
+ *
+ *
+ * Copyright (C) 2007-2009 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * Each handle normally has its own socket subscribed to the WiMAX
+ * 'msg' multicast group, so the kernel sends a copy of every
+ * notification to every handle, and each one parses and discards
+ * those for other interfaces.
+ *
+ * Handles opened with %WIMAXLL_OPEN_SHARED_RX attach instead to a
+ * single process-wide receiver (a bare handle that has only the RX
+ * side). Reading through any of them reads from the receiver's
+ * socket; for each notification, we look up the interface index it
+ * is addressed to and run the callbacks of only the handles for that
+ * interface (plus the ones for "any" interface), found through a hash
+ * table keyed by interface index.
+ *
+ * The mutex protects the hash table and the receiver's life cycle;
+ * it is not held while running callbacks. Instead, each handle a
+ * notification is dispatched to is referenced (\a rx_shared_refs)
+ * until its callbacks are done, and detaching waits for that, so a
+ * handle closed by another thread is not freed under them.
+ */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <netlink/msg.h>
+#include <netlink/netlink.h>
+#include <netlink/genl/genl.h>
+#include <wimaxll.h>
+#include "internal.h"
+#define D_LOCAL 0
+#include "debug.h"
+
+
+/*
+ * Process-wide shared receiver
+ *
+ * \param mutex Protects the whole structure.
+ * \param cond Signalled (with \a mutex) when a handle's \a
+ *     rx_shared_refs drops to zero and \a detach_waiting.
+ * \param detach_waiting Number of threads waiting in
+ *     wimaxll_rx_shared_detach() for a handle to be released.
+ * \param wmx Receiver handle (NULL if there are no handles attached)
+ * \param refcount Number of handles attached
+ * \param hash Handles attached, by interface index (chained through
+ *     \a rx_shared_next); handles for "any" interface are in
+ *     bucket 0.
+ */
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	unsigned detach_waiting;
+	struct wimaxll_handle *wmx;
+	unsigned refcount;
+	struct wimaxll_handle *hash[WIMAXLL_RX_SHARED_HASH_SIZE];
+} wimaxll_rx_shared = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+
+static inline
+unsigned wimaxll_rx_shared_bucket(unsigned ifidx)
+{
+	return ifidx % WIMAXLL_RX_SHARED_HASH_SIZE;
+}
+
+
+/*
+ * Create the receiver handle
+ *
+ * Called with the mutex held; \a wmx is the handle being opened,
+ * which has already resolved the multicast group.
+ */
+static
+struct wimaxll_handle *wimaxll_rx_shared_create(struct wimaxll_handle *wmx)
+{
+	int result;
+	struct wimaxll_handle *rx_wmx;
+
+	result = -ENOMEM;
+	rx_wmx = calloc(1, sizeof(*rx_wmx));
+	if (rx_wmx == NULL)
+		goto error_alloc;
+	rx_wmx->gnl_family_id = wmx->gnl_family_id;
+	rx_wmx->mcg_id = wmx->mcg_id;
+	rx_wmx->transport = wmx->transport;
+	rx_wmx->tx_fd = -1;
+	rx_wmx->rx_fd = -1;
+	wimaxll_rx_lock_init(rx_wmx);
+	result = rx_wmx->transport->rx_open(rx_wmx);
+	if (result < 0) {
+		wimaxll_msg(wmx, "E: shared RX: cannot set up: %d\n",
+			    result);
+		goto error_rx_open;
+	}
+	return rx_wmx;
+
+error_rx_open:
+	wimaxll_rx_lock_destroy(rx_wmx);
+	free(rx_wmx);
+error_alloc:
+	errno = -result;
+	return NULL;
+}
+
+
+/*
+ * Attach a handle to the shared receiver, creating it if needed
+ *
+ * \internal
+ *
+ * \param wmx WiMAX device handle (with the multicast group resolved)
+ * \return 0 if ok, < 0 errno code on error.
+ */
+int wimaxll_rx_shared_attach(struct wimaxll_handle *wmx)
+{
+	int result;
+	unsigned bucket = wimaxll_rx_shared_bucket(wmx->ifidx);
+
+	d_fnstart(3, wmx, "(wmx %p)\n", wmx);
+	pthread_mutex_lock(&wimaxll_rx_shared.mutex);
+	if (wimaxll_rx_shared.wmx == NULL) {
+		wimaxll_rx_shared.wmx = wimaxll_rx_shared_create(wmx);
+		if (wimaxll_rx_shared.wmx == NULL) {
+			result = -errno;
+			goto error_create;
+		}
+	} else if (wimaxll_rx_shared.wmx->mcg_id != wmx->mcg_id
+		   || wimaxll_rx_shared.wmx->transport != wmx->transport) {
+		/* The WiMAX stack was reloaded under us (or the
+		 * transport switched) */
+		wimaxll_msg(wmx, "E: shared RX: multicast group or "
+			    "transport changed (%d vs %d); close all the "
+			    "handles opened with WIMAXLL_OPEN_SHARED_RX "
+			    "first\n",
+			    wimaxll_rx_shared.wmx->mcg_id, wmx->mcg_id);
+		result = -ESTALE;
+		goto error_stale;
+	}
+	wmx->rx_shared_next = wimaxll_rx_shared.hash[bucket];
+	wimaxll_rx_shared.hash[bucket] = wmx;
+	wmx->rx_shared = wimaxll_rx_shared.wmx;
+	wimaxll_rx_shared.refcount++;
+	result = 0;
+error_stale:
+error_create:
+	pthread_mutex_unlock(&wimaxll_rx_shared.mutex);
+	d_fnend(3, wmx, "(wmx %p) = %d\n", wmx, result);
+	return result;
+}
+
+
+/*
+ * Drop a reference taken by wimaxll_rx_shared_dispatch()
+ *
+ * Called with the mutex held.
+ */
+static
+void __wimaxll_rx_shared_put(struct wimaxll_handle *wmx)
+{
+	if (--wmx->rx_shared_refs == 0 && wimaxll_rx_shared.detach_waiting)
+		pthread_cond_broadcast(&wimaxll_rx_shared.cond);
+}
+
+
+/*
+ * Release a handle whose reference was kept by
+ * wimaxll_rx_shared_dispatch() for a pinned receive buffer
+ *
+ * \internal
+ *
+ * Called by wimaxll_recv() once the buffer is moved to the handle's
+ * borrowed table.
+ */
+void wimaxll_rx_shared_put(struct wimaxll_handle *wmx)
+{
+	pthread_mutex_lock(&wimaxll_rx_shared.mutex);
+	__wimaxll_rx_shared_put(wmx);
+	pthread_mutex_unlock(&wimaxll_rx_shared.mutex);
+}
+
+
+/*
+ * Detach a handle from the shared receiver
+ *
+ * \internal
+ *
+ * Once out of the hash table, no new notifications are dispatched to
+ * the handle; we wait for the threads still running its callbacks
+ * (so this can't be called from one of them). Releases the receiver
+ * when the last handle goes away.
+ */
+void wimaxll_rx_shared_detach(struct wimaxll_handle *wmx)
+{
+	struct wimaxll_handle **itr, *rx_wmx;
+
+	d_fnstart(3, wmx, "(wmx %p)\n", wmx);
+	pthread_mutex_lock(&wimaxll_rx_shared.mutex);
+	itr = &wimaxll_rx_shared.hash[wimaxll_rx_shared_bucket(wmx->ifidx)];
+	for (; *itr != NULL; itr = &(*itr)->rx_shared_next)
+		if (*itr == wmx) {
+			*itr = wmx->rx_shared_next;
+			break;
+		}
+	wimaxll_rx_shared.detach_waiting++;
+	while (wmx->rx_shared_refs > 0)
+		pthread_cond_wait(&wimaxll_rx_shared.cond,
+				  &wimaxll_rx_shared.mutex);
+	wimaxll_rx_shared.detach_waiting--;
+	wmx->rx_shared = NULL;
+	wmx->rx_shared_next = NULL;
+	if (--wimaxll_rx_shared.refcount == 0) {
+		rx_wmx = wimaxll_rx_shared.wmx;
+		wimaxll_rx_shared.wmx = NULL;
+		rx_wmx->transport->rx_close(rx_wmx);
+		wimaxll_recv_buf_release_all(rx_wmx);
+		wimaxll_rx_lock_destroy(rx_wmx);
+		free(rx_wmx);
+	}
+	pthread_mutex_unlock(&wimaxll_rx_shared.mutex);
+	d_fnend(3, wmx, "(wmx %p) = void\n", wmx);
+}
+
+
+/*
+ * Route a notification read by the shared receiver
+ *
+ * \internal
+ *
+ * \param ctx Callback context of the handle that is reading
+ * \param nl_hdr Notification
+ * \return \c enum nl_cb_action
+ *
+ * Finds the interface index the notification is addressed to and
+ * runs wimaxll_gnl_cb() for each handle attached for it or for any
+ * interface. For the handle that is reading, \a ctx is used; the
+ * rest get a context of their own, whose result is discarded. If
+ * the callbacks of any of them stop processing (eg: a message was
+ * lent pointing into the receive buffer, which then is pinned), so
+ * does the reading one.
+ *
+ * The targets are referenced while their callbacks run, so they are
+ * not detached (and freed) under them; the one the receive buffer
+ * was pinned for (if any) stays referenced until wimaxll_recv()
+ * hands it the buffer (see wimaxll_rx_shared_put()).
+ */
+int wimaxll_rx_shared_dispatch(struct wimaxll_cb_ctx *ctx,
+			       struct nlmsghdr *nl_hdr)
+{
+	int result = NL_OK;
+	struct genlmsghdr *gnl_hdr = nlmsg_data(nl_hdr);
+	struct nlattr *nla;
+	struct wimaxll_handle *itr, *rx_wmx = ctx->wmx->rx_shared;
+	struct wimaxll_handle *target_stack[WIMAXLL_RX_SHARED_FANOUT_MAX];
+	struct wimaxll_handle **target = target_stack, **new_target;
+	struct wimaxll_handle *pinned = NULL;
+	unsigned ifidx, cnt = 0, size = WIMAXLL_RX_SHARED_FANOUT_MAX, bucket;
+	unsigned target_cnt;
+	int attr, was_pinned = rx_wmx->rx_pin;
+
+	switch (gnl_hdr->cmd) {
+	case WIMAX_GNL_OP_MSG_TO_USER:
+		attr = WIMAX_GNL_MSG_IFIDX;
+		break;
+	case WIMAX_GNL_RE_STATE_CHANGE:
+		attr = WIMAX_GNL_STCH_IFIDX;
+		break;
+	default:
+		d_printf(3, ctx->wmx, "E: %s: received unknown gnl message "
+			 "%d\n", __func__, gnl_hdr->cmd);
+		return NL_SKIP;
+	}
+	nla = nla_find(genlmsg_attrdata(gnl_hdr, 0),
+		       genlmsg_attrlen(gnl_hdr, 0), attr);
+	if (nla == NULL) {
+		wimaxll_msg(ctx->wmx, "E: %s: cannot find IFIDX attribute\n",
+			    __func__);
+		return NL_SKIP;
+	}
+	ifidx = nla_get_u32(nla);
+
+	/* Collect the targets, so we don't run callbacks locked; the
+	 * table is on the stack unless there are too many */
+	pthread_mutex_lock(&wimaxll_rx_shared.mutex);
+	bucket = wimaxll_rx_shared_bucket(ifidx);
+	for (itr = wimaxll_rx_shared.hash[bucket]; itr != NULL;
+	     itr = itr->rx_shared_next)
+		if (itr->ifidx == ifidx)
+			cnt++;
+	for (itr = wimaxll_rx_shared.hash[0]; itr != NULL;
+	     itr = itr->rx_shared_next)
+		if (itr->ifidx == 0)
+			cnt++;
+	if (cnt > size) {
+		new_target = malloc(cnt * sizeof(target[0]));
+		if (new_target == NULL)
+			wimaxll_msg(ctx->wmx, "E: shared RX: no memory to "
+				    "deliver to %u handles, only to %u\n",
+				    cnt, size);
+		else {
+			target = new_target;
+			size = cnt;
+		}
+	}
+	cnt = 0;
+	for (itr = wimaxll_rx_shared.hash[bucket]; itr != NULL;
+	     itr = itr->rx_shared_next)
+		if (itr->ifidx == ifidx && cnt < size) {
+			itr->rx_shared_refs++;
+			target[cnt++] = itr;
+		}
+	for (itr = wimaxll_rx_shared.hash[0]; itr != NULL;
+	     itr = itr->rx_shared_next)
+		if (itr->ifidx == 0 && cnt < size) {
+			itr->rx_shared_refs++;
+			target[cnt++] = itr;
+		}
+	pthread_mutex_unlock(&wimaxll_rx_shared.mutex);
+
+	d_printf(3, ctx->wmx, "D: shared RX: cmd %u ifidx %u to %u handles\n",
+		 gnl_hdr->cmd, ifidx, cnt);
+	target_cnt = cnt;
+	while (cnt-- > 0) {
+		if (target[cnt] == ctx->wmx) {
+			if (wimaxll_gnl_cb(ctx, nl_hdr) == NL_STOP)
+				result = NL_STOP;
+		} else {
+			struct wimaxll_cb_ctx target_ctx =
+				WIMAXLL_CB_CTX_INIT(target[cnt]);
+			if (wimaxll_gnl_cb(&target_ctx, nl_hdr) == NL_STOP)
+				result = NL_STOP;
+		}
+	}
+	if (!was_pinned && rx_wmx->rx_pin)
+		pinned = rx_wmx->rx_pin_wmx;
+	pthread_mutex_lock(&wimaxll_rx_shared.mutex);
+	for (cnt = 0; cnt < target_cnt; cnt++)
+		if (target[cnt] != pinned)
+			__wimaxll_rx_shared_put(target[cnt]);
+	pthread_mutex_unlock(&wimaxll_rx_shared.mutex);
+	if (target != target_stack)
+		free(target);
+	return result;
+}
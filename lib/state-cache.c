@@ -0,0 +1,372 @@
+/*
+ * Linux WiMAX
+ * Cache of the device state kept current by state change notifications
+ *
+ *
+ * Copyright (C) 2007-2009 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ *
+ * Handles that enabled it with wimaxll_state_cache_enable() keep the
+ * last state of the device in struct wimaxll_state_cache. It is
+ * seeded with a STATE_GET and then updated by
+ * wimaxll_gnl_handle_state_change() as the notifications are
+ * processed, so wimaxll_state_get() can answer without a round trip
+ * to the kernel.
+ *
+ * The cache is a sequence lock: writers (the thread processing
+ * notifications or one refreshing the cache) make the sequence
+ * number odd while they update it; readers copy it and retry if the
+ * sequence number was odd or changed in the meantime. Readers never
+ * take a lock or block a writer.
+ *
+ * The cache is only trusted while we know we have seen every state
+ * change. It is marked invalid when:
+ *
+ * - a notification's old state is not the state we had (we missed
+ *   one, or it is an old one that was queued in the socket while we
+ *   refreshed);
+ *
+ * - the receive socket overran (the kernel dropped notifications
+ *   because we didn't read them fast enough; see \a rx_overruns in
+ *   struct wimaxll_handle).
+ *
+ * The next read then queries the kernel and reseeds it.
+ *
+ * On top of that, a read only trusts the cache if there is nothing
+ * waiting to be received (wimaxll_state_cache_fresh()): if nobody is
+ * draining the receive side, the notifications pile up in the socket
+ * and the cache would stay stale forever. In that case we ask the
+ * kernel (without touching the cache, as the notifications will
+ * still be processed later).
+ */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <wimaxll.h>
+#include "internal.h"
+#define D_LOCAL 0
+#include "debug.h"
+
+
+/*
+ * Start updating the cache; waits for any other writer to finish
+ *
+ * Returns the (even) sequence number the cache had.
+ */
+static
+unsigned wimaxll_state_cache_write_begin(struct wimaxll_state_cache *cache)
+{
+	unsigned seq;
+
+	for (;;) {
+		/* volatile: re-read it from memory on every spin */
+		seq = *(volatile unsigned *) &cache->seq;
+		if ((seq & 1) == 0
+		    && __sync_bool_compare_and_swap(&cache->seq, seq, seq + 1))
+			return seq;
+	}
+}
+
+
+static
+void wimaxll_state_cache_write_end(struct wimaxll_state_cache *cache)
+{
+	__sync_add_and_fetch(&cache->seq, 1);
+}
+
+
+/*
+ * Take a consistent copy of the cache into @copy
+ *
+ * Returns the sequence number it had.
+ */
+static
+unsigned wimaxll_state_cache_read(struct wimaxll_state_cache *cache,
+				  struct wimaxll_state_cache *copy)
+{
+	unsigned seq;
+
+	for (;;) {
+		seq = *(volatile unsigned *) &cache->seq;
+		__sync_synchronize();
+		if (seq & 1)
+			continue;
+		*copy = *cache;
+		__sync_synchronize();
+		if (*(volatile unsigned *) &cache->seq == seq)
+			return seq;
+	}
+}
+
+
+/**
+ * Update the state cache with a state change notification
+ *
+ * \internal
+ *
+ * \param wmx WiMAX device handle (with the state cache enabled)
+ * \param old_state State the notification says the device was in
+ * \param new_state State the device is in now
+ *
+ * Called by wimaxll_gnl_handle_state_change() before running the
+ * callbacks, so they already see the new state in the cache.
+ */
+void wimaxll_state_cache_update(struct wimaxll_handle *wmx,
+				enum wimax_st old_state,
+				enum wimax_st new_state)
+{
+	struct wimaxll_state_cache *cache = &wmx->state_cache;
+
+	wimaxll_state_cache_write_begin(cache);
+	if (cache->valid && cache->state != old_state) {
+		d_printf(1, wmx, "D: state cache: missed a state change "
+			 "(%u, notified %u -> %u), invalidating\n",
+			 cache->state, old_state, new_state);
+		cache->valid = 0;
+	}
+	cache->state = new_state;
+	cache->generation++;
+	clock_gettime(CLOCK_MONOTONIC, &cache->changed);
+	wimaxll_state_cache_write_end(cache);
+}
+
+
+/*
+ * Return !0 if every notification received has been processed
+ *
+ * There might be state changes still queued (in the socket or read
+ * and not yet processed) if nobody is receiving on the handle; the
+ * cache is behind them.
+ */
+static
+int wimaxll_state_cache_fresh(struct wimaxll_handle *wmx)
+{
+	struct wimaxll_handle *rx_wmx = wimaxll_rx_wmx(wmx);
+	struct pollfd pfd = {
+		.fd = rx_wmx->rx_fd,
+		.events = POLLIN,
+	};
+
+	if (wimaxll_rx_backlog(wmx))
+		return 0;
+	if (pfd.fd < 0)
+		return 1;
+	return poll(&pfd, 1, 0) == 0;
+}
+
+
+/*
+ * Query the kernel and reseed the cache
+ *
+ * @seq is the sequence number the cache had when it was found
+ * invalid. If anything updated the cache while we were asking the
+ * kernel, we can't know which of both is newer, so we return what
+ * the kernel said but leave the cache as it is (the next read will
+ * query again if still needed).
+ */
+static
+int wimaxll_state_cache_refresh(struct wimaxll_handle *wmx, unsigned seq,
+				struct wimaxll_state_cache *copy,
+				const struct timespec *deadline)
+{
+	int result;
+	unsigned long rx_overruns;
+	struct wimaxll_state_cache *cache = &wmx->state_cache;
+
+	rx_overruns = wimaxll_rx_wmx(wmx)->rx_overruns;
+	result = wimaxll_state_query(wmx, deadline);
+	if (result < 0)
+		return result;
+	if (wimaxll_state_cache_write_begin(cache) == seq) {
+		if (cache->generation == 0 || cache->state != result) {
+			cache->state = result;
+			cache->generation++;
+			clock_gettime(CLOCK_MONOTONIC, &cache->changed);
+		}
+		cache->valid = 1;
+		cache->rx_overruns = rx_overruns;
+	}
+	copy->generation = cache->generation;
+	copy->changed = cache->changed;
+	wimaxll_state_cache_write_end(cache);
+	return result;
+}
+
+
+/**
+ * Return the device state from the cache, refreshing it if needed
+ *
+ * \internal
+ *
+ * \param wmx WiMAX device handle (with the state cache enabled)
+ * \param generation Where to store the generation (can be NULL)
+ * \param changed Where to store the time of the last change (can be
+ *     NULL)
+ * \param deadline Deadline for the query if the cache has to be
+ *     refreshed; NULL for none.
+ * \return state (enum wimax_st) or negative errno code.
+ */
+int wimaxll_state_cache_lookup(struct wimaxll_handle *wmx,
+			       unsigned long *generation,
+			       struct timespec *changed,
+			       const struct timespec *deadline)
+{
+	int result;
+	unsigned seq;
+	struct wimaxll_state_cache copy;
+
+	seq = wimaxll_state_cache_read(&wmx->state_cache, &copy);
+	if (copy.valid
+	    && copy.rx_overruns == wimaxll_rx_wmx(wmx)->rx_overruns) {
+		if (wimaxll_state_cache_fresh(wmx))
+			result = copy.state;
+		else
+			result = wimaxll_state_query(wmx, deadline);
+	} else
+		result = wimaxll_state_cache_refresh(wmx, seq, &copy,
+						     deadline);
+	if (result >= 0) {
+		if (generation != NULL)
+			*generation = copy.generation;
+		if (changed != NULL)
+			*changed = copy.changed;
+	}
+	return result;
+}
+
+
+/**
+ * Keep a cache of the device's state
+ *
+ * \param wmx WiMAX device handle
+ * \return 0 if ok, < 0 errno code on error (the cache stays
+ *     disabled).
+ *
+ * Queries the device's state once and from then on keeps it updated
+ * from the state change notifications, so wimaxll_state_get() and
+ * wimaxll_state_cache_get() return it without asking the kernel
+ * (from any thread, without locking).
+ *
+ * The cache is only as current as the notifications processed:
+ * somebody has to receive on the handle (wimaxll_recv() or a main
+ * loop integration, see \ref receiving). While notifications are
+ * waiting to be received, or if they were lost (the socket overran),
+ * reads query the kernel instead.
+ *
+ * Sets up the receive side of handles opened with
+ * %WIMAXLL_OPEN_LAZY_RX and lets state change notifications through
+ * the filter set with wimaxll_recv_filter().
+ *
+ * \ingroup state_change_group
+ */
+int wimaxll_state_cache_enable(struct wimaxll_handle *wmx)
+{
+	int result;
+
+	d_fnstart(3, wmx, "(wmx %p)\n", wmx);
+	result = -EBADF;
+	if (wmx->ifidx == 0)
+		goto error_not_any;
+	result = 0;
+	if (wmx->state_cache.enabled)
+		goto out;
+	result = wimaxll_mc_rx_ensure(wmx);
+	if (result < 0)
+		goto error_rx_ensure;
+	wmx->state_cache.enabled = 1;
+	wimaxll_rx_filter_update(wmx);
+	/* Seed it */
+	result = wimaxll_state_cache_lookup(wmx, NULL, NULL, NULL);
+	if (result < 0) {
+		wimaxll_msg(wmx, "E: state cache: cannot seed: %d\n",
+			    result);
+		wimaxll_state_cache_disable(wmx);
+		goto error_seed;
+	}
+	result = 0;
+error_seed:
+error_rx_ensure:
+out:
+error_not_any:
+	d_fnend(3, wmx, "(wmx %p) = %d\n", wmx, result);
+	return result;
+}
+
+
+/**
+ * Stop keeping a cache of the device's state
+ *
+ * \param wmx WiMAX device handle
+ *
+ * wimaxll_state_get() goes back to querying the kernel every time.
+ *
+ * \ingroup state_change_group
+ */
+void wimaxll_state_cache_disable(struct wimaxll_handle *wmx)
+{
+	struct wimaxll_state_cache *cache = &wmx->state_cache;
+
+	wimaxll_state_cache_write_begin(cache);
+	cache->enabled = 0;
+	cache->valid = 0;
+	wimaxll_state_cache_write_end(cache);
+	wimaxll_rx_filter_update(wmx);
+}
+
+
+/**
+ * Return the device's state from the cache
+ *
+ * \param wmx WiMAX device handle
+ * \param generation Where to store the generation of the cache (can
+ *     be NULL); it increases every time the state changes (or the
+ *     cache has to be reseeded and the state is a different one), so
+ *     pollers can tell if anything happened since they last looked.
+ * \param changed Where to store the time (%CLOCK_MONOTONIC) of the
+ *     last change (can be NULL).
+ * \return state (enum wimax_st) or negative errno code; -%ENOTCONN
+ *     if the cache is not enabled (see wimaxll_state_cache_enable()).
+ *
+ * Doesn't touch the kernel while the cache is in sync; if it isn't
+ * (see wimaxll_state_cache_enable()), it queries the device.
+ *
+ * \ingroup state_change_group
+ */
+int wimaxll_state_cache_get(struct wimaxll_handle *wmx,
+			    unsigned long *generation,
+			    struct timespec *changed)
+{
+	if (!wmx->state_cache.enabled)
+		return -ENOTCONN;
+	return wimaxll_state_cache_lookup(wmx, generation, changed, NULL);
+}
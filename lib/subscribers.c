@@ -0,0 +1,358 @@
+/*
+ * Linux WiMAX
+ * Lists of callbacks for notifications
+ *
+ *
+ * Copyright (C) 2007-2009 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ *
+ * Besides the single callback per notification type set with
+ * wimaxll_set_cb_msg_to_user() and wimaxll_set_cb_state_change(),
+ * any number of subscribers can be added with
+ * wimaxll_add_cb_msg_to_user() and wimaxll_add_cb_state_change();
+ * each notification is passed to the handle's callback (if any) and
+ * then to every subscriber, in the order they were added. Adding
+ * returns a token to remove the subscriber with wimaxll_remove_cb().
+ *
+ * wimaxll_wait_for_state_change() adds itself as a subscriber for as
+ * long as it waits, instead of replacing the handle's callback; so a
+ * monitoring callback keeps seeing everything while someone else
+ * waits on the same handle. wimaxll_msg_read() doesn't need to: its
+ * messages are handed over by the MSG_TO_USER handler, after the
+ * subscribers have seen them (see lib/msg-queue.c).
+ *
+ * Subscribers can be added and removed from any thread, and from
+ * callbacks. The lists are protected by a mutex, which is not held
+ * while calling the callbacks; a subscriber removed while a
+ * notification is being delivered is just marked dead, so the
+ * dispatcher can keep walking the list, and is freed once no
+ * dispatch is running.
+ */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <wimaxll.h>
+#include "internal.h"
+#define D_LOCAL 0
+#include "debug.h"
+
+
+/*
+ * Add a subscriber to the end of a list
+ */
+static
+int wimaxll_sub_add(struct wimaxll_handle *wmx, unsigned type,
+		    void (*cb)(void), void *priv)
+{
+	struct wimaxll_sub *sub, **prev;
+
+	sub = calloc(1, sizeof(*sub));
+	if (sub == NULL)
+		return -ENOMEM;
+	sub->cb = cb;
+	sub->priv = priv;
+	pthread_mutex_lock(&wmx->sub_mutex);
+	/* Tokens are > 0 and never reused while a handle is open
+	 * (unless it wraps after 2^31 additions) */
+	if (++wmx->sub_token_last <= 0)
+		wmx->sub_token_last = 1;
+	sub->token = wmx->sub_token_last;
+	for (prev = &wmx->subs[type]; *prev != NULL; prev = &(*prev)->next)
+		;
+	*prev = sub;
+	wmx->sub_count[type]++;
+	pthread_mutex_unlock(&wmx->sub_mutex);
+	return sub->token;
+}
+
+
+/*
+ * Free the subscribers marked dead
+ *
+ * Call with the mutex held and no dispatch running.
+ */
+static
+void wimaxll_sub_reap(struct wimaxll_handle *wmx)
+{
+	unsigned type;
+	struct wimaxll_sub *sub, **prev;
+
+	for (type = 0; type < WIMAXLL_SUB_TYPES; type++) {
+		prev = &wmx->subs[type];
+		while ((sub = *prev) != NULL) {
+			if (sub->dead) {
+				*prev = sub->next;
+				free(sub);
+			} else
+				prev = &sub->next;
+		}
+	}
+	wmx->sub_dead = 0;
+}
+
+
+/*
+ * Walk the live subscribers of a list without holding the mutex
+ *
+ * wimaxll_sub_next(wmx, type, NULL) returns the first one (and
+ * starts a dispatch), wimaxll_sub_next(wmx, type, sub) the one after
+ * @sub; when it returns NULL, the dispatch is done. The callback and
+ * private pointer are copied to @cb and @priv under the mutex.
+ */
+static
+struct wimaxll_sub *wimaxll_sub_next(struct wimaxll_handle *wmx,
+				     unsigned type, struct wimaxll_sub *sub,
+				     void (**cb)(void), void **priv)
+{
+	pthread_mutex_lock(&wmx->sub_mutex);
+	if (sub == NULL) {
+		wmx->sub_dispatching++;
+		sub = wmx->subs[type];
+	} else
+		sub = sub->next;
+	while (sub != NULL && sub->dead)
+		sub = sub->next;
+	if (sub != NULL) {
+		*cb = sub->cb;
+		*priv = sub->priv;
+	} else if (--wmx->sub_dispatching == 0 && wmx->sub_dead > 0)
+		wimaxll_sub_reap(wmx);
+	pthread_mutex_unlock(&wmx->sub_mutex);
+	return sub;
+}
+
+
+/*
+ * Merge the result of a callback into that of a dispatch
+ *
+ * If any callback asks to stop processing (-EBUSY), so does the
+ * dispatch; otherwise the last error wins.
+ */
+static
+int wimaxll_sub_result(int result, int cb_result)
+{
+	if (result == -EBUSY || cb_result == -EBUSY)
+		return -EBUSY;
+	return cb_result < 0 ? cb_result : result;
+}
+
+
+/**
+ * Pass a message to the subscribers for MSG_TO_USER
+ *
+ * \internal
+ *
+ * \param wmx WiMAX device handle
+ * \param result What the handle's callback returned (0 if there is
+ *     none).
+ * \return \a result merged with what the subscribers returned: -EBUSY
+ *     if any of them asked to stop processing, otherwise the last
+ *     error (or \a result).
+ */
+int wimaxll_sub_msg_to_user(struct wimaxll_handle *wmx, int result,
+			    const char *pipe_name,
+			    const void *data, size_t size)
+{
+	struct wimaxll_sub *sub = NULL;
+	void (*cb)(void);
+	void *priv;
+	wimaxll_msg_to_user_cb_f msg_to_user_cb;
+
+	while ((sub = wimaxll_sub_next(wmx, WIMAXLL_SUB_MSG_TO_USER, sub,
+				       &cb, &priv)) != NULL) {
+		msg_to_user_cb = (wimaxll_msg_to_user_cb_f) cb;
+		result = wimaxll_sub_result(
+			result, msg_to_user_cb(wmx, priv, pipe_name,
+					       data, size));
+	}
+	return result;
+}
+
+
+/**
+ * Pass a state change to the subscribers for RE_STATE_CHANGE
+ *
+ * \internal
+ *
+ * Same as wimaxll_sub_msg_to_user().
+ */
+int wimaxll_sub_state_change(struct wimaxll_handle *wmx, int result,
+			     enum wimax_st old_state, enum wimax_st new_state)
+{
+	struct wimaxll_sub *sub = NULL;
+	void (*cb)(void);
+	void *priv;
+	wimaxll_state_change_cb_f state_change_cb;
+
+	while ((sub = wimaxll_sub_next(wmx, WIMAXLL_SUB_STATE_CHANGE, sub,
+				       &cb, &priv)) != NULL) {
+		state_change_cb = (wimaxll_state_change_cb_f) cb;
+		result = wimaxll_sub_result(
+			result, state_change_cb(wmx, priv,
+						old_state, new_state));
+	}
+	return result;
+}
+
+
+/*
+ * Free all the subscribers (on close)
+ *
+ * \internal
+ */
+void wimaxll_sub_release_all(struct wimaxll_handle *wmx)
+{
+	unsigned type;
+	struct wimaxll_sub *sub, *next;
+
+	for (type = 0; type < WIMAXLL_SUB_TYPES; type++) {
+		for (sub = wmx->subs[type]; sub != NULL; sub = next) {
+			next = sub->next;
+			free(sub);
+		}
+		wmx->subs[type] = NULL;
+		wmx->sub_count[type] = 0;
+	}
+}
+
+
+/**
+ * Add a callback for MSG_TO_USER messages
+ *
+ * \param wmx WiMAX device handle
+ * \param cb Callback function to add
+ * \param priv Private data pointer to pass to the callback function.
+ * \return a token (> 0) to remove the callback with
+ *     wimaxll_remove_cb(); < 0 errno code on error (including not
+ *     being able to set up the receive side).
+ *
+ * The callback is run for each message received, after the one set
+ * with wimaxll_set_cb_msg_to_user() (if any) and the ones added
+ * before it; messages of pipes that have a callback of their own (see
+ * wimaxll_pipe_set_cb_msg_to_user()) go only to that one. If any of
+ * them returns -%EBUSY, wimaxll_recv() stops after this message.
+ *
+ * Like wimaxll_set_cb_msg_to_user(), this sets up the receive side
+ * of handles opened with %WIMAXLL_OPEN_LAZY_RX and updates the kernel
+ * filter set with %WIMAXLL_RECV_FILTER_CB.
+ *
+ * \ingroup the_messaging_interface
+ */
+int wimaxll_add_cb_msg_to_user(struct wimaxll_handle *wmx,
+			       wimaxll_msg_to_user_cb_f cb, void *priv)
+{
+	int result;
+
+	/* No point in adding it if it will never be called */
+	result = wimaxll_mc_rx_ensure(wmx);
+	if (result < 0)
+		return result;
+	result = wimaxll_sub_add(wmx, WIMAXLL_SUB_MSG_TO_USER,
+				 (void (*)(void)) cb, priv);
+	if (result > 0)
+		wimaxll_rx_filter_update(wmx);
+	return result;
+}
+
+
+/**
+ * Add a callback for state change notifications
+ *
+ * \param wmx WiMAX device handle
+ * \param cb Callback function to add
+ * \param priv Private data pointer to pass to the callback function.
+ * \return a token (> 0) to remove the callback with
+ *     wimaxll_remove_cb(); < 0 errno code on error.
+ *
+ * Same as wimaxll_add_cb_msg_to_user(), for the callbacks set with
+ * wimaxll_set_cb_state_change().
+ *
+ * \ingroup state_change_group
+ */
+int wimaxll_add_cb_state_change(struct wimaxll_handle *wmx,
+				wimaxll_state_change_cb_f cb, void *priv)
+{
+	int result;
+
+	/* No point in adding it if it will never be called */
+	result = wimaxll_mc_rx_ensure(wmx);
+	if (result < 0)
+		return result;
+	result = wimaxll_sub_add(wmx, WIMAXLL_SUB_STATE_CHANGE,
+				 (void (*)(void)) cb, priv);
+	if (result > 0)
+		wimaxll_rx_filter_update(wmx);
+	return result;
+}
+
+
+/**
+ * Remove a callback added with wimaxll_add_cb_msg_to_user() or
+ * wimaxll_add_cb_state_change()
+ *
+ * \param wmx WiMAX device handle
+ * \param token Token returned when the callback was added.
+ * \return 0 if ok, -%ENOENT if there is no callback with that token.
+ *
+ * Once this returns, the callback won't be called for any new
+ * notification; it might still be running for the current one in
+ * another thread (or be the one calling this function).
+ *
+ * \ingroup callbacks
+ */
+int wimaxll_remove_cb(struct wimaxll_handle *wmx, int token)
+{
+	int result = -ENOENT;
+	unsigned type;
+	struct wimaxll_sub *sub;
+
+	pthread_mutex_lock(&wmx->sub_mutex);
+	for (type = 0; type < WIMAXLL_SUB_TYPES; type++)
+		for (sub = wmx->subs[type]; sub != NULL; sub = sub->next) {
+			if (sub->token != token || sub->dead)
+				continue;
+			sub->dead = 1;
+			wmx->sub_dead++;
+			wmx->sub_count[type]--;
+			result = 0;
+			goto out;
+		}
+out:
+	if (result == 0 && wmx->sub_dispatching == 0)
+		wimaxll_sub_reap(wmx);
+	pthread_mutex_unlock(&wmx->sub_mutex);
+	/* No need to update the RX filter: what subscribers needed
+	 * stays accepted (see lib/rx-filter.c) */
+	return result;
+}
@@ -0,0 +1,186 @@
+/*
+ * Linux WiMAX
+ * Run the library against the fake kernel (make check)
+ *
+ *
+ * Copyright (C) 2007-2009 Intel Corporation. All rights reserved.
+ *
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ *
+ *
+ * Runs the hot paths of libwimaxll through the in-process fake
+ * kernel (lib/fake.h), so they are exercised on any box: RFKILL,
+ * RESET, STATE_GET (and the state change notifications they cause)
+ * and writing and reading messages, copied and borrowed.
+ *
+ * Exits with 0 if all the checks pass, 1 if any fails and 77 (so
+ * the test is reported as skipped) if the fake kernel can't be
+ * started.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <wimaxll.h>
+#include "fake.h"
+
+
+static unsigned test_failures;
+
+#define test_check(cond) test_check_fn(!!(cond), #cond, __LINE__)
+
+static
+void test_check_fn(int ok, const char *what, unsigned line)
+{
+	if (ok)
+		return;
+	fprintf(stderr, "E: test-fake.c:%u: check failed: %s\n", line, what);
+	test_failures++;
+}
+
+
+/*
+ * Wait (at most a second) for a state change notification
+ */
+static
+int test_state_change(struct wimaxll_handle *wmx,
+		      enum wimax_st *old_state, enum wimax_st *new_state)
+{
+	struct timespec deadline;
+
+	return wimaxll_wait_for_state_change_deadline(
+		wmx, old_state, new_state,
+		wimaxll_deadline_set(&deadline, 1000));
+}
+
+
+static
+void test_rfkill(struct wimaxll_handle *wmx)
+{
+	enum wimax_st old_state, new_state;
+
+	test_check(wimaxll_rfkill(wmx, WIMAX_RF_QUERY) == 3);
+	test_check(wimaxll_state_get(wmx) == WIMAX_ST_READY);
+	/* Radio off: SW switch off, HW still on */
+	test_check(wimaxll_rfkill(wmx, WIMAX_RF_OFF) == 1);
+	test_check(test_state_change(wmx, &old_state, &new_state) == 0);
+	test_check(old_state == WIMAX_ST_READY
+		   && new_state == WIMAX_ST_RADIO_OFF);
+	test_check(wimaxll_state_get(wmx) == WIMAX_ST_RADIO_OFF);
+	test_check(wimaxll_rfkill(wmx, WIMAX_RF_ON) == 3);
+	test_check(test_state_change(wmx, &old_state, &new_state) == 0);
+	test_check(old_state == WIMAX_ST_RADIO_OFF
+		   && new_state == WIMAX_ST_READY);
+	test_check(wimaxll_state_get(wmx) == WIMAX_ST_READY);
+	test_check(wimaxll_rfkill(wmx, 17) == -EINVAL);
+}
+
+
+static
+void test_reset(struct wimaxll_handle *wmx)
+{
+	test_check(wimaxll_reset(wmx) == 0);
+	test_check(wimaxll_state_get(wmx) == WIMAX_ST_READY);
+}
+
+
+/*
+ * The fake kernel echoes each message written back on its pipe
+ */
+static
+void test_msg(struct wimaxll_handle *wmx)
+{
+	static const char data[] = "ping";
+	ssize_t result;
+	void *buf;
+	const void *borrowed;
+	struct timespec deadline;
+
+	test_check(wimaxll_msg_write(wmx, NULL, data, sizeof(data)) == 0);
+	result = wimaxll_msg_read(wmx, NULL, &buf);
+	test_check(result == sizeof(data));
+	if (result >= 0) {
+		test_check(memcmp(buf, data, sizeof(data)) == 0);
+		wimaxll_msg_free(buf);
+	}
+	/* A message for another pipe is kept for its reader */
+	test_check(wimaxll_msg_write(wmx, "other", data, 1) == 0);
+	test_check(wimaxll_msg_write(wmx, "test", data, sizeof(data)) == 0);
+	result = wimaxll_msg_read_borrow(wmx, "test", &borrowed);
+	test_check(result == sizeof(data));
+	if (result >= 0) {
+		test_check(memcmp(borrowed, data, sizeof(data)) == 0);
+		wimaxll_msg_release(wmx, borrowed);
+	}
+	result = wimaxll_msg_read_deadline(wmx, "other", &buf,
+					   wimaxll_deadline_set(&deadline,
+								1000));
+	test_check(result == 1);
+	if (result >= 0)
+		wimaxll_msg_free(buf);
+	/* Nothing else is coming */
+	result = wimaxll_msg_read_deadline(wmx, "test", &buf,
+					   wimaxll_deadline_set(&deadline,
+								100));
+	test_check(result == -ETIMEDOUT);
+	if (result >= 0)
+		wimaxll_msg_free(buf);
+}
+
+
+int main(void)
+{
+	int result;
+	struct wimaxll_fake_config config = { .echo = 1 };
+	struct wimaxll_fake_stats stats;
+	struct wimaxll_handle *wmx;
+
+	result = wimaxll_fake_start(&config);
+	if (result < 0) {
+		fprintf(stderr, "W: cannot start the fake kernel: %d; "
+			"skipping\n", result);
+		return 77;
+	}
+	wmx = wimaxll_open("lo");
+	test_check(wmx != NULL);
+	if (wmx != NULL) {
+		test_rfkill(wmx);
+		test_reset(wmx);
+		test_msg(wmx);
+		wimaxll_close(wmx);
+	}
+	wimaxll_fake_stats_get(&stats);
+	test_check(stats.acks == stats.requests);
+	wimaxll_fake_stop();
+	if (test_failures > 0) {
+		fprintf(stderr, "E: %u checks failed\n", test_failures);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,242 @@
+/*
+ * Linux WiMAX
+ * Transport to the kernel
+ *
+ *
+ * Copyright (C) 2007-2009 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * The library builds and parses the generic netlink messages; how
+ * they get to and from the kernel is up to a transport (struct
+ * wimaxll_transport_ops). Handles pick the process-wide one when
+ * they are opened.
+ *
+ * The default transport is generic netlink. Test and benchmark code
+ * can replace it with wimaxll_transport_set() (see lib/fake.c) to run
+ * without a WiMAX device.
+ */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <netlink/msg.h>
+#include <netlink/netlink.h>
+#include <wimaxll.h>
+#include "internal.h"
+#define D_LOCAL 0
+#include "debug.h"
+
+
+static
+const struct wimaxll_transport_ops *wimaxll_transport =
+	&wimaxll_transport_netlink;
+
+
+/**
+ * Set the transport new handles use
+ *
+ * \internal
+ *
+ * \param ops Transport to use; NULL to go back to netlink.
+ * \return the transport that was in use.
+ *
+ * Handles already open keep using the transport they were opened
+ * with. Not thread safe; call it before opening handles.
+ */
+const struct wimaxll_transport_ops *wimaxll_transport_set(
+	const struct wimaxll_transport_ops *ops)
+{
+	const struct wimaxll_transport_ops *old = wimaxll_transport;
+
+	wimaxll_transport = ops ? ops : &wimaxll_transport_netlink;
+	return old;
+}
+
+
+/**
+ * Return the transport new handles use
+ *
+ * \internal
+ */
+const struct wimaxll_transport_ops *wimaxll_transport_get(void)
+{
+	return wimaxll_transport;
+}
+
+
+/**
+ * Send a generic netlink message over a handle's transport
+ *
+ * \internal
+ *
+ * \param wmx WiMAX device handle
+ * \param msg Message to send; the header is completed with the
+ *     handle's port ID and the next sequence number (unless already
+ *     set; see wimaxll_tx_seq_next()) and it is sent with
+ *     NLM_F_REQUEST | NLM_F_ACK, like nl_send_auto_complete() would.
+ * \return bytes sent if ok, < 0 errno code on error; -%ENODEV if
+ *     the handle was opened with %WIMAXLL_OPEN_NO_PROBE and turned
+ *     out not to be for a WiMAX device.
+ */
+ssize_t wimaxll_send(struct wimaxll_handle *wmx, struct nl_msg *msg)
+{
+	struct nlmsghdr *nl_hdr = nlmsg_hdr(msg);
+
+	if (wmx->probe_result < 0)
+		return wmx->probe_result;
+	/* libnl's counter is not thread safe; use ours */
+	if (nl_hdr->nlmsg_seq == NL_AUTO_SEQ)
+		nl_hdr->nlmsg_seq = wimaxll_tx_seq_next(wmx);
+	nl_auto_complete(wmx->nlh_tx, msg);
+	return wmx->transport->send(wmx, nl_hdr, nl_hdr->nlmsg_len);
+}
+
+
+/*
+ * Netlink transport
+ */
+
+static
+int wimaxll_netlink_tx_open(struct wimaxll_handle *wmx)
+{
+	int result;
+
+	wmx->nlh_tx = nl_handle_alloc();
+	if (wmx->nlh_tx == NULL) {
+		result = nl_get_errno();
+		wimaxll_msg(wmx, "E: TX: cannot allocate handle: %d (%s)\n",
+			    result, nl_geterror());
+		goto error_nl_handle_alloc_tx;
+	}
+	result = nl_connect(wmx->nlh_tx, NETLINK_GENERIC);
+	if (result < 0) {
+		wimaxll_msg(wmx, "E: TX: cannot connect netlink: %d (%s)\n",
+			    result, nl_geterror());
+		goto error_nl_connect_tx;
+	}
+	wmx->tx_fd = nl_socket_get_fd(wmx->nlh_tx);
+	return 0;
+
+error_nl_connect_tx:
+	nl_handle_destroy(wmx->nlh_tx);
+	wmx->nlh_tx = NULL;
+error_nl_handle_alloc_tx:
+	return result;
+}
+
+
+static
+void wimaxll_netlink_tx_close(struct wimaxll_handle *wmx)
+{
+	nl_close(wmx->nlh_tx);
+	nl_handle_destroy(wmx->nlh_tx);
+	wmx->nlh_tx = NULL;
+	wmx->tx_fd = -1;
+}
+
+
+static
+int wimaxll_netlink_resolve(struct wimaxll_handle *wmx)
+{
+	int result;
+
+	/* Only libnl's resolution code needs to peek; we read ACKs
+	 * into a fixed buffer (wimaxll_tx_recvmsgs()). */
+	nl_socket_enable_msg_peek(wmx->nlh_tx);
+	result = wimaxll_gnl_cache_lookup(wmx);
+	nl_socket_disable_msg_peek(wmx->nlh_tx);
+	return result;
+}
+
+
+static
+int wimaxll_netlink_rx_open(struct wimaxll_handle *wmx)
+{
+	int result;
+
+	wmx->nlh_rx = nl_handle_alloc();
+	if (wmx->nlh_rx == NULL) {
+		result = nl_get_errno();
+		wimaxll_msg(wmx, "E: RX: cannot allocate handle: %d (%s)\n",
+			    result, nl_geterror());
+		goto error_nl_handle_alloc_rx;
+	}
+	result = nl_connect(wmx->nlh_rx, NETLINK_GENERIC);
+	if (result < 0) {
+		wimaxll_msg(wmx, "E: RX: cannot connect netlink: %d (%s)\n",
+			    result, nl_geterror());
+		goto error_nl_connect_rx;
+	}
+	result = nl_socket_add_membership(wmx->nlh_rx, wmx->mcg_id);
+	if (result < 0) {
+		wimaxll_msg(wmx, "E: RX: cannot join multicast group %u: %d (%s)\n",
+			    wmx->mcg_id, result, nl_geterror());
+		goto error_nl_add_membership;
+	}
+	wmx->rx_fd = nl_socket_get_fd(wmx->nlh_rx);
+	return 0;
+
+error_nl_add_membership:
+	nl_close(wmx->nlh_rx);
+error_nl_connect_rx:
+	nl_handle_destroy(wmx->nlh_rx);
+	wmx->nlh_rx = NULL;
+error_nl_handle_alloc_rx:
+	return result;
+}
+
+
+static
+void wimaxll_netlink_rx_close(struct wimaxll_handle *wmx)
+{
+	nl_close(wmx->nlh_rx);
+	nl_handle_destroy(wmx->nlh_rx);
+	wmx->nlh_rx = NULL;
+	wmx->rx_fd = -1;
+}
+
+
+static
+ssize_t wimaxll_netlink_send(struct wimaxll_handle *wmx,
+			     const void *buf, size_t size)
+{
+	return nl_sendto(wmx->nlh_tx, (void *) buf, size);
+}
+
+
+const struct wimaxll_transport_ops wimaxll_transport_netlink = {
+	.name = "netlink",
+	.tx_open = wimaxll_netlink_tx_open,
+	.tx_close = wimaxll_netlink_tx_close,
+	.resolve = wimaxll_netlink_resolve,
+	.rx_open = wimaxll_netlink_rx_open,
+	.rx_close = wimaxll_netlink_rx_close,
+	.send = wimaxll_netlink_send,
+	.rx_filter = 1,
+};
@@ -38,13 +38,20 @@
  */
 #define _GNU_SOURCE
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <errno.h>
 #include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
 #include <linux/types.h>
+#include <linux/futex.h>
 #include <netlink/msg.h>
 #include <netlink/genl/genl.h>
 #include <wimaxll.h>
@@ -149,45 +156,826 @@ error_bad_type:
 }
 
 
+/*
+ * Context for processing ACKs on the TX handle
+ *
+ * \internal
+ *
+ * \param ctx Generic callback context; \a ctx.result gets -EBUSY if
+ *     a completion callback asked to stop processing.
+ *
+ * Each ACK is routed to the thread waiting for its sequence number
+ * (see struct wimaxll_tx_waiter) or to the completion callback of the
+ * in-flight table (see struct wimaxll_tx_req).
+ */
+struct wimaxll_tx_ctx {
+	struct wimaxll_cb_ctx ctx;
+};
+
+
+/*
+ * Sleep while *@addr is @val, up to @deadline (CLOCK_MONOTONIC,
+ * absolute; NULL for no deadline)
+ *
+ * Returns -ETIMEDOUT if the deadline passed, 0 otherwise (woken up,
+ * spuriously or not; the caller rechecks).
+ */
+static
+int wimaxll_futex_wait(int *addr, int val, const struct timespec *deadline)
+{
+	if (syscall(SYS_futex, addr, FUTEX_WAIT_BITSET_PRIVATE, val,
+		    deadline, NULL, FUTEX_BITSET_MATCH_ANY) < 0
+	    && errno == ETIMEDOUT)
+		return -ETIMEDOUT;
+	return 0;
+}
+
+
+static
+void wimaxll_futex_wake(int *addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+
+/*
+ * Wake up a waiter, setting it to @state
+ *
+ * Called with the TX mutex held; as the waiter has to take it to look
+ * at its state, it cannot go away (it lives in its stack) before we
+ * are done.
+ */
+static
+void wimaxll_tx_waiter_wake(struct wimaxll_tx_waiter *w, int state)
+{
+	w->state = state;
+	wimaxll_futex_wake(&w->state);
+}
+
+
+/*
+ * Take a waiter off the list; called with the TX mutex held
+ */
+static
+void __wimaxll_tx_waiter_unlink(struct wimaxll_handle *wmx,
+				struct wimaxll_tx_waiter *w)
+{
+	struct wimaxll_tx_waiter **itr;
+
+	for (itr = &wmx->tx_waiters; *itr != NULL; itr = &(*itr)->next)
+		if (*itr == w) {
+			*itr = w->next;
+			break;
+		}
+}
+
+
+static
+struct wimaxll_tx_req *wimaxll_tx_req_get(struct wimaxll_handle *wmx,
+					  unsigned seq)
+{
+	struct wimaxll_tx_req *req =
+		&wmx->tx_inflight[seq % WIMAXLL_TX_INFLIGHT_MAX];
+
+	if (req->busy && req->seq == seq)
+		return req;
+	return NULL;
+}
+
+
+/*
+ * Wake up the waiters for in-flight slots that are now free or for
+ * the in-flight table to be empty; called with the TX mutex held
+ */
+static
+void __wimaxll_tx_wake_slots(struct wimaxll_handle *wmx)
+{
+	struct wimaxll_tx_waiter **itr, *w;
+	int ready;
+
+	itr = &wmx->tx_waiters;
+	while (*itr != NULL) {
+		w = *itr;
+		if (w->kind == WIMAXLL_TX_WAIT_SLOT)
+			ready = !wmx->tx_inflight[
+				w->seq % WIMAXLL_TX_INFLIGHT_MAX].busy;
+		else if (w->kind == WIMAXLL_TX_WAIT_FLUSH)
+			ready = wmx->tx_inflight_count == 0;
+		else
+			ready = 0;
+		if (ready) {
+			*itr = w->next;
+			wimaxll_tx_waiter_wake(w, WIMAXLL_TX_DONE);
+		} else
+			itr = &w->next;
+	}
+}
+
+
+/*
+ * Deliver the result of an ACK to whoever is waiting for it
+ *
+ * If a thread is waiting for it, hand it the result and wake it up;
+ * if it is for a message in the in-flight table, run its completion
+ * callback (without the TX mutex held). Any other ACK is stale (eg:
+ * an ACK arriving after the handle gave up on it) and is dropped.
+ *
+ * We never stop early: the rest of the datagram might carry ACKs
+ * other threads are waiting for.
+ */
+static
+void wimaxll_tx_complete(struct wimaxll_tx_ctx *tx_ctx, unsigned seq,
+			 int error)
+{
+	int result;
+	struct wimaxll_handle *wmx = tx_ctx->ctx.wmx;
+	struct wimaxll_tx_waiter **itr, *w;
+	struct wimaxll_tx_req *req;
+	wimaxll_ack_cb_f cb;
+	void *priv;
+
+	pthread_mutex_lock(&wmx->tx_mutex);
+	if (wmx->probe_pending) {
+		/* Deferred wimaxll_open() check (WIMAXLL_OPEN_NO_PROBE) */
+		wmx->probe_pending = 0;
+		if (error == -ENODEV) {
+			wimaxll_msg(wmx, "E: device %s is not a WiMAX device; "
+				    "or supports an interface unknown to "
+				    "libwimaxll: %d\n", wmx->name, error);
+			wmx->probe_result = error;
+		}
+	}
+	for (itr = &wmx->tx_waiters; *itr != NULL; itr = &(*itr)->next) {
+		w = *itr;
+		if (w->kind == WIMAXLL_TX_WAIT_ACK && w->seq == seq) {
+			*itr = w->next;
+			w->result = error;
+			wimaxll_tx_waiter_wake(w, WIMAXLL_TX_DONE);
+			pthread_mutex_unlock(&wmx->tx_mutex);
+			return;
+		}
+	}
+	req = wimaxll_tx_req_get(wmx, seq);
+	if (req == NULL) {
+		pthread_mutex_unlock(&wmx->tx_mutex);
+		d_printf(2, wmx, "D: netlink ack: stale ack for seq 0x%x, "
+			 "dropping\n", seq);
+		return;
+	}
+	cb = req->cb;
+	priv = req->priv;
+	req->busy = 0;
+	wmx->tx_inflight_count--;
+	__wimaxll_tx_wake_slots(wmx);
+	pthread_mutex_unlock(&wmx->tx_mutex);
+	if (cb != NULL)
+		result = cb(wmx, priv, seq, error);
+	else {
+		if (error < 0)
+			wimaxll_msg(wmx, "E: seq 0x%x: operation failed: "
+				    "%d\n", seq, error);
+		result = 0;
+	}
+	if (result == -EBUSY) {
+		wimaxll_cb_maybe_set_result(&tx_ctx->ctx, -EBUSY);
+		tx_ctx->ctx.msg_done = 1;
+	}
+}
+
+
+/*
+ * Route an ACK (or error) message received on the TX handle
+ *
+ * \param size Bytes of the message actually received (it might be
+ *     truncated if the kernel sent back a copy of a big message
+ *     along with an error; we only need the header).
+ */
+static
+void wimaxll_tx_ack(struct wimaxll_tx_ctx *tx_ctx, struct nlmsghdr *nl_hdr,
+		    size_t size)
+{
+	struct wimaxll_handle *wmx = tx_ctx->ctx.wmx;
+	struct nlmsgerr *nl_err = nlmsg_data(nl_hdr);
+
+	if (nl_hdr->nlmsg_type != NLMSG_ERROR) {
+		d_printf(2, wmx, "D: TX: unexpected message type %u, "
+			 "skipping\n", nl_hdr->nlmsg_type);
+		return;
+	}
+	if (size < NLMSG_HDRLEN + sizeof(*nl_err)) {
+		wimaxll_msg(wmx, "E: netlink ack: buffer too small "
+			    "(%zu vs %zu expected)\n",
+			    size, NLMSG_HDRLEN + sizeof(*nl_err));
+		return;
+	}
+	wimaxll_tx_complete(tx_ctx, nl_hdr->nlmsg_seq, nl_err->error);
+}
+
+
+/*
+ * Read one datagram of ACKs from the TX handle and route them
+ *
+ * \internal
+ *
+ * Reads into the handle's TX buffer with a single recvmsg() (instead
+ * of letting libnl peek to size a new buffer for each message and
+ * then read it again). MSG_TRUNC makes the kernel report the real
+ * size of the datagram; if it didn't fit, we still have the header
+ * and the error code, so we process it and grow the buffer for the
+ * next time.
+ *
+ * Only the leader (see wimaxll_tx_wait()) calls this. \a flags are
+ * passed to recv() (eg: MSG_DONTWAIT).
+ */
+static
+int wimaxll_tx_recvmsgs(struct wimaxll_handle *wmx,
+			struct wimaxll_tx_ctx *tx_ctx, int flags)
+{
+	ssize_t result;
+	int remaining;
+	struct nlmsghdr *nl_hdr;
+	void *buf;
+
+	if (wmx->tx_buf == NULL) {
+		if (wmx->tx_buf_size == 0)
+			wmx->tx_buf_size = WIMAXLL_TX_BUF_SIZE;
+		wmx->tx_buf = malloc(wmx->tx_buf_size);
+		if (wmx->tx_buf == NULL)
+			return -ENOMEM;
+	}
+	result = recv(wmx->tx_fd, wmx->tx_buf,
+		      wmx->tx_buf_size, flags | MSG_TRUNC);
+	if (result < 0)
+		return -errno;
+	if (result > wmx->tx_buf_size) {
+		/* Truncated; only the first message can be used */
+		wimaxll_tx_ack(tx_ctx, wmx->tx_buf, wmx->tx_buf_size);
+		buf = realloc(wmx->tx_buf, result);
+		if (buf != NULL) {
+			wmx->tx_buf = buf;
+			wmx->tx_buf_size = result;
+			wmx->recv_buf_grow_count++;
+		}
+		return 0;
+	}
+	remaining = result;
+	for (nl_hdr = wmx->tx_buf; nlmsg_ok(nl_hdr, remaining);
+	     nl_hdr = nlmsg_next(nl_hdr, &remaining))
+		wimaxll_tx_ack(tx_ctx, nl_hdr, nl_hdr->nlmsg_len);
+	return 0;
+}
+
+
+/*
+ * Try to become the thread that reads ACKs; called with the TX mutex
+ * held
+ *
+ * Returns 1 if we are now the leader, 0 if another thread is. If we
+ * already were (eg: a completion callback running in the leader does
+ * a synchronous operation), we keep reading; *@nested is set so the
+ * inner call doesn't give up the leadership.
+ */
+static
+int __wimaxll_tx_lead(struct wimaxll_handle *wmx, int *nested)
+{
+	*nested = 0;
+	if (wmx->tx_reading) {
+		if (!pthread_equal(wmx->tx_leader, pthread_self()))
+			return 0;
+		*nested = 1;
+		return 1;
+	}
+	wmx->tx_reading = 1;
+	wmx->tx_leader = pthread_self();
+	return 1;
+}
+
+
+/*
+ * Stop reading ACKs and pass the job on to some thread still waiting;
+ * called with the TX mutex held
+ */
+static
+void __wimaxll_tx_unlead(struct wimaxll_handle *wmx)
+{
+	wmx->tx_reading = 0;
+	if (wmx->tx_waiters != NULL)
+		wimaxll_tx_waiter_wake(wmx->tx_waiters, WIMAXLL_TX_LEAD);
+}
+
+
+/*
+ * Wait until a registered waiter's condition is met
+ *
+ * @w has to be in the handle's waiter list (and is off it when we
+ * return). If no thread is reading ACKs, we do it (and route what we
+ * read to everybody else); otherwise we sleep until the leader
+ * delivers our ACK or passes the leadership on to us.
+ *
+ * With a @deadline, the leader polls the TX socket before reading
+ * and the others sleep no longer than it; when it passes, the
+ * leadership is handed on and @w dropped, so a late ACK for it is
+ * discarded as stale.
+ *
+ * Returns 0 if ok, < 0 errno code if reading failed, the deadline
+ * passed (-ETIMEDOUT) or (if @stop_on_busy) a completion callback
+ * run by us returned -EBUSY.
+ */
+static
+int wimaxll_tx_wait(struct wimaxll_handle *wmx, struct wimaxll_tx_waiter *w,
+		    int stop_on_busy, const struct timespec *deadline)
+{
+	int result = 0, leader = 0, nested = 0, flags = 0;
+	struct pollfd pfd = { .fd = wmx->tx_fd, .events = POLLIN };
+	struct wimaxll_tx_ctx tx_ctx = {
+		.ctx = WIMAXLL_CB_CTX_INIT(wmx),
+	};
+
+	if (deadline != NULL)
+		flags = MSG_DONTWAIT;
+	pthread_mutex_lock(&wmx->tx_mutex);
+	while (w->state != WIMAXLL_TX_DONE) {
+		if (leader || __wimaxll_tx_lead(wmx, &nested)) {
+			leader = 1;
+			pthread_mutex_unlock(&wmx->tx_mutex);
+			if (deadline != NULL) {
+				result = poll(&pfd, 1,
+					      wimaxll_deadline_ms(deadline));
+				if (result == 0)
+					result = -ETIMEDOUT;
+				else if (result < 0 && errno != EINTR)
+					result = -errno;
+				else
+					result = wimaxll_tx_recvmsgs(
+						wmx, &tx_ctx, flags);
+				if (result == -EAGAIN || result == -EINTR)
+					result = 0;
+			} else
+				result = wimaxll_tx_recvmsgs(wmx, &tx_ctx,
+							     flags);
+			pthread_mutex_lock(&wmx->tx_mutex);
+			if (result < 0)
+				break;
+			if (stop_on_busy && tx_ctx.ctx.result == -EBUSY) {
+				result = -EBUSY;
+				break;
+			}
+			continue;
+		}
+		w->state = WIMAXLL_TX_WAITING;
+		pthread_mutex_unlock(&wmx->tx_mutex);
+		result = wimaxll_futex_wait(&w->state, WIMAXLL_TX_WAITING,
+					    deadline);
+		pthread_mutex_lock(&wmx->tx_mutex);
+		if (result < 0 && w->state == WIMAXLL_TX_WAITING)
+			break;
+		result = 0;
+	}
+	if (w->state != WIMAXLL_TX_DONE) {
+		__wimaxll_tx_waiter_unlink(wmx, w);
+		/* We might have been asked to take over reading */
+		if (!leader && w->state == WIMAXLL_TX_LEAD
+		    && !wmx->tx_reading)
+			__wimaxll_tx_unlead(wmx);
+	}
+	if (leader && !nested)
+		__wimaxll_tx_unlead(wmx);
+	pthread_mutex_unlock(&wmx->tx_mutex);
+	return result;
+}
+
+
+/**
+ * Allocate a sequence number for a message to send
+ *
+ * \internal
+ *
+ * \param wmx WiMAX device handle
+ * \return sequence number (never %NL_AUTO_SEQ).
+ *
+ * Safe to call from many threads at the same time.
+ */
+unsigned wimaxll_tx_seq_next(struct wimaxll_handle *wmx)
+{
+	unsigned seq;
+
+	do
+		seq = __sync_add_and_fetch(&wmx->tx_seq, 1);
+	while (seq == NL_AUTO_SEQ);
+	return seq;
+}
+
+
+/**
+ * Register interest in the ACK to a message
+ *
+ * \internal
+ *
+ * \param wmx WiMAX device handle
+ * \param w Waiter to register (usually in the caller's stack)
+ * \param seq Sequence number the message will be sent with
+ *
+ * Must be called \b before sending the message, so whichever thread
+ * reads the ACK knows who to give it to. Then either wait for it with
+ * wimaxll_wait_for_ack() or, if the message could not be sent, drop
+ * \a w with wimaxll_tx_waiter_del().
+ */
+void wimaxll_tx_waiter_add(struct wimaxll_handle *wmx,
+			   struct wimaxll_tx_waiter *w, unsigned seq)
+{
+	w->kind = WIMAXLL_TX_WAIT_ACK;
+	w->seq = seq;
+	w->result = 0;
+	w->state = WIMAXLL_TX_WAITING;
+	pthread_mutex_lock(&wmx->tx_mutex);
+	w->next = wmx->tx_waiters;
+	wmx->tx_waiters = w;
+	pthread_mutex_unlock(&wmx->tx_mutex);
+}
+
+
+/**
+ * Unregister a waiter added with wimaxll_tx_waiter_add()
+ *
+ * \internal
+ *
+ * \param wmx WiMAX device handle
+ * \param w Waiter
+ */
+void wimaxll_tx_waiter_del(struct wimaxll_handle *wmx,
+			   struct wimaxll_tx_waiter *w)
+{
+	pthread_mutex_lock(&wmx->tx_mutex);
+	__wimaxll_tx_waiter_unlink(wmx, w);
+	/* It might have been asked to take over reading */
+	if (w->state == WIMAXLL_TX_LEAD && !wmx->tx_reading)
+		__wimaxll_tx_unlead(wmx);
+	pthread_mutex_unlock(&wmx->tx_mutex);
+}
+
+
 /**
  * Wait for a netlink ACK and pass on the result code it passed
  *
  * \internal
  *
  * \param wmx WiMAX device handle
+ * \param w Waiter registered with wimaxll_tx_waiter_add() before
+ *     sending the message.
+ * \param deadline Absolute time (%CLOCK_MONOTONIC) when to give up;
+ *     NULL to wait for as long as it takes.
  * \return error code passed by the kernel in the nlmsgerr structure
- *     that contained the ACK.
+ *     that contained the ACK; -%ETIMEDOUT if it didn't arrive before
+ *     the deadline (it will be discarded if it does later).
  *
  * Similar to nl_wait_for_ack(), but returns the value in
  * nlmsgerr->error, so it can be used by the kernel to return simple
  * error codes.
+ *
+ * Many threads can wait at the same time; ACKs for the other threads
+ * and for messages sent with wimaxll_msg_write_async() that arrive in
+ * the meantime are passed on to them.
  */
-int wimaxll_wait_for_ack(struct wimaxll_handle *wmx)
+int wimaxll_wait_for_ack(struct wimaxll_handle *wmx,
+			 struct wimaxll_tx_waiter *w,
+			 const struct timespec *deadline)
 {
 	int result;
-	struct nl_cb *cb;
-	struct wimaxll_cb_ctx ctx;
-
-	ctx.wmx = wmx;
-	ctx.result = -EINPROGRESS;
-	ctx.msg_done = 0;
 
-	cb = nl_socket_get_cb(wmx->nlh_tx);
-	nl_cb_set(cb, NL_CB_ACK, NL_CB_CUSTOM, wimaxll_gnl_ack_cb, &ctx);
-	nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, NL_CB_DEFAULT, NULL);
-	nl_cb_err(cb, NL_CB_CUSTOM, wimaxll_gnl_error_cb, &ctx);
-	do
-		result = nl_recvmsgs(wmx->nlh_tx, cb);
-	while (ctx.msg_done == 0 && result >= 0);
-	result = ctx.result;
-	nl_cb_set(cb, NL_CB_ACK, NL_CB_CUSTOM, NL_CB_DEFAULT, NULL);
-	nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, NL_CB_DEFAULT, NULL);
-	nl_cb_err(cb, NL_CB_CUSTOM, NL_CB_DEFAULT, NULL);
-	nl_cb_put(cb);
+	result = wimaxll_tx_wait(wmx, w, 0, deadline);
 	if (result < 0)
 		return result;
-	else
-		return ctx.result;
+	return w->result;
+}
+
+
+/*
+ * Fill out an in-flight table entry; called with the TX mutex held
+ */
+static
+void __wimaxll_tx_inflight_set(struct wimaxll_handle *wmx,
+			       struct wimaxll_tx_req *req, unsigned seq,
+			       wimaxll_ack_cb_f cb, void *priv)
+{
+	req->seq = seq;
+	req->cb = cb;
+	req->priv = priv;
+	req->busy = 1;
+	wmx->tx_inflight_count++;
+}
+
+
+/**
+ * Reserve an entry in the in-flight table for a message
+ *
+ * \internal
+ *
+ * \param wmx WiMAX device handle
+ * \param seq Sequence number the message will be sent with
+ * \param cb Completion callback (can be NULL)
+ * \param priv Private pointer for \a cb
+ * \return 0 if ok, < 0 errno code on error.
+ *
+ * Must be called \b before sending the message so the ACK cannot
+ * arrive before we know about it. If the slot for \a seq is still
+ * taken by an older message, we wait (processing ACKs if no other
+ * thread is) until it is freed.
+ */
+int wimaxll_tx_inflight_add(struct wimaxll_handle *wmx, unsigned seq,
+			    wimaxll_ack_cb_f cb, void *priv)
+{
+	int result = 0;
+	struct wimaxll_tx_req *req =
+		&wmx->tx_inflight[seq % WIMAXLL_TX_INFLIGHT_MAX];
+	struct wimaxll_tx_waiter w;
+
+	pthread_mutex_lock(&wmx->tx_mutex);
+	while (req->busy) {
+		w.kind = WIMAXLL_TX_WAIT_SLOT;
+		w.seq = seq;
+		w.state = WIMAXLL_TX_WAITING;
+		w.next = wmx->tx_waiters;
+		wmx->tx_waiters = &w;
+		pthread_mutex_unlock(&wmx->tx_mutex);
+		result = wimaxll_tx_wait(wmx, &w, 0, NULL);
+		if (result < 0)
+			goto error_wait;
+		pthread_mutex_lock(&wmx->tx_mutex);
+	}
+	__wimaxll_tx_inflight_set(wmx, req, seq, cb, priv);
+	pthread_mutex_unlock(&wmx->tx_mutex);
+error_wait:
+	return result;
+}
+
+
+/**
+ * Reserve an entry in the in-flight table for a message, if there is
+ * room for it
+ *
+ * \internal
+ *
+ * \param wmx WiMAX device handle
+ * \param seq Sequence number the message will be sent with
+ * \param cb Completion callback (can be NULL)
+ * \param priv Private pointer for \a cb
+ * \return 0 if ok, -%EAGAIN if the slot for \a seq is still taken
+ *     by an older message.
+ *
+ * Same as wimaxll_tx_inflight_add(), but never blocks; for the
+ * non-blocking operations (see lib/op-async.c).
+ */
+int wimaxll_tx_inflight_try_add(struct wimaxll_handle *wmx, unsigned seq,
+				wimaxll_ack_cb_f cb, void *priv)
+{
+	int result = -EAGAIN;
+	struct wimaxll_tx_req *req =
+		&wmx->tx_inflight[seq % WIMAXLL_TX_INFLIGHT_MAX];
+
+	pthread_mutex_lock(&wmx->tx_mutex);
+	if (!req->busy) {
+		__wimaxll_tx_inflight_set(wmx, req, seq, cb, priv);
+		result = 0;
+	}
+	pthread_mutex_unlock(&wmx->tx_mutex);
+	return result;
+}
+
+
+/**
+ * Drop an entry from the in-flight table without running its callback
+ *
+ * \internal
+ *
+ * \param wmx WiMAX device handle
+ * \param seq Sequence number of the message (eg: it failed to send)
+ */
+void wimaxll_tx_inflight_del(struct wimaxll_handle *wmx, unsigned seq)
+{
+	struct wimaxll_tx_req *req;
+
+	pthread_mutex_lock(&wmx->tx_mutex);
+	req = wimaxll_tx_req_get(wmx, seq);
+	if (req != NULL) {
+		req->busy = 0;
+		wmx->tx_inflight_count--;
+		__wimaxll_tx_wake_slots(wmx);
+	}
+	pthread_mutex_unlock(&wmx->tx_mutex);
+}
+
+
+/**
+ * Complete all the in-flight messages with -%ECANCELED
+ *
+ * \internal
+ *
+ * \param wmx WiMAX device handle
+ *
+ * Used when closing a handle so the owners of the in-flight messages
+ * can release the resources tied to them.
+ */
+void wimaxll_tx_inflight_cancel(struct wimaxll_handle *wmx)
+{
+	unsigned itr;
+	struct wimaxll_tx_req *req;
+
+	for (itr = 0; itr < WIMAXLL_TX_INFLIGHT_MAX; itr++) {
+		req = &wmx->tx_inflight[itr];
+		if (!req->busy)
+			continue;
+		req->busy = 0;
+		wmx->tx_inflight_count--;
+		if (req->cb)
+			req->cb(wmx, req->priv, req->seq, -ECANCELED);
+	}
+}
+
+
+/**
+ * Return the file descriptor where ACKs for asynchronous messages
+ * are received
+ *
+ * \param wmx WiMAX device handle
+ *
+ * \return file descriptor that can be fed to select() or poll(); when
+ *     ready for reading, call wimaxll_tx_recv() to process the ACKs.
+ *
+ * \ingroup the_messaging_interface
+ */
+int wimaxll_tx_fd(struct wimaxll_handle *wmx)
+{
+	return wmx->tx_fd;
+}
+
+
+/**
+ * Return the number of asynchronous messages waiting for an ACK
+ *
+ * \param wmx WiMAX device handle
+ * \return Number of messages sent with wimaxll_msg_write_async() or
+ *     a *_start() call whose ACK has not been processed yet; while
+ *     it is not zero, event loops need to watch wimaxll_tx_fd().
+ *
+ * \ingroup the_messaging_interface
+ */
+unsigned wimaxll_tx_pending(struct wimaxll_handle *wmx)
+{
+	unsigned count;
+
+	pthread_mutex_lock(&wmx->tx_mutex);
+	count = wmx->tx_inflight_count;
+	pthread_mutex_unlock(&wmx->tx_mutex);
+	return count;
+}
+
+
+/**
+ * Process ACKs for messages sent with wimaxll_msg_write_async()
+ *
+ * \param wmx WiMAX device handle
+ *
+ * \return 0 if ok, -%EBUSY if a completion callback asked to stop
+ *     processing, any other negative errno code on error.
+ *
+ * Reads a batch of ACKs from the kernel and executes, for each, the
+ * completion callback of the message it acknowledges. If there are no
+ * messages waiting for an ACK, it returns immediately.
+ *
+ * If another thread is already reading ACKs (eg: it is waiting in a
+ * synchronous call), it returns 0 right away; that thread will run
+ * the completion callbacks.
+ *
+ * \note This is a blocking call if there are messages in flight but
+ *     no ACKs have arrived yet; use wimaxll_tx_fd() to wait for them
+ *     in a main loop.
+ *
+ * \ingroup the_messaging_interface
+ */
+ssize_t wimaxll_tx_recv(struct wimaxll_handle *wmx)
+{
+	ssize_t result = 0;
+	int nested;
+	struct wimaxll_tx_ctx tx_ctx = {
+		.ctx = WIMAXLL_CB_CTX_INIT(wmx),
+	};
+
+	d_fnstart(3, wmx, "(wmx %p)\n", wmx);
+	pthread_mutex_lock(&wmx->tx_mutex);
+	if (wmx->tx_inflight_count == 0 || !__wimaxll_tx_lead(wmx, &nested)) {
+		pthread_mutex_unlock(&wmx->tx_mutex);
+		goto out;
+	}
+	pthread_mutex_unlock(&wmx->tx_mutex);
+	result = wimaxll_tx_recvmsgs(wmx, &tx_ctx, 0);
+	pthread_mutex_lock(&wmx->tx_mutex);
+	if (!nested)
+		__wimaxll_tx_unlead(wmx);
+	pthread_mutex_unlock(&wmx->tx_mutex);
+	if (tx_ctx.ctx.result == -EBUSY)
+		result = -EBUSY;
+	else if (result > 0)
+		result = 0;
+out:
+	d_fnend(3, wmx, "(wmx %p) = %zd\n", wmx, result);
+	return result;
+}
+
+
+/**
+ * Process the ACKs that are already waiting, without blocking
+ *
+ * \param wmx WiMAX device handle
+ * \param budget Maximum number of datagrams to read (0 for
+ *     %WIMAXLL_RX_BATCH_MAX).
+ * \return Number of datagrams processed (0 if none were waiting or
+ *     another thread is reading ACKs), or a negative errno code if
+ *     the socket couldn't be read.
+ *
+ * For event loop integration (lib/epoll.c, libwimaxll-glib), which
+ * call this when wimaxll_tx_fd() is ready for reading. Unlike
+ * wimaxll_tx_recv(), it also reads (and drops) stale ACKs when there
+ * is nothing in flight, so a level-triggered loop doesn't spin on
+ * them.
+ *
+ * \ingroup the_messaging_interface
+ */
+ssize_t wimaxll_tx_drain(struct wimaxll_handle *wmx, unsigned budget)
+{
+	ssize_t result = 0;
+	unsigned processed = 0;
+	int nested;
+	struct wimaxll_tx_ctx tx_ctx = {
+		.ctx = WIMAXLL_CB_CTX_INIT(wmx),
+	};
+
+	d_fnstart(3, wmx, "(wmx %p budget %u)\n", wmx, budget);
+	if (budget == 0)
+		budget = WIMAXLL_RX_BATCH_MAX;
+	pthread_mutex_lock(&wmx->tx_mutex);
+	if (!__wimaxll_tx_lead(wmx, &nested)) {
+		pthread_mutex_unlock(&wmx->tx_mutex);
+		goto out;
+	}
+	pthread_mutex_unlock(&wmx->tx_mutex);
+	while (processed < budget) {
+		result = wimaxll_tx_recvmsgs(wmx, &tx_ctx, MSG_DONTWAIT);
+		if (result < 0)
+			break;
+		processed++;
+		if (tx_ctx.ctx.result == -EBUSY)
+			break;
+	}
+	pthread_mutex_lock(&wmx->tx_mutex);
+	if (!nested)
+		__wimaxll_tx_unlead(wmx);
+	pthread_mutex_unlock(&wmx->tx_mutex);
+	if (result >= 0 || result == -EAGAIN || processed > 0)
+		result = processed;
+out:
+	d_fnend(3, wmx, "(wmx %p budget %u) = %zd\n", wmx, budget, result);
+	return result;
+}
+
+
+/**
+ * Wait for the ACKs of all the messages sent with
+ * wimaxll_msg_write_async()
+ *
+ * \param wmx WiMAX device handle
+ *
+ * \return 0 if ok, -%EBUSY if a completion callback asked to stop
+ *     processing, any other negative errno code on error.
+ *
+ * Processes ACKs (running the completion callbacks) until no messages
+ * are left in flight. If another thread is reading ACKs, it just
+ * waits for it to drain the in-flight table.
+ *
+ * \note This is a blocking call.
+ *
+ * \ingroup the_messaging_interface
+ */
+ssize_t wimaxll_tx_flush(struct wimaxll_handle *wmx)
+{
+	ssize_t result = 0;
+	struct wimaxll_tx_waiter w = {
+		.kind = WIMAXLL_TX_WAIT_FLUSH,
+		.state = WIMAXLL_TX_WAITING,
+	};
+
+	d_fnstart(3, wmx, "(wmx %p)\n", wmx);
+	pthread_mutex_lock(&wmx->tx_mutex);
+	if (wmx->tx_inflight_count == 0) {
+		pthread_mutex_unlock(&wmx->tx_mutex);
+		goto out;
+	}
+	w.next = wmx->tx_waiters;
+	wmx->tx_waiters = &w;
+	pthread_mutex_unlock(&wmx->tx_mutex);
+	result = wimaxll_tx_wait(wmx, &w, 1, NULL);
+out:
+	d_fnend(3, wmx, "(wmx %p) = %zd\n", wmx, result);
+	return result;
 }
 
 
@@ -239,12 +1027,19 @@ const char *wimaxll_ifname(const struct wimaxll_handle *wmx)
  * Note that if this is an \e any interface (open for all devices),
  * this will vary. When not processing a callback, it will be
  * zero. When processing a callback, this call will return the
- * interface for which the callback was executed.
+ * interface for which the callback was executed (only to the thread
+ * running the callback; the rest still see zero).
+ *
+ * Operations started from such a callback on an \e any handle are
+ * sent to that interface.
  *
  * \ingroup device_management
  */
 unsigned wimaxll_ifidx(const struct wimaxll_handle *wmx)
 {
+	if (wmx->ifidx == 0 && wmx->rx_ifidx != 0
+	    && pthread_equal(wmx->rx_ifidx_thread, pthread_self()))
+		return wmx->rx_ifidx;
 	return wmx->ifidx;
 }
 